@@ -237,6 +237,7 @@ BlockDriverState *bdrv_new(void)
         QLIST_INIT(&bs->op_blockers[i]);
     }
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    notifier_with_return_list_init(&bs->after_write_notifiers);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -1304,6 +1305,7 @@ static void bdrv_replace_child(BdrvChild *child, BlockDriverState *new_bs)
     }
 
     child->bs = new_bs;
+    bdrv_block_status_cache_graph_changed();
 
     if (new_bs) {
         QLIST_INSERT_HEAD(&new_bs->parents, child, next_parent);
@@ -2114,6 +2116,20 @@ int bdrv_reopen_multiple(AioContext *ctx, BlockReopenQueue *bs_queue, Error **er
         bdrv_reopen_commit(&bs_entry->state);
     }
 
+    /* Persistent dirty bitmaps can only be marked as in use in the image once
+     * every node down to the protocol layer has switched to read-write */
+    QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        BlockDriverState *bs = bs_entry->state.bs;
+
+        if (bs->drv->bdrv_reopen_bitmaps_rw && !bdrv_is_read_only(bs)) {
+            bs->drv->bdrv_reopen_bitmaps_rw(bs, &local_err);
+            if (local_err) {
+                error_report_err(local_err);
+                local_err = NULL;
+            }
+        }
+    }
+
     ret = 0;
 
 cleanup:
@@ -2291,6 +2307,7 @@ void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     reopen_state->bs->open_flags         = reopen_state->flags;
     reopen_state->bs->read_only = !(reopen_state->flags & BDRV_O_RDWR);
 
+    bdrv_block_status_cache_clear(reopen_state->bs);
     bdrv_refresh_limits(reopen_state->bs, NULL);
 }
 
@@ -2325,6 +2342,17 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
+    if (bs->drv && !(bs->open_flags & BDRV_O_INACTIVE)) {
+        Error *local_err = NULL;
+
+        bdrv_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_reportf_err(local_err, "Lost persistent bitmaps during "
+                              "closing of '%s': ",
+                              bdrv_get_device_or_node_name(bs));
+        }
+    }
+
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
@@ -2333,6 +2361,7 @@ static void bdrv_close(BlockDriverState *bs)
 
         bs->drv->bdrv_close(bs);
         bs->drv = NULL;
+        bdrv_block_status_cache_clear(bs);
 
         bdrv_set_backing_hd(bs, NULL);
 
@@ -2473,6 +2502,7 @@ static void bdrv_delete(BlockDriverState *bs)
     }
     QTAILQ_REMOVE(&all_bdrv_states, bs, bs_list);
 
+    bdrv_block_status_cache_free(bs);
     g_free(bs);
 }
 
@@ -2493,6 +2523,9 @@ int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
     }
 
     memset(res, 0, sizeof(*res));
+    if (fix) {
+        bdrv_block_status_cache_clear(bs);
+    }
     return bs->drv->bdrv_check(bs, res, fix);
 }
 
@@ -2644,6 +2677,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dirty_bitmap_truncate(bs);
+        bdrv_block_status_cache_clear(bs);
         bdrv_parent_cb_resize(bs);
         ++bs->write_gen;
     }
@@ -3239,6 +3273,7 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
         return;
     }
     bs->open_flags &= ~BDRV_O_INACTIVE;
+    bdrv_block_status_cache_clear(bs);
 
     if (bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs, &local_err);
@@ -3291,6 +3326,16 @@ static int bdrv_inactivate_recurse(BlockDriverState *bs,
     BdrvChild *child;
     int ret;
 
+    if (!setting_flag) {
+        Error *local_err = NULL;
+
+        bdrv_store_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            return -EIO;
+        }
+    }
+
     if (!setting_flag && bs->drv->bdrv_inactivate) {
         ret = bs->drv->bdrv_inactivate(bs);
         if (ret < 0) {
@@ -49,6 +49,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -86,6 +87,92 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->type = type;
 }
 
+/* Boundaries are sorted, so find the bin with a binary search */
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    uint64_t latency = latency_ns > 0 ? latency_ns : 0;
+    int lo = 0, hi = hist->nbins - 1;
+
+    if (!hist->bins) {
+        return;
+    }
+
+    /* Find the first boundary that is greater than the latency */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (latency < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    /* Requests may complete in another thread than the one resetting the
+     * histogram; avoid losing increments without taking a lock */
+    atomic_inc(&hist->bins[lo]);
+}
+
+/* Replace the histogram for @type; an empty list of boundaries disables it */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    uint64List *entry;
+    uint64_t *data, prev = 0;
+    int new_nbins = 1;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry->value <= prev) {
+            return -EINVAL;
+        }
+        new_nbins++;
+        prev = entry->value;
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+
+    if (new_nbins == 1) {
+        memset(hist, 0, sizeof(*hist));
+        return 0;
+    }
+
+    hist->nbins = new_nbins;
+    hist->boundaries = data = g_new(uint64_t, new_nbins - 1);
+    for (entry = boundaries; entry; entry = entry->next) {
+        *data++ = entry->value;
+    }
+    hist->bins = g_new0(uint64_t, new_nbins);
+
+    return 0;
+}
+
+void block_latency_histogram_reset(BlockAcctStats *stats,
+                                   enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    for (i = 0; i < hist->nbins; i++) {
+        atomic_set__nocheck(&hist->bins[i], 0);
+    }
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, NULL);
+    }
+}
+
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
     BlockAcctTimedStats *s;
@@ -106,6 +193,9 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +219,9 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
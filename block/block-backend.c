@@ -850,6 +850,42 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
     return ret;
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    trace_blk_co_copy_range(blk_in, off_in, blk_out, off_out, bytes, flags);
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(blk_bs(blk_in));
+    bdrv_inc_in_flight(blk_bs(blk_out));
+
+    /* throttling disk I/O */
+    if (blk_in->public.throttle_state) {
+        throttle_group_co_io_limits_intercept(blk_in, bytes, false);
+    }
+    if (blk_out->public.throttle_state) {
+        throttle_group_co_io_limits_intercept(blk_out, bytes, true);
+    }
+
+    ret = bdrv_co_copy_range(blk_in->root, off_in, blk_out->root, off_out,
+                             bytes, flags);
+
+    bdrv_dec_in_flight(blk_bs(blk_out));
+    bdrv_dec_in_flight(blk_bs(blk_in));
+    return ret;
+}
+
 typedef struct BlkRwCo {
     BlockBackend *blk;
     int64_t offset;
@@ -932,6 +968,47 @@ int blk_make_zero(BlockBackend *blk, BdrvRequestFlags flags)
     return bdrv_make_zero(blk->root, flags);
 }
 
+typedef struct BlkCopyRangeCo {
+    BlockBackend *blk_in;
+    int64_t off_in;
+    BlockBackend *blk_out;
+    int64_t off_out;
+    int bytes;
+    BdrvRequestFlags flags;
+    int ret;
+} BlkCopyRangeCo;
+
+static void blk_copy_range_entry(void *opaque)
+{
+    BlkCopyRangeCo *crco = opaque;
+
+    crco->ret = blk_co_copy_range(crco->blk_in, crco->off_in,
+                                  crco->blk_out, crco->off_out,
+                                  crco->bytes, crco->flags);
+}
+
+int blk_copy_range(BlockBackend *blk_in, int64_t off_in,
+                   BlockBackend *blk_out, int64_t off_out,
+                   int bytes, BdrvRequestFlags flags)
+{
+    Coroutine *co;
+    BlkCopyRangeCo crco = {
+        .blk_in     = blk_in,
+        .off_in     = off_in,
+        .blk_out    = blk_out,
+        .off_out    = off_out,
+        .bytes      = bytes,
+        .flags      = flags,
+        .ret        = NOT_DONE,
+    };
+
+    co = qemu_coroutine_create(blk_copy_range_entry, &crco);
+    qemu_coroutine_enter(co);
+    BDRV_POLL_WHILE(blk_bs(blk_out), crco.ret == NOT_DONE);
+
+    return crco.ret;
+}
+
 static void error_callback_bh(void *opaque)
 {
     struct BlockBackendAIOCB *acb = opaque;
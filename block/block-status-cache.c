@@ -0,0 +1,250 @@
+/*
+ * Block status cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/block-status-cache.h"
+#include "qemu/atomic.h"
+
+/* Beyond this, the whole cache is dropped and filled again */
+#define BLOCK_STATUS_CACHE_MAX_RANGES   4096
+
+typedef struct BdrvBlockStatusRange {
+    int64_t start;              /* first sector */
+    int64_t end;                /* first sector after the range */
+    int64_t status;             /* BDRV_BLOCK_* flags without the offset */
+    int64_t offset;             /* byte offset of @start if OFFSET_VALID */
+    BlockDriverState *file;
+} BdrvBlockStatusRange;
+
+static unsigned bdrv_graph_gen;
+
+static gint range_cmp(gconstpointer a, gconstpointer b, gpointer opaque)
+{
+    const BdrvBlockStatusRange *ra = a;
+    const BdrvBlockStatusRange *rb = b;
+
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static BdrvBlockStatusCache *get_cache(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *c = &bs->block_status_cache;
+    unsigned graph_gen = atomic_read(&bdrv_graph_gen);
+
+    if (!c->ranges) {
+        c->ranges = g_sequence_new(g_free);
+        c->graph_gen = graph_gen;
+    } else if (c->graph_gen != graph_gen) {
+        g_sequence_remove_range(g_sequence_get_begin_iter(c->ranges),
+                                g_sequence_get_end_iter(c->ranges));
+        c->graph_gen = graph_gen;
+        c->gen++;
+    }
+    return c;
+}
+
+/* Returns the first range that ends after @sector */
+static GSequenceIter *find_range(BdrvBlockStatusCache *c, int64_t sector)
+{
+    BdrvBlockStatusRange key = { .start = sector };
+    GSequenceIter *it;
+
+    it = g_sequence_search(c->ranges, &key, range_cmp, NULL);
+    if (!g_sequence_iter_is_begin(it)) {
+        GSequenceIter *prev = g_sequence_iter_prev(it);
+        BdrvBlockStatusRange *r = g_sequence_get(prev);
+
+        if (r->end > sector) {
+            return prev;
+        }
+    }
+    return it;
+}
+
+static bool can_merge(BdrvBlockStatusRange *a, BdrvBlockStatusRange *b)
+{
+    if (a->end != b->start || a->status != b->status || a->file != b->file) {
+        return false;
+    }
+    if (a->status & BDRV_BLOCK_OFFSET_VALID) {
+        return a->offset + (a->end - a->start) * BDRV_SECTOR_SIZE == b->offset;
+    }
+    return true;
+}
+
+bool bdrv_block_status_cache_lookup(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum,
+                                    BlockDriverState **file, int64_t *status)
+{
+    BdrvBlockStatusCache *c = get_cache(bs);
+    BdrvBlockStatusRange *r;
+    GSequenceIter *it;
+
+    it = find_range(c, sector_num);
+    if (g_sequence_iter_is_end(it)) {
+        goto miss;
+    }
+
+    r = g_sequence_get(it);
+    if (r->start > sector_num) {
+        goto miss;
+    }
+
+    *pnum = MIN(r->end - sector_num, nb_sectors);
+    *file = r->file;
+    *status = r->status;
+    if (r->status & BDRV_BLOCK_OFFSET_VALID) {
+        *status |= r->offset + (sector_num - r->start) * BDRV_SECTOR_SIZE;
+    }
+    c->hits++;
+    return true;
+
+miss:
+    c->misses++;
+    return false;
+}
+
+static void remove_ranges(BdrvBlockStatusCache *c, int64_t sector_num,
+                          int64_t end)
+{
+    GSequenceIter *it;
+
+    it = find_range(c, sector_num);
+    while (!g_sequence_iter_is_end(it)) {
+        BdrvBlockStatusRange *r = g_sequence_get(it);
+        GSequenceIter *next = g_sequence_iter_next(it);
+
+        if (r->start >= end) {
+            break;
+        }
+
+        if (r->start < sector_num && r->end > end) {
+            /* Punch a hole into the middle of the range */
+            BdrvBlockStatusRange *tail = g_new(BdrvBlockStatusRange, 1);
+
+            *tail = *r;
+            tail->start = end;
+            if (tail->status & BDRV_BLOCK_OFFSET_VALID) {
+                tail->offset += (end - r->start) * BDRV_SECTOR_SIZE;
+            }
+            r->end = sector_num;
+            g_sequence_insert_before(next, tail);
+            break;
+        } else if (r->start < sector_num) {
+            r->end = sector_num;
+        } else if (r->end > end) {
+            if (r->status & BDRV_BLOCK_OFFSET_VALID) {
+                r->offset += (end - r->start) * BDRV_SECTOR_SIZE;
+            }
+            /* Still sorted: the range does not move past its successor */
+            r->start = end;
+        } else {
+            g_sequence_remove(it);
+        }
+        it = next;
+    }
+}
+
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int64_t nb_sectors)
+{
+    BdrvBlockStatusCache *c = &bs->block_status_cache;
+
+    /* Queries that are in flight must not store their result */
+    c->gen++;
+
+    if (c->ranges && nb_sectors > 0) {
+        remove_ranges(c, sector_num, sector_num + nb_sectors);
+    }
+}
+
+unsigned bdrv_block_status_cache_gen(BlockDriverState *bs)
+{
+    return bs->block_status_cache.gen;
+}
+
+void bdrv_block_status_cache_store(BlockDriverState *bs, unsigned gen,
+                                   int64_t sector_num, int nb_sectors,
+                                   BlockDriverState *file, int64_t status)
+{
+    BdrvBlockStatusCache *c = get_cache(bs);
+    BdrvBlockStatusRange *r;
+    GSequenceIter *it, *prev;
+
+    if (c->gen != gen || nb_sectors <= 0) {
+        return;
+    }
+
+    if (g_sequence_get_length(c->ranges) >= BLOCK_STATUS_CACHE_MAX_RANGES) {
+        g_sequence_remove_range(g_sequence_get_begin_iter(c->ranges),
+                                g_sequence_get_end_iter(c->ranges));
+    }
+
+    /* A freshly queried status may overlap parts of older ranges */
+    remove_ranges(c, sector_num, sector_num + nb_sectors);
+
+    r = g_new(BdrvBlockStatusRange, 1);
+    *r = (BdrvBlockStatusRange) {
+        .start  = sector_num,
+        .end    = sector_num + nb_sectors,
+        .status = status & ~BDRV_BLOCK_OFFSET_MASK,
+        .offset = status & BDRV_BLOCK_OFFSET_MASK,
+        .file   = file,
+    };
+    it = g_sequence_insert_sorted(c->ranges, r, range_cmp, NULL);
+
+    /* Keep the cache compact by merging with contiguous neighbours */
+    if (!g_sequence_iter_is_begin(it)) {
+        prev = g_sequence_iter_prev(it);
+        if (can_merge(g_sequence_get(prev), r)) {
+            BdrvBlockStatusRange *p = g_sequence_get(prev);
+
+            p->end = r->end;
+            g_sequence_remove(it);
+            it = prev;
+            r = p;
+        }
+    }
+
+    if (!g_sequence_iter_is_end(g_sequence_iter_next(it))) {
+        GSequenceIter *next = g_sequence_iter_next(it);
+        BdrvBlockStatusRange *n = g_sequence_get(next);
+
+        if (can_merge(r, n)) {
+            r->end = n->end;
+            g_sequence_remove(next);
+        }
+    }
+}
+
+void bdrv_block_status_cache_clear(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *c = &bs->block_status_cache;
+
+    c->gen++;
+    if (c->ranges) {
+        g_sequence_remove_range(g_sequence_get_begin_iter(c->ranges),
+                                g_sequence_get_end_iter(c->ranges));
+    }
+}
+
+void bdrv_block_status_cache_graph_changed(void)
+{
+    atomic_inc(&bdrv_graph_gen);
+}
+
+void bdrv_block_status_cache_free(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *c = &bs->block_status_cache;
+
+    if (c->ranges) {
+        g_sequence_free(c->ranges);
+        c->ranges = NULL;
+    }
+}
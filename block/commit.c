@@ -16,6 +16,7 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
+#include "block/copy-pool.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
@@ -42,12 +43,13 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+    CopyPool pool;
 } CommitBlockJob;
 
-static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
-                                        int64_t sector_num, int nb_sectors,
-                                        void *buf)
+static int coroutine_fn commit_populate(void *opaque, int64_t sector_num,
+                                        int nb_sectors, void *buf)
 {
+    CommitBlockJob *s = opaque;
     int ret = 0;
     QEMUIOVector qiov;
     struct iovec iov = {
@@ -57,13 +59,13 @@ static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
 
     qemu_iovec_init_external(&qiov, &iov, 1);
 
-    ret = blk_co_preadv(bs, sector_num * BDRV_SECTOR_SIZE,
+    ret = blk_co_preadv(s->top, sector_num * BDRV_SECTOR_SIZE,
                         qiov.size, &qiov, 0);
     if (ret < 0) {
         return ret;
     }
 
-    ret = blk_co_pwritev(base, sector_num * BDRV_SECTOR_SIZE,
+    ret = blk_co_pwritev(s->base, sector_num * BDRV_SECTOR_SIZE,
                          qiov.size, &qiov, 0);
     if (ret < 0) {
         return ret;
@@ -72,6 +74,26 @@ static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
     return 0;
 }
 
+/*
+ * Applies the error action to a failed request.  Failed chunks are retried
+ * unless the error is to be reported; in that case, returns true and stores
+ * the error in *error.
+ */
+static bool commit_handle_error(void *opaque, int ret, int *error,
+                                bool *retry)
+{
+    CommitBlockJob *s = opaque;
+    BlockErrorAction action =
+        block_job_error_action(&s->common, false, s->on_error, -ret);
+
+    if (action == BLOCK_ERROR_ACTION_REPORT) {
+        *error = ret;
+        return true;
+    }
+    *retry = true;
+    return false;
+}
+
 typedef struct {
     int ret;
 } CommitCompleteData;
@@ -115,8 +137,6 @@ static void coroutine_fn commit_run(void *opaque)
     uint64_t delay_ns = 0;
     int ret = 0;
     int n = 0;
-    void *buf = NULL;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = blk_getlength(s->top);
@@ -139,52 +159,80 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        bool copy;
+    /* Up to max_workers chunks are copied in the background, so the next
+     * allocated chunk is read while the previous one is being written.
+     */
+    sector_num = 0;
+    for (;;) {
+        bool retry;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Requests that are still
+         * in flight complete without our help.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
+
+        if (copy_pool_has_failed(&s->pool)) {
+            if (copy_pool_process_failed(&s->pool, commit_handle_error,
+                                         &ret)) {
+                goto drain;
+            }
+            if (copy_pool_has_failed(&s->pool) &&
+                copy_pool_is_full(&s->pool)) {
+                copy_pool_wait(&s->pool);
+            }
+            continue;
+        }
+
+        if (sector_num == end) {
+            if (s->pool.in_flight == 0) {
+                break;
+            }
+            trace_commit_yield_in_flight(s, sector_num, s->pool.in_flight);
+            copy_pool_wait(&s->pool);
+            continue;
+        }
+
+        while (copy_pool_is_full(&s->pool)) {
+            trace_commit_yield_in_flight(s, sector_num, s->pool.in_flight);
+            copy_pool_wait(&s->pool);
+        }
+
         /* Copy if allocated above the base */
         ret = bdrv_is_allocated_above(blk_bs(s->top), blk_bs(s->base),
                                       sector_num,
                                       COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
                                       &n);
-        copy = (ret == 1);
         trace_commit_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            ret = commit_populate(s->top, s->base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
-        }
         if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, false, s->on_error, -ret);
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                goto out;
-            } else {
-                n = 0;
-                continue;
+            if (commit_handle_error(s, ret, &ret, &retry)) {
+                goto drain;
             }
+            continue;
         }
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
 
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        if (ret == 1) {
+            copy_pool_submit(&s->pool, sector_num, n);
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            }
+        } else {
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
         }
+        sector_num += n;
     }
 
     ret = 0;
 
-out:
-    qemu_vfree(buf);
+drain:
+    copy_pool_finish(&s->pool);
 
+out:
     data = g_malloc(sizeof(*data));
     data->ret = ret;
     block_job_defer_to_main_loop(&s->common, commit_complete, data);
@@ -201,17 +249,26 @@ static void commit_set_speed(BlockJob *job, int64_t speed, Error **errp)
     ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
 }
 
+static void commit_query(BlockJob *job, BlockJobInfo *info)
+{
+    CommitBlockJob *s = container_of(job, CommitBlockJob, common);
+
+    info->has_in_flight = true;
+    info->in_flight = s->pool.bytes_in_flight;
+}
+
 static const BlockJobDriver commit_job_driver = {
     .instance_size = sizeof(CommitBlockJob),
     .job_type      = BLOCK_JOB_TYPE_COMMIT,
     .set_speed     = commit_set_speed,
     .start         = commit_run,
+    .query         = commit_query,
 };
 
 void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top, int64_t speed,
-                  BlockdevOnError on_error, const char *backing_file_str,
-                  Error **errp)
+                  int max_workers, BlockdevOnError on_error,
+                  const char *backing_file_str, Error **errp)
 {
     CommitBlockJob *s;
     BlockReopenQueue *reopen_queue = NULL;
@@ -289,6 +346,8 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     s->backing_file_str = g_strdup(backing_file_str);
 
     s->on_error = on_error;
+    copy_pool_init(&s->pool, &s->common, s->top, COMMIT_BUFFER_SIZE,
+                   max_workers, commit_populate, s);
 
     trace_commit_start(bs, base, top, s);
     block_job_start(&s->common);
@@ -388,6 +447,7 @@ int bdrv_commit(BlockDriverState *bs)
 
     if (drv->bdrv_make_empty) {
         ret = drv->bdrv_make_empty(bs);
+        bdrv_block_status_cache_clear(bs);
         if (ret < 0) {
             goto ro_cleanup;
         }
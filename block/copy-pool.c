@@ -0,0 +1,154 @@
+/*
+ * Bounded pool of background copy requests for block jobs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/blockjob_int.h"
+#include "block/copy-pool.h"
+#include "sysemu/block-backend.h"
+
+void copy_pool_init(CopyPool *pool, BlockJob *job, BlockBackend *blk,
+                    size_t buf_size, int max_workers,
+                    CopyPoolFunc *copy, void *opaque)
+{
+    assert(max_workers > 0);
+
+    *pool = (CopyPool) {
+        .job            = job,
+        .blk            = blk,
+        .buf_size       = buf_size,
+        .copy           = copy,
+        .opaque         = opaque,
+        .max_workers    = max_workers,
+    };
+    QTAILQ_INIT(&pool->failed_ops);
+    QTAILQ_INIT(&pool->free_ops);
+}
+
+/* Buffers are reused across requests instead of being freed */
+static CopyPoolOp *copy_pool_op_get(CopyPool *pool)
+{
+    CopyPoolOp *op = QTAILQ_FIRST(&pool->free_ops);
+
+    if (op) {
+        QTAILQ_REMOVE(&pool->free_ops, op, next);
+    } else {
+        op = g_new0(CopyPoolOp, 1);
+        op->pool = pool;
+        op->buf = blk_blockalign(pool->blk, pool->buf_size);
+    }
+    return op;
+}
+
+static void copy_pool_op_release(CopyPool *pool, CopyPoolOp *op)
+{
+    QTAILQ_INSERT_HEAD(&pool->free_ops, op, next);
+}
+
+static void coroutine_fn copy_pool_entry(void *opaque)
+{
+    CopyPoolOp *op = opaque;
+    CopyPool *pool = op->pool;
+
+    op->ret = pool->copy(pool->opaque, op->sector_num, op->nb_sectors,
+                         op->buf);
+
+    pool->in_flight--;
+    pool->bytes_in_flight -= op->nb_sectors * BDRV_SECTOR_SIZE;
+    if (op->ret < 0) {
+        QTAILQ_INSERT_TAIL(&pool->failed_ops, op, next);
+    } else {
+        pool->job->offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+        copy_pool_op_release(pool, op);
+    }
+
+    if (pool->waiting_for_io) {
+        qemu_coroutine_enter(pool->job->co);
+    }
+}
+
+static void copy_pool_start_op(CopyPool *pool, CopyPoolOp *op)
+{
+    Coroutine *co;
+
+    pool->in_flight++;
+    pool->bytes_in_flight += op->nb_sectors * BDRV_SECTOR_SIZE;
+
+    co = qemu_coroutine_create(copy_pool_entry, op);
+    qemu_coroutine_enter(co);
+}
+
+void copy_pool_submit(CopyPool *pool, int64_t sector_num, int nb_sectors)
+{
+    CopyPoolOp *op;
+
+    assert(!copy_pool_is_full(pool));
+    assert(nb_sectors * BDRV_SECTOR_SIZE <= pool->buf_size);
+
+    op = copy_pool_op_get(pool);
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    copy_pool_start_op(pool, op);
+}
+
+void coroutine_fn copy_pool_wait(CopyPool *pool)
+{
+    assert(!pool->waiting_for_io);
+    pool->waiting_for_io = true;
+    qemu_coroutine_yield();
+    pool->waiting_for_io = false;
+}
+
+bool copy_pool_process_failed(CopyPool *pool, CopyPoolErrorFunc *handle_error,
+                              int *error)
+{
+    CopyPoolOp *op;
+
+    while ((op = QTAILQ_FIRST(&pool->failed_ops))) {
+        if (!op->retry) {
+            if (handle_error(pool->opaque, op->ret, error, &op->retry)) {
+                return true;
+            }
+            if (op->retry) {
+                /* Resubmit after the pause point in block_job_sleep_ns() */
+                return false;
+            }
+            pool->job->offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+            QTAILQ_REMOVE(&pool->failed_ops, op, next);
+            copy_pool_op_release(pool, op);
+            continue;
+        }
+
+        if (copy_pool_is_full(pool)) {
+            return false;
+        }
+        QTAILQ_REMOVE(&pool->failed_ops, op, next);
+        op->retry = false;
+        copy_pool_start_op(pool, op);
+    }
+    return false;
+}
+
+void coroutine_fn copy_pool_finish(CopyPool *pool)
+{
+    CopyPoolOp *op;
+
+    /* Requests may still be in flight after cancellation or an error */
+    while (pool->in_flight > 0) {
+        copy_pool_wait(pool);
+    }
+
+    while ((op = QTAILQ_FIRST(&pool->failed_ops))) {
+        QTAILQ_REMOVE(&pool->failed_ops, op, next);
+        copy_pool_op_release(pool, op);
+    }
+    while ((op = QTAILQ_FIRST(&pool->free_ops))) {
+        QTAILQ_REMOVE(&pool->free_ops, op, next);
+        qemu_vfree(op->buf);
+        g_free(op);
+    }
+}
@@ -984,6 +984,10 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
                                   &bounce_qiov, 0);
     }
 
+    /* The data is unchanged, but the clusters are allocated now */
+    bdrv_block_status_cache_invalidate(bs, cluster_offset >> BDRV_SECTOR_BITS,
+                                       cluster_bytes >> BDRV_SECTOR_BITS);
+
     if (ret < 0) {
         /* It might be okay to ignore write errors for guest requests.  If this
          * is a deliberate copy-on-read then we don't want to ignore the error.
@@ -1260,7 +1264,7 @@ static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
             assert(!bs->supported_zero_flags);
         }
 
-        if (ret == -ENOTSUP) {
+        if (ret == -ENOTSUP && !(flags & BDRV_REQ_NO_FALLBACK)) {
             /* Fall back to bounce buffer if write zeroes is unsupported */
             BdrvRequestFlags write_flags = flags & ~BDRV_REQ_ZERO_WRITE;
 
@@ -1337,6 +1341,10 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    req->write_offset = offset;
+    req->write_bytes = bytes;
+    req->write_qiov = qiov;
+    req->write_flags = flags;
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1386,7 +1394,13 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
     bdrv_debug_event(bs, BLKDBG_PWRITEV_DONE);
 
+    req->write_ret = ret;
+    notifier_with_return_list_notify(&bs->after_write_notifiers, req);
+    req->write_qiov = NULL;
+
     ++bs->write_gen;
+    bdrv_block_status_cache_invalidate(bs, start_sector,
+                                       end_sector - start_sector);
     bdrv_set_dirty(bs, start_sector, end_sector - start_sector);
 
     if (bs->wr_highest_offset < offset + bytes) {
@@ -1526,6 +1540,11 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
      */
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
+    if (bs->serialise_writes_align) {
+        mark_request_serialising(&req, bs->serialise_writes_align);
+        wait_serialising_requests(&req);
+    }
+
     if (!qiov) {
         ret = bdrv_co_do_zero_pwritev(bs, offset, bytes, flags, &req);
         goto out;
@@ -1657,6 +1676,123 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    int64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    int64_t dst_offset,
+                                                    int bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BlockDriverState *bs;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src || !dst || !src->bs || !dst->bs ||
+        !src->bs->drv || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->bs->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst->bs->open_flags & BDRV_O_INACTIVE));
+
+    ret = bdrv_check_byte_request(src->bs, src_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_check_byte_request(dst->bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* There is no bounce buffer to do read-modify-write in */
+    if (!QEMU_IS_ALIGNED(src_offset | bytes, src->bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(dst_offset | bytes, dst->bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        bs = src->bs;
+        if (!bs->drv->bdrv_co_copy_range_from || bs->copy_on_read) {
+            return -ENOTSUP;
+        }
+
+        bdrv_inc_in_flight(bs);
+        tracked_request_begin(&req, bs, src_offset, bytes, BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+        ret = bs->drv->bdrv_co_copy_range_from(bs, src, src_offset,
+                                               dst, dst_offset, bytes, flags);
+        tracked_request_end(&req);
+        bdrv_dec_in_flight(bs);
+    } else {
+        int64_t start_sector = dst_offset >> BDRV_SECTOR_BITS;
+        int64_t end_sector = DIV_ROUND_UP(dst_offset + bytes,
+                                          BDRV_SECTOR_SIZE);
+
+        bs = dst->bs;
+        /* Write notifiers (backup, write-blocking mirror) need to see the
+         * data that is written */
+        if (!bs->drv->bdrv_co_copy_range_to ||
+            !QLIST_EMPTY(&bs->before_write_notifiers.notifiers)) {
+            return -ENOTSUP;
+        }
+
+        bdrv_inc_in_flight(bs);
+        tracked_request_begin(&req, bs, dst_offset, bytes, BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+        ret = bs->drv->bdrv_co_copy_range_to(bs, src, src_offset,
+                                             dst, dst_offset, bytes, flags);
+
+        ++bs->write_gen;
+        bdrv_block_status_cache_invalidate(bs, start_sector,
+                                           end_sector - start_sector);
+        bdrv_set_dirty(bs, start_sector, end_sector - start_sector);
+        if (bs->wr_highest_offset < dst_offset + bytes) {
+            bs->wr_highest_offset = dst_offset + bytes;
+        }
+        if (ret >= 0) {
+            bs->total_sectors = MAX(bs->total_sectors, end_sector);
+            ret = 0;
+        }
+
+        tracked_request_end(&req);
+        bdrv_dec_in_flight(bs);
+    }
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
+                                         BdrvChild *dst, int64_t dst_offset,
+                                         int bytes, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                  bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, int64_t src_offset,
+                                       BdrvChild *dst, int64_t dst_offset,
+                                       int bytes, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
+                                    BdrvChild *dst, int64_t dst_offset,
+                                    int bytes, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                   bytes, flags);
+}
+
 /*
  * Flush ALL BDSes regardless of if they are reachable via a BlkBackend or not.
  */
@@ -1719,6 +1855,8 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
     int64_t total_sectors;
     int64_t n;
     int64_t ret, ret2;
+    unsigned int cache_gen = 0;
+    bool use_cache;
 
     total_sectors = bdrv_nb_sectors(bs);
     if (total_sectors < 0) {
@@ -1746,6 +1884,18 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
 
     *file = NULL;
     bdrv_inc_in_flight(bs);
+
+    /* Only format drivers own the metadata they report, protocols may
+     * change behind our back */
+    use_cache = !bs->drv->protocol_name &&
+                !(bs->open_flags & BDRV_O_INACTIVE);
+    if (use_cache &&
+        bdrv_block_status_cache_lookup(bs, sector_num, nb_sectors, pnum,
+                                       file, &ret)) {
+        goto unallocated;
+    }
+
+    cache_gen = bdrv_block_status_cache_gen(bs);
     ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum,
                                             file);
     if (ret < 0) {
@@ -1762,16 +1912,6 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
 
     if (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) {
         ret |= BDRV_BLOCK_ALLOCATED;
-    } else {
-        if (bdrv_unallocated_blocks_are_zero(bs)) {
-            ret |= BDRV_BLOCK_ZERO;
-        } else if (bs->backing) {
-            BlockDriverState *bs2 = bs->backing->bs;
-            int64_t nb_sectors2 = bdrv_nb_sectors(bs2);
-            if (nb_sectors2 >= 0 && sector_num >= nb_sectors2) {
-                ret |= BDRV_BLOCK_ZERO;
-            }
-        }
     }
 
     if (*file && *file != bs &&
@@ -1799,6 +1939,25 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
         }
     }
 
+    if (use_cache) {
+        bdrv_block_status_cache_store(bs, cache_gen, sector_num, *pnum,
+                                      *file, ret);
+    }
+
+unallocated:
+    /* This depends on the backing file, so it is not cached */
+    if (!(ret & BDRV_BLOCK_ALLOCATED)) {
+        if (bdrv_unallocated_blocks_are_zero(bs)) {
+            ret |= BDRV_BLOCK_ZERO;
+        } else if (bs->backing) {
+            BlockDriverState *bs2 = bs->backing->bs;
+            int64_t nb_sectors2 = bdrv_nb_sectors(bs2);
+            if (nb_sectors2 >= 0 && sector_num >= nb_sectors2) {
+                ret |= BDRV_BLOCK_ZERO;
+            }
+        }
+    }
+
 out:
     bdrv_dec_in_flight(bs);
     return ret;
@@ -2460,6 +2619,11 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
     bdrv_inc_in_flight(bs);
     tracked_request_begin(&req, bs, offset, count, BDRV_TRACKED_DISCARD);
 
+    if (bs->serialise_writes_align) {
+        mark_request_serialising(&req, bs->serialise_writes_align);
+        wait_serialising_requests(&req);
+    }
+
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
     if (ret < 0) {
         goto out;
@@ -2524,6 +2688,9 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
     ret = 0;
 out:
     ++bs->write_gen;
+    bdrv_block_status_cache_invalidate(bs, req.offset >> BDRV_SECTOR_BITS,
+        DIV_ROUND_UP(req.offset + req.bytes, BDRV_SECTOR_SIZE) -
+        (req.offset >> BDRV_SECTOR_BITS));
     bdrv_set_dirty(bs, req.offset >> BDRV_SECTOR_BITS,
                    req.bytes >> BDRV_SECTOR_BITS);
     tracked_request_end(&req);
@@ -2642,6 +2809,12 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier)
+{
+    notifier_with_return_list_add(&bs->after_write_notifiers, notifier);
+}
+
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BdrvChild *child;
@@ -34,6 +34,8 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+typedef struct MirrorOp MirrorOp;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -69,14 +71,59 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+    /* Try to offload copies to the block layer (bdrv_co_copy_range) */
+    bool use_copy_range;
+
+    MirrorCopyMode copy_mode;
+    /* Set once guest writes are forwarded to the target synchronously and
+     * no longer mark the dirty bitmap (write-blocking mode only) */
+    bool active_mode;
+    NotifierWithReturn before_write;
+    NotifierWithReturn after_write;
+    QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+    int active_write_in_flight;
+    uint64_t active_write_count;
+    uint64_t active_write_total_ns;
+    uint64_t active_write_max_ns;
 } MirrorBlockJob;
 
-typedef struct MirrorOp {
+struct MirrorOp {
     MirrorBlockJob *s;
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
-} MirrorOp;
+
+    bool is_active_write;
+    /* For active writes, the guest request that is being mirrored */
+    BdrvTrackedRequest *active_req;
+    /* Guest writes that wait for this operation to complete */
+    CoQueue waiting_requests;
+    QTAILQ_ENTRY(MirrorOp) next;
+};
+
+/* In write-blocking mode the bitmap is disabled once the initial copy is
+ * set up, and from then on only the job changes it */
+static void mirror_set_dirty(MirrorBlockJob *s, int64_t sector_num,
+                             int64_t nb_sectors)
+{
+    if (bdrv_dirty_bitmap_enabled(s->dirty_bitmap)) {
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+    } else {
+        bdrv_set_disabled_dirty_bitmap(s->dirty_bitmap, sector_num,
+                                       nb_sectors);
+    }
+}
+
+static void mirror_reset_dirty(MirrorBlockJob *s, int64_t sector_num,
+                               int64_t nb_sectors)
+{
+    if (bdrv_dirty_bitmap_enabled(s->dirty_bitmap)) {
+        bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+    } else {
+        bdrv_reset_disabled_dirty_bitmap(s->dirty_bitmap, sector_num,
+                                         nb_sectors);
+    }
+}
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
@@ -91,6 +138,19 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+static MirrorOp *mirror_op_new(MirrorBlockJob *s, int64_t sector_num,
+                               int nb_sectors)
+{
+    MirrorOp *op = g_new0(MirrorOp, 1);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    qemu_co_queue_init(&op->waiting_requests);
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, op, next);
+    return op;
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -100,6 +160,11 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret);
 
+    QTAILQ_REMOVE(&s->ops_in_flight, op, next);
+    while (qemu_co_enter_next(&op->waiting_requests)) {
+        /* nothing */
+    }
+
     s->in_flight--;
     s->sectors_in_flight -= op->nb_sectors;
     iov = op->qiov.iov;
@@ -135,7 +200,7 @@ static void mirror_write_complete(void *opaque, int ret)
     if (ret < 0) {
         BlockErrorAction action;
 
-        bdrv_set_dirty_bitmap(s->dirty_bitmap, op->sector_num, op->nb_sectors);
+        mirror_set_dirty(s, op->sector_num, op->nb_sectors);
         action = mirror_error_action(s, false, -ret);
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
@@ -151,7 +216,7 @@ static void mirror_read_complete(void *opaque, int ret)
     if (ret < 0) {
         BlockErrorAction action;
 
-        bdrv_set_dirty_bitmap(s->dirty_bitmap, op->sector_num, op->nb_sectors);
+        mirror_set_dirty(s, op->sector_num, op->nb_sectors);
         action = mirror_error_action(s, true, -ret);
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
@@ -164,6 +229,27 @@ static void mirror_read_complete(void *opaque, int ret)
                     0, mirror_write_complete, op);
 }
 
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = blk_co_copy_range(s->common.blk, op->sector_num * BDRV_SECTOR_SIZE,
+                            s->target, op->sector_num * BDRV_SECTOR_SIZE,
+                            op->nb_sectors * BDRV_SECTOR_SIZE, 0);
+    if (ret < 0) {
+        /* Use the buffers for this and all later operations; the buffered
+         * copy also tells read and write errors apart */
+        trace_mirror_copy_range_fail(s, op->sector_num, op->nb_sectors, ret);
+        s->use_copy_range = false;
+        blk_aio_preadv(s->common.blk, op->sector_num * BDRV_SECTOR_SIZE,
+                       &op->qiov, 0, mirror_read_complete, op);
+        return;
+    }
+    mirror_write_complete(op, 0);
+}
+
 static inline void mirror_clip_sectors(MirrorBlockJob *s,
                                        int64_t sector_num,
                                        int *nb_sectors)
@@ -261,10 +347,7 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     }
 
     /* Allocate a MirrorOp that is used as an AIO callback.  */
-    op = g_new(MirrorOp, 1);
-    op->s = s;
-    op->sector_num = sector_num;
-    op->nb_sectors = nb_sectors;
+    op = mirror_op_new(s, sector_num, nb_sectors);
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -284,6 +367,14 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     s->sectors_in_flight += nb_sectors;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
 
+    /* The buffers are taken even for offloaded copies, so that buf_size
+     * keeps limiting the amount of data in flight */
+    if (s->use_copy_range) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range, op);
+        qemu_coroutine_enter(co);
+        return ret;
+    }
+
     blk_aio_preadv(source, sector_num * BDRV_SECTOR_SIZE, &op->qiov, 0,
                    mirror_read_complete, op);
     return ret;
@@ -298,10 +389,7 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
 
     /* Allocate a MirrorOp that is used as an AIO callback. The qiov is zeroed
      * so the freeing in mirror_iteration_done is nop. */
-    op = g_new0(MirrorOp, 1);
-    op->s = s;
-    op->sector_num = sector_num;
-    op->nb_sectors = nb_sectors;
+    op = mirror_op_new(s, sector_num, nb_sectors);
 
     s->in_flight++;
     s->sectors_in_flight += nb_sectors;
@@ -374,8 +462,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
      * calling bdrv_get_block_status_above could yield - if some blocks are
      * marked dirty in this window, we need to know.
      */
-    bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num,
-                            nb_chunks * sectors_per_chunk);
+    mirror_reset_dirty(s, sector_num, nb_chunks * sectors_per_chunk);
     bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk, nb_chunks);
     while (nb_chunks > 0 && sector_num < end) {
         int ret;
@@ -475,11 +562,224 @@ static void mirror_free_init(MirrorBlockJob *s)
  */
 static void mirror_wait_for_all_io(MirrorBlockJob *s)
 {
-    while (s->in_flight > 0) {
+    while (s->in_flight > 0 || s->active_write_in_flight > 0) {
         mirror_wait_for_io(s);
     }
 }
 
+/* Wait until no mirror operation touches the chunks in the given range */
+static void coroutine_fn mirror_wait_on_conflicts(MirrorBlockJob *s,
+                                                  int64_t sector_num,
+                                                  int nb_sectors)
+{
+    MirrorOp *op;
+    bool retry;
+
+    do {
+        retry = false;
+        QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+            if (sector_num < op->sector_num + op->nb_sectors &&
+                op->sector_num < sector_num + nb_sectors) {
+                qemu_co_queue_wait(&op->waiting_requests);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/* Returns true if another guest write overlapping @req is in flight */
+static bool mirror_overlapping_write(BlockDriverState *bs,
+                                     BdrvTrackedRequest *req)
+{
+    BdrvTrackedRequest *other;
+
+    QLIST_FOREACH(other, &bs->tracked_requests, list) {
+        if (other != req && other->type == BDRV_TRACKED_WRITE &&
+            req->write_offset < other->offset + other->bytes &&
+            other->offset < req->write_offset + req->write_bytes) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns the sectors written by @req, clipped to the job's length */
+static bool mirror_active_write_range(MirrorBlockJob *s,
+                                      BdrvTrackedRequest *req,
+                                      int64_t *sector_num,
+                                      int64_t *end_sector)
+{
+    int64_t offset;
+    unsigned int bytes;
+
+    if (req->type == BDRV_TRACKED_WRITE) {
+        offset = req->write_offset;
+        bytes = req->write_bytes;
+    } else {
+        offset = req->offset;
+        bytes = req->bytes;
+    }
+
+    *sector_num = offset >> BDRV_SECTOR_BITS;
+    *end_sector = MIN(DIV_ROUND_UP(offset + bytes, BDRV_SECTOR_SIZE),
+                      s->bdev_length >> BDRV_SECTOR_BITS);
+    return *sector_num < *end_sector;
+}
+
+/*
+ * In write-blocking mode, guest writes are mirrored to the target once
+ * they have completed on the source.  The dirty bitmap is disabled at that
+ * point, so guest writes do not add work to the background copy.
+ *
+ * The block layer makes the guest request serialising before it waits for
+ * overlapping requests (bs->serialise_writes_align), so a background copy
+ * of the range that starts later reads the new data.  Before the write
+ * reaches the source, this notifier waits for the mirror operations on the
+ * same chunks and registers the write as an operation of its own, which
+ * keeps new background copies away until the target has been written.
+ *
+ * When the write cannot be mirrored safely (discards, concurrent
+ * overlapping writes, target COW that needs the source data) the range is
+ * marked dirty instead.
+ */
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    BlockDriverState *bs = blk_bs(s->common.blk);
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t sector_num, end_sector, chunk_start, chunk_end;
+    bool forward;
+    MirrorOp *op;
+
+    if (!s->active_mode) {
+        return 0;
+    }
+
+    assert(req->bs == bs);
+    assert(req->serialising);
+    if (!mirror_active_write_range(s, req, &sector_num, &end_sector)) {
+        return 0;
+    }
+    chunk_start = QEMU_ALIGN_DOWN(sector_num, sectors_per_chunk);
+    chunk_end = QEMU_ALIGN_UP(end_sector, sectors_per_chunk);
+
+    mirror_wait_on_conflicts(s, chunk_start, chunk_end - chunk_start);
+    if (!s->active_mode) {
+        return 0;
+    }
+
+    forward = req->type == BDRV_TRACKED_WRITE &&
+              !mirror_overlapping_write(bs, req);
+    if (forward && s->cow_bitmap) {
+        forward = test_bit(chunk_start / sectors_per_chunk, s->cow_bitmap) &&
+                  test_bit((chunk_end - 1) / sectors_per_chunk,
+                           s->cow_bitmap);
+    }
+
+    trace_mirror_active_write(s, sector_num << BDRV_SECTOR_BITS,
+                              (end_sector - sector_num) << BDRV_SECTOR_BITS,
+                              forward);
+    if (!forward) {
+        mirror_set_dirty(s, sector_num, end_sector - sector_num);
+        return 0;
+    }
+
+    op = mirror_op_new(s, chunk_start, chunk_end - chunk_start);
+    op->is_active_write = true;
+    op->active_req = req;
+    bitmap_set(s->in_flight_bitmap, chunk_start / sectors_per_chunk,
+               (chunk_end - chunk_start) / sectors_per_chunk);
+    s->active_write_in_flight++;
+    return 0;
+}
+
+/* Second half of a mirrored guest write: copy the data that has just been
+ * written to the source over to the target */
+static int coroutine_fn mirror_after_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvTrackedRequest *req = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t offset = req->write_offset;
+    unsigned int bytes = req->write_bytes;
+    int64_t sector_num, end_sector;
+    int64_t start_ns, latency_ns;
+    MirrorOp *op;
+    int ret;
+
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        if (op->active_req == req) {
+            break;
+        }
+    }
+    if (!op) {
+        return 0;
+    }
+    mirror_active_write_range(s, req, &sector_num, &end_sector);
+
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (req->write_ret < 0) {
+        /* The source has not been written, or only partially */
+        ret = req->write_ret;
+    } else if (req->write_qiov) {
+        ret = blk_co_pwritev(s->target, offset, bytes, req->write_qiov,
+                             req->write_flags & BDRV_REQ_FUA);
+    } else {
+        assert(req->write_flags & BDRV_REQ_ZERO_WRITE);
+        ret = blk_co_pwrite_zeroes(s->target, offset, bytes,
+                                   req->write_flags & BDRV_REQ_MAY_UNMAP);
+    }
+    latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+    trace_mirror_active_write_done(s, offset, bytes, ret, latency_ns);
+
+    if (req->write_ret >= 0) {
+        s->active_write_count++;
+        s->active_write_total_ns += latency_ns;
+        s->active_write_max_ns = MAX(s->active_write_max_ns, latency_ns);
+    }
+
+    if (req->write_ret < 0) {
+        mirror_set_dirty(s, sector_num, end_sector - sector_num);
+    } else if (ret < 0) {
+        BlockErrorAction action;
+
+        /* Leave the range to the background copy */
+        mirror_set_dirty(s, sector_num, end_sector - sector_num);
+        action = mirror_error_action(s, false, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+            s->ret = ret;
+        }
+    } else {
+        /* Chunks that are completely overwritten are now in sync */
+        int64_t full_start = QEMU_ALIGN_UP(sector_num, sectors_per_chunk);
+        int64_t full_end = QEMU_ALIGN_DOWN(end_sector, sectors_per_chunk);
+
+        if (full_end > full_start) {
+            mirror_reset_dirty(s, full_start, full_end - full_start);
+        }
+    }
+
+    bitmap_clear(s->in_flight_bitmap, op->sector_num / sectors_per_chunk,
+                 op->nb_sectors / sectors_per_chunk);
+    QTAILQ_REMOVE(&s->ops_in_flight, op, next);
+    qemu_co_queue_restart_all(&op->waiting_requests);
+    g_free(op);
+
+    s->active_write_in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+
+    /* Errors on the target are handled by the job, not by the guest */
+    return 0;
+}
+
 typedef struct {
     int ret;
 } MirrorExitData;
@@ -698,6 +998,18 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        /* From now on guest writes are forwarded to the target instead of
+         * dirtying the bitmap, so only the initial copy is left to do in
+         * background.  Drain so that no write that already passed the
+         * notifier can still set the bitmap. */
+        bdrv_drained_begin(bs);
+        bdrv_disable_dirty_bitmap(s->dirty_bitmap);
+        bs->serialise_writes_align = s->granularity;
+        s->active_mode = true;
+        bdrv_drained_end(bs);
+    }
+
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap, 0);
     for (;;) {
@@ -804,6 +1116,17 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    /* Stop forwarding guest writes and wait for those still in flight */
+    s->active_mode = false;
+    while (s->active_write_in_flight > 0) {
+        mirror_wait_for_io(s);
+    }
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        bs->serialise_writes_align = 0;
+        notifier_with_return_remove(&s->before_write);
+        notifier_with_return_remove(&s->after_write);
+    }
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -926,6 +1249,28 @@ static void mirror_drain(BlockJob *job)
     }
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_in_flight = true;
+    info->in_flight = s->sectors_in_flight * BDRV_SECTOR_SIZE;
+
+    if (s->copy_mode != MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        return;
+    }
+
+    info->has_active_writes = true;
+    info->active_writes = s->active_write_count;
+    info->has_active_writes_in_flight = true;
+    info->active_writes_in_flight = s->active_write_in_flight;
+    info->has_active_write_latency_ns = true;
+    info->active_write_latency_ns = s->active_write_count ?
+        s->active_write_total_ns / s->active_write_count : 0;
+    info->has_active_write_max_latency_ns = true;
+    info->active_write_max_latency_ns = s->active_write_max_ns;
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .instance_size          = sizeof(MirrorBlockJob),
     .job_type               = BLOCK_JOB_TYPE_MIRROR,
@@ -935,6 +1280,7 @@ static const BlockJobDriver mirror_job_driver = {
     .pause                  = mirror_pause,
     .attached_aio_context   = mirror_attached_aio_context,
     .drain                  = mirror_drain,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -955,7 +1301,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              BlockMirrorBackingMode backing_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
@@ -997,6 +1343,9 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
+    s->use_copy_range = true;
+    QTAILQ_INIT(&s->ops_in_flight);
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -1019,6 +1368,13 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
         }
     }
 
+    if (copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        s->before_write.notify = mirror_before_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+        s->after_write.notify = mirror_after_write_notify;
+        bdrv_add_after_write_notifier(bs, &s->after_write);
+    }
+
     trace_mirror_start(bs, s, opaque);
     block_job_start(&s->common);
 }
@@ -1029,7 +1385,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap, Error **errp)
+                  bool unmap, MirrorCopyMode copy_mode, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1042,7 +1398,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(job_id, bs, BLOCK_JOB_DEFAULT, target, replaces,
                      speed, granularity, buf_size, backing_mode,
-                     on_source_error, on_target_error, unmap, NULL, NULL, errp,
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     NULL, NULL, errp,
                      &mirror_job_driver, is_none_mode, base, false);
 }
 
@@ -1090,7 +1447,8 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
 
     mirror_start_job(job_id, bs, creation_flags, base, NULL, speed, 0, 0,
                      MIRROR_LEAVE_BACKING_CHAIN,
-                     on_error, on_error, true, cb, opaque, &local_err,
+                     on_error, on_error, true, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err,
                      &commit_active_job_driver, false, base, auto_complete);
     if (local_err) {
         error_propagate(errp, local_err);
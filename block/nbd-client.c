@@ -28,221 +28,505 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/range.h"
+#include "trace.h"
 #include "nbd-client.h"
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define HANDLE_TO_INDEX(c, handle) ((handle) ^ ((uint64_t)(intptr_t)c))
+#define INDEX_TO_HANDLE(c, index)  ((index)  ^ ((uint64_t)(intptr_t)c))
 
-static void nbd_recv_coroutines_enter_all(NBDClientSession *s)
+static void nbd_recv_coroutines_enter_all(NBDConnection *c)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i]);
+        if (c->recv_coroutine[i]) {
+            qemu_coroutine_enter(c->recv_coroutine[i]);
         }
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_connection_detach_aio_context(NBDConnection *c,
+                                              AioContext *ctx)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    aio_set_fd_handler(ctx, c->sioc->fd, false, NULL, NULL, NULL);
+}
 
-    if (!client->ioc) { /* Already closed */
+static void nbd_teardown_connection(NBDConnection *c)
+{
+    if (!c->ioc) { /* Already closed */
         return;
     }
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
+    qio_channel_shutdown(c->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    nbd_recv_coroutines_enter_all(client);
+    if (c->read_reply_co) {
+        /* It fails to read from the closed channel and terminates */
+        qemu_coroutine_enter(c->read_reply_co);
+    }
+    nbd_recv_coroutines_enter_all(c);
+
+    nbd_connection_detach_aio_context(c,
+                                      bdrv_get_aio_context(c->session->bs));
+    object_unref(OBJECT(c->sioc));
+    c->sioc = NULL;
+    object_unref(OBJECT(c->ioc));
+    c->ioc = NULL;
+}
 
-    nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+/* Read reply headers and hand each one to the coroutine that sent the
+ * request.  The header is read into a local NBDReply, so that c->reply
+ * only becomes valid once it is complete; a partially received header
+ * makes this coroutine yield until the socket is readable again.  */
+static void coroutine_fn nbd_read_reply_entry(void *opaque)
+{
+    NBDConnection *c = opaque;
+    NBDReply reply;
+    uint64_t i;
+
+    while (c->ioc && nbd_receive_reply(c->ioc, &reply) >= 0) {
+        i = HANDLE_TO_INDEX(c, reply.handle);
+        if (i >= MAX_NBD_REQUESTS || !c->recv_coroutine[i]) {
+            break;
+        }
+
+        /* The request coroutine consumes the payload and resets
+         * c->reply.handle, then the read handler enters us again.  */
+        c->reply = reply;
+        qemu_coroutine_enter(c->recv_coroutine[i]);
+        qemu_coroutine_yield();
+    }
+
+    c->reply.handle = 0;
+    c->read_reply_co = NULL;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NBDClientSession *s = nbd_get_client_session(bs);
+    NBDConnection *c = opaque;
     uint64_t i;
-    int ret;
 
-    if (!s->ioc) { /* Already closed */
+    if (!c->ioc) { /* Already closed */
         return;
     }
 
-    if (s->reply.handle == 0) {
-        /* No reply already in flight.  Fetch a header.  It is possible
-         * that another thread has done the same thing in parallel, so
-         * the socket is not readable anymore.
-         */
-        ret = nbd_receive_reply(s->ioc, &s->reply);
-        if (ret == -EAGAIN) {
-            return;
-        }
-        if (ret < 0) {
-            s->reply.handle = 0;
-            goto fail;
-        }
-    }
-
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
-        goto fail;
-    }
-
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i]);
+    if (c->reply.handle == 0) {
+        /* No reply in flight, read (the rest of) a header */
+        if (c->read_reply_co) {
+            qemu_coroutine_enter(c->read_reply_co);
+        }
+        if (!c->read_reply_co) {
+            nbd_teardown_connection(c);
+        }
         return;
     }
 
-fail:
-    nbd_teardown_connection(bs);
+    /* The payload of the current reply is being read */
+    i = HANDLE_TO_INDEX(c, c->reply.handle);
+    assert(i < MAX_NBD_REQUESTS && c->recv_coroutine[i]);
+    qemu_coroutine_enter(c->recv_coroutine[i]);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NBDConnection *c = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine);
+    qemu_coroutine_enter(c->send_coroutine);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDConnection *c,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
-    qemu_co_mutex_lock(&s->send_mutex);
+    qemu_co_mutex_lock(&c->send_mutex);
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (c->recv_coroutine[i] == NULL) {
+            c->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     g_assert(qemu_in_coroutine());
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(c, i);
 
-    if (!s->ioc) {
-        qemu_co_mutex_unlock(&s->send_mutex);
+    if (!c->ioc) {
+        qemu_co_mutex_unlock(&c->send_mutex);
         return -EPIPE;
     }
 
-    s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    c->send_coroutine = qemu_coroutine_self();
+    aio_context = bdrv_get_aio_context(c->session->bs);
 
-    aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+    aio_set_fd_handler(aio_context, c->sioc->fd, false,
+                       nbd_reply_ready, nbd_restart_write, c);
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
+        qio_channel_set_cork(c->ioc, true);
+        rc = nbd_send_request(c->ioc, request);
         if (rc >= 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
+            ret = nbd_wr_syncv(c->ioc, qiov->iov, qiov->niov, request->len,
                                false);
             if (ret != request->len) {
                 rc = -EIO;
             }
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(c->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(c->ioc, request);
     }
-    aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    aio_set_fd_handler(aio_context, c->sioc->fd, false,
+                       nbd_reply_ready, NULL, c);
+    c->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&c->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NBDClientSession *s,
-                                 NBDRequest *request,
-                                 NBDReply *reply,
-                                 QEMUIOVector *qiov)
+static int nbd_co_read(NBDConnection *c, void *buf, size_t len)
 {
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return nbd_wr_syncv(c->ioc, &iov, 1, len, true) == len ? 0 : -EIO;
+}
+
+static int nbd_co_drop(NBDConnection *c, size_t len)
+{
+    char buf[1024];
+
+    while (len > 0) {
+        size_t count = MIN(len, sizeof(buf));
+        if (nbd_co_read(c, buf, count) < 0) {
+            return -EIO;
+        }
+        len -= count;
+    }
+    return 0;
+}
+
+/* Record that @len bytes at @offset have been described by a data or hole
+ * chunk.  @covered is a sorted list of merged Ranges.  Return -EIO if the
+ * bytes overlap an earlier chunk.  */
+static int nbd_reply_cover(GList **covered, uint64_t offset, uint32_t len)
+{
+    GList *l;
+    Range *range;
+
+    for (l = *covered; l; l = l->next) {
+        range = l->data;
+        if (offset <= range_upb(range) &&
+            offset + len - 1 >= range_lob(range)) {
+            logout("Chunk overlaps an earlier one\n");
+            return -EIO;
+        }
+    }
+
+    range = g_new(Range, 1);
+    range_set_bounds1(range, offset, offset + len);
+    *covered = range_list_insert(*covered, range);
+    return 0;
+}
+
+/* Consume the payload of the structured reply chunk in c->reply.  Data and
+ * holes are stored into @qiov, which covers @request, and the ranges they
+ * describe are added to @covered.  Block status descriptors are stored into
+ * @extent.  An error reported by the server is stored in *@error unless an
+ * earlier one was already there.  Return -EIO if the chunk is invalid or
+ * could not be read, 0 otherwise.  */
+static int nbd_co_receive_chunk(NBDConnection *c, NBDRequest *request,
+                                QEMUIOVector *qiov, GList **covered,
+                                NBDExtent *extent, int *error)
+{
+    NBDReply *reply = &c->reply;
+    uint8_t buf[8 + 4];
+    uint64_t offset;
+    uint32_t len;
+    QEMUIOVector sub_qiov;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
-                reply->error = EIO;
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return reply->length ? -EIO : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        /* [ 0 ..  7] offset, followed by the data */
+        if (!qiov || reply->length < 8 || nbd_co_read(c, buf, 8) < 0) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = reply->length - 8;
+        if (!len || offset < request->from || len > request->len ||
+            offset - request->from > request->len - len) {
+            logout("Data chunk out of range\n");
+            return -EIO;
+        }
+        if (nbd_reply_cover(covered, offset, len) < 0) {
+            return -EIO;
+        }
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset - request->from, len);
+        ret = nbd_wr_syncv(c->ioc, sub_qiov.iov, sub_qiov.niov, len, true);
+        qemu_iovec_destroy(&sub_qiov);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        /* [ 0 ..  7] offset, [ 8 .. 11] hole size */
+        if (!qiov || reply->length != 8 + 4 ||
+            nbd_co_read(c, buf, 8 + 4) < 0) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (!len || offset < request->from || len > request->len ||
+            offset - request->from > request->len - len) {
+            logout("Hole chunk out of range\n");
+            return -EIO;
+        }
+        if (nbd_reply_cover(covered, offset, len) < 0) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* [ 0 ..  3] context id, then (length, flags) descriptors.  We
+         * always send NBD_CMD_FLAG_REQ_ONE, so only use the first one. */
+        if (!extent || reply->length < 4 + 8 || (reply->length - 4) % 8 ||
+            nbd_co_read(c, buf, 4 + 8) < 0) {
+            return -EIO;
+        }
+        if (ldl_be_p(buf) != c->session->info.meta_base_allocation_id) {
+            logout("Block status for unknown context\n");
+            return -EIO;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        if (!extent->length || extent->length > request->len) {
+            logout("Invalid block status extent length\n");
+            return -EIO;
+        }
+        return nbd_co_drop(c, reply->length - 4 - 8);
+
+    default:
+        if (!(reply->type & NBD_REPLY_ERR(0))) {
+            logout("Unknown structured reply type %d\n", reply->type);
+            return -EIO;
+        }
+        /* [ 0 ..  3] error, [ 4 ..  5] message length, then the message
+         * and possibly more type-specific data */
+        if (reply->length < 4 + 2 || nbd_co_read(c, buf, 4 + 2) < 0) {
+            return -EIO;
+        }
+        len = lduw_be_p(buf + 4);
+        if (len > reply->length - 4 - 2) {
+            return -EIO;
+        }
+        if (!*error) {
+            *error = nbd_errno_to_system_errno(ldl_be_p(buf)) ?: EIO;
+        }
+        return nbd_co_drop(c, reply->length - 4 - 2);
+    }
+}
+
+/* Receive the reply to @request, which is either a simple reply or a
+ * series of structured reply chunks.  Read data is stored in @qiov and
+ * block status in @extent.  A successful structured reply to a read must
+ * describe every byte of the request exactly once.  Return 0 on success
+ * or -errno.  */
+static int nbd_co_receive_reply(NBDConnection *c,
+                                NBDRequest *request,
+                                QEMUIOVector *qiov,
+                                NBDExtent *extent)
+{
+    GList *covered = NULL;
+    Range *range;
+    int ret, error = 0;
+    bool structured = false;
+    bool done = false;
+
+    while (!done) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        if (c->reply.handle != request->handle ||
+            !c->ioc) {
+            error = EIO;
+            break;
+        }
+
+        if (!c->reply.structured) {
+            error = c->reply.error;
+            if (qiov && !error) {
+                ret = nbd_wr_syncv(c->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    error = EIO;
+                }
+            }
+            done = true;
+        } else {
+            structured = true;
+            done = c->reply.flags & NBD_REPLY_FLAG_DONE;
+            if (nbd_co_receive_chunk(c, request, qiov, &covered, extent,
+                                     &error) < 0) {
+                /* We lost track of the reply stream, give up on the
+                 * connection.  */
+                qio_channel_shutdown(c->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+                error = EIO;
+                done = true;
             }
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        c->reply.handle = 0;
     }
+
+    if (structured && qiov && !error) {
+        range = covered ? covered->data : NULL;
+        if (!range || covered->next || range_lob(range) != request->from ||
+            range_upb(range) != request->from + request->len - 1) {
+            logout("Structured read reply does not cover the request\n");
+            error = EIO;
+        }
+    }
+    g_list_free_full(covered, g_free);
+    return -error;
 }
 
-static void nbd_coroutine_start(NBDClientSession *s,
+static void nbd_coroutine_start(NBDConnection *c,
                                 NBDRequest *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight == MAX_NBD_REQUESTS) {
-        qemu_co_queue_wait(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (c->in_flight == MAX_NBD_REQUESTS) {
+        qemu_co_queue_wait(&c->free_sema);
+        assert(c->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    c->in_flight++;
 
-    /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    /* c->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NBDClientSession *s,
+static void nbd_coroutine_end(NBDConnection *c,
                               NBDRequest *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_queue_next(&s->free_sema);
+    int i = HANDLE_TO_INDEX(c, request->handle);
+    c->recv_coroutine[i] = NULL;
+    if (c->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_queue_next(&c->free_sema);
     }
 }
 
+/* Pick the connection for a new request: the one with the fewest requests
+ * in flight, starting the search after the previously picked connection
+ * so that ties are spread evenly.  */
+static NBDConnection *nbd_client_pick_connection(NBDClientSession *client)
+{
+    NBDConnection *best = &client->conns[0];
+    int i, best_index = 0;
+
+    for (i = 0; i < client->num_conns; i++) {
+        int index = (client->next_conn + i) % client->num_conns;
+        NBDConnection *c = &client->conns[index];
+
+        if (c->ioc && (!best->ioc || c->in_flight < best->in_flight)) {
+            best = c;
+            best_index = index;
+        }
+    }
+    client->next_conn = (best_index + 1) % client->num_conns;
+    return best;
+}
+
+/* Send @request and wait for the reply.  @write_qiov is the payload of a
+ * write, @read_qiov receives the data of a read and @extent the block
+ * status.  Return 0 on success or -errno.  */
+static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+                          QEMUIOVector *write_qiov, QEMUIOVector *read_qiov,
+                          NBDExtent *extent)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDConnection *c = nbd_client_pick_connection(client);
+    int ret;
+
+    trace_nbd_client_request(bs, c - client->conns, request->type,
+                             request->from, request->len);
+    nbd_coroutine_start(c, request);
+    ret = nbd_co_send_request(c, request, write_qiov);
+    if (ret >= 0) {
+        ret = nbd_co_receive_reply(c, request, read_qiov, extent);
+    }
+    nbd_coroutine_end(c, request);
+    return ret;
+}
+
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
         .len = bytes,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    return nbd_co_request(bs, &request, NULL, qiov, NULL);
+}
+
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDExtent extent = { 0 };
+    NBDRequest request = {
+        .type = NBD_CMD_BLOCK_STATUS,
+        .from = sector_num << BDRV_SECTOR_BITS,
+        .flags = NBD_CMD_FLAG_REQ_ONE,
+    };
+    ssize_t ret;
+
+    if (!client->info.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    request.len = (uint64_t)MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS)
+                  << BDRV_SECTOR_BITS;
+    if (request.from >= client->size) {
+        *pnum = 0;
+        return 0;
+    }
+    request.len = MIN(request.len, client->size - request.from);
+
+    ret = nbd_co_request(bs, &request, NULL, NULL, &extent);
     if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
+        return ret;
+    }
+    if (!extent.length) {
+        /* The server did not send a block status chunk */
+        return -EIO;
     }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        /* Not even one full sector is described, be conservative */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA;
+    }
+    *pnum = extent.length >> BDRV_SECTOR_BITS;
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
 }
 
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
@@ -254,8 +538,6 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
         .from = offset,
         .len = bytes,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     if (flags & BDRV_REQ_FUA) {
         assert(client->nbdflags & NBD_FLAG_SEND_FUA);
@@ -264,28 +546,18 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, qiov, NULL, NULL);
 }
 
 int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int count, BdrvRequestFlags flags)
 {
-    ssize_t ret;
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
         .len = count,
     };
-    NBDReply reply;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES)) {
         return -ENOTSUP;
@@ -299,23 +571,13 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
         request.flags |= NBD_CMD_FLAG_NO_HOLE;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
-    NBDReply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -324,15 +586,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
@@ -343,51 +597,117 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
         .from = offset,
         .len = count,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
-
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].ioc) {
+            nbd_connection_detach_aio_context(&client->conns[i],
+                                              bdrv_get_aio_context(bs));
+        }
+    }
+}
+
+static void nbd_connection_attach_aio_context(NBDConnection *c,
+                                              AioContext *new_context)
+{
+    aio_set_fd_handler(new_context, c->sioc->fd, false,
+                       nbd_reply_ready, NULL, c);
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].ioc) {
+            nbd_connection_attach_aio_context(&client->conns[i], new_context);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
+    for (i = 0; i < client->num_conns; i++) {
+        NBDConnection *c = &client->conns[i];
+
+        if (c->ioc == NULL) {
+            continue;
+        }
+
+        nbd_send_request(c->ioc, &request);
+
+        nbd_teardown_connection(c);
     }
+}
 
-    nbd_send_request(client->ioc, &request);
+static int nbd_connection_init(NBDConnection *c,
+                               QIOChannelSocket *sioc,
+                               const char *export,
+                               QCryptoTLSCreds *tlscreds,
+                               const char *hostname,
+                               uint16_t *nbdflags, off_t *size,
+                               NBDExportInfo *info,
+                               Error **errp)
+{
+    QIOChannel *ioc = NULL;
+    int ret;
+
+    /* NBD handshake */
+    logout("session init %s\n", export);
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
+
+    info->structured_reply = true;
+    info->base_allocation = true;
+    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
+                                nbdflags,
+                                tlscreds, hostname,
+                                &ioc,
+                                size, info, errp);
+    if (ret < 0) {
+        logout("Failed to negotiate with the NBD server\n");
+        if (ioc) {
+            object_unref(OBJECT(ioc));
+        }
+        return ret;
+    }
+
+    qemu_co_mutex_init(&c->send_mutex);
+    qemu_co_queue_init(&c->free_sema);
+    c->sioc = sioc;
+    object_ref(OBJECT(c->sioc));
+
+    c->ioc = ioc;
+    if (!c->ioc) {
+        c->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(c->ioc));
+    }
+
+    /* Now that we're connected, set the socket to be non-blocking and
+     * kick the reply mechanism.  */
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
+    c->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, c);
 
-    nbd_teardown_connection(bs);
+    nbd_connection_attach_aio_context(c, bdrv_get_aio_context(c->session->bs));
+
+    logout("Established connection with NBD server\n");
+    return 0;
 }
 
 int nbd_client_init(BlockDriverState *bs,
@@ -400,19 +720,16 @@ int nbd_client_init(BlockDriverState *bs,
     NBDClientSession *client = nbd_get_client_session(bs);
     int ret;
 
-    /* NBD handshake */
-    logout("session init %s\n", export);
-    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
-
-    ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
-                                tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+    client->bs = bs;
+    client->conns[0].session = client;
+    ret = nbd_connection_init(&client->conns[0], sioc, export,
+                              tlscreds, hostname, &client->nbdflags,
+                              &client->size, &client->info, errp);
     if (ret < 0) {
-        logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
+    client->num_conns = 1;
+
     if (client->nbdflags & NBD_FLAG_SEND_FUA) {
         bs->supported_write_flags = BDRV_REQ_FUA;
         bs->supported_zero_flags |= BDRV_REQ_FUA;
@@ -420,23 +737,45 @@ int nbd_client_init(BlockDriverState *bs,
     if (client->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES) {
         bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
     }
+    return 0;
+}
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_queue_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
-
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
-    }
-
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
+/* Open one more connection to the export opened with nbd_client_init().
+ * The server must have advertised NBD_FLAG_CAN_MULTI_CONN, and must
+ * describe the export in the same way on the new connection.  */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDConnection *c = &client->conns[client->num_conns];
+    NBDExportInfo info;
+    uint16_t nbdflags;
+    off_t size;
+    int ret;
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    assert(client->num_conns > 0 && client->num_conns < MAX_NBD_CONNECTIONS);
+    assert(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN);
 
-    logout("Established connection with NBD server\n");
+    c->session = client;
+    ret = nbd_connection_init(c, sioc, export, tlscreds, hostname,
+                              &nbdflags, &size, &info, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    client->num_conns++;
+
+    if (nbdflags != client->nbdflags || size != client->size ||
+        info.structured_reply != client->info.structured_reply ||
+        info.base_allocation != client->info.base_allocation ||
+        (info.base_allocation && info.meta_base_allocation_id !=
+                                 client->info.meta_base_allocation_id)) {
+        error_setg(errp, "NBD server describes the export differently on "
+                   "another connection");
+        return -EINVAL;
+    }
     return 0;
 }
@@ -16,12 +16,15 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
+
+typedef struct NBDClientSession NBDClientSession;
+
+typedef struct NBDConnection {
+    NBDClientSession *session;
 
-typedef struct NBDClientSession {
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint16_t nbdflags;
-    off_t size;
 
     CoMutex send_mutex;
     CoQueue free_sema;
@@ -29,10 +32,25 @@ typedef struct NBDClientSession {
     int in_flight;
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine *read_reply_co;
     NBDReply reply;
+} NBDConnection;
+
+struct NBDClientSession {
+    BlockDriverState *bs;
+    uint16_t nbdflags;
+    off_t size;
+    NBDExportInfo info;
+
+    /* Requests are spread over all connections, which the server
+     * guarantees to be consistent with each other by advertising
+     * NBD_FLAG_CAN_MULTI_CONN.  */
+    NBDConnection conns[MAX_NBD_CONNECTIONS];
+    int num_conns;
+    int next_conn;
 
     bool is_unix;
-} NBDClientSession;
+};
 
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
 
@@ -42,6 +60,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count);
@@ -52,6 +76,10 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int count, BdrvRequestFlags flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
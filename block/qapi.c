@@ -123,6 +123,18 @@ BlockDeviceInfo *bdrv_block_device_info(BlockBackend *blk,
 
     info->write_threshold = bdrv_write_threshold_get(bs);
 
+    if (!bs->drv->protocol_name) {
+        BdrvBlockStatusCache *c = &bs->block_status_cache;
+
+        info->has_block_status_cache = true;
+        info->block_status_cache = g_new(BlockStatusCacheInfo, 1);
+        *info->block_status_cache = (BlockStatusCacheInfo) {
+            .hits   = c->hits,
+            .misses = c->misses,
+            .ranges = c->ranges ? g_sequence_get_length(c->ranges) : 0,
+        };
+    }
+
     bs0 = bs;
     p_image_info = &info->image;
     while (1) {
@@ -361,6 +373,36 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **p;
+    int i;
+
+    if (!hist->bins) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+
+    p = &info->boundaries;
+    for (i = 0; i < hist->nbins - 1; i++) {
+        *p = g_new0(uint64List, 1);
+        (*p)->value = hist->boundaries[i];
+        p = &(*p)->next;
+    }
+
+    p = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *p = g_new0(uint64List, 1);
+        (*p)->value = atomic_read__nocheck(&hist->bins[i]);
+        p = &(*p)->next;
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -395,6 +437,22 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    ds->rd_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_READ]);
+    ds->has_rd_latency_histogram = ds->rd_latency_histogram != NULL;
+    ds->wr_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_WRITE]);
+    ds->has_wr_latency_histogram = ds->wr_latency_histogram != NULL;
+    ds->flush_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_FLUSH]);
+    ds->has_flush_latency_histogram = ds->flush_latency_histogram != NULL;
+
+    if (blk_get_public(blk)->throttle_state) {
+        ds->has_throttle = true;
+        ds->throttle = g_new0(BlockDeviceThrottleStats, 1);
+        throttle_group_get_stats(blk, ds->throttle);
+    }
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
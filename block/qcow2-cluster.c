@@ -391,30 +391,21 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
     return 0;
 }
 
-static int coroutine_fn do_perform_cow(BlockDriverState *bs,
-                                       uint64_t src_cluster_offset,
-                                       uint64_t cluster_offset,
-                                       int offset_in_cluster,
-                                       int bytes)
+static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
+                                            uint64_t src_cluster_offset,
+                                            unsigned offset_in_cluster,
+                                            QEMUIOVector *qiov)
 {
-    BDRVQcow2State *s = bs->opaque;
-    QEMUIOVector qiov;
-    struct iovec iov;
     int ret;
 
-    iov.iov_len = bytes;
-    iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
-    if (iov.iov_base == NULL) {
-        return -ENOMEM;
+    if (qiov->size == 0) {
+        return 0;
     }
 
-    qemu_iovec_init_external(&qiov, &iov, 1);
-
     BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
 
     if (!bs->drv) {
-        ret = -ENOMEDIUM;
-        goto out;
+        return -ENOMEDIUM;
     }
 
     /* Call .bdrv_co_readv() directly instead of using the public block-layer
@@ -422,43 +413,86 @@ static int coroutine_fn do_perform_cow(BlockDriverState *bs,
      * which can lead to deadlock when block layer copy-on-read is enabled.
      */
     ret = bs->drv->bdrv_co_preadv(bs, src_cluster_offset + offset_in_cluster,
-                                  bytes, &qiov, 0);
+                                  qiov->size, qiov, 0);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    if (bs->encrypted) {
-        Error *err = NULL;
+    return 0;
+}
+
+static bool do_perform_cow_encrypt(BlockDriverState *bs,
+                                   uint64_t src_cluster_offset,
+                                   unsigned offset_in_cluster,
+                                   uint8_t *buffer,
+                                   unsigned bytes)
+{
+    if (bytes && bs->encrypted) {
+        BDRVQcow2State *s = bs->opaque;
         int64_t sector = (src_cluster_offset + offset_in_cluster)
                          >> BDRV_SECTOR_BITS;
+        Error *err = NULL;
         assert(s->cipher);
         assert((offset_in_cluster & ~BDRV_SECTOR_MASK) == 0);
         assert((bytes & ~BDRV_SECTOR_MASK) == 0);
-        if (qcow2_encrypt_sectors(s, sector, iov.iov_base, iov.iov_base,
+        if (qcow2_encrypt_sectors(s, sector, buffer, buffer,
                                   bytes >> BDRV_SECTOR_BITS, true, &err) < 0) {
-            ret = -EIO;
             error_free(err);
-            goto out;
+            return false;
         }
     }
+    return true;
+}
+
+static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
+                                             uint64_t cluster_offset,
+                                             unsigned offset_in_cluster,
+                                             QEMUIOVector *qiov)
+{
+    int ret;
+
+    if (qiov->size == 0) {
+        return 0;
+    }
 
     ret = qcow2_pre_write_overlap_check(bs, 0,
-            cluster_offset + offset_in_cluster, bytes);
+            cluster_offset + offset_in_cluster, qiov->size);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
     ret = bdrv_co_pwritev(bs->file, cluster_offset + offset_in_cluster,
-                          bytes, &qiov, 0);
+                          qiov->size, qiov, 0);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    ret = 0;
-out:
-    qemu_vfree(iov.iov_base);
-    return ret;
+    return 0;
+}
+
+/* State of a COW read that runs in its own coroutine so that the start and
+ * end regions of an allocation can be read in parallel */
+typedef struct Qcow2COWReadCo {
+    BlockDriverState *bs;
+    uint64_t src_cluster_offset;
+    unsigned offset_in_cluster;
+    QEMUIOVector *qiov;
+    Coroutine *waiting;
+    bool done;
+    int ret;
+} Qcow2COWReadCo;
+
+static void coroutine_fn do_perform_cow_read_entry(void *opaque)
+{
+    Qcow2COWReadCo *rco = opaque;
+
+    rco->ret = do_perform_cow_read(rco->bs, rco->src_cluster_offset,
+                                   rco->offset_in_cluster, rco->qiov);
+    rco->done = true;
+    if (rco->waiting) {
+        qemu_coroutine_enter(rco->waiting);
+    }
 }
 
 
@@ -741,31 +775,175 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     return cluster_offset;
 }
 
-static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
+/*
+ * Returns true if the COW region @r of the allocation @m is known to read
+ * as zeroes, so that it can be filled in memory instead of being read.
+ *
+ * Must be called with s->lock held.
+ */
+static bool cow_region_is_zero(BlockDriverState *bs, QCowL2Meta *m,
+                               Qcow2COWRegion *r)
+{
+    unsigned int bytes = r->nb_bytes;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (bs->encrypted) {
+        return false;
+    }
+
+    ret = qcow2_get_cluster_offset(bs, m->offset + r->offset, &bytes,
+                                   &cluster_offset);
+    if (ret < 0 || bytes < r->nb_bytes) {
+        return false;
+    }
+
+    return ret == QCOW2_CLUSTER_ZERO ||
+           (ret == QCOW2_CLUSTER_UNALLOCATED && !bs->backing);
+}
+
+/*
+ * Copies the unmodified parts of the clusters allocated by @m.  Both COW
+ * regions are read in parallel; if m->data_qiov is set, the guest data is
+ * written together with the COW regions in a single request.
+ */
+static int perform_cow(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2COWRegion *start = &m->cow_start;
+    Qcow2COWRegion *end = &m->cow_end;
+    unsigned data_bytes = end->offset - (start->offset + start->nb_bytes);
+    unsigned buffer_size;
+    uint8_t *start_buffer, *end_buffer;
+    bool start_zero, end_zero;
+    QEMUIOVector start_qiov, end_qiov, qiov;
+    Qcow2COWReadCo end_co;
+    size_t align;
     int ret;
 
-    if (r->nb_bytes == 0) {
+    assert(start->nb_bytes <= UINT_MAX - end->nb_bytes);
+    assert(start->offset + start->nb_bytes <= end->offset);
+    assert(!m->data_qiov || m->data_qiov->size == data_bytes);
+
+    if (start->nb_bytes == 0 && end->nb_bytes == 0) {
         return 0;
     }
 
+    /* Pad the start region so that the end region is optimally aligned */
+    align = bdrv_opt_mem_align(bs);
+    assert(align > 0 && align <= UINT_MAX);
+    assert(QEMU_ALIGN_UP(start->nb_bytes, align) <= UINT_MAX - end->nb_bytes);
+    buffer_size = QEMU_ALIGN_UP(start->nb_bytes, align) + end->nb_bytes;
+
+    start_buffer = qemu_try_blockalign(bs, buffer_size);
+    if (start_buffer == NULL) {
+        return -ENOMEM;
+    }
+    end_buffer = start_buffer + buffer_size - end->nb_bytes;
+
+    start_zero = start->nb_bytes && cow_region_is_zero(bs, m, start);
+    end_zero = end->nb_bytes && cow_region_is_zero(bs, m, end);
+
+    qemu_iovec_init(&start_qiov, 1);
+    qemu_iovec_init(&end_qiov, 1);
+    qemu_iovec_init(&qiov, 2 + (m->data_qiov ? m->data_qiov->niov : 0));
+
+    if (start_zero) {
+        memset(start_buffer, 0, start->nb_bytes);
+    } else if (start->nb_bytes) {
+        qemu_iovec_add(&start_qiov, start_buffer, start->nb_bytes);
+    }
+    if (end_zero) {
+        memset(end_buffer, 0, end->nb_bytes);
+    } else if (end->nb_bytes) {
+        qemu_iovec_add(&end_qiov, end_buffer, end->nb_bytes);
+    }
+
     qemu_co_mutex_unlock(&s->lock);
-    ret = do_perform_cow(bs, m->offset, m->alloc_offset, r->offset, r->nb_bytes);
-    qemu_co_mutex_lock(&s->lock);
 
+    /* Read the end region in a separate coroutine while the start region is
+     * read in this one */
+    end_co = (Qcow2COWReadCo) {
+        .bs                 = bs,
+        .src_cluster_offset = m->offset,
+        .offset_in_cluster  = end->offset,
+        .qiov               = &end_qiov,
+    };
+    if (start_qiov.size && end_qiov.size) {
+        Coroutine *co = qemu_coroutine_create(do_perform_cow_read_entry,
+                                              &end_co);
+        qemu_coroutine_enter(co);
+    } else {
+        do_perform_cow_read_entry(&end_co);
+    }
+
+    ret = do_perform_cow_read(bs, m->offset, start->offset, &start_qiov);
+
+    if (!end_co.done) {
+        end_co.waiting = qemu_coroutine_self();
+        qemu_coroutine_yield();
+        assert(end_co.done);
+    }
+    if (ret == 0) {
+        ret = end_co.ret;
+    }
     if (ret < 0) {
-        return ret;
+        goto fail;
     }
 
+    /* Encrypt the data if necessary before writing it */
+    if (!do_perform_cow_encrypt(bs, m->offset, start->offset,
+                                start_buffer, start->nb_bytes) ||
+        !do_perform_cow_encrypt(bs, m->offset, end->offset,
+                                end_buffer, end->nb_bytes)) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    /* If we have the guest data, write everything in one single request */
+    if (m->data_qiov) {
+        if (start->nb_bytes) {
+            qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        }
+        qemu_iovec_concat(&qiov, m->data_qiov, 0, data_bytes);
+        if (end->nb_bytes) {
+            qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        }
+        /* NOTE: there is a write_aio blkdebug event here followed by a
+         * cow_write one in do_perform_cow_write(), but only one single
+         * I/O operation */
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+    } else {
+        /* Otherwise write both COW regions separately */
+        qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, end->offset, &qiov);
+    }
+
+fail:
+    qemu_co_mutex_lock(&s->lock);
+
     /*
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
      * handled.
      */
-    qcow2_cache_depends_on_flush(s->l2_table_cache);
+    if (ret == 0) {
+        qcow2_cache_depends_on_flush(s->l2_table_cache);
+    }
 
-    return 0;
+    qemu_vfree(start_buffer);
+    qemu_iovec_destroy(&start_qiov);
+    qemu_iovec_destroy(&end_qiov);
+    qemu_iovec_destroy(&qiov);
+    return ret;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
@@ -785,12 +963,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
 
     /* copy content of unmodified sectors */
-    ret = perform_cow(bs, m, &m->cow_start);
-    if (ret < 0) {
-        goto err;
-    }
-
-    ret = perform_cow(bs, m, &m->cow_end);
+    ret = perform_cow(bs, m);
     if (ret < 0) {
         goto err;
     }
@@ -1085,6 +1258,18 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
+    /* Sequential writes take their clusters from a reserved extent, so that
+     * the refcounts need not be updated for each of them */
+    if (s->reserve_size) {
+        int ret = qcow2_alloc_reserved_clusters(bs, guest_offset, host_offset,
+                                                nb_clusters);
+        if (ret < 0) {
+            return ret;
+        } else if (ret > 0) {
+            goto out;
+        }
+    }
+
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == 0) {
@@ -1094,15 +1279,18 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
             return cluster_offset;
         }
         *host_offset = cluster_offset;
-        return 0;
     } else {
         int64_t ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
         if (ret < 0) {
             return ret;
         }
         *nb_clusters = ret;
-        return 0;
     }
+
+out:
+    s->seq_alloc_next = start_of_cluster(s, guest_offset) +
+                        (*nb_clusters << s->cluster_bits);
+    return 0;
 }
 
 /*
@@ -29,6 +29,7 @@
 #include "block/qcow2.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -977,6 +978,104 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
     return offset;
 }
 
+/*
+ * Allocates a contiguous extent of s->reserve_size bytes in one refcount
+ * update and, if the protocol can do that without writing, allocates the
+ * host space for it as well.
+ */
+static int qcow2_reserve_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    offset = qcow2_alloc_clusters(bs, s->reserve_size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->reserve_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite_zeroes(bs->file, offset, s->reserve_size,
+                             BDRV_REQ_NO_FALLBACK);
+    if (ret < 0 && ret != -ENOTSUP) {
+        goto fail;
+    }
+
+    trace_qcow2_reserve_clusters(qemu_coroutine_self(), offset,
+                                 s->reserve_size);
+    s->reserve_offset = offset;
+    s->reserve_end = offset + s->reserve_size;
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, offset, s->reserve_size, QCOW2_DISCARD_NEVER);
+    return ret;
+}
+
+/*
+ * Tries to allocate the data clusters for a guest write at @guest_offset
+ * from the current reservation.  A new reservation is only made if the
+ * write directly follows the previous allocation, i.e. if the guest seems
+ * to write sequentially.  If *host_offset is non-zero, the clusters must
+ * start there.
+ *
+ * Returns 1 and updates *host_offset and *nb_clusters if clusters were
+ * taken from the reservation, 0 if the caller must allocate them itself,
+ * and -errno on failure.
+ */
+int qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t guest_offset,
+                                  uint64_t *host_offset,
+                                  uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t avail;
+    int ret;
+
+    if (s->reserve_offset == s->reserve_end) {
+        if (*host_offset ||
+            start_of_cluster(s, guest_offset) != s->seq_alloc_next)
+        {
+            return 0;
+        }
+        ret = qcow2_reserve_clusters(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (*host_offset && *host_offset != s->reserve_offset) {
+        return 0;
+    }
+
+    avail = (s->reserve_end - s->reserve_offset) >> s->cluster_bits;
+    *nb_clusters = MIN(*nb_clusters, avail);
+    *host_offset = s->reserve_offset;
+    s->reserve_offset += *nb_clusters << s->cluster_bits;
+
+    return 1;
+}
+
+/*
+ * Gives the unused part of the reservation back, so that no clusters are
+ * leaked in the image file.
+ */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->reserve_offset < s->reserve_end) {
+        qcow2_free_clusters(bs, s->reserve_offset,
+                            s->reserve_end - s->reserve_offset,
+                            QCOW2_DISCARD_NEVER);
+    }
+    s->reserve_offset = 0;
+    s->reserve_end = 0;
+}
+
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type)
@@ -1309,11 +1408,10 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
  *
  * Modifies the number of errors in res.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                         BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t start, last, cluster_offset, k, refcount;
@@ -1406,8 +1504,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_entry & ~511, nb_csectors * 512);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, l2_entry & ~511,
+                                           nb_csectors * 512);
             if (ret < 0) {
                 goto fail;
             }
@@ -1445,8 +1544,9 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1498,8 +1598,8 @@ static int check_refcounts_l1(BlockDriverState *bs,
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                        l1_table_offset, l1_size2);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, refcount_table_size,
+                                   l1_table_offset, l1_size2);
     if (ret < 0) {
         goto fail;
     }
@@ -1528,8 +1628,9 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, l2_offset,
+                                           s->cluster_size);
             if (ret < 0) {
                 goto fail;
             }
@@ -1744,14 +1845,15 @@ static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 res->corruptions_fixed++;
-                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                    offset, s->cluster_size);
+                ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                               nb_clusters, offset,
+                                               s->cluster_size);
                 if (ret < 0) {
                     return ret;
                 }
                 /* No need to check whether the refcount is now greater than 1:
                  * This area was just allocated and zeroed, so it can only be
-                 * exactly 1 after inc_refcounts() */
+                 * exactly 1 after qcow2_inc_refcounts_imrt() */
                 continue;
 
 resize_fail:
@@ -1766,8 +1868,8 @@ resize_fail:
         }
 
         if (offset != 0) {
-            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                           offset, s->cluster_size);
             if (ret < 0) {
                 return ret;
             }
@@ -1807,8 +1909,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        0, s->cluster_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters, 0,
+                                   s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -1829,16 +1931,22 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             return ret;
         }
     }
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->snapshots_offset, s->snapshots_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->snapshots_offset, s->snapshots_size);
     if (ret < 0) {
         return ret;
     }
 
     /* refcount data */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->refcount_table_offset,
-                        s->refcount_table_size * sizeof(uint64_t));
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->refcount_table_offset,
+                                   s->refcount_table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
         return ret;
     }
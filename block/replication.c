@@ -310,12 +310,14 @@ static void secondary_do_checkpoint(BDRVReplicationState *s, Error **errp)
     }
 
     ret = s->active_disk->bs->drv->bdrv_make_empty(s->active_disk->bs);
+    bdrv_block_status_cache_clear(s->active_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make active disk empty");
         return;
     }
 
     ret = s->hidden_disk->bs->drv->bdrv_make_empty(s->hidden_disk->bs);
+    bdrv_block_status_cache_clear(s->hidden_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make hidden disk empty");
         return;
@@ -184,6 +184,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
     if (!drv) {
         return -ENOMEDIUM;
     }
+    bdrv_block_status_cache_clear(bs);
     if (drv->bdrv_snapshot_goto) {
         return drv->bdrv_snapshot_goto(bs, snapshot_id);
     }
@@ -336,6 +337,7 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
         return -EINVAL;
     }
     if (drv->bdrv_snapshot_load_tmp) {
+        bdrv_block_status_cache_clear(bs);
         return drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
     }
     error_setg(errp, "Block format '%s' used by device '%s' "
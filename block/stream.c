@@ -15,6 +15,7 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
+#include "block/copy-pool.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
@@ -38,12 +39,13 @@ typedef struct StreamBlockJob {
     BlockdevOnError on_error;
     char *backing_file_str;
     int bs_flags;
+    CopyPool pool;
 } StreamBlockJob;
 
-static int coroutine_fn stream_populate(BlockBackend *blk,
-                                        int64_t sector_num, int nb_sectors,
-                                        void *buf)
+static int coroutine_fn stream_populate(void *opaque, int64_t sector_num,
+                                        int nb_sectors, void *buf)
 {
+    StreamBlockJob *s = opaque;
     struct iovec iov = {
         .iov_base = buf,
         .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
@@ -53,8 +55,29 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     qemu_iovec_init_external(&qiov, &iov, 1);
 
     /* Copy-on-read the unallocated clusters */
-    return blk_co_preadv(blk, sector_num * BDRV_SECTOR_SIZE, qiov.size, &qiov,
-                         BDRV_REQ_COPY_ON_READ);
+    return blk_co_preadv(s->common.blk, sector_num * BDRV_SECTOR_SIZE,
+                         qiov.size, &qiov, BDRV_REQ_COPY_ON_READ);
+}
+
+/*
+ * Applies the error action to a failed request.  Returns true if the job
+ * must be stopped, i.e. the error is to be reported.
+ */
+static bool stream_handle_error(void *opaque, int ret, int *error,
+                                bool *retry)
+{
+    StreamBlockJob *s = opaque;
+    BlockErrorAction action =
+        block_job_error_action(&s->common, s->on_error, true, -ret);
+
+    *retry = action == BLOCK_ERROR_ACTION_STOP;
+    if (*retry) {
+        return false;
+    }
+    if (*error == 0) {
+        *error = ret;
+    }
+    return action == BLOCK_ERROR_ACTION_REPORT;
 }
 
 typedef struct {
@@ -105,7 +128,6 @@ static void coroutine_fn stream_run(void *opaque)
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     if (!bs->backing) {
         goto out;
@@ -118,7 +140,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -129,17 +150,47 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        bool copy;
+    /* Up to max_workers chunks are copied in the background while this
+     * coroutine looks up the allocation status of the next ones.
+     */
+    for (;;) {
+        bool copy, retry;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Requests that are still
+         * in flight complete without our help.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
+        if (copy_pool_has_failed(&s->pool)) {
+            if (copy_pool_process_failed(&s->pool, stream_handle_error,
+                                         &error)) {
+                break;
+            }
+            if (copy_pool_has_failed(&s->pool) &&
+                copy_pool_is_full(&s->pool)) {
+                copy_pool_wait(&s->pool);
+            }
+            continue;
+        }
+
+        if (sector_num == end) {
+            if (s->pool.in_flight == 0) {
+                break;
+            }
+            trace_stream_yield_in_flight(s, sector_num, s->pool.in_flight);
+            copy_pool_wait(&s->pool);
+            continue;
+        }
+
+        while (copy_pool_is_full(&s->pool)) {
+            trace_stream_yield_in_flight(s, sector_num, s->pool.in_flight);
+            copy_pool_wait(&s->pool);
+        }
+
         copy = false;
 
         ret = bdrv_is_allocated(bs, sector_num,
@@ -160,32 +211,30 @@ static void coroutine_fn stream_run(void *opaque)
             copy = (ret == 1);
         }
         trace_stream_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            ret = stream_populate(blk, sector_num, n, buf);
-        }
         if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
+            if (stream_handle_error(s, ret, &error, &retry)) {
                 break;
             }
+            if (retry) {
+                continue;
+            }
         }
         ret = 0;
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        if (copy) {
+            copy_pool_submit(&s->pool, sector_num, n);
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            }
+        } else {
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
         }
+        sector_num += n;
     }
 
+    copy_pool_finish(&s->pool);
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -193,8 +242,6 @@ static void coroutine_fn stream_run(void *opaque)
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
 out:
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
@@ -214,16 +261,26 @@ static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
     ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
 }
 
+static void stream_query(BlockJob *job, BlockJobInfo *info)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+
+    info->has_in_flight = true;
+    info->in_flight = s->pool.bytes_in_flight;
+}
+
 static const BlockJobDriver stream_job_driver = {
     .instance_size = sizeof(StreamBlockJob),
     .job_type      = BLOCK_JOB_TYPE_STREAM,
     .set_speed     = stream_set_speed,
     .start         = stream_run,
+    .query         = stream_query,
 };
 
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
-                  int64_t speed, BlockdevOnError on_error, Error **errp)
+                  int64_t speed, int max_workers, BlockdevOnError on_error,
+                  Error **errp)
 {
     StreamBlockJob *s;
     BlockDriverState *iter;
@@ -255,6 +312,8 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->bs_flags = orig_bs_flags;
 
     s->on_error = on_error;
+    copy_pool_init(&s->pool, &s->common, s->common.blk, STREAM_BUFFER_SIZE,
+                   max_workers, stream_populate, s);
     trace_stream_start(bs, base, s);
     block_job_start(&s->common);
 }
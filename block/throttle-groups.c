@@ -52,21 +52,40 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * Only the per-group lock is taken on the I/O path; the global
+ * throttle_groups_lock just protects the list of groups.
+ *
+ * By default the members of a group take turns in round-robin order.
+ * Once any member has a weight or a reservation, the group switches to
+ * weighted fair sharing: whenever the group is saturated, the next
+ * request comes from the member that has received the least service
+ * relative to its weight, except that members who have not reached
+ * their reserved rate of requests per second go first.  Only members
+ * with queued requests are considered, so idle capacity is still
+ * available to whoever needs it.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
     BlockBackend *tokens[2];
     bool any_timer_armed[2];
+    bool fair_share;
+    uint64_t vtime[2]; /* virtual time of the last scheduled request */
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
+/* Service is accounted in units of this many bytes, at least one per
+ * request, and scaled so that large weights keep enough precision */
+#define THROTTLE_FAIR_SHARE_UNIT 4096
+#define THROTTLE_FAIR_SHARE_SCALE (1 << 20)
+
 static QemuMutex throttle_groups_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -184,6 +203,96 @@ static inline bool blk_has_pending_reqs(BlockBackend *blk,
     return blkp->pending_reqs[is_write];
 }
 
+/* Recompute whether the group uses weighted fair sharing.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_update_fair_share(ThrottleGroup *tg)
+{
+    BlockBackendPublic *blkp;
+
+    tg->fair_share = false;
+    QLIST_FOREACH(blkp, &tg->head, round_robin) {
+        if (blkp->throttle_weight || blkp->throttle_reservation) {
+            tg->fair_share = true;
+            break;
+        }
+    }
+}
+
+/* Return the BlockBackend with pending I/O requests that should be served
+ * next in weighted fair-share mode: the one whose reservation is the most
+ * overdue, or else the one that has received the least weighted service.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @blk:       the current BlockBackend
+ * @is_write:  the type of operation (read/write)
+ * @ret:       the next BlockBackend with pending requests, or blk if there is
+ *             none.
+ */
+static BlockBackend *next_fair_share_token(BlockBackend *blk, bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    BlockBackendPublic *iter, *due = NULL, *best = NULL;
+    int64_t now = qemu_clock_get_ns(blkp->throttle_timers.clock_type);
+
+    QLIST_FOREACH(iter, &tg->head, round_robin) {
+        if (!iter->pending_reqs[is_write]) {
+            continue;
+        }
+        if (iter->throttle_reservation &&
+            iter->throttle_rtag[is_write] <= now &&
+            (!due ||
+             iter->throttle_rtag[is_write] < due->throttle_rtag[is_write])) {
+            due = iter;
+        }
+        if (!best ||
+            iter->throttle_vtime[is_write] < best->throttle_vtime[is_write]) {
+            best = iter;
+        }
+    }
+
+    if (due) {
+        return blk_by_public(due);
+    }
+    return best ? blk_by_public(best) : blk;
+}
+
+/* Charge a request that is about to be executed to its BlockBackend in
+ * weighted fair-share mode.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @blk:       the BlockBackend executing the request
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_fair_share_account(BlockBackend *blk, unsigned int bytes,
+                                        bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    uint64_t units = MAX(1, DIV_ROUND_UP(bytes, THROTTLE_FAIR_SHARE_UNIT));
+    unsigned weight = blkp->throttle_weight ?: 1;
+
+    tg->vtime[is_write] = MAX(tg->vtime[is_write],
+                              blkp->throttle_vtime[is_write]);
+    blkp->throttle_vtime[is_write] += units * THROTTLE_FAIR_SHARE_SCALE /
+                                      weight;
+
+    if (blkp->throttle_reservation) {
+        int64_t now = qemu_clock_get_ns(blkp->throttle_timers.clock_type);
+        int64_t interval = NANOSECONDS_PER_SECOND / blkp->throttle_reservation;
+
+        /* Service above the reserved rate pushes the tag into the future,
+         * but an idle member does not build up credit */
+        blkp->throttle_rtag[is_write] =
+            MAX(blkp->throttle_rtag[is_write] + interval, now);
+    }
+}
+
 /* Return the next BlockBackend in the round-robin sequence with pending I/O
  * requests.
  *
@@ -200,6 +309,10 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
     BlockBackend *token, *start;
 
+    if (tg->fair_share) {
+        return next_fair_share_token(blk, is_write);
+    }
+
     start = token = tg->tokens[is_write];
 
     /* get next bs round in round robin style */
@@ -285,8 +398,11 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current blk */
-        if (qemu_in_coroutine() &&
+        /* In round-robin mode give preference to requests from the current
+         * blk.  In fair-share mode only the member picked by
+         * next_fair_share_token() may go next, even if blk has requests
+         * queued as well.  */
+        if (qemu_in_coroutine() && (!tg->fair_share || token == blk) &&
             qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
             token = blk;
         } else {
@@ -300,8 +416,8 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 }
 
 /* Check if an I/O request needs to be throttled, wait and set a timer
- * if necessary, and schedule the next request using a round robin
- * algorithm.
+ * if necessary, and schedule the next request in round-robin order or,
+ * if the group uses it, by weighted fair sharing.
  *
  * @blk:       the current BlockBackend
  * @bytes:     the number of bytes for this I/O
@@ -316,23 +432,40 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    QEMUClockType clock_type = blkp->throttle_timers.clock_type;
     qemu_mutex_lock(&tg->lock);
 
+    /* A member that was idle starts at the group's current virtual time,
+     * so that it cannot claim the service it did not use meanwhile */
+    if (tg->fair_share && !blkp->pending_reqs[is_write]) {
+        blkp->throttle_vtime[is_write] = MAX(blkp->throttle_vtime[is_write],
+                                             tg->vtime[is_write]);
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(blk, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || blkp->pending_reqs[is_write]) {
+        int64_t start = qemu_clock_get_ns(clock_type);
+
         blkp->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&blkp->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
         blkp->pending_reqs[is_write]--;
+
+        blkp->throttle_waited[is_write]++;
+        blkp->throttle_wait_ns[is_write] += qemu_clock_get_ns(clock_type) -
+                                            start;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
+    if (tg->fair_share) {
+        throttle_fair_share_account(blk, bytes, is_write);
+    }
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -397,6 +530,60 @@ void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the weight and the reservation of a BlockBackend. Once any member of
+ * a group has either, the group schedules requests by weighted fair
+ * sharing instead of round-robin.
+ *
+ * @blk:         the BlockBackend, which need not be in a group yet
+ * @weight:      relative share of the group's I/O, or 0 to unset it
+ * @reservation: requests per second served ahead of the other members,
+ *               or 0 to unset it
+ */
+void throttle_group_set_share(BlockBackend *blk, unsigned weight,
+                              unsigned reservation)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg;
+
+    if (!blkp->throttle_state) {
+        blkp->throttle_weight = weight;
+        blkp->throttle_reservation = reservation;
+        return;
+    }
+
+    tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    blkp->throttle_weight = weight;
+    blkp->throttle_reservation = reservation;
+    throttle_group_update_fair_share(tg);
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the throttling statistics of a BlockBackend that is a member of a
+ * group.
+ *
+ * @blk:   a BlockBackend that is a member of the group
+ * @stats: the statistics will be written here
+ */
+void throttle_group_get_stats(BlockBackend *blk,
+                              BlockDeviceThrottleStats *stats)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    qemu_mutex_lock(&tg->lock);
+    stats->group = g_strdup(tg->name);
+    stats->weight = blkp->throttle_weight;
+    stats->reservation = blkp->throttle_reservation;
+    stats->rd_queue_depth = blkp->pending_reqs[0];
+    stats->wr_queue_depth = blkp->pending_reqs[1];
+    stats->rd_throttled = blkp->throttle_waited[0];
+    stats->wr_throttled = blkp->throttle_waited[1];
+    stats->rd_wait_time_ns = blkp->throttle_wait_ns[0];
+    stats->wr_wait_time_ns = blkp->throttle_wait_ns[1];
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -468,6 +655,13 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
     }
 
     QLIST_INSERT_HEAD(&tg->head, blkp, round_robin);
+    throttle_group_update_fair_share(tg);
+
+    /* Start with the group's virtual time, not with an advantage */
+    for (i = 0; i < 2; i++) {
+        blkp->throttle_vtime[i] = tg->vtime[i];
+        blkp->throttle_rtag[i] = 0;
+    }
 
     throttle_timers_init(&blkp->throttle_timers,
                          blk_get_aio_context(blk),
@@ -513,6 +707,7 @@ void throttle_group_unregister_blk(BlockBackend *blk)
 
     /* remove the current blk from the list */
     QLIST_REMOVE(blkp, round_robin);
+    throttle_group_update_fair_share(tg);
     throttle_timers_destroy(&blkp->throttle_timers);
     qemu_mutex_unlock(&tg->lock);
 
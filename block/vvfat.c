@@ -2793,6 +2793,7 @@ static int do_commit(BDRVVVFATState* s)
 
     if (s->qcow->bs->drv->bdrv_make_empty) {
         s->qcow->bs->drv->bdrv_make_empty(s->qcow->bs);
+        bdrv_block_status_cache_clear(s->qcow->bs);
     }
 
     memset(s->used_clusters, 0, sector2cluster(s, s->sector_count));
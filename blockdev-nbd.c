@@ -146,7 +146,7 @@ void qmp_nbd_server_start(SocketAddress *addr,
 }
 
 void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
-                        Error **errp)
+                        bool has_multi_conn, bool multi_conn, Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
@@ -176,7 +176,16 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+    /* Connections to a read-only export cannot see inconsistent data.
+     * A writable node may also be written by the guest or a block job,
+     * so only the user can tell whether several connections are safe. */
+    if (!has_multi_conn) {
+        multi_conn = !writable;
+    }
+
+    exp = nbd_export_new(bs, 0, -1,
+                         (writable ? 0 : NBD_FLAG_READ_ONLY) |
+                         (multi_conn ? NBD_FLAG_CAN_MULTI_CONN : 0),
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
@@ -1967,6 +1967,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2015,6 +2016,9 @@ static void block_dirty_bitmap_clear_prepare(BlkActionState *common,
     if (bdrv_dirty_bitmap_frozen(state->bitmap)) {
         error_setg(errp, "Cannot modify a frozen bitmap");
         return;
+    } else if (bdrv_dirty_bitmap_qmp_locked(state->bitmap)) {
+        error_setg(errp, "Cannot modify a locked bitmap");
+        return;
     } else if (!bdrv_dirty_bitmap_enabled(state->bitmap)) {
         error_setg(errp, "Cannot clear a disabled bitmap");
         return;
@@ -2672,6 +2676,16 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
+    if (arg->has_weight && (arg->weight < 0 || arg->weight > 10000)) {
+        error_setg(errp, "weight must be between 0 and 10000");
+        goto out;
+    }
+    if (arg->has_reservation &&
+        (arg->reservation < 0 || arg->reservation > 1000000)) {
+        error_setg(errp, "reservation must be between 0 and 1000000");
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2685,6 +2699,14 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         }
         /* Set the new throttling configuration */
         blk_set_io_limits(blk, &cfg);
+        if (arg->has_weight || arg->has_reservation) {
+            BlockBackendPublic *blkp = blk_get_public(blk);
+
+            throttle_group_set_share(blk,
+                arg->has_weight ? arg->weight : blkp->throttle_weight,
+                arg->has_reservation ? arg->reservation :
+                                       blkp->throttle_reservation);
+        }
     } else if (blk_get_public(blk)->throttle_state) {
         /* If all throttling settings are set to 0, disable I/O limits */
         blk_io_limits_disable(blk);
@@ -2694,12 +2716,93 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(bool has_device, const char *device,
+                                     bool has_id, const char *id,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     bool has_reset, bool reset,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    bool has_type[BLOCK_MAX_IOTYPE];
+    uint64List *type_boundaries[BLOCK_MAX_IOTYPE];
+    bool any_boundaries;
+    int i;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+
+    has_type[BLOCK_ACCT_READ] = has_boundaries_read || has_boundaries;
+    type_boundaries[BLOCK_ACCT_READ] =
+        has_boundaries_read ? boundaries_read : boundaries;
+    has_type[BLOCK_ACCT_WRITE] = has_boundaries_write || has_boundaries;
+    type_boundaries[BLOCK_ACCT_WRITE] =
+        has_boundaries_write ? boundaries_write : boundaries;
+    has_type[BLOCK_ACCT_FLUSH] = has_boundaries_flush || has_boundaries;
+    type_boundaries[BLOCK_ACCT_FLUSH] =
+        has_boundaries_flush ? boundaries_flush : boundaries;
+    any_boundaries = has_boundaries || has_boundaries_read ||
+                     has_boundaries_write || has_boundaries_flush;
+
+    if (has_reset && reset && any_boundaries) {
+        error_setg(errp, "'reset' cannot be combined with boundaries");
+        return;
+    }
+
+    /* Check everything first so that the command is all or nothing */
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        uint64List *entry;
+        uint64_t prev = 0;
+
+        for (entry = type_boundaries[i]; entry; entry = entry->next) {
+            if (entry->value <= prev) {
+                error_setg(errp, "Histogram boundaries must be greater than "
+                           "zero and in ascending order");
+                return;
+            }
+            prev = entry->value;
+        }
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+    if (has_reset && reset) {
+        for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+            block_latency_histogram_reset(stats, i);
+        }
+    } else if (!any_boundaries) {
+        block_latency_histograms_clear(stats);
+    } else {
+        for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+            if (has_type[i]) {
+                block_latency_histogram_set(stats, i, type_boundaries[i]);
+            }
+        }
+    }
+
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2725,7 +2828,20 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp))
+    {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap != NULL) {
+        bdrv_dirty_bitmap_set_persistance(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2749,6 +2865,12 @@ void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
                    name);
         goto out;
     }
+    if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently locked and cannot be removed",
+                   name);
+        goto out;
+    }
     bdrv_dirty_bitmap_make_anon(bitmap);
     bdrv_release_dirty_bitmap(bs, bitmap);
 
@@ -2777,6 +2899,11 @@ void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
                    "Bitmap '%s' is currently frozen and cannot be modified",
                    name);
         goto out;
+    } else if (bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+        error_setg(errp,
+                   "Bitmap '%s' is currently locked and cannot be modified",
+                   name);
+        goto out;
     } else if (!bdrv_dirty_bitmap_enabled(bitmap)) {
         error_setg(errp,
                    "Bitmap '%s' is currently disabled and cannot be cleared",
@@ -2919,6 +3046,7 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockDriverState *bs, *iter;
@@ -2930,6 +3058,14 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
     if (!has_on_error) {
         on_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
+    if (max_workers < 1 || max_workers > BLOCK_JOB_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(BLOCK_JOB_MAX_WORKERS));
+        return;
+    }
 
     bs = bdrv_lookup_bs(device, device, errp);
     if (!bs) {
@@ -2988,7 +3124,7 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
     base_name = has_backing_file ? backing_file : base_name;
 
     stream_start(has_job_id ? job_id : NULL, bs, base_bs, base_name,
-                 has_speed ? speed : 0, on_error, &local_err);
+                 has_speed ? speed : 0, max_workers, on_error, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto out;
@@ -3005,6 +3141,7 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
                       bool has_top, const char *top,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -3020,6 +3157,9 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_workers) {
+        max_workers = 1;
+    }
 
     /* Important Note:
      *  libvirt relies on the DeviceNotFound error class in order to probe for
@@ -3093,6 +3233,11 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
                              " but 'top' is the active layer");
             goto out;
         }
+        if (has_max_workers) {
+            error_setg(errp, "'max-workers' specified,"
+                             " but 'top' is the active layer");
+            goto out;
+        }
         commit_active_start(has_job_id ? job_id : NULL, bs, base_bs,
                             BLOCK_JOB_DEFAULT, speed, on_error, NULL, NULL,
                             &local_err, false);
@@ -3101,9 +3246,15 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
         if (bdrv_op_is_blocked(overlay_bs, BLOCK_OP_TYPE_COMMIT_TARGET, errp)) {
             goto out;
         }
+        if (max_workers < 1 || max_workers > BLOCK_JOB_MAX_WORKERS) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                       "a value between 1 and "
+                       stringify(BLOCK_JOB_MAX_WORKERS));
+            goto out;
+        }
         commit_start(has_job_id ? job_id : NULL, bs, base_bs, top_bs, speed,
-                     on_error, has_backing_file ? backing_file : NULL,
-                     &local_err);
+                     max_workers, on_error,
+                     has_backing_file ? backing_file : NULL, &local_err);
     }
     if (local_err != NULL) {
         error_propagate(errp, local_err);
@@ -3221,6 +3372,12 @@ static BlockJob *do_drive_backup(DriveBackup *backup, BlockJobTxn *txn,
             bdrv_unref(target_bs);
             goto out;
         }
+        if (bdrv_dirty_bitmap_qmp_locked(bmap)) {
+            error_setg(errp, "Bitmap '%s' is currently locked and cannot be "
+                       "used for backup", backup->bitmap);
+            bdrv_unref(target_bs);
+            goto out;
+        }
     }
 
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
@@ -3339,6 +3496,8 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_on_target_error,
                                    BlockdevOnError on_target_error,
                                    bool has_unmap, bool unmap,
+                                   bool has_copy_mode,
+                                   MirrorCopyMode copy_mode,
                                    Error **errp)
 {
 
@@ -3360,6 +3519,9 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3389,7 +3551,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     mirror_start(job_id, bs, target,
                  has_replaces ? replaces : NULL,
                  speed, granularity, buf_size, sync, backing_mode,
-                 on_source_error, on_target_error, unmap, errp);
+                 on_source_error, on_target_error, unmap, copy_mode, errp);
 }
 
 void qmp_drive_mirror(DriveMirror *arg, Error **errp)
@@ -3527,6 +3689,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_on_source_error, arg->on_source_error,
                            arg->has_on_target_error, arg->on_target_error,
                            arg->has_unmap, arg->unmap,
+                           arg->has_copy_mode, arg->copy_mode,
                            &local_err);
     bdrv_unref(target_bs);
     error_propagate(errp, local_err);
@@ -3545,6 +3708,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3576,6 +3740,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            true, true,
+                           has_copy_mode, copy_mode,
                            &local_err);
     error_propagate(errp, local_err);
 
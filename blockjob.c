@@ -610,6 +610,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
     info->speed     = job->speed;
     info->io_status = job->iostatus;
     info->ready     = job->ready;
+    if (job->driver->query) {
+        job->driver->query(job, info);
+    }
     return info;
 }
 
@@ -0,0 +1,474 @@
+/*
+ * vhost-user-blk sample application
+ *
+ * Serves a disk image to a vhost-user-blk device over a unix socket.  The
+ * image is accessed through the QEMU block layer, like qemu-nbd does, and
+ * the request buffers are passed to it as iovecs that point directly into
+ * the shared guest memory.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qapi/qmp/qstring.h"
+#include "sysemu/block-backend.h"
+#include "block/block.h"
+#include "crypto/init.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "contrib/libvhost-user/libvhost-user.h"
+
+#include <getopt.h>
+
+#define VHOST_USER_BLK_DEFAULT_QUEUES 1
+
+typedef struct VubDev {
+    VuDev parent;
+    BlockBackend *blk;
+    uint16_t num_queues;
+    bool read_only;
+    bool connected;
+    int listen_fd;
+    GHashTable *watches;
+} VubDev;
+
+typedef struct VubReq {
+    VuVirtqElement elem;
+    VubDev *vdev;
+    VuVirtq *vq;
+    struct virtio_blk_outhdr out;
+    uint8_t *status;
+} VubReq;
+
+typedef struct VubWatch {
+    VuDev *vu_dev;
+    vu_watch_cb cb;
+    void *data;
+} VubWatch;
+
+static bool vub_quit;
+
+static void vub_accept(void *opaque);
+
+static void vub_req_complete(VubReq *req, uint8_t status, size_t in_len)
+{
+    VuDev *vu_dev = &req->vdev->parent;
+
+    *req->status = status;
+    vu_queue_push(vu_dev, req->vq, &req->elem, in_len + 1);
+    vu_queue_notify(vu_dev, req->vq);
+    free(req);
+}
+
+static void coroutine_fn vub_req_co(void *opaque)
+{
+    VubReq *req = opaque;
+    BlockBackend *blk = req->vdev->blk;
+    struct iovec *out_iov = req->elem.out_sg;
+    struct iovec *in_iov = req->elem.in_sg;
+    unsigned out_num = req->elem.out_num;
+    unsigned in_num = req->elem.in_num;
+    QEMUIOVector qiov;
+    size_t in_len = 0;
+    uint64_t offset;
+    uint32_t type;
+    int ret = 0;
+
+    offset = le64_to_cpu(req->out.sector) << BDRV_SECTOR_BITS;
+    type = le32_to_cpu(req->out.type);
+
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+        qemu_iovec_init_external(&qiov, in_iov, in_num);
+        ret = blk_co_preadv(blk, offset, qiov.size, &qiov, 0);
+        in_len = qiov.size;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        if (req->vdev->read_only) {
+            ret = -EROFS;
+            break;
+        }
+        qemu_iovec_init_external(&qiov, out_iov, out_num);
+        ret = blk_co_pwritev(blk, offset, qiov.size, &qiov, 0);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        ret = blk_co_flush(blk);
+        break;
+    case VIRTIO_BLK_T_GET_ID:
+        in_len = iov_from_buf(in_iov, in_num, 0, "vhost_user_blk",
+                              MIN(sizeof("vhost_user_blk"),
+                                  VIRTIO_BLK_ID_BYTES));
+        break;
+    default:
+        vub_req_complete(req, VIRTIO_BLK_S_UNSUPP, 0);
+        return;
+    }
+
+    vub_req_complete(req, ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK,
+                     in_len);
+}
+
+/*
+ * Split off the request header and the status byte; what remains of the
+ * element's iovecs is the data buffer in guest memory.
+ */
+static bool vub_req_parse(VubReq *req)
+{
+    VuVirtqElement *elem = &req->elem;
+    struct iovec *in_last;
+
+    if (elem->out_num < 1 || elem->in_num < 1) {
+        error_report("virtio-blk request missing headers");
+        return false;
+    }
+
+    if (iov_to_buf(elem->out_sg, elem->out_num, 0, &req->out,
+                   sizeof(req->out)) != sizeof(req->out)) {
+        error_report("virtio-blk request outhdr too short");
+        return false;
+    }
+    iov_discard_front(&elem->out_sg, &elem->out_num, sizeof(req->out));
+
+    in_last = &elem->in_sg[elem->in_num - 1];
+    if (in_last->iov_len < 1) {
+        error_report("virtio-blk request inhdr too short");
+        return false;
+    }
+    req->status = (uint8_t *)in_last->iov_base + in_last->iov_len - 1;
+    iov_discard_back(elem->in_sg, &elem->in_num, 1);
+
+    return true;
+}
+
+static void vub_process_vq(VuDev *vu_dev, int idx)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    VuVirtq *vq = vu_get_queue(vu_dev, idx);
+    VubReq *req;
+    Coroutine *co;
+
+    while ((req = vu_queue_pop(vu_dev, vq, sizeof(VubReq)))) {
+        req->vdev = vdev;
+        req->vq = vq;
+
+        if (!vub_req_parse(req)) {
+            vu_queue_push(vu_dev, vq, &req->elem, 0);
+            vu_queue_notify(vu_dev, vq);
+            free(req);
+            continue;
+        }
+
+        co = qemu_coroutine_create(vub_req_co, req);
+        qemu_coroutine_enter(co);
+    }
+}
+
+static void vub_queue_set_started(VuDev *vu_dev, int idx, bool started)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    VuVirtq *vq = vu_get_queue(vu_dev, idx);
+
+    /* The ring must be quiescent before its base is handed back to QEMU */
+    if (!started) {
+        blk_drain(vdev->blk);
+    }
+
+    vu_set_queue_handler(vu_dev, vq, started ? vub_process_vq : NULL);
+}
+
+static uint64_t vub_get_features(VuDev *vu_dev)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    uint64_t features;
+
+    features = 1ULL << VIRTIO_BLK_F_SEG_MAX |
+               1ULL << VIRTIO_BLK_F_BLK_SIZE |
+               1ULL << VIRTIO_BLK_F_FLUSH |
+               1ULL << VIRTIO_BLK_F_CONFIG_WCE |
+               1ULL << VIRTIO_F_VERSION_1;
+
+    if (vdev->read_only) {
+        features |= 1ULL << VIRTIO_BLK_F_RO;
+    }
+    if (vdev->num_queues > 1) {
+        features |= 1ULL << VIRTIO_BLK_F_MQ;
+    }
+
+    return features;
+}
+
+static int vub_get_config(VuDev *vu_dev, uint8_t *config, uint32_t len)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    struct virtio_blk_config blkcfg = { 0 };
+    int64_t size;
+
+    size = blk_getlength(vdev->blk);
+    if (size < 0) {
+        return -1;
+    }
+
+    blkcfg.capacity = cpu_to_le64(size >> BDRV_SECTOR_BITS);
+    blkcfg.seg_max = cpu_to_le32(128 - 2);
+    blkcfg.blk_size = cpu_to_le32(BDRV_SECTOR_SIZE);
+    blkcfg.wce = blk_enable_write_cache(vdev->blk);
+    blkcfg.num_queues = cpu_to_le16(vdev->num_queues);
+
+    memcpy(config, &blkcfg, MIN(len, sizeof(blkcfg)));
+    return 0;
+}
+
+static int vub_set_config(VuDev *vu_dev, const uint8_t *data,
+                          uint32_t offset, uint32_t size)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+
+    /* Only the writeback cache mode can be changed by the driver */
+    if (offset != offsetof(struct virtio_blk_config, wce) || size != 1) {
+        return -1;
+    }
+
+    blk_set_enable_write_cache(vdev->blk, data[0] != 0);
+    return 0;
+}
+
+static const VuDevIface vub_iface = {
+    .get_features = vub_get_features,
+    .get_config = vub_get_config,
+    .set_config = vub_set_config,
+    .queue_set_started = vub_queue_set_started,
+};
+
+static void vub_panic_cb(VuDev *vu_dev, const char *buf)
+{
+    error_report("vhost-user-blk: %s", buf);
+}
+
+static void vub_watch_read(void *opaque)
+{
+    VubWatch *w = opaque;
+
+    w->cb(w->vu_dev, VU_WATCH_IN, w->data);
+}
+
+static void vub_set_watch(VuDev *vu_dev, int fd, int condition,
+                          vu_watch_cb cb, void *data)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+    VubWatch *w;
+
+    assert(condition == VU_WATCH_IN);
+
+    w = g_hash_table_lookup(vdev->watches, GINT_TO_POINTER(fd));
+    if (!w) {
+        w = g_new0(VubWatch, 1);
+        g_hash_table_insert(vdev->watches, GINT_TO_POINTER(fd), w);
+    }
+    w->vu_dev = vu_dev;
+    w->cb = cb;
+    w->data = data;
+
+    qemu_set_fd_handler(fd, vub_watch_read, NULL, w);
+}
+
+static void vub_remove_watch(VuDev *vu_dev, int fd)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    g_hash_table_remove(vdev->watches, GINT_TO_POINTER(fd));
+}
+
+static void vub_disconnect(VubDev *vdev)
+{
+    if (!vdev->connected) {
+        return;
+    }
+
+    blk_drain(vdev->blk);
+    vu_deinit(&vdev->parent);
+    vdev->connected = false;
+
+    /* Wait for the next master */
+    qemu_set_fd_handler(vdev->listen_fd, vub_accept, NULL, vdev);
+}
+
+static void vub_dispatch(VuDev *vu_dev, int condition, void *data)
+{
+    VubDev *vdev = container_of(vu_dev, VubDev, parent);
+
+    if (!vu_dispatch(vu_dev) || vu_dev->broken) {
+        error_report("vhost-user-blk: disconnecting");
+        vub_disconnect(vdev);
+    }
+}
+
+static void vub_accept(void *opaque)
+{
+    VubDev *vdev = opaque;
+    int sock;
+
+    sock = qemu_accept(vdev->listen_fd, NULL, NULL);
+    if (sock < 0) {
+        error_report("Failed to accept connection: %s", strerror(errno));
+        return;
+    }
+
+    /* Only one master at a time */
+    qemu_set_fd_handler(vdev->listen_fd, NULL, NULL, NULL);
+
+    vu_init(&vdev->parent, vdev->num_queues, sock, vub_panic_cb,
+            vub_set_watch, vub_remove_watch, &vub_iface);
+    vdev->connected = true;
+    vub_set_watch(&vdev->parent, sock, VU_WATCH_IN, vub_dispatch, NULL);
+}
+
+static void termsig_handler(int signum)
+{
+    atomic_set(&vub_quit, true);
+    qemu_notify_event();
+}
+
+static void usage(const char *name)
+{
+    (printf) (
+"Usage: %s [OPTIONS] FILE\n"
+"Serve FILE to a vhost-user-blk device\n"
+"\n"
+"  -h, --help                display this help and exit\n"
+"  -V, --version             output version information and exit\n"
+"\n"
+"  -s, --socket=PATH         path of the unix socket to listen on\n"
+"  -f, --format=FORMAT       set image format (raw, qcow2, ...)\n"
+"  -r, --read-only           export read-only\n"
+"  -q, --queues=NUM          number of virtqueues (default %d, max %d)\n"
+"\n"
+"Report bugs to <qemu-devel@nongnu.org>\n"
+    , name, VHOST_USER_BLK_DEFAULT_QUEUES, VHOST_MAX_NR_VIRTQUEUE);
+}
+
+int main(int argc, char **argv)
+{
+    VubDev vdev = {
+        .num_queues = VHOST_USER_BLK_DEFAULT_QUEUES,
+        .listen_fd = -1,
+    };
+    const char *sopt = "hVs:f:rq:";
+    struct option lopt[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "version", no_argument, NULL, 'V' },
+        { "socket", required_argument, NULL, 's' },
+        { "format", required_argument, NULL, 'f' },
+        { "read-only", no_argument, NULL, 'r' },
+        { "queues", required_argument, NULL, 'q' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *sockpath = NULL;
+    const char *fmt = NULL;
+    QDict *options = NULL;
+    Error *local_err = NULL;
+    struct sigaction sa_sigterm;
+    unsigned long queues;
+    int flags = BDRV_O_RDWR;
+    int ch;
+
+    memset(&sa_sigterm, 0, sizeof(sa_sigterm));
+    sa_sigterm.sa_handler = termsig_handler;
+    sigaction(SIGTERM, &sa_sigterm, NULL);
+    sigaction(SIGINT, &sa_sigterm, NULL);
+
+    module_call_init(MODULE_INIT_TRACE);
+    qcrypto_init(&error_fatal);
+    module_call_init(MODULE_INIT_QOM);
+    qemu_init_exec_dir(argv[0]);
+
+    while ((ch = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+        switch (ch) {
+        case 's':
+            sockpath = optarg;
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'r':
+            vdev.read_only = true;
+            flags &= ~BDRV_O_RDWR;
+            break;
+        case 'q':
+            if (qemu_strtoul(optarg, NULL, 0, &queues) < 0 ||
+                queues < 1 || queues > VHOST_MAX_NR_VIRTQUEUE) {
+                error_report("Invalid number of queues '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            vdev.num_queues = queues;
+            break;
+        case 'V':
+            printf("%s " QEMU_VERSION QEMU_PKGVERSION "\n", argv[0]);
+            exit(EXIT_SUCCESS);
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            error_report("Try `%s --help' for more information.", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1 || !sockpath) {
+        error_report("Invalid number of arguments");
+        error_printf("Try `%s --help' for more information.\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (qemu_init_main_loop(&local_err)) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    bdrv_init();
+
+    if (fmt) {
+        options = qdict_new();
+        qdict_put(options, "driver", qstring_from_str(fmt));
+    }
+    vdev.blk = blk_new_open(argv[optind], NULL, options, flags, &local_err);
+    if (!vdev.blk) {
+        error_reportf_err(local_err, "Failed to blk_new_open '%s': ",
+                          argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    blk_set_enable_write_cache(vdev.blk, true);
+
+    vdev.listen_fd = unix_listen(sockpath, NULL, 0, &local_err);
+    if (vdev.listen_fd < 0) {
+        error_report_err(local_err);
+        blk_unref(vdev.blk);
+        exit(EXIT_FAILURE);
+    }
+
+    vdev.watches = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, g_free);
+    qemu_set_fd_handler(vdev.listen_fd, vub_accept, NULL, &vdev);
+
+    while (!atomic_read(&vub_quit)) {
+        main_loop_wait(false);
+    }
+
+    vub_disconnect(&vdev);
+    qemu_set_fd_handler(vdev.listen_fd, NULL, NULL, NULL);
+    close(vdev.listen_fd);
+    unlink(sockpath);
+    g_hash_table_destroy(vdev.watches);
+    blk_unref(vdev.blk);
+    bdrv_close_all();
+
+    return EXIT_SUCCESS;
+}
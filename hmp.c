@@ -222,6 +222,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->has_multifd_pages) {
+            intList *channel;
+
+            monitor_printf(mon, "multifd pages:");
+            for (channel = info->ram->multifd_pages; channel;
+                 channel = channel->next) {
+                monitor_printf(mon, " %" PRId64, channel->value);
+            }
+            monitor_printf(mon, "\n");
+        }
     }
 
     if (info->has_disk) {
@@ -246,6 +256,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_evictions);
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -253,6 +269,20 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_postcopy_fault_latency) {
+        PostcopyFaultLatency *lat = info->postcopy_fault_latency;
+        intList *bucket;
+
+        monitor_printf(mon, "postcopy faults: %" PRIu64 "\n", lat->faults);
+        monitor_printf(mon, "postcopy fault max latency: %" PRIu64
+                       " microseconds\n", lat->max);
+        monitor_printf(mon, "postcopy fault latency histogram:");
+        for (bucket = lat->histogram; bucket; bucket = bucket->next) {
+            monitor_printf(mon, " %" PRId64, bucket->value);
+        }
+        monitor_printf(mon, "\n");
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -322,6 +352,14 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
             params->x_checkpoint_delay);
+        assert(params->has_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
+        assert(params->has_compress_method);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
         monitor_printf(mon, "\n");
     }
 
@@ -1394,6 +1432,19 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.has_x_checkpoint_delay = true;
                 use_int_value = true;
                 break;
+            case MIGRATION_PARAMETER_MULTIFD_CHANNELS:
+                p.has_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                p.has_compress_method = true;
+                p.compress_method = qapi_enum_parse(
+                    MigrationCompressMethod_lookup, valuestr,
+                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                break;
             }
 
             if (use_int_value) {
@@ -1411,6 +1462,7 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.cpu_throttle_increment = valueint;
                 p.downtime_limit = valueint;
                 p.x_checkpoint_delay = valueint;
+                p.multifd_channels = valueint;
             }
 
             qmp_migrate_set_parameters(&p, &err);
@@ -1573,7 +1625,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
 
     qmp_block_stream(true, device, device, base != NULL, base, false, NULL,
                      false, NULL, qdict_haskey(qdict, "speed"), speed,
-                     true, BLOCKDEV_ON_ERROR_REPORT, &error);
+                     true, BLOCKDEV_ON_ERROR_REPORT, false, 0, &error);
 
     hmp_handle_error(mon, &error);
 }
@@ -1964,7 +2016,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable,
+                           false, false, &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -1984,7 +2037,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     bool writable = qdict_get_try_bool(qdict, "writable", false);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, false, false, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
@@ -26,6 +26,8 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+typedef struct VirtIOBlockQueue VirtIOBlockQueue;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
@@ -42,6 +44,29 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* With the "iothreads" property, virtqueue i is serviced by
+     * iothreads[i % num_iothreads].  The BlockBackend stays in @ctx, the
+     * AioContext of the first iothread: the other iothreads pop and map
+     * the requests of their queues under their own AioContext only, then
+     * acquire @ctx just to submit them.  Requests complete in @ctx and are
+     * handed back to the iothread of their queue, which pushes them to
+     * the used ring and notifies the guest.
+     */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    VirtIOBlockQueue *queues;
+};
+
+struct VirtIOBlockQueue {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+    AioContext *ctx;
+
+    /* Only for queues serviced outside of the BlockBackend's AioContext */
+    QEMUBH *complete_bh;
+    QemuMutex lock;
+    VirtIOBlockReq *completed;      /* protected by @lock */
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -62,7 +87,7 @@ static void notify_guest_bh(void *opaque)
     memset(s->batch_notify_vqs, 0, sizeof(bitmap));
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long bits = bitmap[j / BITS_PER_LONG];
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -75,6 +100,109 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* Context: AioContext of the queue */
+static void virtio_blk_data_plane_complete_bh(void *opaque)
+{
+    VirtIOBlockQueue *q = opaque;
+    VirtIOBlockReq *req, *next;
+
+    qemu_mutex_lock(&q->lock);
+    req = q->completed;
+    q->completed = NULL;
+    qemu_mutex_unlock(&q->lock);
+
+    if (!req) {
+        return;
+    }
+    for (; req; req = next) {
+        next = req->next;
+        virtqueue_push(q->vq, &req->elem, req->in_len);
+        g_free(req);
+    }
+    virtio_notify_irqfd(q->s->vdev, q->vq);
+}
+
+/* Context: AioContext of the BlockBackend */
+void virtio_blk_data_plane_complete(VirtIOBlockDataPlane *s,
+                                    VirtIOBlockReq *req)
+{
+    VirtIOBlockQueue *q = &s->queues[virtio_get_queue_index(req->vq)];
+
+    if (q->ctx == s->ctx) {
+        virtqueue_push(req->vq, &req->elem, req->in_len);
+        virtio_blk_data_plane_notify(s, req->vq);
+        g_free(req);
+        return;
+    }
+
+    /* The used ring belongs to the iothread of the queue */
+    qemu_mutex_lock(&q->lock);
+    req->next = q->completed;
+    q->completed = req;
+    qemu_mutex_unlock(&q->lock);
+    qemu_bh_schedule(q->complete_bh);
+}
+
+/* Context: QEMU global mutex held */
+static bool virtio_blk_data_plane_parse_iothreads(VirtIOBlockDataPlane *s,
+                                                  const char *list,
+                                                  Error **errp)
+{
+    char **ids = g_strsplit(list, ":", -1);
+    unsigned n = g_strv_length(ids);
+    unsigned i;
+
+    if (n == 0) {
+        error_setg(errp, "iothreads property must list at least one iothread");
+        g_strfreev(ids);
+        return false;
+    }
+
+    s->iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        Object *obj = object_resolve_path_type(ids[i], TYPE_IOTHREAD, NULL);
+
+        if (!obj) {
+            error_setg(errp, "iothread '%s' not found", ids[i]);
+            g_strfreev(ids);
+            return false;
+        }
+        object_ref(obj);
+        s->iothreads[s->num_iothreads++] = IOTHREAD(obj);
+    }
+
+    g_strfreev(ids);
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_blk_data_plane_free(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; s->queues && i < s->conf->num_queues; i++) {
+        VirtIOBlockQueue *q = &s->queues[i];
+
+        if (q->complete_bh) {
+            qemu_bh_delete(q->complete_bh);
+            qemu_mutex_destroy(&q->lock);
+        }
+    }
+    g_free(s->queues);
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->batch_notify_vqs);
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+    }
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+    }
+    g_free(s);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -83,10 +211,17 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothreads) {
+        error_setg(errp, "iothread and iothreads properties are "
+                   "mutually exclusive");
+        return;
+    }
+
+    if (conf->iothread || conf->iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -115,13 +250,41 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
+    if (conf->iothreads &&
+        !virtio_blk_data_plane_parse_iothreads(s, conf->iothreads, errp)) {
+        virtio_blk_data_plane_free(s);
+        return;
+    }
+
     if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
+    } else if (s->num_iothreads) {
+        s->ctx = iothread_get_aio_context(s->iothreads[0]);
     } else {
         s->ctx = qemu_get_aio_context();
     }
+
+    s->queues = g_new0(VirtIOBlockQueue, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        VirtIOBlockQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->vq = virtio_get_queue(vdev, i);
+        if (s->num_iothreads) {
+            IOThread *iothread = s->iothreads[i % s->num_iothreads];
+            q->ctx = iothread_get_aio_context(iothread);
+        } else {
+            q->ctx = s->ctx;
+        }
+        if (q->ctx != s->ctx) {
+            qemu_mutex_init(&q->lock);
+            q->complete_bh = aio_bh_new(q->ctx,
+                                        virtio_blk_data_plane_complete_bh, q);
+        }
+    }
+
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
@@ -139,12 +302,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
-    }
-    g_free(s);
+    virtio_blk_data_plane_free(s);
 }
 
 static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
@@ -158,6 +316,32 @@ static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
     virtio_blk_handle_vq(s, vq);
 }
 
+/* Handler for virtqueues serviced by an iothread other than the one that
+ * owns the BlockBackend.  It runs under the AioContext of its own iothread,
+ * so the queues of different iothreads are popped in parallel; only the
+ * submission is serialized on the BlockBackend's AioContext.
+ */
+static void virtio_blk_data_plane_handle_output_mq(VirtIODevice *vdev,
+                                                   VirtQueue *vq)
+{
+    VirtIOBlock *s = (VirtIOBlock *)vdev;
+    VirtIOBlockReq *reqs;
+    AioContext *ctx;
+
+    assert(s->dataplane);
+    assert(s->dataplane_started);
+
+    reqs = virtio_blk_get_requests(s, vq);
+    if (!reqs) {
+        return;
+    }
+
+    ctx = s->dataplane->ctx;
+    aio_context_acquire(ctx);
+    virtio_blk_handle_requests(s, reqs);
+    aio_context_release(ctx);
+}
+
 /* Context: QEMU global mutex held */
 int virtio_blk_data_plane_start(VirtIODevice *vdev)
 {
@@ -209,14 +393,16 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->queues[i].ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
-                virtio_blk_data_plane_handle_output);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
+                ctx == s->ctx ? virtio_blk_data_plane_handle_output
+                              : virtio_blk_data_plane_handle_output_mq);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -249,20 +435,37 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
-    /* Stop notifications for new requests from guest */
+    /* Stop notifications for new requests from guest.  Once the handler
+     * is removed under its AioContext lock, no queue handler can be
+     * submitting requests from another iothread anymore.
+     */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->queues[i].ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        aio_context_release(ctx);
     }
 
+    aio_context_acquire(s->ctx);
+
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
+    /* Push the requests that completed during the drain */
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockQueue *q = &s->queues[i];
+
+        if (q->complete_bh) {
+            aio_context_acquire(q->ctx);
+            virtio_blk_data_plane_complete_bh(q);
+            aio_context_release(q->ctx);
+        }
+    }
+
     for (i = 0; i < nvqs; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
     }
@@ -16,6 +16,7 @@
 #define HW_DATAPLANE_VIRTIO_BLK_H
 
 #include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-blk.h"
 
 typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
 
@@ -24,6 +25,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   Error **errp);
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq);
+void virtio_blk_data_plane_complete(VirtIOBlockDataPlane *s,
+                                    VirtIOBlockReq *req);
 
 int virtio_blk_data_plane_start(VirtIODevice *vdev);
 void virtio_blk_data_plane_stop(VirtIODevice *vdev);
@@ -1058,6 +1058,38 @@ int rom_add_option(const char *file, int32_t bootindex)
     return rom_add_file(file, "genroms", 0, bootindex, true, NULL, NULL);
 }
 
+/*
+ * With ignore-shared, RAM blocks mapped with MAP_SHARED are not migrated:
+ * the destination maps the same memory as the source, which is still
+ * running, so writing the ROM there would corrupt the source's guest.
+ * The destination can only enable the capability after this reset, so
+ * during an incoming migration every shared block is taken as one that may
+ * be left out.  If it is migrated after all, the stream brings the data.
+ */
+static bool rom_in_ignored_ram(Rom *rom)
+{
+    MemoryRegionSection section;
+    RAMBlock *block = NULL;
+    ram_addr_t offset;
+
+    if (!runstate_check(RUN_STATE_INMIGRATE)) {
+        return false;
+    }
+    if (rom->mr) {
+        block = qemu_ram_block_from_host(memory_region_get_ram_ptr(rom->mr),
+                                         false, &offset);
+    } else {
+        section = memory_region_find(get_system_memory(), rom->addr, 1);
+        if (int128_nz(section.size) && memory_region_is_ram(section.mr)) {
+            block = qemu_ram_block_from_host(
+                memory_region_get_ram_ptr(section.mr) +
+                section.offset_within_region, false, &offset);
+        }
+        memory_region_unref(section.mr);
+    }
+    return block && qemu_ram_is_shared(block);
+}
+
 #if defined(CONFIG_GNU_MCU_ECLIPSE)
 void rom_reset(void *unused)
 #else
@@ -1077,6 +1109,9 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
+        if (rom_in_ignored_ram(rom)) {
+            continue;
+        }
         if (rom->mr) {
             void *host = memory_region_get_ram_ptr(rom->mr);
             memcpy(host, rom->data, rom->datasize);
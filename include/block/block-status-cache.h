@@ -0,0 +1,91 @@
+/*
+ * Block status cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef BLOCK_STATUS_CACHE_H
+#define BLOCK_STATUS_CACHE_H
+
+#include "qemu-common.h"
+
+/*
+ * Every node keeps the block status that its driver reported for ranges of
+ * its own layer (not including the backing chain), so that repeated queries
+ * of deep backing chains by block jobs and qemu-img do not go down to the
+ * image metadata each time.  The cache is filled by
+ * bdrv_co_get_block_status() and dropped for a range whenever that range is
+ * written or discarded; anything that may change the mapping of the whole
+ * image (truncation, graph changes, snapshots, ...) drops it completely.
+ */
+typedef struct BdrvBlockStatusCache {
+    GSequence *ranges;          /* BdrvBlockStatusRange, sorted by start */
+    unsigned graph_gen;         /* graph generation the ranges belong to */
+    unsigned gen;               /* incremented by every invalidation */
+    uint64_t hits;
+    uint64_t misses;
+} BdrvBlockStatusCache;
+
+/*
+ * bdrv_block_status_cache_lookup:
+ *
+ * Look up the status of @sector_num.  On a hit, returns true and fills in
+ * the status, *pnum (at most @nb_sectors) and *file like the driver's
+ * bdrv_co_get_block_status() would.
+ */
+bool bdrv_block_status_cache_lookup(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum,
+                                    BlockDriverState **file, int64_t *status);
+
+/*
+ * bdrv_block_status_cache_gen:
+ *
+ * Returns the current generation of the cache, to be passed to
+ * bdrv_block_status_cache_store() for a status queried afterwards.
+ */
+unsigned bdrv_block_status_cache_gen(BlockDriverState *bs);
+
+/*
+ * bdrv_block_status_cache_store:
+ *
+ * Remember that [@sector_num, @sector_num + @nb_sectors) has @status.
+ * @gen is the generation from before the status was queried; nothing is
+ * stored if anything was invalidated in the meantime, because the status
+ * may already be stale.
+ */
+void bdrv_block_status_cache_store(BlockDriverState *bs, unsigned gen,
+                                   int64_t sector_num, int nb_sectors,
+                                   BlockDriverState *file, int64_t status);
+
+/*
+ * bdrv_block_status_cache_invalidate:
+ *
+ * Drop the cached status of all sectors in the given range.
+ */
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int64_t nb_sectors);
+
+/*
+ * bdrv_block_status_cache_clear:
+ *
+ * Drop the whole cache of @bs.
+ */
+void bdrv_block_status_cache_clear(BlockDriverState *bs);
+
+/*
+ * bdrv_block_status_cache_graph_changed:
+ *
+ * Called whenever a child of any node is replaced.  Cached ranges point to
+ * child nodes, so all caches are dropped lazily.
+ */
+void bdrv_block_status_cache_graph_changed(void);
+
+/*
+ * bdrv_block_status_cache_free:
+ *
+ * Free the cache when @bs is deleted.
+ */
+void bdrv_block_status_cache_free(BlockDriverState *bs);
+
+#endif
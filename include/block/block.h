@@ -66,8 +66,13 @@ typedef enum {
     BDRV_REQ_FUA                = 0x10,
     BDRV_REQ_WRITE_COMPRESSED   = 0x20,
 
+    /* Only valid for write zeroes requests: fail with -ENOTSUP instead of
+     * falling back to writing a zeroed buffer if the driver cannot zero the
+     * range efficiently. */
+    BDRV_REQ_NO_FALLBACK        = 0x40,
+
     /* Mask of valid flags */
-    BDRV_REQ_MASK               = 0x3f,
+    BDRV_REQ_MASK               = 0x7f,
 } BdrvRequestFlags;
 
 typedef struct BlockSizes {
@@ -248,6 +253,18 @@ int coroutine_fn bdrv_co_writev(BdrvChild *child, int64_t sector_num,
  */
 int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                                        int count, BdrvRequestFlags flags);
+/*
+ * Copy a range of data from @src to @dst without passing it through a QEMU
+ * buffer, e.g. with copy_file_range() or a reflink.  Both offsets and
+ * @bytes must be aligned to the request alignment of the respective node.
+ *
+ * Returns -ENOTSUP if the nodes don't support offloading this copy; callers
+ * should then fall back to reading and writing the data themselves.  Only
+ * BDRV_REQ_NO_SERIALISING is supported in @flags.
+ */
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
+                                    BdrvChild *dst, int64_t dst_offset,
+                                    int bytes, BdrvRequestFlags flags);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
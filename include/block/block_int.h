@@ -35,6 +35,7 @@
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
+#include "block/block-status-cache.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
@@ -75,6 +76,17 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_offset;
     unsigned int overlap_bytes;
 
+    /* For write requests, the (aligned) range and data that is about to be
+     * written, valid while the before_write_notifiers and the
+     * after_write_notifiers run.  @write_qiov is NULL for zero writes.
+     * @write_ret is the result of the write, for the after_write_notifiers.
+     */
+    int64_t write_offset;
+    unsigned int write_bytes;
+    QEMUIOVector *write_qiov;
+    int write_flags;
+    int write_ret;
+
     QLIST_ENTRY(BdrvTrackedRequest) list;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
@@ -165,6 +177,26 @@ struct BlockDriver {
         int64_t offset, int count, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int count);
+
+    /*
+     * Offloaded copy of a range from @src to @dst.  The block layer calls
+     * .bdrv_co_copy_range_from() on the source node.  Drivers either pass
+     * the request on to one of their children with bdrv_co_copy_range_from()
+     * or, once the data is reached, hand it over to the destination with
+     * bdrv_co_copy_range_to(), which calls .bdrv_co_copy_range_to() on the
+     * destination node in the same way.
+     *
+     * These function pointers may be NULL or return -ENOTSUP, in which case
+     * the caller falls back to a buffered copy.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, int64_t src_offset,
+        BdrvChild *dst, int64_t dst_offset,
+        int bytes, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, int64_t src_offset,
+        BdrvChild *dst, int64_t dst_offset,
+        int bytes, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -320,6 +352,28 @@ struct BlockDriver {
     void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
                            Error **errp);
 
+    /**
+     * Write the persistent dirty bitmaps of @bs back to the image. Called
+     * before the image is closed or inactivated, while the in-memory bitmaps
+     * still exist.
+     */
+    void (*bdrv_store_persistent_dirty_bitmaps)(BlockDriverState *bs,
+                                                Error **errp);
+    /**
+     * Check whether a new persistent bitmap with the given @name and
+     * @granularity can be stored in the image.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+    /**
+     * Called after @bs has been reopened read-write, once all nodes in the
+     * reopen queue have been committed, to mark the persistent dirty bitmaps
+     * as in use again.
+     */
+    void (*bdrv_reopen_bitmaps_rw)(BlockDriverState *bs, Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -471,6 +525,13 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after the data of a write request reached the driver */
+    NotifierWithReturnList after_write_notifiers;
+
+    /* If non-zero, writes and discards are made serialising with this
+     * alignment before they wait for overlapping requests */
+    uint64_t serialise_writes_align;
+
     /* number of in-flight requests; overall and serialising */
     unsigned int in_flight;
     unsigned int serialising_in_flight;
@@ -522,6 +583,9 @@ struct BlockDriverState {
     /* The error object in use for blocking operations on backing_hd */
     Error *backing_blocker;
 
+    /* block status of this layer, see block/block-status-cache.c */
+    BdrvBlockStatusCache block_status_cache;
+
     /* threshold limit for writes, in bytes. "High water mark". */
     uint64_t write_threshold_offset;
     NotifierWithReturn write_threshold_notifier;
@@ -571,6 +635,12 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
 int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
+                                         BdrvChild *dst, int64_t dst_offset,
+                                         int bytes, BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, int64_t src_offset,
+                                       BdrvChild *dst, int64_t dst_offset,
+                                       int bytes, BdrvRequestFlags flags);
 
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
@@ -586,6 +656,16 @@ BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_add_after_write_notifier:
+ *
+ * Register a callback that is invoked once a write request has been
+ * processed by the driver, while the request is still tracked.  The result
+ * of the write is in the write_ret field of the request.
+ */
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -654,6 +734,9 @@ void bdrv_wakeup(BlockDriverState *bs);
 int is_windows_drive(const char *filename);
 #endif
 
+/* Upper limit for the number of parallel requests of stream and commit jobs */
+#define BLOCK_JOB_MAX_WORKERS 64
+
 /**
  * stream_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -664,6 +747,7 @@ int is_windows_drive(const char *filename);
  * @backing_file_str: The file name that will be written to @bs as the
  * the new backing file if the job completes. Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_workers: The maximum number of chunks copied in parallel.
  * @on_error: The action to take upon error.
  * @errp: Error object.
  *
@@ -676,7 +760,8 @@ int is_windows_drive(const char *filename);
  */
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
-                  int64_t speed, BlockdevOnError on_error, Error **errp);
+                  int64_t speed, int max_workers, BlockdevOnError on_error,
+                  Error **errp);
 
 /**
  * commit_start:
@@ -686,6 +771,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  * @top: Top block device to be committed.
  * @base: Block device that will be written into, and become the new top.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_workers: The maximum number of chunks copied in parallel.
  * @on_error: The action to take upon error.
  * @backing_file_str: String to use as the backing file in @top's overlay
  * @errp: Error object.
@@ -693,8 +779,8 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  */
 void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top, int64_t speed,
-                  BlockdevOnError on_error, const char *backing_file_str,
-                  Error **errp);
+                  int max_workers, BlockdevOnError on_error,
+                  const char *backing_file_str, Error **errp);
 /**
  * commit_active_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -732,6 +818,7 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
+ * @copy_mode: When to write data to @target.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -745,7 +832,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap, Error **errp);
+                  bool unmap, MirrorCopyMode copy_mode, Error **errp);
 
 /*
  * backup_job_create:
@@ -798,6 +885,10 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int64_t nr_sect);
 bool bdrv_requests_pending(BlockDriverState *bs);
 
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
+void bdrv_set_disabled_dirty_bitmap(BdrvDirtyBitmap *bitmap,
+                                    int64_t cur_sector, int64_t nr_sectors);
+void bdrv_reset_disabled_dirty_bitmap(BdrvDirtyBitmap *bitmap,
+                                      int64_t cur_sector, int64_t nr_sectors);
 void bdrv_undo_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *in);
 
 void bdrv_inc_in_flight(BlockDriverState *bs);
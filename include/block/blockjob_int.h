@@ -111,6 +111,12 @@ struct BlockJobDriver {
      * as required to ensure progress.
      */
     void (*drain)(BlockJob *job);
+
+    /*
+     * If the callback is not NULL, it will be invoked by block_job_query()
+     * to fill in job type specific fields of @info.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 };
 
 /**
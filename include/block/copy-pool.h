@@ -0,0 +1,110 @@
+/*
+ * Bounded pool of background copy requests for block jobs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef BLOCK_COPY_POOL_H
+#define BLOCK_COPY_POOL_H
+
+#include "qemu/queue.h"
+#include "qemu/coroutine.h"
+#include "block/blockjob.h"
+
+/*
+ * Copies one chunk of [@sector_num, @sector_num + @nb_sectors) using @buf,
+ * which is large enough for the chunk.  Returns 0 or a negative errno.
+ */
+typedef int coroutine_fn CopyPoolFunc(void *opaque, int64_t sector_num,
+                                      int nb_sectors, void *buf);
+
+/*
+ * Applies the job's error action to a failed chunk.  Returns true if the
+ * job must be stopped, which stores the error in *error.  Otherwise *retry
+ * tells whether the chunk is to be copied again or skipped.
+ */
+typedef bool CopyPoolErrorFunc(void *opaque, int ret, int *error,
+                               bool *retry);
+
+typedef struct CopyPool CopyPool;
+
+typedef struct CopyPoolOp {
+    CopyPool *pool;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+    int ret;
+    bool retry;                 /* failed, resubmit when the job resumes */
+    QTAILQ_ENTRY(CopyPoolOp) next;
+} CopyPoolOp;
+
+/*
+ * Lets a block job copy up to @max_workers chunks in background coroutines
+ * while its own coroutine looks for the next chunk.  Completed chunks are
+ * accounted in the job's offset.  All functions must be called from the
+ * job coroutine.
+ */
+struct CopyPool {
+    BlockJob *job;
+    BlockBackend *blk;          /* for the alignment of the buffers */
+    size_t buf_size;
+    CopyPoolFunc *copy;
+    void *opaque;
+
+    int max_workers;
+    int in_flight;
+    int64_t bytes_in_flight;
+    bool waiting_for_io;
+    QTAILQ_HEAD(, CopyPoolOp) failed_ops;
+    QTAILQ_HEAD(, CopyPoolOp) free_ops;
+};
+
+void copy_pool_init(CopyPool *pool, BlockJob *job, BlockBackend *blk,
+                    size_t buf_size, int max_workers,
+                    CopyPoolFunc *copy, void *opaque);
+
+/*
+ * copy_pool_submit:
+ *
+ * Start copying [@sector_num, @sector_num + @nb_sectors) in the background.
+ * The caller must make sure that the pool is not full.
+ */
+void copy_pool_submit(CopyPool *pool, int64_t sector_num, int nb_sectors);
+
+/*
+ * copy_pool_wait:
+ *
+ * Yield until one of the requests in flight completes.
+ */
+void coroutine_fn copy_pool_wait(CopyPool *pool);
+
+/*
+ * copy_pool_process_failed:
+ *
+ * Run @handle_error on the chunks that failed in the background and
+ * resubmit the ones to be retried, as far as the pool has room for them.
+ * Chunks that fail for the first time are resubmitted only on the next
+ * call, so that the job passes its pause point first.  Returns true if the
+ * job must be stopped.
+ */
+bool copy_pool_process_failed(CopyPool *pool, CopyPoolErrorFunc *handle_error,
+                              int *error);
+
+/*
+ * copy_pool_finish:
+ *
+ * Wait for all requests in flight and free the buffers.
+ */
+void coroutine_fn copy_pool_finish(CopyPool *pool);
+
+static inline bool copy_pool_is_full(CopyPool *pool)
+{
+    return pool->in_flight >= pool->max_workers;
+}
+
+static inline bool copy_pool_has_failed(CopyPool *pool)
+{
+    return !QTAILQ_EMPTY(&pool->failed_ops);
+}
+
+#endif
@@ -60,9 +60,30 @@ typedef struct NBDRequest NBDRequest;
 struct NBDReply {
     uint64_t handle;
     uint32_t error;
+    bool structured; /* Header of a structured reply chunk */
+    uint16_t flags; /* NBD_REPLY_FLAG_*, structured replies only */
+    uint16_t type; /* NBD_REPLY_TYPE_*, structured replies only */
+    uint32_t length; /* Payload length, structured replies only */
 };
 typedef struct NBDReply NBDReply;
 
+/* A block status descriptor of the "base:allocation" context */
+struct NBDExtent {
+    uint32_t length;
+    uint32_t flags; /* NBD_STATE_* */
+};
+typedef struct NBDExtent NBDExtent;
+
+/* Features negotiated by nbd_receive_negotiate().  The caller sets the
+ * fields to the features it would like to use, and they are cleared if
+ * the server does not support them. */
+struct NBDExportInfo {
+    bool structured_reply;
+    bool base_allocation;
+    uint32_t meta_base_allocation_id;
+};
+typedef struct NBDExportInfo NBDExportInfo;
+
 /* Transmission (export) flags: sent from server to client during handshake,
    but describe what will happen during transmission */
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
@@ -72,6 +93,8 @@ typedef struct NBDReply NBDReply;
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
 #define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)     /* Send WRITE_ZEROES */
+#define NBD_FLAG_SEND_DF        (1 << 7)        /* Send DF (Do not Fragment) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multi-client cache consistent */
 
 /* New-style handshake (global) flags, sent from server to client, and
    control what will happen during handshake phase. */
@@ -88,17 +111,21 @@ typedef struct NBDReply NBDReply;
 
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Metadata context. */
 
 #define NBD_REP_ERR_UNSUP       NBD_REP_ERR(1)  /* Unknown option */
 #define NBD_REP_ERR_POLICY      NBD_REP_ERR(2)  /* Server denied */
 #define NBD_REP_ERR_INVALID     NBD_REP_ERR(3)  /* Invalid length */
 #define NBD_REP_ERR_PLATFORM    NBD_REP_ERR(4)  /* Not compiled in */
 #define NBD_REP_ERR_TLS_REQD    NBD_REP_ERR(5)  /* TLS required */
+#define NBD_REP_ERR_UNKNOWN     NBD_REP_ERR(6)  /* Export unknown */
 #define NBD_REP_ERR_SHUTDOWN    NBD_REP_ERR(7)  /* Server shutting down */
 
 /* Request flags, sent from client to server during transmission phase */
 #define NBD_CMD_FLAG_FUA        (1 << 0) /* 'force unit access' during write */
 #define NBD_CMD_FLAG_NO_HOLE    (1 << 1) /* don't punch hole on zero run */
+#define NBD_CMD_FLAG_DF         (1 << 2) /* don't fragment structured read */
+#define NBD_CMD_FLAG_REQ_ONE    (1 << 3) /* only one extent in block status */
 
 /* Supported request types */
 enum {
@@ -109,8 +136,26 @@ enum {
     NBD_CMD_TRIM = 4,
     /* 5 reserved for failed experiment NBD_CMD_CACHE */
     NBD_CMD_WRITE_ZEROES = 6,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Structured reply flags */
+#define NBD_REPLY_FLAG_DONE     (1 << 0) /* This is the last chunk */
+
+/* Structured reply types */
+#define NBD_REPLY_ERR(value)    ((1 << 15) | (value))
+
+#define NBD_REPLY_TYPE_NONE          0
+#define NBD_REPLY_TYPE_OFFSET_DATA   1
+#define NBD_REPLY_TYPE_OFFSET_HOLE   2
+#define NBD_REPLY_TYPE_BLOCK_STATUS  5
+#define NBD_REPLY_TYPE_ERROR         NBD_REPLY_ERR(1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET  NBD_REPLY_ERR(2)
+
+/* Flags of block status descriptors in the "base:allocation" context */
+#define NBD_STATE_HOLE          (1 << 0) /* unallocated */
+#define NBD_STATE_ZERO          (1 << 1) /* reads as zeroes */
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -131,10 +176,11 @@ ssize_t nbd_wr_syncv(QIOChannel *ioc,
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp);
+                          off_t *size, NBDExportInfo *info, Error **errp);
 int nbd_init(int fd, QIOChannelSocket *sioc, uint16_t flags, off_t size);
 ssize_t nbd_send_request(QIOChannel *ioc, NBDRequest *request);
 ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply);
+int nbd_errno_to_system_errno(int err);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -36,6 +36,11 @@ void throttle_group_unref(ThrottleState *ts);
 void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg);
 
+void throttle_group_set_share(BlockBackend *blk, unsigned weight,
+                              unsigned reservation);
+void throttle_group_get_stats(BlockBackend *blk,
+                              BlockDeviceThrottleStats *stats);
+
 void throttle_group_register_blk(BlockBackend *blk, const char *groupname);
 void throttle_group_unregister_blk(BlockBackend *blk);
 void throttle_group_restart_blk(BlockBackend *blk);
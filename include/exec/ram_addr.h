@@ -37,6 +37,10 @@ struct RAMBlock {
     QLIST_ENTRY(RAMBlock) next;
     int fd;
     size_t page_size;
+    /* Pages saved to a mapped-ram migration file, and where they are */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -420,8 +424,11 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
             if (src[idx][offset]) {
                 unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
+
+                /* Migration merges without the iothread lock, so make sure
+                 * that no concurrent update of the word is lost
+                 */
+                new_dirty = ~atomic_fetch_or(&dest[k], bits);
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
             }
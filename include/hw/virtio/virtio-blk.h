@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -81,5 +82,7 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+VirtIOBlockReq *virtio_blk_get_requests(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_handle_requests(VirtIOBlock *s, VirtIOBlockReq *reqs);
 
 #endif
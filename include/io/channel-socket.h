@@ -48,6 +48,10 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    bool zero_copy;          /* send with MSG_ZEROCOPY */
+    bool zero_copy_enabled;  /* SO_ZEROCOPY was set on the socket */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
@@ -248,4 +252,48 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_set_zero_copy:
+ * @ioc: the socket channel object
+ * @enabled: whether writes should avoid copying their data
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * While zero copy is enabled, writes to the channel pass
+ * MSG_ZEROCOPY to sendmsg(), so that the kernel transmits
+ * straight from the caller's pages.  The caller must not
+ * modify or free the written buffers until
+ * qio_channel_socket_poll_zero_copy() reports that the
+ * kernel is done with them: every successful write made
+ * in this mode increments @ioc->zero_copy_queued, and the
+ * buffers of a write may be reused once the count of
+ * completed writes has caught up with the value of
+ * @ioc->zero_copy_queued after that write.
+ *
+ * Returns: 0 on success, -1 if zero copy is not supported
+ * by the host or by the socket
+ */
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 bool enabled,
+                                 Error **errp);
+
+/**
+ * qio_channel_socket_poll_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Collect the completion notifications that the kernel
+ * queued on the socket's error queue for writes made in
+ * zero copy mode.  This never blocks.  A connected socket
+ * polls with POLLERR while notifications are queued; once
+ * it has been shut down it reports POLLHUP instead, and
+ * the caller has to check again later.  The kernel may keep
+ * reading the buffers for as long as the peer does not
+ * acknowledge the data, so the socket must stay open until
+ * all the writes have completed.
+ *
+ * Returns: the number of zero copy writes completed so far
+ */
+uint64_t
+qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc);
+
 #endif /* QIO_CHANNEL_SOCKET_H */
@@ -0,0 +1,82 @@
+/*
+ * Page compression methods for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/*
+ * zlib compresses every page on its own, so that any decompression thread
+ * can handle any page.  The other methods are streaming: each compressor
+ * keeps the pages it has already emitted as a dictionary for the next ones,
+ * and the pages of one stream must be decompressed in the order they were
+ * compressed, by a single decompressor.
+ */
+typedef struct MigrationDecompressor MigrationDecompressor;
+
+/**
+ * migration_compress_method_supported: Check whether a method is built in
+ */
+bool migration_compress_method_supported(MigrationCompressMethod method);
+
+/**
+ * migration_compress_is_streaming: Check whether compressors for @method
+ * keep state from one page to the next
+ */
+bool migration_compress_is_streaming(MigrationCompressMethod method);
+
+/**
+ * migration_compress_bound: Returns the largest compressed size that a page
+ * of @size bytes can have with @method
+ */
+size_t migration_compress_bound(MigrationCompressMethod method, size_t size);
+
+/**
+ * migration_compressor_new: Create a compressor
+ *
+ * @method: a method for which migration_compress_method_supported() is true
+ * @level: compression level, 0 to 9
+ * @page_size: the size of the pages that will be compressed
+ */
+MigrationCompressor *migration_compressor_new(MigrationCompressMethod method,
+                                              int level, size_t page_size);
+void migration_compressor_free(MigrationCompressor *c);
+MigrationCompressMethod migration_compressor_method(MigrationCompressor *c);
+
+/**
+ * migration_compress_page: Compress one page into @dst
+ *
+ * @src may be modified concurrently (e.g. by a running guest); what is
+ * emitted is always consistent for the decompressor.
+ *
+ * Returns the compressed size, or -1 if @dst_len is too small or the
+ * library failed.  A streaming compressor cannot be used again after a
+ * failure.
+ */
+ssize_t migration_compress_page(MigrationCompressor *c, const uint8_t *src,
+                                size_t size, uint8_t *dst, size_t dst_len);
+
+/**
+ * migration_decompressor_new: Create a decompressor for pages of @page_size
+ */
+MigrationDecompressor *migration_decompressor_new(MigrationCompressMethod
+                                                  method, size_t page_size);
+void migration_decompressor_free(MigrationDecompressor *d);
+
+/**
+ * migration_decompress_page: Decompress @len bytes from @src into the
+ * @size bytes at @dst
+ *
+ * Returns 0 on success, -1 if the data is corrupt or does not decompress
+ * to exactly @size bytes.
+ */
+int migration_decompress_page(MigrationDecompressor *d, const uint8_t *src,
+                              size_t len, uint8_t *dst, size_t size);
+
+#endif
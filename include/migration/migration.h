@@ -200,6 +200,8 @@ void migration_tls_channel_process_incoming(MigrationState *s,
                                             QIOChannel *ioc,
                                             Error **errp);
 
+bool migration_has_all_channels(void);
+
 void migration_channel_connect(MigrationState *s,
                                QIOChannel *ioc,
                                const char *hostname);
@@ -223,10 +225,38 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+QIOChannel *socket_send_channel_create(Error **errp);
+
+void socket_cleanup_outgoing_migration(void);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
+/**
+ * file_channel_create: Open the file of the running file: migration again
+ *
+ * The channel is read-only on the destination and write-only on the
+ * source; @direct asks for O_DIRECT.
+ */
+QIOChannel *file_channel_create(bool direct, Error **errp);
+
+void file_cleanup_migration(void);
+
+/*
+ * Read or write exactly @len bytes at @offset of a channel opened by
+ * file_channel_create() or by the file: migration itself.
+ */
+int file_pwrite_all(QIOChannel *ioc, const uint8_t *buf, size_t len,
+                    off_t offset, Error **errp);
+int file_pread_all(QIOChannel *ioc, uint8_t *buf, size_t len, off_t offset,
+                   Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -251,7 +281,19 @@ MigrationState *migrate_get_current(void);
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
+void migrate_decompress_set_method(MigrationCompressMethod method);
 void migrate_decompress_threads_join(void);
+int multifd_save_setup(Error **errp);
+void multifd_save_cleanup(void);
+void multifd_load_setup(void);
+void multifd_load_cleanup(void);
+bool multifd_recv_all_channels_created(void);
+void multifd_recv_new_channel(QIOChannel *ioc);
+int postcopy_preempt_setup(Error **errp);
+void postcopy_preempt_save_cleanup(void);
+bool postcopy_preempt_channel_created(void);
+void postcopy_preempt_new_channel(QIOChannel *ioc);
+void postcopy_preempt_load_cleanup(bool failed);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -265,11 +307,15 @@ uint64_t skipped_mig_bytes_transferred(void);
 uint64_t skipped_mig_pages_transferred(void);
 uint64_t norm_mig_bytes_transferred(void);
 uint64_t norm_mig_pages_transferred(void);
+intList *multifd_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+double xbzrle_mig_cache_hit_rate(void);
+uint64_t xbzrle_mig_cache_evictions(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -296,12 +342,17 @@ void migrate_del_blocker(Error *reason);
 
 bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
+bool migrate_dirty_bitmaps(void);
 
 bool migrate_auto_converge(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/* Select the next accelerated implementation of xbzrle_encode_buffer,
+ * returns false when all have been used.  Only for tests.
+ */
+bool test_xbzrle_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -311,8 +362,16 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
+bool migrate_mapped_ram(void);
+bool migrate_direct_io(void);
+bool migrate_ignore_shared(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -27,8 +27,11 @@ typedef struct PageCache PageCache;
  * @cache pointer to the PageCache struct
  * @num_pages: cache maximal number of cached pages
  * @page_size: cache page size
+ * @ways: number of pages that share the same hash (rounded down to a
+ *        power of 2)
  */
-PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+PageCache *cache_init(int64_t num_pages, unsigned int page_size,
+                      unsigned int ways);
 
 /**
  * cache_fini: free all cache resources
@@ -72,6 +75,14 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_get_evictions: Returns the number of cached pages that were
+ * replaced by another page
+ *
+ * @cache pointer to the PageCache struct
+ */
+uint64_t cache_get_evictions(const PageCache *cache);
+
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
@@ -96,4 +96,20 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Returns how long the guest waited for the pages it faulted on during the
+ * last incoming postcopy, or NULL if there was none
+ */
+PostcopyFaultLatency *postcopy_fault_latency_get(void);
+
+/*
+ * Write tracking of RAM for background snapshots, on the source
+ */
+bool ram_write_tracking_supported(void);
+int ram_write_tracking_start(void);
+void ram_write_tracking_stop(void);
+/* Host address of a write that waits for the protection to be removed */
+void *ram_write_tracking_get_fault(void);
+int ram_write_tracking_release(void *host, size_t length);
+
 #endif
@@ -76,6 +76,17 @@ typedef struct BlockBackendPublic {
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
     QLIST_ENTRY(BlockBackendPublic) round_robin;
+
+    /* Weighted fair-share scheduling, also protected by the ThrottleGroup
+     * lock.  weight and reservation are 0 if they have not been set. */
+    unsigned       throttle_weight;
+    unsigned       throttle_reservation;
+    uint64_t       throttle_vtime[2];
+    int64_t        throttle_rtag[2];
+
+    /* Requests that had to wait, and for how long in total */
+    uint64_t       throttle_waited[2];
+    uint64_t       throttle_wait_ns[2];
 } BlockBackendPublic;
 
 BlockBackend *blk_new(void);
@@ -128,6 +139,12 @@ BlockAIOCB *blk_aio_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                                   int count, BdrvRequestFlags flags,
                                   BlockCompletionFunc *cb, void *opaque);
 int blk_make_zero(BlockBackend *blk, BdrvRequestFlags flags);
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags);
+int blk_copy_range(BlockBackend *blk_in, int64_t off_in,
+                   BlockBackend *blk_out, int64_t off_out,
+                   int bytes, BdrvRequestFlags flags);
 int blk_pread(BlockBackend *blk, int64_t offset, void *buf, int count);
 int blk_pwrite(BlockBackend *blk, int64_t offset, const void *buf, int count,
                BdrvRequestFlags flags);
@@ -25,6 +25,10 @@
 #include "trace.h"
 #include "qapi/clone-visitor.h"
 
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
 #define SOCKET_MAX_FDS 16
 
 SocketAddress *
@@ -387,6 +391,84 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
     return NULL;
 }
 
+
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 bool enabled,
+                                 Error **errp)
+{
+#ifdef CONFIG_MSG_ZEROCOPY
+    if (enabled && !ioc->zero_copy_enabled) {
+        int v = 1;
+
+        if (qemu_setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY,
+                            &v, sizeof(v)) < 0) {
+            error_setg_errno(errp, errno,
+                             "Unable to enable zero copy on socket");
+            return -1;
+        }
+        ioc->zero_copy_enabled = true;
+    }
+    ioc->zero_copy = enabled;
+    return 0;
+#else
+    if (enabled) {
+        error_setg(errp, "Zero copy is not supported by this host");
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+
+uint64_t
+qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc)
+{
+#ifdef CONFIG_MSG_ZEROCOPY
+    while (ioc->zero_copy_sent < ioc->zero_copy_queued) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = { NULL, };
+        struct cmsghdr *cmsg;
+        struct sock_extended_err *serr;
+        ssize_t ret;
+
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(ioc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* EAGAIN: nothing else has completed yet */
+            break;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg) {
+            break;
+        }
+        if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+              (cmsg->cmsg_level == SOL_IPV6 &&
+               cmsg->cmsg_type == IPV6_RECVERR))) {
+            continue;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        if (serr->ee_errno != 0 ||
+            serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            continue;
+        }
+
+        /* ee_info..ee_data is the range of sendmsg() calls completed */
+        ioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+        trace_qio_channel_socket_zero_copy_complete(ioc, serr->ee_info,
+                                                    serr->ee_data);
+    }
+#endif
+    return ioc->zero_copy_sent;
+}
+
+
 static void qio_channel_socket_init(Object *obj)
 {
     QIOChannelSocket *ioc = QIO_CHANNEL_SOCKET(obj);
@@ -550,7 +632,23 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
 
  retry:
+#ifdef CONFIG_MSG_ZEROCOPY
+    if (sioc->zero_copy) {
+        ret = sendmsg(sioc->fd, &msg, MSG_ZEROCOPY);
+        if (ret > 0) {
+            sioc->zero_copy_queued++;
+            return ret;
+        }
+        /* The kernel is short of memory to pin the pages; copy instead */
+        if (ret < 0 && errno == ENOBUFS) {
+            ret = sendmsg(sioc->fd, &msg, 0);
+        }
+    } else {
+        ret = sendmsg(sioc->fd, &msg, 0);
+    }
+#else
     ret = sendmsg(sioc->fd, &msg, 0);
+#endif
     if (ret <= 0) {
         if (errno == EAGAIN) {
             return QIO_CHANNEL_ERR_BLOCK;
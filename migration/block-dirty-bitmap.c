@@ -0,0 +1,704 @@
+/*
+ * Block dirty bitmap migration
+ *
+ * Named dirty bitmaps are sent as a separate live section.  All bitmaps
+ * are announced in the setup stage, so that the destination creates them
+ * and starts tracking writes before the guest runs there.  The bitmap
+ * data itself only becomes stable once the source is stopped, so it is
+ * sent either within the downtime (precopy) or lazily while the
+ * destination is already running (postcopy).  Until a bitmap is
+ * completed, the destination keeps it frozen and accumulates new writes
+ * in its successor, which is merged back once all data has arrived.
+ *
+ * Format of a chunk:
+ *
+ *   byte flags
+ *   [ byte len + node name ]           if DEVICE_NAME
+ *   [ byte len + bitmap name ]         if BITMAP_NAME
+ *   [ be32 granularity, byte flags ]   if START
+ *   [ be64 start sector, be32 nr_sectors,
+ *     [ be64 buffer size, buffer ]     if BITS and not ZEROES
+ *   ]                                  if BITS
+ *
+ * The node and bitmap names are only sent when they differ from those of
+ * the previous chunk.  Every section ends with an EOS chunk.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "block/block.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "hw/hw.h"
+#include "qemu/cutils.h"
+#include "qemu/queue.h"
+#include "migration/block.h"
+#include "migration/migration.h"
+
+/* Amount of serialized bitmap data sent per chunk */
+#define CHUNK_SIZE     (1 << 10)
+
+#define DIRTY_BITMAP_MIG_FLAG_EOS           0x01
+#define DIRTY_BITMAP_MIG_FLAG_ZEROES        0x02
+#define DIRTY_BITMAP_MIG_FLAG_BITMAP_NAME   0x04
+#define DIRTY_BITMAP_MIG_FLAG_DEVICE_NAME   0x08
+#define DIRTY_BITMAP_MIG_FLAG_START         0x10
+#define DIRTY_BITMAP_MIG_FLAG_COMPLETE      0x20
+#define DIRTY_BITMAP_MIG_FLAG_BITS          0x40
+
+#define DIRTY_BITMAP_MIG_KNOWN_FLAGS        0x7f
+
+#define DIRTY_BITMAP_MIG_START_FLAG_ENABLED     0x01
+#define DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT  0x02
+
+#define DIRTY_BITMAP_MIG_START_KNOWN_FLAGS      0x03
+
+//#define DEBUG_DIRTY_BITMAP_MIGRATION
+
+#ifdef DEBUG_DIRTY_BITMAP_MIGRATION
+#define DPRINTF(fmt, ...) \
+    do { printf("dirty_bitmap_migration: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+typedef struct DirtyBitmapMigBitmapState {
+    /* Written during setup phase.  */
+    BlockDriverState *bs;
+    char *node_name;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t total_sectors;
+    uint64_t sectors_per_chunk;
+    QSIMPLEQ_ENTRY(DirtyBitmapMigBitmapState) entry;
+
+    /* Only used by migration thread.  */
+    bool bulk_completed;
+    uint64_t cur_sector;
+} DirtyBitmapMigBitmapState;
+
+typedef struct DirtyBitmapMigState {
+    QSIMPLEQ_HEAD(dbms_list, DirtyBitmapMigBitmapState) dbms_list;
+
+    /* Only used by migration thread.  */
+    bool bulk_completed;
+
+    /* Names sent with the previous chunk */
+    BlockDriverState *prev_bs;
+    BdrvDirtyBitmap *prev_bitmap;
+} DirtyBitmapMigState;
+
+typedef struct DirtyBitmapLoadState {
+    uint32_t flags;
+    char node_name[256];
+    char bitmap_name[256];
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+} DirtyBitmapLoadState;
+
+static DirtyBitmapMigState dirty_bitmap_mig_state;
+
+/* Names persist across sections, just like on the source side */
+static DirtyBitmapLoadState dirty_bitmap_load_state;
+
+static void put_name(QEMUFile *f, const char *name)
+{
+    int len = strlen(name);
+
+    assert(len < 256);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (const uint8_t *)name, len);
+}
+
+static int get_name(QEMUFile *f, char *name)
+{
+    int len = qemu_get_byte(f);
+
+    if (qemu_get_buffer(f, (uint8_t *)name, len) != len) {
+        return -EIO;
+    }
+    name[len] = '\0';
+    return 0;
+}
+
+static void send_bitmap_header(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
+                               uint32_t flags)
+{
+    BlockDriverState *bs = dbms->bs;
+    BdrvDirtyBitmap *bitmap = dbms->bitmap;
+
+    if (bs != dirty_bitmap_mig_state.prev_bs) {
+        dirty_bitmap_mig_state.prev_bs = bs;
+        flags |= DIRTY_BITMAP_MIG_FLAG_DEVICE_NAME;
+    }
+
+    if (bitmap != dirty_bitmap_mig_state.prev_bitmap) {
+        dirty_bitmap_mig_state.prev_bitmap = bitmap;
+        flags |= DIRTY_BITMAP_MIG_FLAG_BITMAP_NAME;
+    }
+
+    qemu_put_byte(f, flags);
+
+    if (flags & DIRTY_BITMAP_MIG_FLAG_DEVICE_NAME) {
+        put_name(f, dbms->node_name);
+    }
+
+    if (flags & DIRTY_BITMAP_MIG_FLAG_BITMAP_NAME) {
+        put_name(f, bdrv_dirty_bitmap_name(bitmap));
+    }
+}
+
+static void send_bitmap_start(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
+{
+    uint8_t flags = 0;
+
+    if (bdrv_dirty_bitmap_enabled(dbms->bitmap)) {
+        flags |= DIRTY_BITMAP_MIG_START_FLAG_ENABLED;
+    }
+    if (bdrv_dirty_bitmap_get_persistance(dbms->bitmap)) {
+        flags |= DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT;
+    }
+
+    send_bitmap_header(f, dbms, DIRTY_BITMAP_MIG_FLAG_START);
+    qemu_put_be32(f, bdrv_dirty_bitmap_granularity(dbms->bitmap));
+    qemu_put_byte(f, flags);
+}
+
+static void send_bitmap_complete(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
+{
+    send_bitmap_header(f, dbms, DIRTY_BITMAP_MIG_FLAG_COMPLETE);
+}
+
+/* Called with iothread lock taken.  */
+
+static void send_bitmap_bits(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
+                             uint64_t start_sector, uint32_t nr_sectors)
+{
+    AioContext *aio_context = bdrv_get_aio_context(dbms->bs);
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS;
+    uint64_t buf_size;
+    uint8_t *buf;
+
+    /* Pad to 64 bits so that 32-bit and 64-bit hosts agree on the size */
+    buf_size = bdrv_dirty_bitmap_serialization_size(dbms->bitmap,
+                                                    start_sector, nr_sectors);
+    buf_size = QEMU_ALIGN_UP(buf_size, sizeof(uint64_t));
+    buf = g_malloc0(buf_size);
+
+    aio_context_acquire(aio_context);
+    bdrv_dirty_bitmap_serialize_part(dbms->bitmap, buf,
+                                     start_sector, nr_sectors);
+    aio_context_release(aio_context);
+
+    if (buffer_is_zero(buf, buf_size)) {
+        flags |= DIRTY_BITMAP_MIG_FLAG_ZEROES;
+    }
+
+    send_bitmap_header(f, dbms, flags);
+
+    qemu_put_be64(f, start_sector);
+    qemu_put_be32(f, nr_sectors);
+
+    if (!(flags & DIRTY_BITMAP_MIG_FLAG_ZEROES)) {
+        qemu_put_be64(f, buf_size);
+        qemu_put_buffer(f, buf, buf_size);
+    }
+
+    g_free(buf);
+}
+
+/* Called with iothread lock taken.  */
+
+static void dirty_bitmap_mig_cleanup(void *opaque)
+{
+    DirtyBitmapMigBitmapState *dbms;
+
+    while ((dbms = QSIMPLEQ_FIRST(&dirty_bitmap_mig_state.dbms_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&dirty_bitmap_mig_state.dbms_list, entry);
+        bdrv_dirty_bitmap_set_qmp_locked(dbms->bitmap, false);
+        bdrv_unref(dbms->bs);
+        g_free(dbms->node_name);
+        g_free(dbms);
+    }
+
+    dirty_bitmap_mig_state.prev_bs = NULL;
+    dirty_bitmap_mig_state.prev_bitmap = NULL;
+}
+
+/* Called with iothread lock taken.  */
+
+static int init_dirty_bitmap_migration(void)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    DirtyBitmapMigBitmapState *dbms;
+    BdrvNextIterator it;
+
+    dirty_bitmap_mig_state.bulk_completed = false;
+    dirty_bitmap_mig_state.prev_bs = NULL;
+    dirty_bitmap_mig_state.prev_bitmap = NULL;
+
+    for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
+        const char *name = bdrv_get_device_or_node_name(bs);
+
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+        {
+            if (!bdrv_dirty_bitmap_name(bitmap)) {
+                continue;
+            }
+
+            if (!name || strcmp(name, "") == 0) {
+                error_report("Found bitmap '%s' in unnamed node %p. It can't "
+                             "be migrated", bdrv_dirty_bitmap_name(bitmap),
+                             bs);
+                goto fail;
+            }
+
+            if (strlen(name) > 255 ||
+                strlen(bdrv_dirty_bitmap_name(bitmap)) > 255) {
+                error_report("Name of node '%s' or of its bitmap '%s' is too "
+                             "long to be migrated", name,
+                             bdrv_dirty_bitmap_name(bitmap));
+                goto fail;
+            }
+
+            if (bdrv_dirty_bitmap_frozen(bitmap) ||
+                bdrv_dirty_bitmap_qmp_locked(bitmap)) {
+                error_report("Can't migrate bitmap '%s' of node '%s' while it "
+                             "is in use by another operation",
+                             bdrv_dirty_bitmap_name(bitmap), name);
+                goto fail;
+            }
+
+            bdrv_ref(bs);
+            bdrv_dirty_bitmap_set_qmp_locked(bitmap, true);
+
+            dbms = g_new0(DirtyBitmapMigBitmapState, 1);
+            dbms->bs = bs;
+            dbms->node_name = g_strdup(name);
+            dbms->bitmap = bitmap;
+            dbms->total_sectors = bdrv_nb_sectors(bs);
+            dbms->sectors_per_chunk = CHUNK_SIZE * 8 *
+                (bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS);
+
+            QSIMPLEQ_INSERT_TAIL(&dirty_bitmap_mig_state.dbms_list,
+                                 dbms, entry);
+        }
+    }
+
+    return 0;
+
+fail:
+    dirty_bitmap_mig_cleanup(NULL);
+    return -1;
+}
+
+/* Called with iothread lock taken.  */
+
+static void bulk_phase_send_chunk(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
+{
+    uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                              dbms->sectors_per_chunk);
+
+    send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+
+    dbms->cur_sector += nr_sectors;
+    if (dbms->cur_sector >= dbms->total_sectors) {
+        dbms->bulk_completed = true;
+    }
+}
+
+/* Sends the data of all bitmaps, stopping early if @limit is set and the
+ * rate limit is hit.  Takes the iothread lock for every chunk unless the
+ * caller already holds it.
+ */
+
+static void bulk_phase(QEMUFile *f, bool limit)
+{
+    DirtyBitmapMigBitmapState *dbms;
+    bool locked = qemu_mutex_iothread_locked();
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        while (!dbms->bulk_completed) {
+            if (!locked) {
+                qemu_mutex_lock_iothread();
+            }
+            bulk_phase_send_chunk(f, dbms);
+            if (!locked) {
+                qemu_mutex_unlock_iothread();
+            }
+            if (limit && qemu_file_rate_limit(f)) {
+                return;
+            }
+        }
+    }
+
+    dirty_bitmap_mig_state.bulk_completed = true;
+}
+
+static int dirty_bitmap_save_setup(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigBitmapState *dbms;
+    int ret;
+
+    DPRINTF("Enter save live setup\n");
+
+    qemu_mutex_lock_iothread();
+    ret = init_dirty_bitmap_migration();
+    if (ret == 0) {
+        QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+            send_bitmap_start(f, dbms);
+        }
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return 0;
+}
+
+static int dirty_bitmap_save_iterate(QEMUFile *f, void *opaque)
+{
+    /* The bitmaps may still change while the source runs, so only send
+     * them once the source has stopped for good.
+     */
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+
+    DPRINTF("Enter save live iterate\n");
+
+    if (in_postcopy && !dirty_bitmap_mig_state.bulk_completed) {
+        bulk_phase(f, true);
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+
+    return !in_postcopy || dirty_bitmap_mig_state.bulk_completed;
+}
+
+/* Called with iothread lock taken in the precopy case.  */
+
+static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigBitmapState *dbms;
+
+    DPRINTF("Enter save live complete\n");
+
+    if (!dirty_bitmap_mig_state.bulk_completed) {
+        bulk_phase(f, false);
+    }
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        send_bitmap_complete(f, dbms);
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+
+    DPRINTF("Dirty bitmap migration completed\n");
+
+    return 0;
+}
+
+static void dirty_bitmap_save_pending(QEMUFile *f, void *opaque,
+                                      uint64_t max_size,
+                                      uint64_t *non_postcopiable_pending,
+                                      uint64_t *postcopiable_pending)
+{
+    DirtyBitmapMigBitmapState *dbms;
+    uint64_t pending = 0;
+
+    /* Before postcopy nothing is sent, and reporting the data here would
+     * only keep precopy from converging; in plain precopy it is all sent
+     * within the downtime.
+     */
+    if (!migration_in_postcopy(migrate_get_current())) {
+        return;
+    }
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        uint64_t gran = bdrv_dirty_bitmap_granularity(dbms->bitmap);
+        uint64_t sectors = dbms->bulk_completed ? 0 :
+                           dbms->total_sectors - dbms->cur_sector;
+
+        pending += DIV_ROUND_UP(sectors << BDRV_SECTOR_BITS, gran);
+    }
+
+    pending = DIV_ROUND_UP(pending, BITS_PER_BYTE);
+
+    DPRINTF("Enter save live pending %" PRIu64 "\n", pending);
+    *postcopiable_pending += pending;
+}
+
+/* The incoming side runs without the iothread lock during postcopy */
+
+static bool dirty_bitmap_lock_iothread(void)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+static int dirty_bitmap_load_start(QEMUFile *f, DirtyBitmapLoadState *s)
+{
+    Error *local_err = NULL;
+    AioContext *aio_context;
+    uint32_t granularity = qemu_get_be32(f);
+    uint8_t flags = qemu_get_byte(f);
+    bool unlock;
+    int ret = 0;
+
+    if (granularity < BDRV_SECTOR_SIZE ||
+        (granularity & (granularity - 1)) != 0) {
+        error_report("Invalid granularity %" PRIu32 " of bitmap '%s'",
+                     granularity, s->bitmap_name);
+        return -EINVAL;
+    }
+
+    if (flags & ~DIRTY_BITMAP_MIG_START_KNOWN_FLAGS) {
+        error_report("Unknown start flags %#x of bitmap '%s'", flags,
+                     s->bitmap_name);
+        return -EINVAL;
+    }
+
+    unlock = dirty_bitmap_lock_iothread();
+    aio_context = bdrv_get_aio_context(s->bs);
+    aio_context_acquire(aio_context);
+
+    s->bitmap = bdrv_create_dirty_bitmap(s->bs, granularity, s->bitmap_name,
+                                         &local_err);
+    if (!s->bitmap) {
+        error_report_err(local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    bdrv_dirty_bitmap_set_persistance(s->bitmap,
+                        flags & DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT);
+    bdrv_dirty_bitmap_set_qmp_locked(s->bitmap, true);
+
+    if (flags & DIRTY_BITMAP_MIG_START_FLAG_ENABLED) {
+        /* Writes go to the successor until all data has arrived */
+        if (bdrv_dirty_bitmap_create_successor(s->bs, s->bitmap,
+                                               &local_err) < 0) {
+            error_report_err(local_err);
+            ret = -EINVAL;
+            goto out;
+        }
+    } else {
+        bdrv_disable_dirty_bitmap(s->bitmap);
+    }
+
+out:
+    aio_context_release(aio_context);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+}
+
+static int dirty_bitmap_load_complete(QEMUFile *f, DirtyBitmapLoadState *s)
+{
+    Error *local_err = NULL;
+    AioContext *aio_context;
+    bool unlock;
+    int ret = 0;
+
+    unlock = dirty_bitmap_lock_iothread();
+    aio_context = bdrv_get_aio_context(s->bs);
+    aio_context_acquire(aio_context);
+
+    bdrv_dirty_bitmap_deserialize_finish(s->bitmap);
+
+    if (bdrv_dirty_bitmap_frozen(s->bitmap)) {
+        if (!bdrv_reclaim_dirty_bitmap(s->bs, s->bitmap, &local_err)) {
+            error_report_err(local_err);
+            ret = -EINVAL;
+        }
+    }
+    bdrv_dirty_bitmap_set_qmp_locked(s->bitmap, false);
+
+    aio_context_release(aio_context);
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+}
+
+static int dirty_bitmap_load_bits(QEMUFile *f, DirtyBitmapLoadState *s)
+{
+    uint64_t start_sector = qemu_get_be64(f);
+    uint32_t nr_sectors = qemu_get_be32(f);
+    uint64_t align = bdrv_dirty_bitmap_serialization_align(s->bitmap);
+    uint64_t size = bdrv_dirty_bitmap_size(s->bitmap);
+    AioContext *aio_context;
+    uint64_t buf_size, expected;
+    uint8_t *buf = NULL;
+
+    if (nr_sectors == 0 || start_sector >= size ||
+        nr_sectors > size - start_sector || start_sector % align != 0 ||
+        (start_sector + nr_sectors != size && nr_sectors % align != 0)) {
+        error_report("Invalid range %" PRIu64 "+%" PRIu32 " for bitmap '%s'",
+                     start_sector, nr_sectors, s->bitmap_name);
+        return -EINVAL;
+    }
+
+    if (!(s->flags & DIRTY_BITMAP_MIG_FLAG_ZEROES)) {
+        buf_size = qemu_get_be64(f);
+        expected = bdrv_dirty_bitmap_serialization_size(s->bitmap,
+                                                        start_sector,
+                                                        nr_sectors);
+        if (buf_size != QEMU_ALIGN_UP(expected, sizeof(uint64_t))) {
+            error_report("Unexpected data size %" PRIu64 " for bitmap '%s'",
+                         buf_size, s->bitmap_name);
+            return -EINVAL;
+        }
+
+        buf = g_malloc(buf_size);
+        if (qemu_get_buffer(f, buf, buf_size) != buf_size) {
+            g_free(buf);
+            return -EIO;
+        }
+    }
+
+    /* The bitmap is frozen or disabled, so nothing else writes to it */
+    aio_context = bdrv_get_aio_context(s->bs);
+    aio_context_acquire(aio_context);
+    if (buf) {
+        bdrv_dirty_bitmap_deserialize_part(s->bitmap, buf, start_sector,
+                                           nr_sectors, false);
+    } else {
+        bdrv_dirty_bitmap_deserialize_zeroes(s->bitmap, start_sector,
+                                             nr_sectors, false);
+    }
+    aio_context_release(aio_context);
+
+    g_free(buf);
+    return 0;
+}
+
+static int dirty_bitmap_load_header(QEMUFile *f, DirtyBitmapLoadState *s)
+{
+    Error *local_err = NULL;
+
+    s->flags = qemu_get_byte(f);
+
+    if (s->flags & ~DIRTY_BITMAP_MIG_KNOWN_FLAGS) {
+        error_report("Unknown dirty bitmap migration flags: %#x", s->flags);
+        return -EINVAL;
+    }
+
+    if (s->flags & DIRTY_BITMAP_MIG_FLAG_DEVICE_NAME) {
+        if (get_name(f, s->node_name) < 0) {
+            return -EIO;
+        }
+        s->bs = bdrv_lookup_bs(s->node_name, s->node_name, &local_err);
+        if (!s->bs) {
+            error_report_err(local_err);
+            return -EINVAL;
+        }
+        s->bitmap = NULL;
+    }
+
+    if (s->flags & DIRTY_BITMAP_MIG_FLAG_BITMAP_NAME) {
+        if (get_name(f, s->bitmap_name) < 0) {
+            return -EIO;
+        }
+        s->bitmap = NULL;
+    }
+
+    if (!(s->flags & (DIRTY_BITMAP_MIG_FLAG_START |
+                      DIRTY_BITMAP_MIG_FLAG_COMPLETE |
+                      DIRTY_BITMAP_MIG_FLAG_BITS))) {
+        return 0;
+    }
+
+    if (!s->bs) {
+        error_report("Dirty bitmap chunk without a node");
+        return -EINVAL;
+    }
+
+    /* START creates the bitmap, everything else needs an existing one */
+    if (!(s->flags & DIRTY_BITMAP_MIG_FLAG_START) && !s->bitmap) {
+        s->bitmap = bdrv_find_dirty_bitmap(s->bs, s->bitmap_name);
+        if (!s->bitmap || !bdrv_dirty_bitmap_qmp_locked(s->bitmap)) {
+            error_report("Error: unknown dirty bitmap '%s' for block "
+                         "device '%s'", s->bitmap_name, s->node_name);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
+{
+    DirtyBitmapLoadState *s = &dirty_bitmap_load_state;
+    int ret;
+
+    DPRINTF("Enter load\n");
+
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+
+    do {
+        ret = dirty_bitmap_load_header(f, s);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (s->flags & DIRTY_BITMAP_MIG_FLAG_START) {
+            ret = dirty_bitmap_load_start(f, s);
+        } else if (s->flags & DIRTY_BITMAP_MIG_FLAG_COMPLETE) {
+            ret = dirty_bitmap_load_complete(f, s);
+        } else if (s->flags & DIRTY_BITMAP_MIG_FLAG_BITS) {
+            ret = dirty_bitmap_load_bits(f, s);
+        }
+
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+        if (ret) {
+            return ret;
+        }
+    } while (!(s->flags & DIRTY_BITMAP_MIG_FLAG_EOS));
+
+    DPRINTF("Completed load\n");
+    return 0;
+}
+
+static bool dirty_bitmap_is_active(void *opaque)
+{
+    return migrate_dirty_bitmaps();
+}
+
+static SaveVMHandlers savevm_dirty_bitmap_handlers = {
+    .save_live_setup = dirty_bitmap_save_setup,
+    .save_live_iterate = dirty_bitmap_save_iterate,
+    .save_live_complete_precopy = dirty_bitmap_save_complete,
+    .save_live_complete_postcopy = dirty_bitmap_save_complete,
+    .save_live_pending = dirty_bitmap_save_pending,
+    .load_state = dirty_bitmap_load,
+    .cleanup = dirty_bitmap_mig_cleanup,
+    .is_active = dirty_bitmap_is_active,
+};
+
+void dirty_bitmap_mig_init(void)
+{
+    QSIMPLEQ_INIT(&dirty_bitmap_mig_state.dbms_list);
+
+    register_savevm_live(NULL, "dirty-bitmap", 0, 1,
+                         &savevm_dirty_bitmap_handlers,
+                         &dirty_bitmap_mig_state);
+}
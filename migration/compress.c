@@ -0,0 +1,346 @@
+/*
+ * Page compression methods for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "migration/compress.h"
+
+/*
+ * LZ4 only looks back 64 KiB, but it needs that history to stay at the
+ * same address.  Both sides copy pages into a ring of this many bytes plus
+ * one page and wrap at the same points, as in the LZ4 ring buffer example.
+ */
+#define LZ4_HISTORY_SIZE (64 * 1024)
+
+/* Room for the zstd frame header, which comes with the first page */
+#define ZSTD_FRAME_HEADER_MAX 32
+
+struct MigrationCompressor {
+    MigrationCompressMethod method;
+    int level;
+    uint8_t *ring;
+    size_t ring_size;
+    size_t ring_pos;
+#ifdef CONFIG_ZSTD
+    ZSTD_CStream *zcs;
+#endif
+#ifdef CONFIG_LZ4
+    LZ4_stream_t *lz4;
+#endif
+};
+
+struct MigrationDecompressor {
+    MigrationCompressMethod method;
+    uint8_t *ring;
+    size_t ring_size;
+    size_t ring_pos;
+#ifdef CONFIG_ZSTD
+    ZSTD_DStream *zds;
+#endif
+#ifdef CONFIG_LZ4
+    LZ4_streamDecode_t *lz4;
+#endif
+};
+
+bool migration_compress_method_supported(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return true;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+bool migration_compress_is_streaming(MigrationCompressMethod method)
+{
+    return method != MIGRATION_COMPRESS_METHOD_ZLIB;
+}
+
+size_t migration_compress_bound(MigrationCompressMethod method, size_t size)
+{
+    switch (method) {
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return ZSTD_compressBound(size) + ZSTD_FRAME_HEADER_MAX;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return LZ4_compressBound(size);
+#endif
+    default:
+        return compressBound(size);
+    }
+}
+
+/* Returns where the next page of @size bytes goes in a ring buffer */
+static uint8_t *ring_next(uint8_t *ring, size_t ring_size, size_t *pos,
+                          size_t size)
+{
+    uint8_t *p;
+
+    if (*pos + size > ring_size) {
+        *pos = 0;
+    }
+    p = ring + *pos;
+    *pos += size;
+    return p;
+}
+
+MigrationCompressor *migration_compressor_new(MigrationCompressMethod method,
+                                              int level, size_t page_size)
+{
+    MigrationCompressor *c = g_new0(MigrationCompressor, 1);
+
+    assert(migration_compress_method_supported(method));
+    c->method = method;
+    c->level = level;
+
+    switch (method) {
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        c->zcs = ZSTD_createCStream();
+        if (!c->zcs) {
+            abort();
+        }
+        /* Level 0 means "no compression" for zlib, use the fastest one */
+        ZSTD_initCStream(c->zcs, MAX(level, 1));
+        break;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        c->lz4 = LZ4_createStream();
+        if (!c->lz4) {
+            abort();
+        }
+        c->ring_size = LZ4_HISTORY_SIZE + page_size;
+        c->ring = g_malloc(c->ring_size);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    return c;
+}
+
+void migration_compressor_free(MigrationCompressor *c)
+{
+    if (!c) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCStream(c->zcs);
+#endif
+#ifdef CONFIG_LZ4
+    if (c->lz4) {
+        LZ4_freeStream(c->lz4);
+    }
+#endif
+    g_free(c->ring);
+    g_free(c);
+}
+
+MigrationCompressMethod migration_compressor_method(MigrationCompressor *c)
+{
+    return c->method;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t zstd_compress_page(MigrationCompressor *c, const uint8_t *src,
+                                  size_t size, uint8_t *dst, size_t dst_len)
+{
+    ZSTD_inBuffer in = { src, size, 0 };
+    ZSTD_outBuffer out = { dst, dst_len, 0 };
+    size_t ret;
+
+    /*
+     * The stream copies its input into the window before compressing it,
+     * so a page that changes under our feet is still seen only once.
+     */
+    while (in.pos < in.size) {
+        ret = ZSTD_compressStream(c->zcs, &out, &in);
+        if (ZSTD_isError(ret) || out.pos == out.size) {
+            return -1;
+        }
+    }
+
+    /* End the block, but not the frame, so the window is kept */
+    ret = ZSTD_flushStream(c->zcs, &out);
+    if (ret != 0) {
+        return -1;
+    }
+    return out.pos;
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static ssize_t lz4_compress_page(MigrationCompressor *c, const uint8_t *src,
+                                 size_t size, uint8_t *dst, size_t dst_len)
+{
+    uint8_t *p = ring_next(c->ring, c->ring_size, &c->ring_pos, size);
+    int ret;
+
+    /* The copy is also what the decompressor will have in its history */
+    memcpy(p, src, size);
+    ret = LZ4_compress_fast_continue(c->lz4, (const char *)p, (char *)dst,
+                                     size, dst_len, 1);
+    return ret > 0 ? ret : -1;
+}
+#endif
+
+ssize_t migration_compress_page(MigrationCompressor *c, const uint8_t *src,
+                                size_t size, uint8_t *dst, size_t dst_len)
+{
+    uLongf blen = dst_len;
+
+    switch (c->method) {
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return zstd_compress_page(c, src, size, dst, dst_len);
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return lz4_compress_page(c, src, size, dst, dst_len);
+#endif
+    default:
+        if (compress2(dst, &blen, src, size, c->level) != Z_OK) {
+            return -1;
+        }
+        return blen;
+    }
+}
+
+MigrationDecompressor *migration_decompressor_new(MigrationCompressMethod
+                                                  method, size_t page_size)
+{
+    MigrationDecompressor *d = g_new0(MigrationDecompressor, 1);
+
+    assert(migration_compress_method_supported(method));
+    d->method = method;
+
+    switch (method) {
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        d->zds = ZSTD_createDStream();
+        if (!d->zds) {
+            abort();
+        }
+        ZSTD_initDStream(d->zds);
+        break;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        d->lz4 = LZ4_createStreamDecode();
+        if (!d->lz4) {
+            abort();
+        }
+        d->ring_size = LZ4_HISTORY_SIZE + page_size;
+        d->ring = g_malloc(d->ring_size);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    return d;
+}
+
+void migration_decompressor_free(MigrationDecompressor *d)
+{
+    if (!d) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeDStream(d->zds);
+#endif
+#ifdef CONFIG_LZ4
+    if (d->lz4) {
+        LZ4_freeStreamDecode(d->lz4);
+    }
+#endif
+    g_free(d->ring);
+    g_free(d);
+}
+
+#ifdef CONFIG_ZSTD
+static int zstd_decompress_page(MigrationDecompressor *d, const uint8_t *src,
+                                size_t len, uint8_t *dst, size_t size)
+{
+    ZSTD_inBuffer in = { src, len, 0 };
+    ZSTD_outBuffer out = { dst, size, 0 };
+    size_t in_pos, out_pos, ret;
+
+    while (in.pos < in.size) {
+        in_pos = in.pos;
+        out_pos = out.pos;
+        ret = ZSTD_decompressStream(d->zds, &out, &in);
+        if (ZSTD_isError(ret)) {
+            return -1;
+        }
+        if (in.pos == in_pos && out.pos == out_pos) {
+            /* More data than fits in the page */
+            return -1;
+        }
+    }
+    return out.pos == size ? 0 : -1;
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static int lz4_decompress_page(MigrationDecompressor *d, const uint8_t *src,
+                               size_t len, uint8_t *dst, size_t size)
+{
+    uint8_t *p = ring_next(d->ring, d->ring_size, &d->ring_pos, size);
+    int ret;
+
+    ret = LZ4_decompress_safe_continue(d->lz4, (const char *)src, (char *)p,
+                                       len, size);
+    if (ret != size) {
+        return -1;
+    }
+    memcpy(dst, p, size);
+    return 0;
+}
+#endif
+
+int migration_decompress_page(MigrationDecompressor *d, const uint8_t *src,
+                              size_t len, uint8_t *dst, size_t size)
+{
+    uLongf dlen = size;
+
+    switch (d->method) {
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return zstd_decompress_page(d, src, len, dst, size);
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return lz4_decompress_page(d, src, len, dst, size);
+#endif
+    default:
+        if (uncompress(dst, &dlen, src, len) != Z_OK || dlen != size) {
+            return -1;
+        }
+        return 0;
+    }
+}
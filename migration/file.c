@@ -0,0 +1,163 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+
+/*
+ * Path and access mode of the running file: migration, for the channels
+ * that read or write RAM at fixed offsets with mapped-ram
+ */
+static char *file_path;
+static int file_flags;
+
+QIOChannel *file_channel_create(bool direct, Error **errp)
+{
+    QIOChannelFile *fioc;
+    int flags = file_flags;
+
+    if (!file_path) {
+        error_setg(errp, "Mapped-ram needs a file: migration URI");
+        return NULL;
+    }
+    if (direct) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        error_setg(errp, "Direct I/O is not supported on this host");
+        return NULL;
+#endif
+    }
+
+    fioc = qio_channel_file_new_path(file_path, flags, 0, errp);
+    if (!fioc) {
+        return NULL;
+    }
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-ram");
+    return QIO_CHANNEL(fioc);
+}
+
+void file_cleanup_migration(void)
+{
+    g_free(file_path);
+    file_path = NULL;
+}
+
+int file_pwrite_all(QIOChannel *ioc, const uint8_t *buf, size_t len,
+                    off_t offset, Error **errp)
+{
+#ifdef _WIN32
+    error_setg(errp, "Mapped-ram is not supported on this host");
+    return -1;
+#else
+    int fd = QIO_CHANNEL_FILE(ioc)->fd;
+
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno, "Unable to write to %s", file_path);
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+#endif
+}
+
+int file_pread_all(QIOChannel *ioc, uint8_t *buf, size_t len, off_t offset,
+                   Error **errp)
+{
+#ifdef _WIN32
+    error_setg(errp, "Mapped-ram is not supported on this host");
+    return -1;
+#else
+    int fd = QIO_CHANNEL_FILE(ioc)->fd;
+
+    while (len) {
+        ssize_t ret = pread(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno, "Unable to read from %s", file_path);
+            return -1;
+        }
+        if (ret == 0) {
+            error_setg(errp, "Unexpected end of %s", file_path);
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+#endif
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(path);
+    fioc = qio_channel_file_new_path(path, O_WRONLY | O_CREAT | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    file_cleanup_migration();
+    file_path = g_strdup(path);
+    file_flags = O_WRONLY;
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(migrate_get_current(), ioc);
+    object_unref(OBJECT(ioc));
+    return FALSE; /* unregister */
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(path);
+    fioc = qio_channel_file_new_path(path, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    file_cleanup_migration();
+    file_path = g_strdup(path);
+    file_flags = O_RDONLY;
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch(QIO_CHANNEL(fioc),
+                          G_IO_IN,
+                          file_accept_incoming_migration,
+                          NULL,
+                          NULL);
+}
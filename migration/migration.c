@@ -20,6 +20,7 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/balloon.h"
 #include "block/block.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/util.h"
@@ -37,6 +38,7 @@
 #include "io/channel-buffer.h"
 #include "io/channel-tls.h"
 #include "migration/colo.h"
+#include "migration/compress.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -68,11 +70,17 @@
  */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
+/* Default number of channels used by multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
 static bool deferred_incoming;
 
+/* Main incoming stream, held back until all multifd channels are there */
+static QEMUFile *incoming_main_file;
+
 /*
  * Current state of incoming postcopy; note this is not part of
  * MigrationIncomingState since it's state is used during cleanup
@@ -101,6 +109,8 @@ MigrationState *migrate_get_current(void)
             .max_bandwidth = MAX_THROTTLE,
             .downtime_limit = DEFAULT_MIGRATE_SET_DOWNTIME,
             .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .compress_method = MIGRATION_COMPRESS_METHOD_ZLIB,
         },
     };
 
@@ -327,6 +337,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -426,7 +438,10 @@ static void process_incoming_migration_co(void *opaque)
     }
 
     qemu_fclose(f);
+    incoming_main_file = NULL;
     free_xbzrle_decoded_buf();
+    multifd_load_cleanup();
+    postcopy_preempt_load_cleanup(ret < 0);
 
     if (ret < 0) {
         migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
@@ -464,10 +479,45 @@ void migration_channel_process_incoming(MigrationState *s,
         if (local_err) {
             error_report_err(local_err);
         }
+    } else if (!incoming_main_file) {
+        /* The first connection carries the main migration stream */
+        incoming_main_file = qemu_fopen_channel_input(ioc);
+        multifd_load_setup();
+        if (migration_has_all_channels()) {
+            migration_fd_process_incoming(incoming_main_file);
+        }
     } else {
-        QEMUFile *f = qemu_fopen_channel_input(ioc);
-        migration_fd_process_incoming(f);
+        if (migrate_postcopy_preempt()) {
+            postcopy_preempt_new_channel(ioc);
+        } else {
+            multifd_recv_new_channel(ioc);
+        }
+        if (migration_has_all_channels()) {
+            migration_fd_process_incoming(incoming_main_file);
+        }
+    }
+}
+
+/*
+ * Returns true once all connections of the incoming migration have been
+ * accepted.  Loading the main stream waits for the multifd and postcopy
+ * preempt channels, so it is only processed afterwards.
+ */
+bool migration_has_all_channels(void)
+{
+    /* With mapped-ram, RAM is read from the file, not from connections */
+    bool multifd = migrate_use_multifd() && !migrate_mapped_ram();
+
+    if (!multifd && !migrate_postcopy_preempt()) {
+        return true;
     }
+    if (!incoming_main_file) {
+        return false;
+    }
+    if (multifd && !multifd_recv_all_channels_created()) {
+        return false;
+    }
+    return !migrate_postcopy_preempt() || postcopy_preempt_channel_created();
 }
 
 
@@ -595,6 +645,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->downtime_limit = s->parameters.downtime_limit;
     params->has_x_checkpoint_delay = true;
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->has_multifd_channels = true;
+    params->multifd_channels = s->parameters.multifd_channels;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
 
     return params;
 }
@@ -628,6 +682,9 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
+        info->xbzrle_cache->cache_evictions = xbzrle_mig_cache_evictions();
     }
 }
 
@@ -644,6 +701,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = s->dirty_sync_count;
     info->ram->postcopy_requests = s->postcopy_requests;
+    info->ram->multifd_pages = multifd_pages_transferred();
+    info->ram->has_multifd_pages = !!info->ram->multifd_pages;
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
@@ -745,6 +804,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     }
     info->status = s->state;
 
+    /* On the destination */
+    info->postcopy_fault_latency = postcopy_fault_latency_get();
+    info->has_postcopy_fault_latency = !!info->postcopy_fault_latency;
+
     return info;
 }
 
@@ -754,6 +817,7 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
     bool old_postcopy_cap = migrate_postcopy_ram();
+    bool old_snapshot_cap = migrate_background_snapshot();
 
     if (migration_is_setup_or_active(s->state)) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
@@ -798,6 +862,76 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        if (migrate_use_compression() || migrate_postcopy_ram() ||
+            migrate_colo_enabled()) {
+            /* The sync points of the multifd channels are only placed
+             * between dirty bitmap rounds of precopy RAM.
+             */
+            error_report("Multifd is not currently compatible with "
+                         "compression, postcopy or COLO");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_postcopy_preempt() && !migrate_postcopy_ram()) {
+        error_report("Postcopy preempt needs the postcopy-ram capability");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT] = false;
+    }
+
+    if (migrate_background_snapshot()) {
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_use_multifd() ||
+            migrate_colo_enabled() || migrate_dirty_bitmaps()) {
+            /* Only RAM is written to while the snapshot is saved; the
+             * pages can't be sent in any other way than as they are.
+             */
+            error_report("Background snapshot is not currently compatible "
+                         "with postcopy, compression, XBZRLE, multifd, COLO "
+                         "or dirty bitmaps");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] =
+                false;
+        } else if (!old_snapshot_cap && !ram_write_tracking_supported()) {
+            /* ram_write_tracking_supported will have emitted a more
+             * detailed message
+             */
+            error_report("Background snapshot is not supported");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] =
+                false;
+        }
+    }
+
+    if (migrate_mapped_ram()) {
+        if (migrate_postcopy_ram() || migrate_use_compression() ||
+            migrate_use_xbzrle() || migrate_colo_enabled() ||
+            migrate_background_snapshot()) {
+            /* Every page has a single place in the file, where it is
+             * written as it is.
+             */
+            error_report("Mapped-ram is not currently compatible with "
+                         "postcopy, compression, XBZRLE, COLO or background "
+                         "snapshots");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM] = false;
+        }
+    }
+
+    if (migrate_direct_io() &&
+        (!migrate_mapped_ram() || !migrate_use_multifd())) {
+        /* Only the page writes of the multifd threads are aligned */
+        error_report("Direct I/O needs the mapped-ram and multifd "
+                     "capabilities");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_DIRECT_IO] = false;
+    }
+
+    if (migrate_ignore_shared() &&
+        (migrate_postcopy_ram() || migrate_colo_enabled() ||
+         migrate_background_snapshot())) {
+        /* Postcopy would discard the shared memory on the destination */
+        error_report("Ignore-shared is not currently compatible with "
+                     "postcopy, COLO or background snapshots");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_IGNORE_SHARED] = false;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
@@ -858,6 +992,26 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
                     "x_checkpoint_delay",
                     "is invalid, it should be positive");
     }
+    if (params->has_multifd_channels &&
+        (params->multifd_channels < 1 || params->multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (params->has_compress_method) {
+        if (!migration_compress_method_supported(params->compress_method)) {
+            error_setg(errp, "Compression method '%s' is not supported by "
+                       "this QEMU binary",
+                       MigrationCompressMethod_lookup[params->compress_method]);
+            return;
+        }
+        /* The compression threads are already running with the old one */
+        if (migration_is_setup_or_active(s->state)) {
+            error_setg(errp, QERR_MIGRATION_ACTIVE);
+            return;
+        }
+    }
 
     if (params->has_compress_level) {
         s->parameters.compress_level = params->compress_level;
@@ -896,6 +1050,12 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
     if (params->has_x_checkpoint_delay) {
         s->parameters.x_checkpoint_delay = params->x_checkpoint_delay;
     }
+    if (params->has_multifd_channels) {
+        s->parameters.multifd_channels = params->multifd_channels;
+    }
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
 }
 
 
@@ -950,9 +1110,13 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_save_cleanup();
+        postcopy_preempt_save_cleanup();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
+    socket_cleanup_outgoing_migration();
+    file_cleanup_migration();
 
     assert((s->state != MIGRATION_STATUS_ACTIVE) &&
            (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
@@ -1160,6 +1324,17 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_background_snapshot() && (params.blk || params.shared)) {
+        error_setg(errp, "Block migration is not compatible with background "
+                   "snapshots");
+        return;
+    }
+
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Mapped-ram needs a file: migration URI");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1174,6 +1349,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -1278,6 +1455,15 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_dirty_bitmaps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -1296,6 +1482,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1314,6 +1509,69 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_channels;
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRECT_IO];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_IGNORE_SHARED];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1942,8 +2200,158 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/* Restarts the guest once its RAM is write-protected */
+static void background_snapshot_vm_start_bh(void *opaque)
+{
+    if (runstate_check(RUN_STATE_SAVE_VM)) {
+        vm_start();
+    }
+}
+
+/*
+ * Stops the guest, saves the devices to @fb and write-protects RAM, so that
+ * RAM can then be saved as it is at this point.
+ */
+static int background_snapshot_start(MigrationState *s, QEMUFile *fb)
+{
+    int64_t start_time;
+    bool old_vm_running;
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    old_vm_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret) {
+        ret = vm_stop(RUN_STATE_SAVE_VM);
+    }
+    if (!ret) {
+        cpu_synchronize_all_states();
+        qemu_savevm_state_complete_non_iterable(fb, false);
+        qemu_fflush(fb);
+        ret = qemu_file_get_error(fb);
+    }
+    if (!ret) {
+        ret = ram_write_tracking_start();
+    }
+    if (old_vm_running) {
+        /*
+         * Devices write to guest RAM when the VM starts; let the main
+         * thread do it, since this thread must stay free to save the
+         * pages they wait for.
+         */
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                background_snapshot_vm_start_bh, NULL);
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
+/*
+ * Migration thread for background snapshots.  The guest is only paused
+ * while the devices are saved into a buffer and RAM is write-protected.
+ * RAM is then sent as it was at that point while the guest runs: a page
+ * that the guest writes to is sent before any other, and is writable again
+ * once it's in the stream.  The devices follow RAM, where the destination
+ * expects them.
+ */
+static void *background_snapshot_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    int64_t end_time;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    int ret;
+
+    rcu_register_thread();
+
+    /*
+     * A page that the balloon discards would be mapped again without its
+     * write protection, and the guest's writes to it would be missed
+     */
+    qemu_mutex_lock_iothread();
+    qemu_balloon_inhibit(true);
+    qemu_mutex_unlock_iothread();
+
+    /* The guest may be waiting for the pages, never sleep */
+    qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_begin(s->to_dst_file, &s->params);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    bioc = qio_channel_buffer_new(4096);
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ret = qemu_file_get_error(s->to_dst_file);
+    if (!ret) {
+        ret = background_snapshot_start(s, fb);
+    }
+    if (ret) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    }
+
+    while (s->state == MIGRATION_STATUS_ACTIVE) {
+        if (qemu_savevm_state_iterate(s->to_dst_file, false) > 0) {
+            /* All of RAM is saved */
+            break;
+        }
+        if (qemu_file_get_error(s->to_dst_file)) {
+            migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                              MIGRATION_STATUS_FAILED);
+            trace_migration_thread_file_err();
+            break;
+        }
+    }
+
+    trace_migration_thread_after_loop();
+    /* Whatever happened, the guest must be able to write again */
+    ram_write_tracking_stop();
+
+    if (s->state == MIGRATION_STATUS_ACTIVE) {
+        qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+        qemu_fflush(s->to_dst_file);
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          qemu_file_get_error(s->to_dst_file) ?
+                          MIGRATION_STATUS_FAILED :
+                          MIGRATION_STATUS_COMPLETED);
+    }
+    qemu_fclose(fb);
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    qemu_mutex_lock_iothread();
+    qemu_balloon_inhibit(false);
+    qemu_savevm_state_cleanup();
+    if (s->state == MIGRATION_STATUS_COMPLETED) {
+        uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
+        s->total_time = end_time - s->total_time;
+        if (s->total_time) {
+            s->mbps = (((double) transferred_bytes * 8.0) /
+                       ((double) s->total_time)) / 1000;
+        }
+    }
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
+    Error *local_err = NULL;
+
     s->expected_downtime = s->parameters.downtime_limit;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
 
@@ -1968,9 +2376,23 @@ void migrate_fd_connect(MigrationState *s)
         }
     }
 
+    if (multifd_save_setup(&local_err) < 0 ||
+        postcopy_preempt_setup(&local_err) < 0) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     migrate_compress_threads_create();
-    qemu_thread_create(&s->thread, "migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "migration", background_snapshot_thread,
+                           s, QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -24,6 +24,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -44,6 +46,20 @@ struct PostcopyDiscardState {
     unsigned int nsentcmds;
 };
 
+/* Elements of PostcopyFaultLatency's histogram */
+#define POSTCOPY_FAULT_LATENCY_BUCKETS 24
+
+static struct {
+    QemuMutex lock;
+    /* Pages faulted on and not placed yet: host address -> request time */
+    GHashTable *pending;
+    /* Size of @pending, read without the lock on every placed page */
+    unsigned int outstanding;
+    uint64_t faults;
+    uint64_t max;
+    uint64_t histogram[POSTCOPY_FAULT_LATENCY_BUCKETS];
+} *fault_latency;
+
 /* Postcopy needs to detect accesses to pages that haven't yet been copied
  * across, and efficiently map new pages in, the techniques for doing this
  * are target OS specific.
@@ -301,6 +317,10 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* Pages from the preempt channel are placed through the userfaultfd */
+    postcopy_preempt_load_cleanup(qemu_file_get_error(mis->from_src_file) !=
+                                  0);
+
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -412,6 +432,58 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
     return 0;
 }
 
+static void postcopy_fault_latency_init(void)
+{
+    if (fault_latency) {
+        return;
+    }
+    fault_latency = g_new0(typeof(*fault_latency), 1);
+    qemu_mutex_init(&fault_latency->lock);
+    fault_latency->pending = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+}
+
+/* Called by the fault thread for the host page at @host */
+static void postcopy_fault_requested(void *host)
+{
+    int64_t *start;
+
+    qemu_mutex_lock(&fault_latency->lock);
+    /* Several vCPUs may wait for the page, the first one waited longest */
+    if (!g_hash_table_lookup(fault_latency->pending, host)) {
+        start = g_new(int64_t, 1);
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(fault_latency->pending, host, start);
+        atomic_inc(&fault_latency->outstanding);
+    }
+    qemu_mutex_unlock(&fault_latency->lock);
+}
+
+/* Called once the host page at @host is placed, from any channel */
+static void postcopy_fault_resolved(void *host)
+{
+    int64_t *start;
+    uint64_t us;
+    int bucket;
+
+    /* Most pages are placed by the background copy, not for a fault */
+    if (!fault_latency || !atomic_read(&fault_latency->outstanding)) {
+        return;
+    }
+    qemu_mutex_lock(&fault_latency->lock);
+    start = g_hash_table_lookup(fault_latency->pending, host);
+    if (start) {
+        us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *start) / SCALE_US;
+        bucket = us < 2 ? 0 : 63 - clz64(us);
+        fault_latency->histogram[MIN(bucket,
+                                     POSTCOPY_FAULT_LATENCY_BUCKETS - 1)]++;
+        fault_latency->max = MAX(fault_latency->max, us);
+        fault_latency->faults++;
+        g_hash_table_remove(fault_latency->pending, host);
+        atomic_dec(&fault_latency->outstanding);
+    }
+    qemu_mutex_unlock(&fault_latency->lock);
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -491,6 +563,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
         trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset);
+        postcopy_fault_requested((void *)(uintptr_t)
+                                 (msg.arg.pagefault.address &
+                                  ~(uint64_t)(hostpagesize - 1)));
 
         /*
          * Send the request to the source - we want to request one
@@ -537,6 +612,7 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    postcopy_fault_latency_init();
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -587,6 +663,7 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
     }
 
     trace_postcopy_place_page(host);
+    postcopy_fault_resolved(host);
     return 0;
 }
 
@@ -611,6 +688,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
     }
 
     trace_postcopy_place_page_zero(host);
+    postcopy_fault_resolved(host);
     return 0;
 }
 
@@ -638,6 +716,249 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return mis->postcopy_tmp_page;
 }
 
+/*
+ * Write tracking for background snapshots, on the source: RAM is
+ * write-protected, and a write of the guest to a page blocks until the
+ * migration thread has saved the page and removed the protection.
+ */
+static int wp_ufd = -1;
+
+static bool ufd_wp_version_check(int ufd)
+{
+    struct uffdio_api api_struct;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed: %s", __func__, strerror(errno));
+        return false;
+    }
+
+    if (!(api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        error_report("Host kernel lacks userfaultfd write protection");
+        return false;
+    }
+
+    return true;
+}
+
+static int wp_range_register(int ufd, const char *block_name,
+                             void *host_addr, ram_addr_t length)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s: userfault register %s: %s", __func__, block_name,
+                     strerror(errno));
+        return -errno;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("RAM block %s cannot be write-protected", block_name);
+        return -ENOTSUP;
+    }
+
+    return 0;
+}
+
+static int wp_range_protect(int ufd, void *host_addr, ram_addr_t length,
+                            bool protect)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)host_addr;
+    wp_struct.range.len = length;
+    /* Removing the protection wakes up the threads that faulted on it */
+    wp_struct.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int check_wp_range(const char *block_name, void *host_addr,
+                          ram_addr_t offset, ram_addr_t length, void *opaque)
+{
+    RAMBlock *rb = qemu_ram_block_by_name(block_name);
+    int ufd = *(int *)opaque;
+    int ret;
+
+    if (qemu_ram_pagesize(rb) > getpagesize()) {
+        error_report("Background snapshots don't support large page sizes "
+                     "(%s)", block_name);
+        return -E2BIG;
+    }
+
+    ret = wp_range_register(ufd, block_name, host_addr, length);
+    if (!ret) {
+        struct uffdio_range range_struct = {
+            .start = (uintptr_t)host_addr,
+            .len = length,
+        };
+
+        ioctl(ufd, UFFDIO_UNREGISTER, &range_struct);
+    }
+
+    return ret;
+}
+
+/*
+ * Returns true if the host can write-protect all of the RAM blocks
+ */
+bool ram_write_tracking_supported(void)
+{
+    bool ret = false;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        return false;
+    }
+
+    if (ufd_wp_version_check(ufd) &&
+        !qemu_ram_foreach_block(check_wp_range, &ufd)) {
+        ret = true;
+    }
+
+    close(ufd);
+    return ret;
+}
+
+/*
+ * A page that is not mapped cannot be write-protected: map it by reading
+ * from it.  This must happen with the VM stopped and the balloon inhibited,
+ * right before the range is protected, or a page discarded in between
+ * would be neither mapped nor protected and its writes would be missed.
+ */
+static void populate_range(void *host_addr, ram_addr_t length)
+{
+    volatile uint8_t *p = host_addr;
+    ram_addr_t off;
+
+    for (off = 0; off < length; off += getpagesize()) {
+        (void)p[off];
+    }
+}
+
+static int start_wp_range(const char *block_name, void *host_addr,
+                          ram_addr_t offset, ram_addr_t length, void *opaque)
+{
+    int ret;
+
+    trace_ram_write_tracking_range(block_name, host_addr, length);
+
+    populate_range(host_addr, length);
+    ret = wp_range_register(wp_ufd, block_name, host_addr, length);
+    if (ret) {
+        return ret;
+    }
+
+    ret = wp_range_protect(wp_ufd, host_addr, length, true);
+    if (ret) {
+        error_report("%s: write protect %s: %s", __func__, block_name,
+                     strerror(-ret));
+    }
+    return ret;
+}
+
+/*
+ * Maps and write-protects all of RAM.  Called with the VM stopped, the BQL
+ * held and the balloon inhibited.
+ * Returns 0 on success
+ */
+int ram_write_tracking_start(void)
+{
+    assert(wp_ufd == -1);
+
+    /* Faults are polled for by the migration thread */
+    wp_ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (wp_ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    if (!ufd_wp_version_check(wp_ufd) ||
+        qemu_ram_foreach_block(start_wp_range, NULL)) {
+        ram_write_tracking_stop();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int stop_wp_range(const char *block_name, void *host_addr,
+                         ram_addr_t offset, ram_addr_t length, void *opaque)
+{
+    struct uffdio_range range_struct = {
+        .start = (uintptr_t)host_addr,
+        .len = length,
+    };
+
+    /* Fails harmlessly on the ranges that were not registered */
+    wp_range_protect(wp_ufd, host_addr, length, false);
+    ioctl(wp_ufd, UFFDIO_UNREGISTER, &range_struct);
+
+    return 0;
+}
+
+/*
+ * Removes the protection from all of RAM, waking up any thread that
+ * waits on it.  Safe to call if write tracking is not started.
+ */
+void ram_write_tracking_stop(void)
+{
+    if (wp_ufd == -1) {
+        return;
+    }
+
+    qemu_ram_foreach_block(stop_wp_range, NULL);
+    close(wp_ufd);
+    wp_ufd = -1;
+}
+
+/*
+ * Returns the host address that a thread waits to write to, or NULL if
+ * there is none at the moment.
+ */
+void *ram_write_tracking_get_fault(void)
+{
+    struct uffd_msg msg;
+    ssize_t ret;
+
+    do {
+        ret = read(wp_ufd, &msg, sizeof(msg));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != sizeof(msg)) {
+        /* EAGAIN: nobody is waiting */
+        return NULL;
+    }
+    if (msg.event != UFFD_EVENT_PAGEFAULT ||
+        !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+        return NULL;
+    }
+
+    trace_ram_write_tracking_fault(msg.arg.pagefault.address);
+    return (void *)(uintptr_t)msg.arg.pagefault.address;
+}
+
+/*
+ * Makes the @length bytes at @host writable again, once they have been
+ * saved.  Returns 0 on success
+ */
+int ram_write_tracking_release(void *host, size_t length)
+{
+    return wp_range_protect(wp_ufd, host, length, false);
+}
+
 #else
 /* No target OS support, stubs just fail */
 bool postcopy_ram_supported_by_host(void)
@@ -695,8 +1016,60 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+bool ram_write_tracking_supported(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int ram_write_tracking_start(void)
+{
+    assert(0);
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+void *ram_write_tracking_get_fault(void)
+{
+    assert(0);
+    return NULL;
+}
+
+int ram_write_tracking_release(void *host, size_t length)
+{
+    assert(0);
+    return -1;
+}
+
 #endif
 
+PostcopyFaultLatency *postcopy_fault_latency_get(void)
+{
+    PostcopyFaultLatency *info;
+    intList *bucket;
+    int i;
+
+    if (!fault_latency) {
+        return NULL;
+    }
+
+    info = g_new0(PostcopyFaultLatency, 1);
+    qemu_mutex_lock(&fault_latency->lock);
+    info->faults = fault_latency->faults;
+    info->max = fault_latency->max;
+    for (i = POSTCOPY_FAULT_LATENCY_BUCKETS - 1; i >= 0; i--) {
+        bucket = g_new0(intList, 1);
+        bucket->value = fault_latency->histogram[i];
+        bucket->next = info->histogram;
+        info->histogram = bucket;
+    }
+    qemu_mutex_unlock(&fault_latency->lock);
+    return info;
+}
+
 /* ------------------------------------------------------------------------- */
 
 /**
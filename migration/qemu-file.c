@@ -30,6 +30,7 @@
 #include "qemu/coroutine.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/compress.h"
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
@@ -273,6 +274,48 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Moves the underlying file to @offset, interpreted as in lseek(2), once
+ * the buffered data is written out or, when reading, dropped; SEEK_CUR is
+ * relative to what was consumed from the stream, not to the data read
+ * ahead.  qemu_ftell() keeps counting the bytes transferred.
+ *
+ * Returns the new offset in the file, or a negative error value, which is
+ * also set as the error of the stream.
+ */
+int64_t qemu_file_seek(QEMUFile *f, int64_t offset, int whence)
+{
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        int pending = f->buf_size - f->buf_index;
+
+        if (whence == SEEK_CUR) {
+            offset -= pending;
+        }
+        f->pos -= pending;
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = f->ops->seek(f->opaque, offset, whence);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -530,6 +573,11 @@ int64_t qemu_ftell_fast(QEMUFile *f)
     int64_t ret = f->pos;
     int i;
 
+    if (!qemu_file_is_writable(f)) {
+        /* What has been read ahead is not consumed yet */
+        return ret - (f->buf_size - f->buf_index);
+    }
+
     for (i = 0; i < f->iovcnt; i++) {
         ret += f->iov[i].iov_len;
     }
@@ -569,6 +617,15 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/*
+ * Count data that was sent on another channel against the rate limit,
+ * as if it had been written to @f.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -615,8 +672,8 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* Compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+/* Compress size bytes of data start at p with the compressor c
+ * and store the compressed data to the buffer of f.
  *
  * When f is not writable, return -1 if f has no space to save the
  * compressed data.
@@ -625,25 +682,29 @@ uint64_t qemu_get_be64(QEMUFile *f)
  * data, return -1.
  */
 
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
+ssize_t qemu_put_compression_data(QEMUFile *f, MigrationCompressor *c,
+                                  const uint8_t *p, size_t size)
 {
+    size_t bound = migration_compress_bound(migration_compressor_method(c),
+                                            size);
     ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
 
-    if (blen < compressBound(size)) {
+    if (blen < bound) {
         if (!qemu_file_is_writable(f)) {
             return -1;
         }
         qemu_fflush(f);
         blen = IO_BUF_SIZE - sizeof(int32_t);
-        if (blen < compressBound(size)) {
+        if (blen < bound) {
             return -1;
         }
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = migration_compress_page(c, p, size,
+                                   f->buf + f->buf_index + sizeof(int32_t),
+                                   blen);
+    if (blen < 0) {
         error_report("Compress Failed!");
-        return 0;
+        return -1;
     }
     qemu_put_be32(f, blen);
     if (f->ops->writev_buffer) {
@@ -28,7 +28,6 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "cpu.h"
-#include <zlib.h>
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
@@ -44,6 +43,9 @@
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
+#include "migration/compress.h"
+#include "io/channel.h"
+#include "qemu/iov.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -69,6 +71,13 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+
+/*
+ * Stream ids of compressed pages are sent as a byte: 0 is the migration
+ * thread, 1 to 255 are the compression threads.
+ */
+#define COMPRESS_STREAM_MAX 256
 
 static uint8_t *ZERO_TARGET_PAGE;
 
@@ -77,6 +86,18 @@ static inline bool is_zero_range(uint8_t *p, uint64_t size)
     return buffer_is_zero(p, size);
 }
 
+/*
+ * With ignore-shared, RAM blocks mapped with MAP_SHARED are left out of the
+ * RAM stream: the destination maps the same memory.
+ */
+static bool ramblock_is_ignored(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared(block);
+}
+
+/* Pages whose addresses hash to the same XBZRLE cache set */
+#define XBZRLE_CACHE_WAYS 8
+
 /* struct contains XBZRLE cache and a static page
    used by the compression */
 static struct {
@@ -126,7 +147,7 @@ int64_t xbzrle_cache_resize(int64_t new_size)
             goto out_new_size;
         }
         new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
+                               TARGET_PAGE_SIZE, XBZRLE_CACHE_WAYS);
         if (!new_cache) {
             error_report("Error creating cache");
             ret = -1;
@@ -155,6 +176,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -219,6 +242,24 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+double xbzrle_mig_cache_hit_rate(void)
+{
+    uint64_t lookups = acct_info.xbzrle_cache_hit +
+                       acct_info.xbzrle_cache_miss;
+
+    return lookups ? (double)acct_info.xbzrle_cache_hit / lookups : 0;
+}
+
+uint64_t xbzrle_mig_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -261,6 +302,9 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    MigrationCompressor *comp;
+    /* Stream id of comp, sent with each page if the method is streaming */
+    int stream;
 };
 typedef struct CompressParam CompressParam;
 
@@ -272,6 +316,7 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
+    MigrationDecompressor *decomp;
 };
 typedef struct DecompressParam DecompressParam;
 
@@ -286,107 +331,1121 @@ static QemuCond comp_done_cond;
 /* The empty QEMUFileOps will be used by file in CompressParam */
 static const QEMUFileOps empty_ops = { };
 
+/* Used by the migration thread for the first page of each block */
+static MigrationCompressor *comp_main;
+
 static bool compression_switch;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
+/* Method used by the source, from the configuration section */
+static MigrationCompressMethod decompress_method;
+/* One decompressor per stream of the source, created on first use */
+static MigrationDecompressor *decomp_streams[COMPRESS_STREAM_MAX];
+static bool decompress_failed;
+
+static int do_compress_ram_page(QEMUFile *f, MigrationCompressor *comp,
+                                int stream, RAMBlock *block,
+                                ram_addr_t offset);
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->block) {
+            block = param->block;
+            offset = param->offset;
+            param->block = NULL;
+            qemu_mutex_unlock(&param->mutex);
+
+            do_compress_ram_page(param->file, param->comp, param->stream,
+                                 block, offset);
+
+            qemu_mutex_lock(&comp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&comp_done_cond);
+            qemu_mutex_unlock(&comp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static inline void terminate_compression_threads(void)
+{
+    int idx, thread_count;
+
+    thread_count = migrate_compress_threads();
+    for (idx = 0; idx < thread_count; idx++) {
+        qemu_mutex_lock(&comp_param[idx].mutex);
+        comp_param[idx].quit = true;
+        qemu_cond_signal(&comp_param[idx].cond);
+        qemu_mutex_unlock(&comp_param[idx].mutex);
+    }
+}
+
+void migrate_compress_threads_join(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    terminate_compression_threads();
+    thread_count = migrate_compress_threads();
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_join(compress_threads + i);
+        qemu_fclose(comp_param[i].file);
+        migration_compressor_free(comp_param[i].comp);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+    }
+    migration_compressor_free(comp_main);
+    comp_main = NULL;
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(compress_threads);
+    g_free(comp_param);
+    compress_threads = NULL;
+    comp_param = NULL;
+}
+
+void migrate_compress_threads_create(void)
+{
+    MigrationCompressMethod method = migrate_compress_method();
+    int level = migrate_compress_level();
+    int i, thread_count;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    compression_switch = true;
+    comp_main = migration_compressor_new(method, level, TARGET_PAGE_SIZE);
+    thread_count = migrate_compress_threads();
+    compress_threads = g_new0(QemuThread, thread_count);
+    comp_param = g_new0(CompressParam, thread_count);
+    qemu_cond_init(&comp_done_cond);
+    qemu_mutex_init(&comp_done_lock);
+    for (i = 0; i < thread_count; i++) {
+        /* comp_param[i].file is just used as a dummy buffer to save data,
+         * set its ops to empty.
+         */
+        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].done = true;
+        comp_param[i].quit = false;
+        comp_param[i].comp = migration_compressor_new(method, level,
+                                                      TARGET_PAGE_SIZE);
+        comp_param[i].stream = i + 1;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(compress_threads + i, "compress",
+                           do_data_compress, comp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Multiple channels */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* The packet carries no pages, it only marks the end of a sync round */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Target pages that are sent together in one packet */
+#define MULTIFD_PAGES_PER_PACKET 64
+
+/* Sent once on every channel, before any packet */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+} QEMU_PACKED MultiFDInit;
+
+/* Only the first @pages entries of @offset are sent, followed by the pages */
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t pages;
+    uint32_t unused;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+} QEMU_PACKED MultiFDPacket;
+
+#define MULTIFD_PACKET_HDR_SIZE (offsetof(MultiFDPacket, offset))
+
+typedef struct {
+    RAMBlock *block;
+    uint32_t used;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted whenever a job or a sync is queued, or on quit */
+    QemuSemaphore sem;
+    /* protects everything below */
+    QemuMutex mutex;
+    bool running;
+    bool quit;
+    /* @pages is owned by the thread until the packet has been sent */
+    bool pending_job;
+    bool pending_sync;
+    MultiFDPages *pages;
+    uint64_t packet_num;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET + 1];
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* pages collected by the migration thread for the next packet */
+    MultiFDPages *pages;
+    /* posted by every channel that has no pending job */
+    QemuSemaphore channels_ready;
+    /* posted by every channel once it has sent a sync packet */
+    QemuSemaphore sem_sync;
+    int next_channel;
+    /* set once a channel failed */
+    bool quit;
+    /* bitmap_sync_count when the last sync marker was sent */
+    uint64_t synced_bitmap;
+} *multifd_send_state;
+
+/* Normal pages handed to each channel by the last multifd migration */
+static struct {
+    int count;
+    uint64_t *pages;
+} multifd_send_stats;
+
+/* Returns NULL unless the last outgoing migration used multifd */
+intList *multifd_pages_transferred(void)
+{
+    intList *head = NULL;
+    int i;
+
+    for (i = multifd_send_stats.count - 1; i >= 0; i--) {
+        intList *entry = g_new0(intList, 1);
+
+        entry->value = atomic_read(&multifd_send_stats.pages[i]);
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
+static int multifd_writev_all(QIOChannel *ioc, struct iovec *iov,
+                              unsigned int niov, Error **errp)
+{
+    while (niov) {
+        ssize_t len = qio_channel_writev(ioc, iov, niov, errp);
+
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_wait(ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        iov_discard_front(&iov, &niov, len);
+    }
+    return 0;
+}
+
+/*
+ * Fail the migration after an error on one of the channels, and make sure
+ * that the migration thread does not wait for any of them any more.
+ */
+static void multifd_send_terminate_threads(Error *err)
+{
+    int i;
+
+    if (err) {
+        MigrationState *s = migrate_get_current();
+
+        error_report_err(err);
+        if (s->to_dst_file) {
+            qemu_file_set_error(s->to_dst_file, -EIO);
+        }
+    }
+    atomic_set(&multifd_send_state->quit, true);
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+        qemu_sem_post(&multifd_send_state->channels_ready);
+        qemu_sem_post(&multifd_send_state->sem_sync);
+    }
+}
+
+/*
+ * With mapped-ram, the pages go to their place in the file instead of a
+ * packet; runs of consecutive pages are written at once.
+ */
+static int multifd_pwrite_pages(MultiFDSendParams *p, uint32_t used,
+                                Error **errp)
+{
+    RAMBlock *block = p->pages->block;
+    ram_addr_t *offset = p->pages->offset;
+    uint32_t i, j;
+
+    for (i = 0; i < used; i = j) {
+        for (j = i + 1; j < used &&
+             offset[j] == offset[j - 1] + TARGET_PAGE_SIZE; j++) {
+        }
+        if (file_pwrite_all(p->c, block->host + offset[i],
+                            (j - i) * TARGET_PAGE_SIZE,
+                            block->pages_offset + offset[i], errp) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDInit init = {
+        .magic = cpu_to_be32(MULTIFD_MAGIC),
+        .version = cpu_to_be32(MULTIFD_VERSION),
+        .id = cpu_to_be32(p->id),
+    };
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    Error *local_err = NULL;
+    int ret;
+
+    if (!migrate_mapped_ram() &&
+        multifd_writev_all(p->c, &iov, 1, &local_err) < 0) {
+        goto out;
+    }
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        MultiFDPacket *packet = &p->packet;
+        uint32_t used = 0, flags = 0, i;
+
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job) {
+            used = p->pages->used;
+            pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                    p->pages->block->idstr);
+            for (i = 0; i < used; i++) {
+                ram_addr_t offset = p->pages->offset[i];
+
+                packet->offset[i] = cpu_to_be64(offset);
+                p->iov[i + 1].iov_base = p->pages->block->host + offset;
+                p->iov[i + 1].iov_len = TARGET_PAGE_SIZE;
+            }
+        } else if (p->pending_sync) {
+            flags = MULTIFD_FLAG_SYNC;
+            p->pending_sync = false;
+            packet->ramblock[0] = '\0';
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+            continue;
+        }
+        packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+        packet->flags = cpu_to_be32(flags);
+        packet->pages = cpu_to_be32(used);
+        packet->packet_num = cpu_to_be64(p->packet_num++);
+        qemu_mutex_unlock(&p->mutex);
+
+        if (migrate_mapped_ram()) {
+            ret = multifd_pwrite_pages(p, used, &local_err);
+        } else {
+            p->iov[0].iov_base = packet;
+            p->iov[0].iov_len = MULTIFD_PACKET_HDR_SIZE +
+                                used * sizeof(uint64_t);
+            ret = multifd_writev_all(p->c, p->iov, used + 1, &local_err);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        if (used) {
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else {
+            qemu_sem_post(&multifd_send_state->sem_sync);
+        }
+    }
+
+out:
+    if (local_err && atomic_read(&multifd_send_state->quit)) {
+        /* Shut down by multifd_save_cleanup() or by another channel */
+        error_free(local_err);
+    } else if (local_err) {
+        multifd_send_terminate_threads(local_err);
+    }
+    return NULL;
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    multifd_send_terminate_threads(NULL);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->running) {
+            /* A thread stuck in a write must not block the join */
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_thread_join(&p->thread);
+        }
+        object_unref(OBJECT(p->c));
+        qemu_sem_destroy(&p->sem);
+        qemu_mutex_destroy(&p->mutex);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+int multifd_save_setup(Error **errp)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (migrate_get_current()->parameters.tls_creds) {
+        error_setg(errp, "Multifd does not support TLS");
+        return -1;
+    }
+
+    thread_count = migrate_multifd_channels();
+    g_free(multifd_send_stats.pages);
+    multifd_send_stats.pages = g_new0(uint64_t, thread_count);
+    multifd_send_stats.count = thread_count;
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        char *name;
+
+        if (migrate_mapped_ram()) {
+            p->c = file_channel_create(migrate_direct_io(), errp);
+        } else {
+            p->c = socket_send_channel_create(errp);
+        }
+        if (!p->c) {
+            multifd_save_cleanup();
+            return -1;
+        }
+        multifd_send_state->count++;
+        qio_channel_set_blocking(p->c, true, NULL);
+
+        p->id = i;
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_sem_init(&p->sem, 0);
+        qemu_mutex_init(&p->mutex);
+        p->running = true;
+        name = g_strdup_printf("multifdsend_%d", i);
+        qemu_thread_create(&p->thread, name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+    return 0;
+}
+
+/*
+ * Hand the collected pages to the next idle channel.
+ *
+ * Returns 0 on success, -1 if the channels failed.
+ */
+static int multifd_send_pages(void)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    int i;
+
+    if (atomic_read(&multifd_send_state->quit)) {
+        return -1;
+    }
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    i = multifd_send_state->next_channel;
+    while (true) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+        i = (i + 1) % multifd_send_state->count;
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+    atomic_set(&multifd_send_stats.pages[i],
+               multifd_send_stats.pages[i] + pages->used);
+
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    p->pending_job = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+    return 0;
+}
+
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->block && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    if (pages->used == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+    return 0;
+}
+
+/* Mapped RAM */
+
+#define MAPPED_RAM_HDR_VERSION 1
+
+/* The pages of every RAM block start at this alignment in the file */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT (1024 * 1024)
+
+/* Size of the header that follows every RAM block in the setup stage */
+#define MAPPED_RAM_HDR_SIZE (4 + 3 * 8)
+
+/*
+ * Channel on the migration file for the bitmaps and, without multifd, for
+ * the pages that the migration thread writes.
+ */
+static QIOChannel *mapped_ram_ioc;
+
+/* On the destination, channel with O_DIRECT to read the pages */
+static QIOChannel *mapped_ram_direct_ioc;
+
+typedef struct {
+    QemuThread thread;
+    RAMBlock *block;
+    QIOChannel *ioc;
+    unsigned long *bmap;
+    unsigned long start;
+    unsigned long end;
+    Error *err;
+} MappedRamLoadParams;
+
+/* The bitmap in the file has one bit per target page, starting with the
+ * least significant bit of the first byte.
+ */
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS,
+                        BITS_PER_BYTE);
+}
+
+static void mapped_ram_cleanup(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    rcu_read_unlock();
+
+    if (mapped_ram_ioc) {
+        object_unref(OBJECT(mapped_ram_ioc));
+        mapped_ram_ioc = NULL;
+    }
+    if (mapped_ram_direct_ioc) {
+        object_unref(OBJECT(mapped_ram_direct_ioc));
+        mapped_ram_direct_ioc = NULL;
+    }
+}
+
+/*
+ * Lay out the regions of @block in the file, after its header in the
+ * stream: the bitmap of the pages present, then the pages at their offset
+ * in the block.  The stream goes on after them.
+ */
+static int mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    int64_t pos = qemu_file_seek(f, 0, SEEK_CUR);
+
+    if (pos < 0) {
+        return pos;
+    }
+
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    block->bitmap_offset = pos + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block),
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+    trace_mapped_ram_setup_block(block->idstr, block->bitmap_offset,
+                                 block->pages_offset);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    pos = qemu_file_seek(f, block->pages_offset + block->used_length,
+                         SEEK_SET);
+    return pos < 0 ? pos : 0;
+}
+
+/*
+ * Write the page at @offset of @block to its place in the file, either
+ * from one of the multifd threads or from here.  Zero pages are not
+ * written, only left out of the bitmap.
+ *
+ * Returns the number of pages written, or -1 on error.
+ */
+static int mapped_ram_save_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset,
+                                uint64_t *bytes_transferred)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    Error *local_err = NULL;
+
+    if (!block->file_bmap) {
+        error_report("RAM block %s has no place in the mapped-ram file",
+                     block->idstr);
+        qemu_file_set_error(f, -EINVAL);
+        return -1;
+    }
+
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    if (migrate_use_multifd()) {
+        if (multifd_queue_page(block, offset) < 0) {
+            return -1;
+        }
+    } else if (file_pwrite_all(mapped_ram_ioc, block->host + offset,
+                               TARGET_PAGE_SIZE, block->pages_offset + offset,
+                               &local_err) < 0) {
+        error_report_err(local_err);
+        qemu_file_set_error(f, -EIO);
+        return -1;
+    }
+
+    /* Account for it in the main stream, for rate limiting and stats */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
+}
+
+/* Called once all the pages are written */
+static int mapped_ram_save_bitmaps(void)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t size = mapped_ram_bitmap_size(block);
+        Error *local_err = NULL;
+        unsigned long page;
+        uint8_t *buf;
+        int ret;
+
+        /* Not in the file, e.g. ignored */
+        if (!block->file_bmap) {
+            continue;
+        }
+        buf = g_malloc0(size);
+        for (page = find_first_bit(block->file_bmap, pages); page < pages;
+             page = find_next_bit(block->file_bmap, pages, page + 1)) {
+            buf[page / BITS_PER_BYTE] |= 1 << (page % BITS_PER_BYTE);
+        }
+        ret = file_pwrite_all(mapped_ram_ioc, buf, size, block->bitmap_offset,
+                              &local_err);
+        g_free(buf);
+        if (ret < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int mapped_ram_load_setup(void)
+{
+    Error *local_err = NULL;
+
+    mapped_ram_ioc = file_channel_create(false, &local_err);
+    if (mapped_ram_ioc && migrate_direct_io()) {
+        mapped_ram_direct_ioc = file_channel_create(true, &local_err);
+    }
+    if (local_err) {
+        error_report_err(local_err);
+        mapped_ram_cleanup();
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Read the pages from p->start to p->end of a block, in runs */
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoadParams *p = opaque;
+    RAMBlock *block = p->block;
+    unsigned long page = p->start, next;
+
+    while (page < p->end) {
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+        ram_addr_t len;
+
+        if (test_bit(page, p->bmap)) {
+            next = find_next_zero_bit(p->bmap, p->end, page);
+            len = (ram_addr_t)(next - page) << TARGET_PAGE_BITS;
+            if (file_pread_all(p->ioc, block->host + offset, len,
+                               block->pages_offset + offset, &p->err) < 0) {
+                break;
+            }
+        } else {
+            /* Not in the file, the pages were zero on the source */
+            next = find_next_bit(p->bmap, p->end, page);
+            len = (ram_addr_t)(next - page) << TARGET_PAGE_BITS;
+            ram_handle_compressed(block->host + offset, 0, len);
+        }
+        page = next;
+    }
+    return NULL;
+}
+
+/*
+ * Load @block from the mapped-ram file, after its header in the stream.
+ * The pages are split between multifd-channels threads with multifd, and
+ * the stream is then moved after the regions of the block.
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t size = mapped_ram_bitmap_size(block);
+    int threads = migrate_use_multifd() ? migrate_multifd_channels() : 1;
+    unsigned long chunk = DIV_ROUND_UP(pages, threads);
+    MappedRamLoadParams *params;
+    Error *local_err = NULL;
+    unsigned long *bmap, page;
+    uint32_t version;
+    uint64_t page_size;
+    uint8_t *buf;
+    int64_t pos;
+    int i, ret = 0;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (version != MAPPED_RAM_HDR_VERSION || page_size != TARGET_PAGE_SIZE) {
+        error_report("Unsupported mapped-ram header for RAM block %s: "
+                     "version %" PRIu32 ", page size %" PRIu64,
+                     block->idstr, version, page_size);
+        return -EINVAL;
+    }
+    if (block->bitmap_offset < 0 ||
+        block->pages_offset < block->bitmap_offset + (off_t)size ||
+        block->pages_offset & (TARGET_PAGE_SIZE - 1)) {
+        error_report("Invalid mapped-ram regions for RAM block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    buf = g_malloc(size);
+    if (file_pread_all(mapped_ram_ioc, buf, size, block->bitmap_offset,
+                       &local_err) < 0) {
+        error_report_err(local_err);
+        g_free(buf);
+        return -EIO;
+    }
+    bmap = bitmap_new(pages);
+    for (page = 0; page < pages; page++) {
+        if (buf[page / BITS_PER_BYTE] & (1 << (page % BITS_PER_BYTE))) {
+            set_bit(page, bmap);
+        }
+    }
+    g_free(buf);
+
+    trace_mapped_ram_load_block(block->idstr, pages, threads);
+    params = g_new0(MappedRamLoadParams, threads);
+    for (i = 0; i < threads; i++) {
+        MappedRamLoadParams *p = &params[i];
+
+        p->block = block;
+        p->ioc = mapped_ram_direct_ioc ? mapped_ram_direct_ioc
+                                       : mapped_ram_ioc;
+        p->bmap = bmap;
+        p->start = MIN(i * chunk, pages);
+        p->end = MIN(p->start + chunk, pages);
+        if (threads == 1) {
+            mapped_ram_load_thread(p);
+        } else {
+            char *name = g_strdup_printf("mappedram_%d", i);
+
+            qemu_thread_create(&p->thread, name, mapped_ram_load_thread, p,
+                               QEMU_THREAD_JOINABLE);
+            g_free(name);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        MappedRamLoadParams *p = &params[i];
+
+        if (threads > 1) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->err && !ret) {
+            error_report_err(p->err);
+            ret = -EIO;
+        } else if (p->err) {
+            error_free(p->err);
+        }
+    }
+    g_free(params);
+    g_free(bmap);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pos = qemu_file_seek(f, block->pages_offset + block->used_length,
+                         SEEK_SET);
+    return pos < 0 ? pos : 0;
+}
+
+/* Postcopy preempt channel */
+
+#define POSTCOPY_PREEMPT_MAGIC 0x50524d50U
+#define POSTCOPY_PREEMPT_VERSION 1
+
+/* The host page is all zeroes, its data is not sent */
+#define POSTCOPY_PREEMPT_FLAG_ZERO (1 << 0)
+/* No page follows, the source is done with the channel */
+#define POSTCOPY_PREEMPT_FLAG_EOS  (1 << 1)
+
+/* Sent once on the channel, before any packet */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} QEMU_PACKED PostcopyPreemptInit;
+
+/* Followed by one host page, unless one of the flags is set */
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t offset;
+    char ramblock[256];
+} QEMU_PACKED PostcopyPreemptPacket;
+
+static struct {
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted for every queued request, for the end of stream, or on quit */
+    QemuSemaphore sem;
+    /* posted once the thread is done with the channel */
+    QemuSemaphore sem_done;
+    PostcopyPreemptPacket packet;
+    /* protects everything below */
+    QemuMutex mutex;
+    QSIMPLEQ_HEAD(, MigrationSrcPageRequest) requests;
+    bool eos;
+    bool quit;
+} *postcopy_preempt_send_state;
+
+/* Bytes sent on the preempt channel, for ram_bytes_transferred() */
+static uint64_t postcopy_preempt_bytes;
+
+/*
+ * Clears the dirty bits of the host page at @offset of @block, unless some
+ * of its target pages are already sent.  The migration thread may be in the
+ * middle of that host page, and the destination needs to receive every
+ * host page in full on one channel; it will finish the page itself then.
+ *
+ * Returns true if the host page is to be sent on the preempt channel.
+ */
+static bool postcopy_preempt_claim_page(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    unsigned long nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    unsigned long n = qemu_host_page_size >> TARGET_PAGE_BITS;
+    bool claimed;
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    claimed = find_next_zero_bit(bitmap, nr + n, nr) == nr + n;
+    if (claimed) {
+        bitmap_clear(bitmap, nr, n);
+        migration_dirty_pages -= n;
+    }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+    return claimed;
+}
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int postcopy_preempt_send_packet(RAMBlock *block, ram_addr_t offset,
+                                        uint32_t flags, Error **errp)
+{
+    PostcopyPreemptPacket *packet = &postcopy_preempt_send_state->packet;
+    struct iovec iov[2] = {
+        { .iov_base = packet, .iov_len = sizeof(*packet) },
+    };
+    unsigned int niov = 1;
+
+    packet->magic = cpu_to_be32(POSTCOPY_PREEMPT_MAGIC);
+    packet->offset = cpu_to_be64(offset);
+    if (block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock), block->idstr);
+        if (buffer_is_zero(block->host + offset, qemu_host_page_size)) {
+            flags |= POSTCOPY_PREEMPT_FLAG_ZERO;
+        } else {
+            iov[1].iov_base = block->host + offset;
+            iov[1].iov_len = qemu_host_page_size;
+            niov = 2;
+        }
+        trace_postcopy_preempt_send_page(block->idstr, offset, flags);
+    } else {
+        packet->ramblock[0] = '\0';
+    }
+    packet->flags = cpu_to_be32(flags);
 
-static void *do_data_compress(void *opaque)
+    if (multifd_writev_all(postcopy_preempt_send_state->c, iov, niov,
+                           errp) < 0) {
+        return -1;
+    }
+    postcopy_preempt_bytes += sizeof(*packet) + (niov > 1 ?
+                                                 qemu_host_page_size : 0);
+    return 0;
+}
+
+static int postcopy_preempt_send_request(struct MigrationSrcPageRequest *req,
+                                         Error **errp)
 {
-    CompressParam *param = opaque;
-    RAMBlock *block;
     ram_addr_t offset;
+    int ret = 0;
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->block) {
-            block = param->block;
-            offset = param->offset;
-            param->block = NULL;
-            qemu_mutex_unlock(&param->mutex);
+    rcu_read_lock();
+    for (offset = req->offset & qemu_host_page_mask;
+         offset < req->offset + req->len;
+         offset += qemu_host_page_size) {
+        if (postcopy_preempt_claim_page(req->rb, offset)) {
+            ret = postcopy_preempt_send_packet(req->rb, offset, 0, errp);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *postcopy_preempt_send_thread(void *opaque)
+{
+    PostcopyPreemptInit init = {
+        .magic = cpu_to_be32(POSTCOPY_PREEMPT_MAGIC),
+        .version = cpu_to_be32(POSTCOPY_PREEMPT_VERSION),
+    };
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    struct MigrationSrcPageRequest *req;
+    Error *local_err = NULL;
+    bool eos = false;
+    int ret;
 
-            do_compress_ram_page(param->file, block, offset);
+    rcu_register_thread();
 
-            qemu_mutex_lock(&comp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&comp_done_cond);
-            qemu_mutex_unlock(&comp_done_lock);
+    if (multifd_writev_all(postcopy_preempt_send_state->c, &iov, 1,
+                           &local_err) < 0) {
+        goto out;
+    }
 
-            qemu_mutex_lock(&param->mutex);
+    while (!eos) {
+        ret = 0;
+        qemu_sem_wait(&postcopy_preempt_send_state->sem);
+        qemu_mutex_lock(&postcopy_preempt_send_state->mutex);
+        if (postcopy_preempt_send_state->quit) {
+            qemu_mutex_unlock(&postcopy_preempt_send_state->mutex);
+            break;
+        }
+        /* Requests queued before the end of stream are still served */
+        req = QSIMPLEQ_FIRST(&postcopy_preempt_send_state->requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&postcopy_preempt_send_state->requests,
+                                 next_req);
         } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+            eos = postcopy_preempt_send_state->eos;
+        }
+        qemu_mutex_unlock(&postcopy_preempt_send_state->mutex);
+
+        if (req) {
+            ret = postcopy_preempt_send_request(req, &local_err);
+            memory_region_unref(req->rb->mr);
+            g_free(req);
+        } else if (eos) {
+            ret = postcopy_preempt_send_packet(NULL, 0,
+                                               POSTCOPY_PREEMPT_FLAG_EOS,
+                                               &local_err);
+        }
+        if (ret < 0) {
+            break;
         }
     }
-    qemu_mutex_unlock(&param->mutex);
 
+out:
+    if (local_err && !atomic_read(&postcopy_preempt_send_state->quit)) {
+        MigrationState *s = migrate_get_current();
+
+        error_report_err(local_err);
+        qemu_file_set_error(s->to_dst_file, -EIO);
+    } else {
+        error_free(local_err);
+    }
+    qemu_sem_post(&postcopy_preempt_send_state->sem_done);
+    rcu_unregister_thread();
     return NULL;
 }
 
-static inline void terminate_compression_threads(void)
+int postcopy_preempt_setup(Error **errp)
 {
-    int idx, thread_count;
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+    if (migrate_get_current()->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS");
+        return -1;
+    }
 
-    thread_count = migrate_compress_threads();
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        comp_param[idx].quit = true;
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+    postcopy_preempt_send_state = g_new0(typeof(*postcopy_preempt_send_state),
+                                         1);
+    postcopy_preempt_send_state->c = socket_send_channel_create(errp);
+    if (!postcopy_preempt_send_state->c) {
+        g_free(postcopy_preempt_send_state);
+        postcopy_preempt_send_state = NULL;
+        return -1;
     }
+    qio_channel_set_blocking(postcopy_preempt_send_state->c, true, NULL);
+    qemu_sem_init(&postcopy_preempt_send_state->sem, 0);
+    qemu_sem_init(&postcopy_preempt_send_state->sem_done, 0);
+    qemu_mutex_init(&postcopy_preempt_send_state->mutex);
+    QSIMPLEQ_INIT(&postcopy_preempt_send_state->requests);
+    postcopy_preempt_bytes = 0;
+
+    qemu_thread_create(&postcopy_preempt_send_state->thread,
+                       "postcopy/preempt", postcopy_preempt_send_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    return 0;
 }
 
-void migrate_compress_threads_join(void)
+void postcopy_preempt_save_cleanup(void)
 {
-    int i, thread_count;
+    struct MigrationSrcPageRequest *req, *next;
 
-    if (!migrate_use_compression()) {
+    if (!postcopy_preempt_send_state) {
         return;
     }
-    terminate_compression_threads();
-    thread_count = migrate_compress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
+    qemu_mutex_lock(&postcopy_preempt_send_state->mutex);
+    atomic_set(&postcopy_preempt_send_state->quit, true);
+    qemu_mutex_unlock(&postcopy_preempt_send_state->mutex);
+    qemu_sem_post(&postcopy_preempt_send_state->sem);
+
+    /* A thread stuck in a write must not block the join */
+    qio_channel_shutdown(postcopy_preempt_send_state->c,
+                         QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    qemu_thread_join(&postcopy_preempt_send_state->thread);
+    object_unref(OBJECT(postcopy_preempt_send_state->c));
+
+    rcu_read_lock();
+    QSIMPLEQ_FOREACH_SAFE(req, &postcopy_preempt_send_state->requests,
+                          next_req, next) {
+        memory_region_unref(req->rb->mr);
+        g_free(req);
     }
-    qemu_mutex_destroy(&comp_done_lock);
-    qemu_cond_destroy(&comp_done_cond);
-    g_free(compress_threads);
-    g_free(comp_param);
-    compress_threads = NULL;
-    comp_param = NULL;
+    rcu_read_unlock();
+
+    qemu_sem_destroy(&postcopy_preempt_send_state->sem);
+    qemu_sem_destroy(&postcopy_preempt_send_state->sem_done);
+    qemu_mutex_destroy(&postcopy_preempt_send_state->mutex);
+    g_free(postcopy_preempt_send_state);
+    postcopy_preempt_send_state = NULL;
 }
 
-void migrate_compress_threads_create(void)
+/* Called from the return path thread */
+static void postcopy_preempt_queue_request(struct MigrationSrcPageRequest *req)
 {
-    int i, thread_count;
+    qemu_mutex_lock(&postcopy_preempt_send_state->mutex);
+    QSIMPLEQ_INSERT_TAIL(&postcopy_preempt_send_state->requests, req,
+                         next_req);
+    qemu_mutex_unlock(&postcopy_preempt_send_state->mutex);
+    qemu_sem_post(&postcopy_preempt_send_state->sem);
+}
 
-    if (!migrate_use_compression()) {
+/*
+ * Called by the migration thread once all RAM is sent, so that the
+ * destination knows that no page is in flight on the preempt channel any
+ * more when it reaches the end of the main stream.
+ */
+static void postcopy_preempt_send_eos(void)
+{
+    bool wait;
+
+    if (!postcopy_preempt_send_state) {
         return;
     }
-    compression_switch = true;
-    thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
-    comp_param = g_new0(CompressParam, thread_count);
-    qemu_cond_init(&comp_done_cond);
-    qemu_mutex_init(&comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        comp_param[i].quit = false;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
-        qemu_thread_create(compress_threads + i, "compress",
-                           do_data_compress, comp_param + i,
-                           QEMU_THREAD_JOINABLE);
+    qemu_mutex_lock(&postcopy_preempt_send_state->mutex);
+    wait = !postcopy_preempt_send_state->eos;
+    postcopy_preempt_send_state->eos = true;
+    qemu_mutex_unlock(&postcopy_preempt_send_state->mutex);
+
+    if (wait) {
+        qemu_sem_post(&postcopy_preempt_send_state->sem);
+        qemu_sem_wait(&postcopy_preempt_send_state->sem_done);
     }
 }
 
@@ -439,6 +1498,18 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/* cache_insert() that accounts for the pages it evicts */
+static int xbzrle_cache_insert(ram_addr_t current_addr, const uint8_t *data)
+{
+    uint64_t evictions = cache_get_evictions(XBZRLE.cache);
+    int ret;
+
+    ret = cache_insert(XBZRLE.cache, current_addr, data, bitmap_sync_count);
+    acct_info.xbzrle_cache_evictions += cache_get_evictions(XBZRLE.cache) -
+                                        evictions;
+    return ret;
+}
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -453,8 +1524,7 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
-                 bitmap_sync_count);
+    xbzrle_cache_insert(current_addr, ZERO_TARGET_PAGE);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -485,8 +1555,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             bitmap_sync_count) == -1) {
+            if (xbzrle_cache_insert(current_addr, *current_data) == -1) {
                 return -1;
             } else {
                 /* update *current_data when the page has been
@@ -496,6 +1565,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         }
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -576,20 +1646,102 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     int nr = addr >> TARGET_PAGE_BITS;
     unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
 
+    /* The postcopy preempt thread sends pages too */
+    if (postcopy_preempt_send_state) {
+        qemu_mutex_lock(&migration_bitmap_mutex);
+    }
     ret = test_and_clear_bit(nr, bitmap);
 
     if (ret) {
         migration_dirty_pages--;
     }
+    if (postcopy_preempt_send_state) {
+        qemu_mutex_unlock(&migration_bitmap_mutex);
+    }
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+/* Returns the number of pages that became dirty in the migration bitmap */
+static uint64_t migration_bitmap_sync_range(ram_addr_t start,
+                                            ram_addr_t length)
 {
     unsigned long *bitmap;
     bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    return cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+}
+
+/*
+ * Bytes of RAM whose dirty log is merged into the migration bitmap at a
+ * time, without the iothread lock, by migration_bitmap_sync_chunked()
+ */
+#define MIGRATION_BITMAP_SYNC_CHUNK (1ULL << 30)
+
+/* Called with the iothread lock held */
+static void migration_bitmap_sync_all(void)
+{
+    RAMBlock *block;
+
+    memory_global_dirty_log_sync();
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
+        migration_dirty_pages +=
+            migration_bitmap_sync_range(block->offset, block->used_length);
+    }
+    rcu_read_unlock();
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+}
+
+/*
+ * Called without the iothread lock.  The lock is only taken to pull the
+ * dirty log of one RAMBlock out of the accelerator, which cannot be split
+ * further as e.g. KVM syncs whole memory slots.  The log is then merged
+ * into the migration bitmap in chunks, with the lock released, so that
+ * vCPUs and devices are never stalled for more than one RAMBlock.
+ *
+ * Returns the number of pages that became dirty in the migration bitmap;
+ * the caller adds it to migration_dirty_pages under the iothread lock, as
+ * migration_bitmap_extend() does.
+ */
+static uint64_t migration_bitmap_sync_chunked(void)
+{
+    RAMBlock *block;
+    ram_addr_t used_length, offset, len;
+    int64_t start, hold, max_hold = 0;
+    unsigned int slices = 0;
+    uint64_t num_dirty = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
+        qemu_mutex_lock_iothread();
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        memory_region_sync_dirty_bitmap(block->mr);
+        used_length = block->used_length;
+        hold = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        qemu_mutex_unlock_iothread();
+
+        max_hold = MAX(max_hold, hold);
+        slices++;
+
+        for (offset = 0; offset < used_length; offset += len) {
+            len = MIN(used_length - offset, MIGRATION_BITMAP_SYNC_CHUNK);
+            qemu_mutex_lock(&migration_bitmap_mutex);
+            num_dirty += migration_bitmap_sync_range(block->offset + offset,
+                                                     len);
+            qemu_mutex_unlock(&migration_bitmap_mutex);
+        }
+    }
+    rcu_read_unlock();
+
+    trace_migration_bitmap_sync_chunked(slices, max_hold);
+    return num_dirty;
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -608,9 +1760,12 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
-static void migration_bitmap_sync(void)
+/*
+ * Called with the iothread lock held, unless @chunked; in that case the
+ * lock is only held for short periods, see migration_bitmap_sync_chunked().
+ */
+static void migration_bitmap_sync(bool chunked)
 {
-    RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     int64_t end_time;
@@ -627,15 +1782,14 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
-    memory_global_dirty_log_sync();
+    if (chunked) {
+        uint64_t num_dirty = migration_bitmap_sync_chunked();
 
-    qemu_mutex_lock(&migration_bitmap_mutex);
-    rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+        qemu_mutex_lock_iothread();
+        migration_dirty_pages += num_dirty;
+    } else {
+        migration_bitmap_sync_all();
     }
-    rcu_read_unlock();
-    qemu_mutex_unlock(&migration_bitmap_mutex);
 
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
@@ -683,6 +1837,10 @@ static void migration_bitmap_sync(void)
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(bitmap_sync_count, NULL);
     }
+
+    if (chunked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 /**
@@ -735,12 +1893,17 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     ram_addr_t current_addr;
     uint8_t *p;
     int ret;
-    bool send_async = true;
+    /* A background snapshot lets the guest write to the page once it's sent */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
 
     p = block->host + offset;
 
+    if (migrate_mapped_ram()) {
+        return mapped_ram_save_page(f, block, offset, bytes_transferred);
+    }
+
     /* In doubt sent page as normal */
     bytes_xmit = 0;
     ret = ram_control_save_page(f, block->offset,
@@ -754,7 +1917,10 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
 
     current_addr = block->offset + offset;
 
-    if (block == last_sent_block) {
+    /* With multifd, the last page of the main stream may be from an older
+     * block than last_sent_block, so always name the block.
+     */
+    if (block == last_sent_block && !migrate_use_multifd()) {
         offset |= RAM_SAVE_FLAG_CONTINUE;
     }
     if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
@@ -786,6 +1952,20 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         }
     }
 
+    /* Normal page that one of the multifd channels can send */
+    if (pages == -1 && send_async && migrate_use_multifd()) {
+        if (multifd_queue_page(block, pss->offset) < 0) {
+            XBZRLE_cache_unlock();
+            return -1;
+        }
+        /* Account for it in the main stream, for rate limiting and stats */
+        qemu_update_position(f, TARGET_PAGE_SIZE);
+        qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
@@ -805,16 +1985,36 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
+/*
+ * save_compress_page_header: write the header of a compressed page
+ *
+ * Streaming methods are followed by the id of the stream that compressed
+ * the page, so that the destination can feed all the pages of a stream to
+ * the same decompressor.
+ */
+static size_t save_compress_page_header(QEMUFile *f, MigrationCompressor *comp,
+                                        int stream, RAMBlock *block,
+                                        ram_addr_t offset)
+{
+    size_t size;
+
+    size = save_page_header(f, block, offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+    if (migration_compress_is_streaming(migration_compressor_method(comp))) {
+        qemu_put_byte(f, stream);
+        size++;
+    }
+    return size;
+}
+
+static int do_compress_ram_page(QEMUFile *f, MigrationCompressor *comp,
+                                int stream, RAMBlock *block,
                                 ram_addr_t offset)
 {
     int bytes_sent, blen;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
 
-    bytes_sent = save_page_header(f, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+    bytes_sent = save_compress_page_header(f, comp, stream, block, offset);
+    blen = qemu_put_compression_data(f, comp, p, TARGET_PAGE_SIZE);
     if (blen < 0) {
         bytes_sent = 0;
         qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
@@ -946,10 +2146,10 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
                 /* Make sure the first page is sent out before other pages */
-                bytes_xmit = save_page_header(f, block, offset |
-                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
+                bytes_xmit = save_compress_page_header(f, comp_main, 0,
+                                                       block, offset);
+                blen = qemu_put_compression_data(f, comp_main, p,
+                                                 TARGET_PAGE_SIZE);
                 if (blen > 0) {
                     *bytes_transferred += bytes_xmit + blen;
                     acct_info.norm_pages++;
@@ -1128,6 +2328,47 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
     return !!block;
 }
 
+/*
+ * In a background snapshot, get a page that the guest waits to write to;
+ * skips pages that are already sent (!dirty)
+ *
+ *     pss:      PageSearchStatus structure updated with found block/offset
+ * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *
+ * Returns:      true if such a page is found
+ */
+static bool get_fault_page(PageSearchStatus *pss, ram_addr_t *ram_addr_abs)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    RAMBlock *block;
+    ram_addr_t offset;
+    void *host;
+
+    while ((host = ram_write_tracking_get_fault())) {
+        block = qemu_ram_block_from_host(host, false, &offset);
+        if (!block) {
+            continue;
+        }
+        /* Host pages are sent, then released, as a whole */
+        offset &= ~((ram_addr_t)qemu_host_page_size - 1);
+        *ram_addr_abs = block->offset + offset;
+        if (!test_bit(*ram_addr_abs >> TARGET_PAGE_BITS, bitmap)) {
+            /* Raced with the background search, the page is released */
+            continue;
+        }
+
+        trace_get_fault_page(block->idstr, (uint64_t)offset,
+                             (uint64_t)*ram_addr_abs);
+        /* Same as for queued pages, see get_queued_page() */
+        ram_bulk_stage = false;
+        pss->block = block;
+        pss->offset = offset;
+        return true;
+    }
+
+    return false;
+}
+
 /**
  * flush_page_queue: Flush any remaining pages in the ram request queue
  *    it should be empty at the end anyway, but in error cases there may be
@@ -1202,9 +2443,13 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
     new_entry->len = len;
 
     memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&ms->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
-    qemu_mutex_unlock(&ms->src_page_req_mutex);
+    if (postcopy_preempt_send_state) {
+        postcopy_preempt_queue_request(new_entry);
+    } else {
+        qemu_mutex_lock(&ms->src_page_req_mutex);
+        QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+        qemu_mutex_unlock(&ms->src_page_req_mutex);
+    }
     rcu_read_unlock();
 
     return 0;
@@ -1302,6 +2547,17 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
         dirty_ram_abs += TARGET_PAGE_SIZE;
     } while (pss->offset & (qemu_host_page_size - 1));
 
+    if (pages && migrate_background_snapshot()) {
+        /* The page is copied into the stream, the guest can change it */
+        int ret = ram_write_tracking_release(pss->block->host + pss->offset -
+                                             qemu_host_page_size,
+                                             qemu_host_page_size);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->offset -= TARGET_PAGE_SIZE;
     return pages;
@@ -1343,7 +2599,12 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
     do {
         again = true;
-        found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        found = migrate_background_snapshot() &&
+                get_fault_page(&pss, &dirty_ram_abs);
+
+        if (!found) {
+            found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        }
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -1387,21 +2648,30 @@ uint64_t ram_bytes_remaining(void)
 
 uint64_t ram_bytes_transferred(void)
 {
-    return bytes_transferred;
+    return bytes_transferred + postcopy_preempt_bytes;
 }
 
-uint64_t ram_bytes_total(void)
+static uint64_t ram_bytes_total_common(bool count_ignored)
 {
     RAMBlock *block;
     uint64_t total = 0;
 
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next)
-        total += block->used_length;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (count_ignored || !ramblock_is_ignored(block)) {
+            total += block->used_length;
+        }
+    }
     rcu_read_unlock();
     return total;
 }
 
+/* The RAM that is migrated, which leaves out the ignored blocks */
+uint64_t ram_bytes_total(void)
+{
+    return ram_bytes_total_common(false);
+}
+
 void free_xbzrle_decoded_buf(void)
 {
     g_free(xbzrle_decoded_buf);
@@ -1423,7 +2693,9 @@ static void ram_migration_cleanup(void *opaque)
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
-        memory_global_dirty_log_stop();
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_stop();
+        }
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
 
@@ -1438,6 +2710,8 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    mapped_ram_cleanup();
 }
 
 static void reset_ram_globals(void)
@@ -1782,7 +3056,7 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     rcu_read_lock();
 
     /* This should be our last sync, the src is now paused */
-    migration_bitmap_sync();
+    migration_bitmap_sync(false);
 
     unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
     if (!unsentmap) {
@@ -1875,6 +3149,7 @@ err:
 static int ram_save_init_globals(void)
 {
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    RAMBlock *block;
 
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
@@ -1886,7 +3161,7 @@ static int ram_save_init_globals(void)
         ZERO_TARGET_PAGE = g_malloc0(TARGET_PAGE_SIZE);
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
+                                  TARGET_PAGE_SIZE, XBZRLE_CACHE_WAYS);
         if (!XBZRLE.cache) {
             XBZRLE_cache_unlock();
             error_report("Error creating cache");
@@ -1924,6 +3199,13 @@ static int ram_save_init_globals(void)
     migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
     migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            bitmap_clear(migration_bitmap_rcu->bmap,
+                         block->offset >> TARGET_PAGE_BITS,
+                         block->used_length >> TARGET_PAGE_BITS);
+        }
+    }
 
     if (migrate_postcopy_ram()) {
         migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
@@ -1936,13 +3218,62 @@ static int ram_save_init_globals(void)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    /*
+     * A background snapshot saves every page once, as it is when RAM gets
+     * write-protected; it doesn't care about later writes.
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync(false);
+    }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
     rcu_read_unlock();
 
-    return 0;
+    return 0;
+}
+
+/*
+ * A page that was dirtied again may be sent on a different channel (or on
+ * the main stream) than its previous copy.  Before any page of a new dirty
+ * bitmap round goes out, send a sync packet on every channel and put a
+ * marker on the main stream: the destination waits at the marker until all
+ * channels received their sync packet, so older copies can never overtake
+ * newer ones.  Waiting for the packets to be sent here also guarantees that
+ * nothing is left in the channels when the migration completes.
+ */
+static void multifd_send_sync_main(QEMUFile *f)
+{
+    int i;
+
+    if (!migrate_use_multifd() || atomic_read(&multifd_send_state->quit)) {
+        return;
+    }
+    if (multifd_send_state->pages->used && multifd_send_pages() < 0) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending_sync = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+    }
+    multifd_send_state->synced_bitmap = bitmap_sync_count;
+
+    /* With mapped-ram, waiting for the channels is enough for an older copy
+     * of a page not to be written over a newer one; the destination reads
+     * the pages from the file, not from the stream.
+     */
+    if (!migrate_mapped_ram()) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+        bytes_transferred += 8;
+    }
+    trace_multifd_send_sync_main(bitmap_sync_count);
 }
 
 /* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
@@ -1962,14 +3293,35 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
          }
     }
 
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        mapped_ram_ioc = file_channel_create(false, &local_err);
+        if (!mapped_ram_ioc) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     rcu_read_lock();
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    /* The ignored blocks are still listed, for the destination to check */
+    qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_ignore_shared()) {
+            qemu_put_byte(f, ramblock_is_ignored(block));
+        }
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
+        if (migrate_mapped_ram() && mapped_ram_setup_block(f, block) < 0) {
+            rcu_read_unlock();
+            return -1;
+        }
     }
 
     rcu_read_unlock();
@@ -1997,6 +3349,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     /* Read version before ram_list.blocks */
     smp_rmb();
 
+    if (migrate_use_multifd() &&
+        multifd_send_state->synced_bitmap != bitmap_sync_count) {
+        multifd_send_sync_main(f);
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
@@ -2053,8 +3410,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     rcu_read_lock();
 
     if (!migration_in_postcopy(migrate_get_current())) {
-        migration_bitmap_sync();
+        migration_bitmap_sync(false);
     }
+    multifd_send_sync_main(f);
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -2073,6 +3431,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    multifd_send_sync_main(f);
+    if (migrate_mapped_ram() && mapped_ram_save_bitmaps() < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    postcopy_preempt_send_eos();
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2092,11 +3455,9 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     if (!migration_in_postcopy(migrate_get_current()) &&
         remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
         rcu_read_lock();
-        migration_bitmap_sync();
+        migration_bitmap_sync(true);
         rcu_read_unlock();
-        qemu_mutex_unlock_iothread();
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
 
@@ -2202,7 +3563,6 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
     uint8_t *des;
     int len;
 
@@ -2214,14 +3574,18 @@ static void *do_data_decompress(void *opaque)
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
+            /* zlib decompression will fail in some case, especially
              * when the page is dirted when doing the compression, it's
              * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+             * and the failure won't break the data in other pages.
+             * Streaming methods compress a stable copy, so a failure
+             * means that the stream is corrupt.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            if (migration_decompress_page(param->decomp, param->compbuf, len,
+                                          des, TARGET_PAGE_SIZE) < 0 &&
+                migration_compress_is_streaming(decompress_method)) {
+                atomic_set(&decompress_failed, true);
+            }
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2256,10 +3620,24 @@ static void wait_for_decompress_done(void)
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+void migrate_decompress_set_method(MigrationCompressMethod method)
+{
+    decompress_method = method;
+}
+
 void migrate_decompress_threads_create(void)
 {
+    size_t compbuf_size = 0;
     int i, thread_count;
 
+    /* Until the configuration section says otherwise */
+    decompress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
+    decompress_failed = false;
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD__MAX; i++) {
+        compbuf_size = MAX(compbuf_size,
+                           migration_compress_bound(i, TARGET_PAGE_SIZE));
+    }
+
     thread_count = migrate_decompress_threads();
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
@@ -2268,7 +3646,7 @@ void migrate_decompress_threads_create(void)
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf = g_malloc0(compbuf_size);
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2294,27 +3672,45 @@ void migrate_decompress_threads_join(void)
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
     }
+    for (i = 0; i < COMPRESS_STREAM_MAX; i++) {
+        migration_decompressor_free(decomp_streams[i]);
+        decomp_streams[i] = NULL;
+    }
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
     decomp_param = NULL;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+/*
+ * Pages of a streaming method must be decompressed in order, so @stream
+ * always goes to the same thread; zlib pages (stream 0) go to any idle one.
+ */
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               int len, int stream)
 {
+    bool streaming = migration_compress_is_streaming(decompress_method);
     int idx, thread_count;
 
+    if (!decomp_streams[stream]) {
+        decomp_streams[stream] = migration_decompressor_new(decompress_method,
+                                                            TARGET_PAGE_SIZE);
+    }
+
     thread_count = migrate_decompress_threads();
     qemu_mutex_lock(&decomp_done_lock);
     while (true) {
         for (idx = 0; idx < thread_count; idx++) {
+            if (streaming && idx != stream % thread_count) {
+                continue;
+            }
             if (decomp_param[idx].done) {
                 decomp_param[idx].done = false;
                 qemu_mutex_lock(&decomp_param[idx].mutex);
                 qemu_get_buffer(f, decomp_param[idx].compbuf, len);
                 decomp_param[idx].des = host;
                 decomp_param[idx].len = len;
+                decomp_param[idx].decomp = decomp_streams[stream];
                 qemu_cond_signal(&decomp_param[idx].cond);
                 qemu_mutex_unlock(&decomp_param[idx].mutex);
                 break;
@@ -2329,6 +3725,505 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+typedef struct {
+    /* the id sent by the source, once the header has been read */
+    int id;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted by the main thread to let the channel go past a sync packet */
+    QemuSemaphore sem_sync;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    /* set for every channel id whose header has been received */
+    bool *id_seen;
+    /* posted by every channel that reached a sync packet, or failed */
+    QemuSemaphore sem_sync;
+    bool quit;
+    bool failed;
+} *multifd_recv_state;
+
+/*
+ * Returns 1 if everything was read, 0 on end of file before any data and
+ * -1 on error.
+ */
+static int multifd_readv_all(QIOChannel *ioc, struct iovec *iov,
+                             unsigned int niov, Error **errp)
+{
+    bool partial = false;
+
+    while (niov) {
+        ssize_t len = qio_channel_readv(ioc, iov, niov, errp);
+
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_wait(ioc, G_IO_IN);
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            if (partial) {
+                error_setg(errp, "Unexpected end of multifd channel");
+                return -1;
+            }
+            return 0;
+        }
+        partial = true;
+        iov_discard_front(&iov, &niov, len);
+    }
+    return 1;
+}
+
+static int multifd_recv_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket *packet = &p->packet;
+    struct iovec iov = {
+        .iov_base = packet,
+        .iov_len = MULTIFD_PACKET_HDR_SIZE,
+    };
+    RAMBlock *block;
+    uint32_t used, i;
+    int ret;
+
+    ret = multifd_readv_all(p->c, &iov, 1, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd channel %d: bad packet magic", p->id);
+        return -1;
+    }
+    packet->flags = be32_to_cpu(packet->flags);
+    used = be32_to_cpu(packet->pages);
+    if (used > MULTIFD_PAGES_PER_PACKET) {
+        error_setg(errp, "multifd channel %d: packet with %u pages",
+                   p->id, used);
+        return -1;
+    }
+    if (!used) {
+        return 1;
+    }
+
+    iov.iov_base = packet->offset;
+    iov.iov_len = used * sizeof(uint64_t);
+    ret = multifd_readv_all(p->c, &iov, 1, errp);
+    if (ret == 0) {
+        error_setg(errp, "multifd channel %d: truncated packet", p->id);
+    }
+    if (ret <= 0) {
+        return -1;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = '\0';
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        rcu_read_unlock();
+        error_setg(errp, "multifd channel %d: unknown RAM block %s",
+                   p->id, packet->ramblock);
+        return -1;
+    }
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            !offset_in_ramblock(block, offset)) {
+            rcu_read_unlock();
+            error_setg(errp, "multifd channel %d: illegal RAM offset "
+                       RAM_ADDR_FMT, p->id, offset);
+            return -1;
+        }
+        p->iov[i].iov_base = block->host + offset;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+    ret = multifd_readv_all(p->c, p->iov, used, errp);
+    rcu_read_unlock();
+    if (ret == 0) {
+        error_setg(errp, "multifd channel %d: truncated packet", p->id);
+    }
+    if (ret <= 0) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * The source sends the header right after connecting.  It is read by the
+ * channel's thread, so that a slow or silent peer cannot stall the main
+ * loop.
+ */
+static int multifd_recv_initial_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDInit init;
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    uint32_t id;
+    int ret;
+
+    ret = multifd_readv_all(p->c, &iov, 1, errp);
+    if (ret < 0) {
+        error_prepend(errp, "multifd channel: ");
+        return -1;
+    }
+    if (ret == 0) {
+        error_setg(errp, "multifd channel: closed before the header");
+        return -1;
+    }
+    id = be32_to_cpu(init.id);
+    if (be32_to_cpu(init.magic) != MULTIFD_MAGIC ||
+        be32_to_cpu(init.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd channel: bad header");
+        return -1;
+    }
+    if (id >= migrate_multifd_channels() ||
+        atomic_xchg(&multifd_recv_state->id_seen[id], true)) {
+        error_setg(errp, "multifd channel: unexpected channel id %u "
+                   "(multifd-channels must match on both sides)", id);
+        return -1;
+    }
+    p->id = id;
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    rcu_register_thread();
+
+    if (multifd_recv_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+
+    while (true) {
+        ret = multifd_recv_packet(p, &local_err);
+        if (ret <= 0) {
+            break;
+        }
+        if (p->packet.flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+out:
+    if (!atomic_read(&multifd_recv_state->quit)) {
+        /*
+         * The source closes the channels once it is done, possibly before
+         * the main stream has been loaded completely; a main thread that
+         * still waits for this channel has to give up, though.
+         */
+        if (local_err) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+        atomic_set(&multifd_recv_state->failed, true);
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+    error_free(local_err);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void multifd_load_setup(void)
+{
+    int thread_count;
+
+    /* mapped-ram reads the pages from the file, there are no channels */
+    if (!migrate_use_multifd() || migrate_mapped_ram() || multifd_recv_state) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->id_seen = g_new0(bool, thread_count);
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+}
+
+void multifd_load_cleanup(void)
+{
+    int i, thread_count;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    atomic_set(&multifd_recv_state->quit, true);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (!p->c) {
+            continue;
+        }
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        qemu_sem_post(&p->sem_sync);
+        qemu_thread_join(&p->thread);
+        object_unref(OBJECT(p->c));
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state->id_seen);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    return multifd_recv_state &&
+           multifd_recv_state->count == migrate_multifd_channels();
+}
+
+/*
+ * Channels are numbered in the order they are accepted; the id sent by the
+ * source is only checked by the channel's thread.
+ */
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+    char *name;
+    int i;
+
+    multifd_load_setup();
+    if (!multifd_recv_state) {
+        error_report("Unexpected multifd channel, the multifd capability "
+                     "is not enabled");
+        qio_channel_close(ioc, NULL);
+        return;
+    }
+    if (multifd_recv_state->count == migrate_multifd_channels()) {
+        error_report("multifd channel: too many channels (multifd-channels "
+                     "must match on both sides)");
+        qio_channel_close(ioc, NULL);
+        return;
+    }
+
+    i = multifd_recv_state->count++;
+    p = &multifd_recv_state->params[i];
+    p->id = i;
+    p->c = ioc;
+    object_ref(OBJECT(ioc));
+    qemu_sem_init(&p->sem_sync, 0);
+    qio_channel_set_blocking(ioc, true, NULL);
+
+    name = g_strdup_printf("multifdrecv_%d", i);
+    qemu_thread_create(&p->thread, name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    g_free(name);
+}
+
+/*
+ * Wait until every channel received the sync packet that matches the
+ * marker just read from the main stream, then let them all continue.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd sync marker, but the multifd capability is "
+                     "not enabled");
+        return -EINVAL;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+        if (atomic_read(&multifd_recv_state->failed)) {
+            return -EIO;
+        }
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+    return 0;
+}
+
+static struct {
+    QemuThread thread;
+    QIOChannel *c;
+    PostcopyPreemptPacket packet;
+    /* Temporary host page that is later 'placed' */
+    void *page;
+} *postcopy_preempt_recv_state;
+
+/*
+ * Returns 1 if a page was placed, 0 at the end of the stream and -1 on
+ * error.
+ */
+static int postcopy_preempt_recv_page(Error **errp)
+{
+    PostcopyPreemptPacket *packet = &postcopy_preempt_recv_state->packet;
+    struct iovec iov = { .iov_base = packet, .iov_len = sizeof(*packet) };
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint32_t flags;
+    void *host;
+    int ret;
+
+    ret = multifd_readv_all(postcopy_preempt_recv_state->c, &iov, 1, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    flags = be32_to_cpu(packet->flags);
+    offset = be64_to_cpu(packet->offset);
+    if (be32_to_cpu(packet->magic) != POSTCOPY_PREEMPT_MAGIC) {
+        error_setg(errp, "postcopy preempt channel: bad packet magic");
+        return -1;
+    }
+    if (flags & POSTCOPY_PREEMPT_FLAG_EOS) {
+        return 0;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = '\0';
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block || (offset & ~qemu_host_page_mask) ||
+        !offset_in_ramblock(block, offset)) {
+        rcu_read_unlock();
+        error_setg(errp, "postcopy preempt channel: illegal page %s/"
+                   RAM_ADDR_FMT, packet->ramblock, offset);
+        return -1;
+    }
+    host = block->host + offset;
+    trace_postcopy_preempt_recv_page(packet->ramblock, offset, flags);
+
+    if (flags & POSTCOPY_PREEMPT_FLAG_ZERO) {
+        ret = postcopy_place_page_zero(mis, host);
+    } else {
+        iov.iov_base = postcopy_preempt_recv_state->page;
+        iov.iov_len = qemu_host_page_size;
+        ret = multifd_readv_all(postcopy_preempt_recv_state->c, &iov, 1,
+                                errp);
+        if (ret <= 0) {
+            rcu_read_unlock();
+            if (ret == 0) {
+                error_setg(errp, "postcopy preempt channel: truncated page");
+            } else {
+                error_prepend(errp, "postcopy preempt channel: ");
+            }
+            return -1;
+        }
+        ret = postcopy_place_page(mis, host, postcopy_preempt_recv_state->page);
+    }
+    rcu_read_unlock();
+    if (ret < 0) {
+        error_setg(errp, "postcopy preempt channel: failed to place page");
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * The source sends the header right after connecting.  It is read by the
+ * channel's thread, so that a slow or silent peer cannot stall the main
+ * loop.
+ */
+static int postcopy_preempt_recv_header(Error **errp)
+{
+    PostcopyPreemptInit init;
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    int ret;
+
+    ret = multifd_readv_all(postcopy_preempt_recv_state->c, &iov, 1, errp);
+    if (ret < 0) {
+        error_prepend(errp, "postcopy preempt channel: ");
+        return -1;
+    }
+    if (ret == 0) {
+        error_setg(errp, "postcopy preempt channel: closed before the "
+                   "header");
+        return -1;
+    }
+    if (be32_to_cpu(init.magic) != POSTCOPY_PREEMPT_MAGIC ||
+        be32_to_cpu(init.version) != POSTCOPY_PREEMPT_VERSION) {
+        error_setg(errp, "postcopy preempt channel: bad header");
+        return -1;
+    }
+    return 0;
+}
+
+static void *postcopy_preempt_recv_thread(void *opaque)
+{
+    Error *local_err = NULL;
+    int ret;
+
+    rcu_register_thread();
+
+    ret = postcopy_preempt_recv_header(&local_err);
+    if (!ret) {
+        do {
+            ret = postcopy_preempt_recv_page(&local_err);
+        } while (ret > 0);
+    }
+
+    if (ret < 0) {
+        MigrationIncomingState *mis = migration_incoming_get_current();
+
+        /* Requested pages will not arrive, fail the main stream as well */
+        error_report_err(local_err);
+        if (mis && mis->from_src_file) {
+            qemu_file_set_error(mis->from_src_file, -EIO);
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+bool postcopy_preempt_channel_created(void)
+{
+    return postcopy_preempt_recv_state != NULL;
+}
+
+void postcopy_preempt_new_channel(QIOChannel *ioc)
+{
+    if (postcopy_preempt_recv_state) {
+        error_report("Unexpected migration channel");
+        qio_channel_close(ioc, NULL);
+        return;
+    }
+
+    qio_channel_set_blocking(ioc, true, NULL);
+    postcopy_preempt_recv_state = g_new0(typeof(*postcopy_preempt_recv_state),
+                                         1);
+    postcopy_preempt_recv_state->c = ioc;
+    object_ref(OBJECT(ioc));
+    postcopy_preempt_recv_state->page = qemu_memalign(qemu_host_page_size,
+                                                      qemu_host_page_size);
+    qemu_thread_create(&postcopy_preempt_recv_state->thread,
+                       "postcopy/preempt", postcopy_preempt_recv_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * The source ends the preempt channel before the main stream, so unless
+ * the migration @failed, the thread is just waited for.
+ */
+void postcopy_preempt_load_cleanup(bool failed)
+{
+    if (!postcopy_preempt_recv_state) {
+        return;
+    }
+    if (failed) {
+        qio_channel_shutdown(postcopy_preempt_recv_state->c,
+                             QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
+    qemu_thread_join(&postcopy_preempt_recv_state->thread);
+    object_unref(OBJECT(postcopy_preempt_recv_state->c));
+    qemu_vfree(postcopy_preempt_recv_state->page);
+    g_free(postcopy_preempt_recv_state);
+    postcopy_preempt_recv_state = NULL;
+}
+
 /*
  * Allocate data structures etc needed by incoming migration with postcopy-ram
  * postcopy-ram's similarly names postcopy_ram_incoming_init does the work
@@ -2433,6 +4328,9 @@ static int ram_load_postcopy(QEMUFile *f)
                                          TARGET_PAGE_SIZE);
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2466,7 +4364,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
-    int len = 0;
+    int len = 0, stream;
     /*
      * If system is running in postcopy mode, page inserts to host memory must
      * be atomic
@@ -2513,17 +4411,24 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
+            if (migrate_mapped_ram()) {
+                ret = mapped_ram_load_setup();
+            }
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
                 ram_addr_t length;
+                bool ignored = false;
 
                 len = qemu_get_byte(f);
                 qemu_get_buffer(f, (uint8_t *)id, len);
                 id[len] = 0;
                 length = qemu_get_be64(f);
+                if (migrate_ignore_shared()) {
+                    ignored = qemu_get_byte(f);
+                }
 
                 block = qemu_ram_block_by_name(id);
                 if (block) {
@@ -2538,6 +4443,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (ignored != ramblock_is_ignored(block)) {
+                        /* Its memory would be neither sent nor shared */
+                        error_report("RAM block %s must be shared on both "
+                                     "sides or on neither", id);
+                        ret = -EINVAL;
+                    }
+                    if (!ret && !ignored && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2546,6 +4460,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            mapped_ram_cleanup();
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
@@ -2558,13 +4473,19 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            stream = 0;
+            if (migration_compress_is_streaming(decompress_method)) {
+                stream = qemu_get_byte(f);
+            }
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > migration_compress_bound(decompress_method,
+                                               TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            decompress_data_with_multi_threads(f, host, len, stream);
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
@@ -2575,6 +4496,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2593,6 +4517,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     wait_for_decompress_done();
+    if (!ret && atomic_read(&decompress_failed)) {
+        error_report("Failed to decompress %s page",
+                     MigrationCompressMethod_lookup[decompress_method]);
+        ret = -EINVAL;
+    }
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
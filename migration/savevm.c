@@ -39,7 +39,10 @@
 #include "audio/audio.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
+#include "migration/compress.h"
 #include "qapi/qmp/qerror.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
@@ -266,6 +269,7 @@ typedef struct SaveState {
     uint32_t len;
     const char *name;
     uint32_t target_page_bits;
+    uint32_t compress_method;
 } SaveState;
 
 static SaveState savevm_state = {
@@ -288,6 +292,7 @@ static void configuration_pre_save(void *opaque)
     state->len = strlen(current_name);
     state->name = current_name;
     state->target_page_bits = TARGET_PAGE_BITS;
+    state->compress_method = migrate_compress_method();
 }
 
 static int configuration_pre_load(void *opaque)
@@ -299,6 +304,7 @@ static int configuration_pre_load(void *opaque)
      * minimum possible value for this CPU.
      */
     state->target_page_bits = TARGET_PAGE_BITS_MIN;
+    state->compress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
     return 0;
 }
 
@@ -319,6 +325,16 @@ static int configuration_post_load(void *opaque, int version_id)
         return -EINVAL;
     }
 
+    if (!migration_compress_method_supported(state->compress_method)) {
+        error_report("Compression method '%s' of the source is not supported "
+                     "by this QEMU binary",
+                     state->compress_method < MIGRATION_COMPRESS_METHOD__MAX ?
+                     MigrationCompressMethod_lookup[state->compress_method] :
+                     "unknown");
+        return -EINVAL;
+    }
+    migrate_decompress_set_method(state->compress_method);
+
     return 0;
 }
 
@@ -345,6 +361,27 @@ static const VMStateDescription vmstate_target_page_bits = {
     }
 };
 
+/* The compress-method subsection is only sent if the compress capability
+ * uses something else than zlib, which is what older destinations expect.
+ * The destination decompresses RAM pages with the method it contains.
+ */
+static bool vmstate_compress_method_needed(void *opaque)
+{
+    return migrate_use_compression() &&
+           migrate_compress_method() != MIGRATION_COMPRESS_METHOD_ZLIB;
+}
+
+static const VMStateDescription vmstate_compress_method = {
+    .name = "configuration/compress-method",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = vmstate_compress_method_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(compress_method, SaveState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_configuration = {
     .name = "configuration",
     .version_id = 1,
@@ -358,6 +395,7 @@ static const VMStateDescription vmstate_configuration = {
     },
     .subsections = (const VMStateDescription*[]) {
         &vmstate_target_page_bits,
+        &vmstate_compress_method,
         NULL
     }
 };
@@ -909,6 +947,88 @@ bool qemu_savevm_state_blocked(Error **errp)
     return false;
 }
 
+/*
+ * Time and stream size of the sections saved while the VM is stopped, and
+ * of the sections loaded on the destination, for query-vmstate-timing.
+ * The lists are only changed with the BQL held.
+ */
+typedef struct VMStateTimings {
+    VMStateTimingList *head;
+    VMStateTimingList **tail;
+} VMStateTimings;
+
+static VMStateTimings savevm_timings = { NULL, &savevm_timings.head };
+static VMStateTimings loadvm_timings = { NULL, &loadvm_timings.head };
+/* The next section saved while the VM is stopped starts a new list */
+static bool savevm_timings_stale;
+
+static void vmstate_timings_reset(VMStateTimings *t)
+{
+    qapi_free_VMStateTimingList(t->head);
+    t->head = NULL;
+    t->tail = &t->head;
+}
+
+static VMStateTiming *vmstate_timings_add(VMStateTimings *t,
+                                          SaveStateEntry *se,
+                                          int64_t start_ns, int64_t bytes)
+{
+    VMStateTimingList *entry = g_new0(VMStateTimingList, 1);
+    VMStateTiming *timing = g_new0(VMStateTiming, 1);
+
+    timing->idstr = g_strdup(se->idstr);
+    timing->instance_id = se->instance_id;
+    timing->time = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns) /
+                   SCALE_US;
+    timing->bytes = bytes;
+
+    entry->value = timing;
+    *t->tail = entry;
+    t->tail = &entry->next;
+    return timing;
+}
+
+static void savevm_timing_record(QEMUFile *f, SaveStateEntry *se,
+                                 int64_t start_ns, int64_t start_pos)
+{
+    VMStateTiming *timing;
+
+    if (savevm_timings_stale) {
+        vmstate_timings_reset(&savevm_timings);
+        savevm_timings_stale = false;
+    }
+    timing = vmstate_timings_add(&savevm_timings, se, start_ns,
+                                 qemu_ftell_fast(f) - start_pos);
+    trace_savevm_section_timing(se->idstr, se->instance_id, timing->time,
+                                timing->bytes);
+}
+
+static void loadvm_timing_record(QEMUFile *f, SaveStateEntry *se,
+                                 int64_t start_ns, int64_t start_pos)
+{
+    VMStateTiming *timing;
+
+    timing = vmstate_timings_add(&loadvm_timings, se, start_ns,
+                                 qemu_ftell_fast(f) - start_pos);
+    trace_loadvm_section_timing(se->idstr, se->instance_id, timing->time,
+                                timing->bytes);
+}
+
+VMStateTimingInfo *qmp_query_vmstate_timing(Error **errp)
+{
+    VMStateTimingInfo *info = g_new0(VMStateTimingInfo, 1);
+
+    if (savevm_timings.head) {
+        info->has_save = true;
+        info->save = QAPI_CLONE(VMStateTimingList, savevm_timings.head);
+    }
+    if (loadvm_timings.head) {
+        info->has_load = true;
+        info->load = QAPI_CLONE(VMStateTimingList, loadvm_timings.head);
+    }
+    return info;
+}
+
 static bool enforce_config_section(void)
 {
     MachineState *machine = MACHINE(qdev_get_machine());
@@ -924,6 +1044,12 @@ void qemu_savevm_state_header(QEMUFile *f)
     if (!savevm_state.skip_configuration || enforce_config_section()) {
         qemu_put_byte(f, QEMU_VM_CONFIGURATION);
         vmstate_save_state(f, &vmstate_configuration, &savevm_state, 0);
+    } else if (vmstate_compress_method_needed(NULL)) {
+        /* The destination would take the pages for zlib ones */
+        error_report("compress-method %s requires a machine type that "
+                     "sends the configuration section",
+                     MigrationCompressMethod_lookup[migrate_compress_method()]);
+        qemu_file_set_error(f, -EINVAL);
     }
 
 }
@@ -935,6 +1061,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
     int ret;
 
     trace_savevm_state_begin();
+    savevm_timings_stale = true;
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->set_params) {
             continue;
@@ -1065,9 +1192,8 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start_ns, start_pos;
     int ret;
     bool in_postcopy = migration_in_postcopy(migrate_get_current());
 
@@ -1089,6 +1215,8 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
             }
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        start_pos = qemu_ftell_fast(f);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
@@ -1099,12 +1227,28 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
             qemu_file_set_error(f, ret);
             return;
         }
+        savevm_timing_record(f, se, start_ns, start_pos);
     }
 
     if (iterable_only) {
         return;
     }
 
+    qemu_savevm_state_complete_non_iterable(f, in_postcopy);
+}
+
+/*
+ * Saves the devices that are not saved iteratively, then ends the stream
+ * (unless postcopy is still going).  Background snapshots store this before
+ * saving RAM and send it after RAM.
+ */
+void qemu_savevm_state_complete_non_iterable(QEMUFile *f, bool in_postcopy)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    int64_t start_ns, start_pos;
+
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
@@ -1119,6 +1263,8 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         }
 
         trace_savevm_section_start(se->idstr, se->section_id);
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        start_pos = qemu_ftell_fast(f);
 
         json_start_object(vmdesc, NULL);
         json_prop_str(vmdesc, "name", se->idstr);
@@ -1128,9 +1274,12 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         vmstate_save(f, se, vmdesc);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        savevm_timing_record(f, se, start_ns, start_pos);
 
         json_end_object(vmdesc);
     }
+    /* A later stop (e.g. the next COLO checkpoint) starts over */
+    savevm_timings_stale = true;
 
     if (!in_postcopy) {
         /* Postcopy stream will still be going */
@@ -1779,13 +1928,28 @@ void loadvm_free_handlers(MigrationIncomingState *mis)
     }
 }
 
+/*
+ * Whole sections and the last part of iterative ones are timed; the postcopy
+ * listen thread runs without the BQL and is left out.
+ */
+static bool loadvm_section_timed(uint8_t section_type)
+{
+    return (section_type == QEMU_VM_SECTION_FULL ||
+            section_type == QEMU_VM_SECTION_END) &&
+           qemu_mutex_iothread_locked();
+}
+
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               uint8_t section_type)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
     LoadStateEntry *le;
     char idstr[256];
+    /* The section type has already been read */
+    int64_t start_pos = qemu_ftell_fast(f) - 1;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     /* Read section start */
@@ -1838,15 +2002,22 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, le)) {
         return -EINVAL;
     }
+    if (loadvm_section_timed(section_type)) {
+        loadvm_timing_record(f, se, start_ns, start_pos);
+    }
 
     return 0;
 }
 
 static int
-qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis,
+                             uint8_t section_type)
 {
     uint32_t section_id;
     LoadStateEntry *le;
+    /* The section type has already been read */
+    int64_t start_pos = qemu_ftell_fast(f) - 1;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     section_id = qemu_get_be32(f);
@@ -1871,6 +2042,9 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, le)) {
         return -EINVAL;
     }
+    if (loadvm_section_timed(section_type)) {
+        loadvm_timing_record(f, le->se, start_ns, start_pos);
+    }
 
     return 0;
 }
@@ -1886,14 +2060,14 @@ static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            ret = qemu_loadvm_section_start_full(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
-            ret = qemu_loadvm_section_part_end(f, mis);
+            ret = qemu_loadvm_section_part_end(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
@@ -1931,6 +2105,8 @@ int qemu_loadvm_state(QEMUFile *f)
         return -EINVAL;
     }
 
+    vmstate_timings_reset(&loadvm_timings);
+
     v = qemu_get_be32(f);
     if (v != QEMU_VM_FILE_MAGIC) {
         error_report("Not a migration stream");
@@ -22,6 +22,7 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "io/channel-socket.h"
+#include "qapi/clone-visitor.h"
 #include "trace.h"
 
 
@@ -55,6 +56,34 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the running outgoing migration, for the multifd channels */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "Multifd and postcopy preempt need a tcp: or "
+                   "unix: migration URI");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "multifd-socket-outgoing");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+void socket_cleanup_outgoing_migration(void)
+{
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = NULL;
+}
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -100,6 +129,9 @@ static void socket_start_outgoing_migration(MigrationState *s,
         data->hostname = g_strdup(saddr->u.inet.data->host);
     }
 
+    socket_cleanup_outgoing_migration();
+    outgoing_saddr = QAPI_CLONE(SocketAddress, saddr);
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-outgoing");
     qio_channel_socket_connect_async(sioc,
                                      saddr,
@@ -152,6 +184,11 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
                                        QIO_CHANNEL(sioc));
     object_unref(OBJECT(sioc));
 
+    if (!migration_has_all_channels()) {
+        /* Keep listening for the multifd channels */
+        return TRUE;
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
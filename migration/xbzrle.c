@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,13 +25,265 @@
 
   length = uleb128 encoded integer
  */
+/*
+ * The encoder alternates between two scans: the length of the run of
+ * equal bytes (zrun) and the length of the run of bytes that all differ
+ * (nzrun) at the start of a range.  Both return exact byte counts, so
+ * every implementation produces the same encoding.
+ *
+ * The generic versions need the end of the range to be aligned to
+ * sizeof(long), which is the case for the buffers of xbzrle_encode_buffer.
+ */
+static uint32_t zrun_len_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                             uint32_t len)
+{
+    uint32_t res = len % sizeof(long);
+    uint32_t i = 0;
+
+    /* not aligned to sizeof(long) */
+    while (i < res && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    if (i < res) {
+        return i;
+    }
+
+    /* word at a time for speed */
+    while (i < len &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static uint32_t nzrun_len_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                              uint32_t len)
+{
+    uint32_t res = len % sizeof(long);
+    uint32_t i = 0;
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    while (i < res && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    if (i < res) {
+        return i;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < len) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
+                i++;
+            }
+            break;
+        }
+        i += sizeof(long);
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* The vectorized functions leave the last partial vector to the generic
+ * ones.  movemask gives one bit per byte, set if old and new are equal.
+ */
+static uint32_t zrun_len_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              uint32_t len)
+{
+    uint32_t i = 0;
+    unsigned eq;
+
+    for (; i + 16 <= len; i += 16) {
+        eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old_buf + i)),
+                           _mm_loadu_si128((__m128i *)(new_buf + i))));
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return i + zrun_len_int(old_buf + i, new_buf + i, len - i);
+}
+
+static uint32_t nzrun_len_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               uint32_t len)
+{
+    uint32_t i = 0;
+    unsigned eq;
+
+    for (; i + 16 <= len; i += 16) {
+        eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old_buf + i)),
+                           _mm_loadu_si128((__m128i *)(new_buf + i))));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return i + nzrun_len_int(old_buf + i, new_buf + i, len - i);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint32_t zrun_len_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              uint32_t len)
+{
+    uint32_t i = 0, eq;
+
+    for (; i + 32 <= len; i += 32) {
+        eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(old_buf + i)),
+                              _mm256_loadu_si256((__m256i *)(new_buf + i))));
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return i + zrun_len_int(old_buf + i, new_buf + i, len - i);
+}
+
+static uint32_t nzrun_len_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               uint32_t len)
+{
+    uint32_t i = 0, eq;
+
+    for (; i + 32 <= len; i += 32) {
+        eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(old_buf + i)),
+                              _mm256_loadu_si256((__m256i *)(new_buf + i))));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return i + nzrun_len_int(old_buf + i, new_buf + i, len - i);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_xbzrle_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support <cpuid.h>.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ZRUN  zrun_len_int
+# define INIT_NZRUN nzrun_len_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ZRUN  zrun_len_sse2
+# define INIT_NZRUN nzrun_len_sse2
+#endif
+
+typedef uint32_t (*run_len_fn)(const uint8_t *, const uint8_t *, uint32_t);
+
+static unsigned cpuid_cache = INIT_CACHE;
+static run_len_fn zrun_len = INIT_ZRUN;
+static run_len_fn nzrun_len = INIT_NZRUN;
+
+static void init_accel(unsigned cache)
+{
+    zrun_len = zrun_len_int;
+    nzrun_len = nzrun_len_int;
+    if (cache & CACHE_SSE2) {
+        zrun_len = zrun_len_sse2;
+        nzrun_len = nzrun_len_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        zrun_len = zrun_len_avx2;
+        nzrun_len = nzrun_len_avx2;
+    }
+#endif
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_next_accel(void)
+{
+    /* If no bits set, we just tested the generic functions, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define zrun_len  zrun_len_int
+#define nzrun_len nzrun_len_int
+bool test_xbzrle_next_accel(void)
+{
+    return false;
+}
+#endif
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    uint32_t zrun, nzrun;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,31 +294,11 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun = zrun_len(old_buf + i, new_buf + i, slen - i);
+        i += zrun;
 
         /* buffer unchanged */
-        if (zrun_len == slen) {
+        if (zrun == slen) {
             return 0;
         }
 
@@ -74,53 +307,23 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return d;
         }
 
-        d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
+        d += uleb128_encode_small(dst + d, zrun);
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
 
-        d += uleb128_encode_small(dst + d, nzrun_len);
+        nzrun = nzrun_len(old_buf + i, new_buf + i, slen - i);
+
+        d += uleb128_encode_small(dst + d, nzrun);
         /* overflow */
-        if (d + nzrun_len > dlen) {
+        if (d + nzrun > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
+        memcpy(dst + d, new_buf + i, nzrun);
+        d += nzrun;
+        i += nzrun;
     }
 
     return d;
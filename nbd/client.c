@@ -21,7 +21,7 @@
 #include "qapi/error.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     int ret;
     switch (err) {
@@ -276,6 +276,121 @@ static int nbd_handle_reply_err(QIOChannel *ioc, nbd_opt_reply *reply,
     return result;
 }
 
+/* Send an option without payload and wait for the NBD_REP_ACK reply.
+ * Return 1 if the server acknowledged the option, 0 if it does not
+ * support it, or -1 with errp set if it is impossible to continue. */
+static int nbd_request_simple_option(QIOChannel *ioc, uint32_t opt,
+                                     Error **errp)
+{
+    nbd_opt_reply reply;
+    int error;
+
+    if (nbd_send_option_request(ioc, opt, 0, NULL, errp) < 0) {
+        return -1;
+    }
+    if (nbd_receive_option_reply(ioc, opt, &reply, errp) < 0) {
+        return -1;
+    }
+    error = nbd_handle_reply_err(ioc, &reply, errp);
+    if (error <= 0) {
+        return error;
+    }
+    if (reply.type != NBD_REP_ACK || reply.length != 0) {
+        error_setg(errp, "Unexpected reply type %" PRIx32 " for option %"
+                   PRIx32, reply.type, opt);
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+    return 1;
+}
+
+/* Select the "base:allocation" metadata context of export @name with
+ * NBD_OPT_SET_META_CONTEXT.  Return 1 and store the context id in
+ * *@context_id if the server selected it, 0 if it is not available, or
+ * -1 with errp set if it is impossible to continue. */
+static int nbd_receive_meta_context(QIOChannel *ioc, const char *name,
+                                    uint32_t *context_id, Error **errp)
+{
+    size_t name_len = strlen(name);
+    size_t context_len = strlen(NBD_META_BASE_ALLOCATION);
+    uint32_t data_len = 4 + name_len + 4 + 4 + context_len;
+    char *data = g_malloc(data_len);
+    char *p = data;
+    char context[sizeof(NBD_META_BASE_ALLOCATION)];
+    nbd_opt_reply reply;
+    bool selected = false;
+    uint32_t id;
+    int ret = -1;
+
+    /* Option payload:
+       [ 0 ..  3]     export name length
+       [ 4 ..  xx]    export name
+       [xx .. xx+3]   number of queries (1)
+       [.. ]          query length, query
+     */
+    stl_be_p(p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    stl_be_p(p, 1);
+    stl_be_p(p + 4, context_len);
+    memcpy(p + 8, NBD_META_BASE_ALLOCATION, context_len);
+
+    if (nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, data_len, data,
+                                errp) < 0) {
+        goto out;
+    }
+
+    while (1) {
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT, &reply,
+                                     errp) < 0) {
+            goto out;
+        }
+        ret = nbd_handle_reply_err(ioc, &reply, errp);
+        if (ret <= 0) {
+            goto out;
+        }
+        if (reply.type == NBD_REP_ACK) {
+            if (reply.length != 0) {
+                error_setg(errp, "Unexpected length to ACK response");
+                break;
+            }
+            ret = selected;
+            goto out;
+        }
+        if (reply.type != NBD_REP_META_CONTEXT ||
+            reply.length < sizeof(id) ||
+            reply.length - sizeof(id) >= sizeof(context)) {
+            /* We only asked for one context, which has a short name */
+            error_setg(errp, "Unexpected reply type %" PRIx32 " len %" PRIu32
+                       " to meta context request", reply.type, reply.length);
+            break;
+        }
+        if (read_sync(ioc, &id, sizeof(id)) != sizeof(id)) {
+            error_setg(errp, "Failed to read meta context id");
+            break;
+        }
+        be32_to_cpus(&id);
+        reply.length -= sizeof(id);
+        if (read_sync(ioc, context, reply.length) != reply.length) {
+            error_setg(errp, "Failed to read meta context name");
+            break;
+        }
+        context[reply.length] = '\0';
+        TRACE("Server selected meta context '%s' with id %" PRIu32,
+              context, id);
+        if (!strcmp(context, NBD_META_BASE_ALLOCATION)) {
+            *context_id = id;
+            selected = true;
+        }
+    }
+
+    nbd_send_opt_abort(ioc);
+    ret = -1;
+ out:
+    g_free(data);
+    return ret;
+}
+
 /* Process another portion of the NBD_OPT_LIST reply.  Set *@match if
  * the current reply matches @want or if the server does not support
  * NBD_OPT_LIST, otherwise leave @match alone.  Return 0 if iteration
@@ -457,7 +572,7 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExportInfo *info, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
@@ -566,6 +681,35 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                 goto fail;
             }
         }
+        if (info && info->structured_reply) {
+            if (fixedNewStyle) {
+                rc = nbd_request_simple_option(ioc, NBD_OPT_STRUCTURED_REPLY,
+                                               errp);
+                if (rc < 0) {
+                    rc = -EINVAL;
+                    goto fail;
+                }
+                info->structured_reply = rc > 0;
+                rc = -EINVAL;
+            } else {
+                info->structured_reply = false;
+            }
+        }
+        if (info && info->base_allocation) {
+            if (info->structured_reply) {
+                rc = nbd_receive_meta_context(ioc, name,
+                                              &info->meta_base_allocation_id,
+                                              errp);
+                if (rc < 0) {
+                    rc = -EINVAL;
+                    goto fail;
+                }
+                info->base_allocation = rc > 0;
+                rc = -EINVAL;
+            } else {
+                info->base_allocation = false;
+            }
+        }
         /* write the export name request */
         if (nbd_send_option_request(ioc, NBD_OPT_EXPORT_NAME, -1, name,
                                     errp) < 0) {
@@ -587,6 +731,11 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
     } else if (magic == NBD_CLIENT_MAGIC) {
         uint32_t oldflags;
 
+        if (info) {
+            info->structured_reply = false;
+            info->base_allocation = false;
+        }
+
         if (name) {
             error_setg(errp, "Server does not support export names");
             goto fail;
@@ -771,33 +920,71 @@ ssize_t nbd_send_request(QIOChannel *ioc, NBDRequest *request)
     return 0;
 }
 
+/* Read a simple reply or the header of a structured reply chunk.  Must be
+ * called in coroutine context if @ioc is non-blocking, so that a partially
+ * received header makes the caller yield.  */
 ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
-    /* Reply
+    /* Simple reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    payload length
      */
 
     magic = ldl_be_p(buf);
-    reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
-    reply->error = nbd_errno_to_system_errno(reply->error);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The chunk header is longer than a simple reply */
+        ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                        sizeof(buf) - NBD_REPLY_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret != sizeof(buf) - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error = 0;
+        reply->flags = lduw_be_p(buf + 4);
+        reply->type = lduw_be_p(buf + 6);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got structured reply chunk: { .flags = %" PRIx16
+              ", .type = %" PRIu16 ", handle = %" PRIu64
+              ", .length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->structured = false;
+    reply->flags = 0;
+    reply->type = 0;
+    reply->length = 0;
+    reply->error = nbd_errno_to_system_errno(ldl_be_p(buf + 4));
 
     if (reply->error == ESHUTDOWN) {
         /* This works even on mingw which lacks a native ESHUTDOWN */
@@ -814,4 +1001,3 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
     }
     return 0;
 }
-
@@ -19,8 +19,27 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu/main-loop.h"
 #include "nbd-internal.h"
 
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Maximum number of descriptors in a NBD_CMD_BLOCK_STATUS reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 1024
+
+/* Requests up to this size get a buffer from the client's pool */
+#define NBD_POOL_BUFFER_SIZE (1024 * 1024)
+
+/* Smaller replies are cheaper to copy than to pin for MSG_ZEROCOPY */
+#define NBD_ZERO_COPY_MIN (16 * 1024)
+
+/* The kernel pins reply headers sent with MSG_ZEROCOPY along with the
+ * data, so each pooled buffer carries room for the headers of a few
+ * zero copy sends.  A slot holds a structured reply chunk header plus
+ * the offset of a NBD_REPLY_TYPE_OFFSET_DATA chunk.  */
+#define NBD_ZERO_COPY_HEADERS 8
+#define NBD_ZERO_COPY_HEADER_SIZE 32
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -50,11 +69,22 @@ static int system_errno_to_nbd_errno(int err)
 /* Definitions for opaque data types */
 
 typedef struct NBDRequestData NBDRequestData;
+typedef struct NBDBuffer NBDBuffer;
+
+struct NBDBuffer {
+    QSIMPLEQ_ENTRY(NBDBuffer) entry;
+    uint8_t *data;
+    /* Reusable once this many zero copy sends have completed */
+    uint64_t zero_copy_seq;
+    uint8_t headers[NBD_ZERO_COPY_HEADERS][NBD_ZERO_COPY_HEADER_SIZE];
+    int nb_headers;
+};
 
 struct NBDRequestData {
     QSIMPLEQ_ENTRY(NBDRequestData) entry;
     NBDClient *client;
     uint8_t *data;
+    NBDBuffer *buf; /* pooled buffer backing @data, if any */
     bool complete;
 };
 
@@ -84,6 +114,8 @@ struct NBDClient {
     void (*close)(NBDClient *client);
 
     bool no_zeroes;
+    bool structured_reply;
+    bool base_allocation; /* "base:allocation" meta context selected */
     NBDExport *exp;
     QCryptoTLSCreds *tlscreds;
     char *tlsaclname;
@@ -100,6 +132,11 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    bool zero_copy; /* data replies may use MSG_ZEROCOPY */
+    QSIMPLEQ_HEAD(, NBDBuffer) free_buffers;
+    QSIMPLEQ_HEAD(, NBDBuffer) zero_copy_buffers; /* still owned by kernel */
+    int nb_buffers;
 };
 
 /* That's all folks */
@@ -365,6 +402,158 @@ fail:
     return rc;
 }
 
+/* Read a 32-bit big endian field of an option payload, of which @length
+ * bytes are left.  Return 0 on success, -EINVAL if the payload is too
+ * short, or -EIO on read failure. */
+static int nbd_negotiate_read_be32(QIOChannel *ioc, uint32_t *length,
+                                   uint32_t *val)
+{
+    if (*length < sizeof(*val)) {
+        return -EINVAL;
+    }
+    if (nbd_negotiate_read(ioc, val, sizeof(*val)) != sizeof(*val)) {
+        LOG("read failed");
+        return -EIO;
+    }
+    be32_to_cpus(val);
+    *length -= sizeof(*val);
+    return 0;
+}
+
+/* Send a NBD_REP_META_CONTEXT reply for the "base:allocation" context.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_send_meta_context(QIOChannel *ioc, uint32_t opt)
+{
+    const char *name = NBD_META_BASE_ALLOCATION;
+    size_t name_len = strlen(name);
+    uint32_t id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+    int rc;
+
+    rc = nbd_negotiate_send_rep_len(ioc, NBD_REP_META_CONTEXT, opt,
+                                    sizeof(id) + name_len);
+    if (rc < 0) {
+        return rc;
+    }
+    if (nbd_negotiate_write(ioc, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (nbd_negotiate_write(ioc, name, name_len) != name_len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Process NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The
+ * only context we know is "base:allocation", which describes holes and
+ * zeroed areas of the export with NBD_CMD_BLOCK_STATUS.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_handle_meta_context(NBDClient *client, uint32_t opt,
+                                             uint32_t length)
+{
+    char name[NBD_MAX_NAME_SIZE + 1];
+    char query[sizeof(NBD_META_BASE_ALLOCATION)];
+    uint32_t len, nb_queries, i;
+    bool base_allocation = false;
+    int rc;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. xx+3]  number of queries
+        ...           query length, query
+     */
+    if (opt == NBD_OPT_SET_META_CONTEXT && !client->structured_reply) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          opt, "Structured replies are not "
+                                          "enabled");
+    }
+
+    rc = nbd_negotiate_read_be32(client->ioc, &length, &len);
+    if (rc < 0) {
+        goto invalid;
+    }
+    if (len > NBD_MAX_NAME_SIZE || len > length) {
+        goto invalid;
+    }
+    if (nbd_negotiate_read(client->ioc, name, len) != len) {
+        LOG("read failed");
+        return -EIO;
+    }
+    name[len] = '\0';
+    length -= len;
+
+    rc = nbd_negotiate_read_be32(client->ioc, &length, &nb_queries);
+    if (rc < 0) {
+        goto invalid;
+    }
+    for (i = 0; i < nb_queries; i++) {
+        rc = nbd_negotiate_read_be32(client->ioc, &length, &len);
+        if (rc < 0) {
+            goto invalid;
+        }
+        if (len > length) {
+            goto invalid;
+        }
+        length -= len;
+        if (len >= sizeof(query)) {
+            /* Too long to be a context we know */
+            if (nbd_negotiate_drop_sync(client->ioc, len) != len) {
+                return -EIO;
+            }
+            continue;
+        }
+        if (nbd_negotiate_read(client->ioc, query, len) != len) {
+            LOG("read failed");
+            return -EIO;
+        }
+        query[len] = '\0';
+        TRACE("Client queried meta context '%s'", query);
+        if (!strcmp(query, NBD_META_BASE_ALLOCATION) ||
+            (opt == NBD_OPT_LIST_META_CONTEXT && !strcmp(query, "base:"))) {
+            base_allocation = true;
+        }
+    }
+    if (length) {
+        goto invalid;
+    }
+
+    if (!nbd_export_find(name)) {
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN,
+                                          opt, "Export '%s' not present",
+                                          name);
+    }
+
+    /* An empty list queries all contexts */
+    if (opt == NBD_OPT_LIST_META_CONTEXT && !nb_queries) {
+        base_allocation = true;
+    }
+    if (base_allocation) {
+        rc = nbd_negotiate_send_meta_context(client->ioc, opt);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->base_allocation = base_allocation;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    if (rc == -EIO) {
+        return rc;
+    }
+    if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                      "Malformed meta context request");
+}
+
 /* Handle NBD_OPT_STARTTLS. Return NULL to drop connection, or else the
  * new channel for all further (now-encrypted) communication. */
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
@@ -554,6 +743,37 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                if (length) {
+                    if (nbd_negotiate_drop_sync(client->ioc, length) !=
+                        length) {
+                        return -EIO;
+                    }
+                    ret = nbd_negotiate_send_rep_err(client->ioc,
+                                                     NBD_REP_ERR_INVALID,
+                                                     clientflags,
+                                                     "OPT_STRUCTURED_REPLY "
+                                                     "should not have length");
+                } else {
+                    TRACE("Client enabled structured replies");
+                    client->structured_reply = true;
+                    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                                 clientflags);
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_STARTTLS:
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
                     return -EIO;
@@ -615,9 +835,9 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     NBDClient *client = data->client;
     char buf[8 + 8 + 8 + 128];
     int rc;
-    const uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                              NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
-                              NBD_FLAG_SEND_WRITE_ZEROES);
+    uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
+                        NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                        NBD_FLAG_SEND_WRITE_ZEROES);
     bool oldStyle;
     size_t len;
 
@@ -678,6 +898,9 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
             goto fail;
         }
 
+        if (client->structured_reply) {
+            myflags |= NBD_FLAG_SEND_DF;
+        }
         TRACE("advertising size %" PRIu64 " and flags %x",
               client->exp->size, client->exp->nbdflags | myflags);
         stq_be_p(buf + 18, client->exp->size);
@@ -738,11 +961,8 @@ static ssize_t nbd_receive_request(QIOChannel *ioc, NBDRequest *request)
     return 0;
 }
 
-static ssize_t nbd_send_reply(QIOChannel *ioc, NBDReply *reply)
+static void nbd_encode_reply(uint8_t *buf, NBDReply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     reply->error = system_errno_to_nbd_errno(reply->error);
 
     TRACE("Sending response to client: { .error = %" PRId32
@@ -757,20 +977,151 @@ static ssize_t nbd_send_reply(QIOChannel *ioc, NBDReply *reply)
     stl_be_p(buf, NBD_REPLY_MAGIC);
     stl_be_p(buf + 4, reply->error);
     stq_be_p(buf + 8, reply->handle);
+}
 
-    ret = write_sync(ioc, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
+#define MAX_NBD_REQUESTS 16
+
+/* Buffers in the pool of each client; some may wait for the kernel to
+ * complete a zero copy send while others serve new requests */
+#define NBD_MAX_POOL_BUFFERS (2 * MAX_NBD_REQUESTS)
+
+/* Move buffers whose zero copy sends have completed back to the free list */
+static void nbd_reap_zero_copy(NBDClient *client)
+{
+    NBDBuffer *buf;
+    uint64_t sent;
+
+    if (!client->zero_copy) {
+        return;
     }
 
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
+    sent = qio_channel_socket_poll_zero_copy(client->sioc);
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_buffers)) &&
+           buf->zero_copy_seq <= sent) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_buffers, entry);
+        QSIMPLEQ_INSERT_HEAD(&client->free_buffers, buf, entry);
     }
-    return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+static void nbd_buffer_free(NBDBuffer *buf)
+{
+    qemu_vfree(buf->data);
+    g_free(buf);
+}
+
+/* Buffers of a closed client that the kernel may still be sending from */
+typedef struct NBDZeroCopyDrain {
+    QIOChannelSocket *sioc;
+    QSIMPLEQ_HEAD(, NBDBuffer) buffers;
+} NBDZeroCopyDrain;
+
+/* Delays between two checks of the error queue of a closed client, in
+ * nanoseconds, and how long until a warning is printed */
+#define NBD_ZERO_COPY_DRAIN_MIN_DELAY (1 * SCALE_MS)
+#define NBD_ZERO_COPY_DRAIN_MAX_DELAY (100 * SCALE_MS)
+#define NBD_ZERO_COPY_DRAIN_WARN      (1000 * SCALE_MS)
+
+/* Free each buffer once the kernel has completed its zero copy send.  The
+ * socket has been shut down, so it polls as hung up rather than waking us
+ * up for its error queue; check it with an increasing delay instead.  */
+static void coroutine_fn nbd_drain_zero_copy_entry(void *opaque)
+{
+    NBDZeroCopyDrain *drain = opaque;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t delay = NBD_ZERO_COPY_DRAIN_MIN_DELAY;
+    bool warned = false;
+    NBDBuffer *buf;
+    uint64_t sent;
+
+    while (!QSIMPLEQ_EMPTY(&drain->buffers)) {
+        sent = qio_channel_socket_poll_zero_copy(drain->sioc);
+        while ((buf = QSIMPLEQ_FIRST(&drain->buffers)) &&
+               buf->zero_copy_seq <= sent) {
+            QSIMPLEQ_REMOVE_HEAD(&drain->buffers, entry);
+            nbd_buffer_free(buf);
+        }
+        if (QSIMPLEQ_EMPTY(&drain->buffers)) {
+            break;
+        }
+
+        if (!warned && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start >=
+                       NBD_ZERO_COPY_DRAIN_WARN) {
+            /* Keep the buffers, they are still pinned */
+            LOG("zero copy sends of a closed client still pending");
+            warned = true;
+        }
+        co_aio_sleep_ns(qemu_get_aio_context(), QEMU_CLOCK_REALTIME, delay);
+        delay = MIN(delay * 2, NBD_ZERO_COPY_DRAIN_MAX_DELAY);
+    }
+
+    object_unref(OBJECT(drain->sioc));
+    g_free(drain);
+}
+
+/* Must be called while the socket is still open, since the completions of
+ * zero copy sends are read from its error queue */
+static void nbd_free_buffers(NBDClient *client)
+{
+    NBDZeroCopyDrain *drain;
+    NBDBuffer *buf;
+
+    nbd_reap_zero_copy(client);
+    while ((buf = QSIMPLEQ_FIRST(&client->free_buffers))) {
+        QSIMPLEQ_REMOVE_HEAD(&client->free_buffers, entry);
+        nbd_buffer_free(buf);
+    }
+
+    /* The kernel reads the pages of a zero copy send lazily, as long as
+     * the data has not been acknowledged.  Freeing them now could put
+     * reused memory on the wire, so wait for their completions in the
+     * background; the socket stays open until then.  */
+    if (!QSIMPLEQ_EMPTY(&client->zero_copy_buffers)) {
+        drain = g_new0(NBDZeroCopyDrain, 1);
+        drain->sioc = client->sioc;
+        object_ref(OBJECT(drain->sioc));
+        QSIMPLEQ_INIT(&drain->buffers);
+        QSIMPLEQ_CONCAT(&drain->buffers, &client->zero_copy_buffers);
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_drain_zero_copy_entry,
+                                                   drain));
+    }
+    client->nb_buffers = 0;
+}
+
+/* Allocate the data buffer of @req.  Requests that fit are served from a
+ * pool of page aligned buffers, so that zero copy sends do not have to
+ * pin freshly allocated memory every time.  */
+static int nbd_request_alloc_data(NBDRequestData *req, uint32_t len)
+{
+    NBDClient *client = req->client;
+    NBDBuffer *buf;
+
+    if (len <= NBD_POOL_BUFFER_SIZE) {
+        nbd_reap_zero_copy(client);
+        buf = QSIMPLEQ_FIRST(&client->free_buffers);
+        if (buf) {
+            QSIMPLEQ_REMOVE_HEAD(&client->free_buffers, entry);
+        } else if (client->nb_buffers < NBD_MAX_POOL_BUFFERS) {
+            buf = g_new0(NBDBuffer, 1);
+            buf->data = qemu_try_memalign(getpagesize(),
+                                          NBD_POOL_BUFFER_SIZE);
+            if (!buf->data) {
+                g_free(buf);
+                return -ENOMEM;
+            }
+            client->nb_buffers++;
+        }
+        if (buf) {
+            buf->zero_copy_seq = 0;
+            buf->nb_headers = 0;
+            req->buf = buf;
+            req->data = buf->data;
+            return 0;
+        }
+    }
+
+    req->data = blk_try_blockalign(client->exp->blk, len);
+    return req->data ? 0 : -ENOMEM;
+}
 
 void nbd_client_get(NBDClient *client)
 {
@@ -786,6 +1137,7 @@ void nbd_client_put(NBDClient *client)
         assert(client->closing);
 
         nbd_unset_handlers(client);
+        nbd_free_buffers(client);
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
         if (client->tlscreds) {
@@ -838,7 +1190,13 @@ static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->buf) {
+        if (req->buf->zero_copy_seq) {
+            QSIMPLEQ_INSERT_TAIL(&client->zero_copy_buffers, req->buf, entry);
+        } else {
+            QSIMPLEQ_INSERT_HEAD(&client->free_buffers, req->buf, entry);
+        }
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
@@ -1036,35 +1394,278 @@ void nbd_export_close_all(void)
     }
 }
 
-static ssize_t nbd_co_send_reply(NBDRequestData *req, NBDReply *reply,
-                                 int len)
+/* Send @iov, whose last element may point into the data buffer of @req,
+ * with a single writev.  Large payloads in pooled buffers are sent without
+ * copying them into the socket buffer; the buffer then goes back to the
+ * pool only once the kernel reports completion.  Return -EIO if the data
+ * could not be sent, 0 on success.  */
+static int nbd_co_send_iov(NBDClient *client, NBDRequestData *req,
+                           struct iovec *iov, int niov, size_t len)
 {
-    NBDClient *client = req->client;
-    ssize_t rc, ret;
+    struct iovec zc_iov[2];
+    bool zero_copy = client->zero_copy && req && req->buf &&
+                     req->buf->nb_headers < NBD_ZERO_COPY_HEADERS &&
+                     iov[niov - 1].iov_len >= NBD_ZERO_COPY_MIN;
+    ssize_t ret;
+
+    if (zero_copy) {
+        /* The headers normally live on the stack; move them to the buffer */
+        uint8_t *hdr = req->buf->headers[req->buf->nb_headers++];
+        size_t hdr_len = iov_to_buf(iov, niov - 1, 0, hdr,
+                                    NBD_ZERO_COPY_HEADER_SIZE);
+
+        assert(hdr_len == len - iov[niov - 1].iov_len);
+        zc_iov[0].iov_base = hdr;
+        zc_iov[0].iov_len = hdr_len;
+        zc_iov[1] = iov[niov - 1];
+        iov = zc_iov;
+        niov = 2;
+    }
 
     g_assert(qemu_in_coroutine());
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
     nbd_set_handlers(client);
 
-    if (!len) {
-        rc = nbd_send_reply(client->ioc, reply);
-    } else {
-        qio_channel_set_cork(client->ioc, true);
-        rc = nbd_send_reply(client->ioc, reply);
-        if (rc >= 0) {
-            ret = write_sync(client->ioc, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        qio_channel_set_cork(client->ioc, false);
+    if (zero_copy) {
+        qio_channel_socket_set_zero_copy(client->sioc, true, &error_abort);
+    }
+    ret = nbd_wr_syncv(client->ioc, iov, niov, len, false);
+    if (zero_copy) {
+        qio_channel_socket_set_zero_copy(client->sioc, false, &error_abort);
+        req->buf->zero_copy_seq = client->sioc->zero_copy_queued;
     }
 
     client->send_coroutine = NULL;
     nbd_set_handlers(client);
     qemu_co_mutex_unlock(&client->send_lock);
-    return rc;
+    return ret == len ? 0 : -EIO;
+}
+
+static int nbd_co_send_reply(NBDRequestData *req, NBDReply *reply, int len)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = req->data, .iov_len = len },
+    };
+
+    nbd_encode_reply(buf, reply);
+    return nbd_co_send_iov(req->client, req, iov, len ? 2 : 1,
+                           sizeof(buf) + len);
+}
+
+/* Send a structured reply chunk for @handle.  The payload is passed in
+ * @iov[1] to @iov[niov - 1]; @iov[0] is filled with the chunk header.
+ * If @iov[niov - 1] points into the data buffer of @req, it may be sent
+ * without copying.
+ * Return -EIO if the chunk could not be sent, 0 on success. */
+static int nbd_co_send_chunk(NBDClient *client, NBDRequestData *req,
+                             uint64_t handle, uint16_t flags, uint16_t type,
+                             struct iovec *iov, int niov)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    size_t len = iov_size(iov + 1, niov - 1);
+
+    TRACE("Sending structured reply chunk: { .flags = %" PRIx16
+          ", .type = %" PRIu16 ", handle = %" PRIu64 ", .length = %zu }",
+          flags, type, handle, len);
+
+    /* Chunk header
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    payload length
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, len);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+
+    return nbd_co_send_iov(client, req, iov, niov, sizeof(buf) + len);
+}
+
+static int nbd_co_send_structured_error(NBDClient *client, uint64_t handle,
+                                        int error)
+{
+    uint8_t payload[4 + 2];
+    struct iovec iov[2];
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length (no message)
+     */
+    stl_be_p(payload, system_errno_to_nbd_errno(error));
+    stw_be_p(payload + 4, 0);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = sizeof(payload);
+    return nbd_co_send_chunk(client, NULL, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, iov, 2);
+}
+
+/* Reply to NBD_CMD_READ with structured reply chunks.  Areas that read as
+ * zeroes are sent as hole chunks instead of data, unless the client asked
+ * for a single chunk with NBD_CMD_FLAG_DF.  Return -EIO if the connection
+ * must be dropped; read errors are reported to the client.  */
+static int coroutine_fn nbd_co_send_sparse_read(NBDRequestData *req,
+                                                NBDRequest *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t offset = request->from + exp->dev_offset;
+    uint32_t done = 0;
+    struct iovec iov[3];
+    int ret;
+
+    if (!request->len) {
+        return nbd_co_send_chunk(client, req, request->handle,
+                                 NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+                                 iov, 1);
+    }
+
+    while (done < request->len) {
+        uint32_t len = request->len - done;
+        uint8_t payload[8 + 4];
+        uint16_t flags;
+        bool hole = false;
+
+        if (bs && !(request->flags & NBD_CMD_FLAG_DF) &&
+            QEMU_IS_ALIGNED(offset + done, BDRV_SECTOR_SIZE)) {
+            BlockDriverState *file;
+            int64_t status;
+            int pnum;
+
+            status = bdrv_get_block_status_above(bs, NULL,
+                                                 (offset + done) >>
+                                                 BDRV_SECTOR_BITS,
+                                                 DIV_ROUND_UP(len,
+                                                     BDRV_SECTOR_SIZE),
+                                                 &pnum, &file);
+            if (status >= 0 && pnum > 0) {
+                len = MIN(len, (uint64_t)pnum << BDRV_SECTOR_BITS);
+                hole = status & BDRV_BLOCK_ZERO;
+            }
+        }
+
+        flags = done + len == request->len ? NBD_REPLY_FLAG_DONE : 0;
+        stq_be_p(payload, request->from + done);
+        iov[1].iov_base = payload;
+        if (hole) {
+            TRACE("Sending hole of %" PRIu32 " byte(s)", len);
+            stl_be_p(payload + 8, len);
+            iov[1].iov_len = 8 + 4;
+            ret = nbd_co_send_chunk(client, req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE, iov, 2);
+        } else {
+            ret = blk_pread(exp->blk, offset + done, req->data + done, len);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(client, request->handle,
+                                                    -ret);
+            }
+            TRACE("Read %" PRIu32" byte(s)", len);
+            iov[1].iov_len = 8;
+            iov[2].iov_base = req->data + done;
+            iov[2].iov_len = len;
+            ret = nbd_co_send_chunk(client, req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA, iov, 3);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS for the "base:allocation" context.
+ * Return -EIO if the connection must be dropped; errors querying the
+ * block status are reported to the client.  */
+static int coroutine_fn nbd_co_send_block_status(NBDClient *client,
+                                                 NBDRequest *request)
+{
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t offset = request->from + exp->dev_offset;
+    uint64_t end = offset + request->len;
+    NBDExtent *extents;
+    unsigned int i, nb_extents = 0;
+    uint32_t id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+    struct iovec iov[3];
+    int ret;
+
+    if (!bs || !request->len) {
+        return nbd_co_send_structured_error(client, request->handle, EINVAL);
+    }
+
+    extents = g_new(NBDExtent, NBD_MAX_BLOCK_STATUS_EXTENTS);
+    while (offset < end) {
+        int64_t sector_num = offset >> BDRV_SECTOR_BITS;
+        BlockDriverState *file;
+        int64_t status;
+        uint32_t len, flags;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num,
+                                             DIV_ROUND_UP(end,
+                                                 BDRV_SECTOR_SIZE) -
+                                             sector_num,
+                                             &pnum, &file);
+        if (status < 0) {
+            g_free(extents);
+            return nbd_co_send_structured_error(client, request->handle,
+                                                -status);
+        }
+        if (!pnum) {
+            break;
+        }
+
+        len = MIN((uint64_t)(sector_num + pnum) << BDRV_SECTOR_BITS, end) -
+              offset;
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (nb_extents && extents[nb_extents - 1].flags == flags) {
+            extents[nb_extents - 1].length += len;
+        } else if ((request->flags & NBD_CMD_FLAG_REQ_ONE && nb_extents) ||
+                   nb_extents == NBD_MAX_BLOCK_STATUS_EXTENTS) {
+            break;
+        } else {
+            extents[nb_extents].length = len;
+            extents[nb_extents].flags = flags;
+            nb_extents++;
+        }
+        offset += len;
+    }
+
+    if (!nb_extents) {
+        g_free(extents);
+        return nbd_co_send_structured_error(client, request->handle, EINVAL);
+    }
+
+    TRACE("Sending %u block status extent(s)", nb_extents);
+    for (i = 0; i < nb_extents; i++) {
+        cpu_to_be32s(&extents[i].length);
+        cpu_to_be32s(&extents[i].flags);
+    }
+
+    /* Block status payload
+       [ 0 ..  3]    metadata context id
+       [ 4 ..  7]    extent length       \
+       [ 8 .. 11]    extent flags        / repeated nb_extents times
+     */
+    iov[1].iov_base = &id;
+    iov[1].iov_len = sizeof(id);
+    iov[2].iov_base = extents;
+    iov[2].iov_len = nb_extents * sizeof(extents[0]);
+    ret = nbd_co_send_chunk(client, NULL, request->handle, NBD_REPLY_FLAG_DONE,
+                            NBD_REPLY_TYPE_BLOCK_STATUS, iov, 3);
+    g_free(extents);
+    return ret;
 }
 
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
@@ -1122,9 +1723,8 @@ static ssize_t nbd_co_receive_request(NBDRequestData *req,
             goto out;
         }
 
-        req->data = blk_try_blockalign(client->exp->blk, request->len);
-        if (req->data == NULL) {
-            rc = -ENOMEM;
+        rc = nbd_request_alloc_data(req, request->len);
+        if (rc < 0) {
             goto out;
         }
     }
@@ -1147,17 +1747,27 @@ static ssize_t nbd_co_receive_request(NBDRequestData *req,
         rc = request->type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE)) {
+    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
+                           NBD_CMD_FLAG_DF | NBD_CMD_FLAG_REQ_ONE)) {
         LOG("unsupported flags (got 0x%x)", request->flags);
         rc = -EINVAL;
         goto out;
     }
-    if (request->type != NBD_CMD_WRITE_ZEROES &&
-        (request->flags & NBD_CMD_FLAG_NO_HOLE)) {
+    if ((request->type != NBD_CMD_WRITE_ZEROES &&
+         (request->flags & NBD_CMD_FLAG_NO_HOLE)) ||
+        (request->type != NBD_CMD_READ &&
+         (request->flags & NBD_CMD_FLAG_DF)) ||
+        (request->type != NBD_CMD_BLOCK_STATUS &&
+         (request->flags & NBD_CMD_FLAG_REQ_ONE))) {
         LOG("unexpected flags (got 0x%x)", request->flags);
         rc = -EINVAL;
         goto out;
     }
+    if ((request->flags & NBD_CMD_FLAG_DF) && !client->structured_reply) {
+        LOG("DF flag without structured replies");
+        rc = -EINVAL;
+        goto out;
+    }
 
     rc = 0;
 
@@ -1222,6 +1832,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1293,6 +1910,20 @@ static void nbd_trip(void *opaque)
         }
         break;
 
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->base_allocation) {
+            TRACE("No metadata context selected, return error");
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+
+        if (nbd_co_send_block_status(client, &request) < 0) {
+            goto out;
+        }
+        break;
+
     case NBD_CMD_DISC:
         /* unreachable, thanks to special case in nbd_co_receive_request() */
         abort();
@@ -1328,7 +1959,15 @@ static void nbd_trip(void *opaque)
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
-        if (nbd_co_send_reply(req, &reply, 0) < 0 || !req->complete) {
+        if (client->structured_reply &&
+            (request.type == NBD_CMD_READ ||
+             request.type == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_structured_error(client, reply.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0 || !req->complete) {
             goto out;
         }
         break;
@@ -1349,6 +1988,9 @@ static void nbd_read(void *opaque)
 {
     NBDClient *client = opaque;
 
+    /* Zero copy completions make the socket poll as having an error */
+    nbd_reap_zero_copy(client);
+
     if (client->recv_coroutine) {
         qemu_coroutine_enter(client->recv_coroutine);
     } else {
@@ -1396,25 +2038,58 @@ static void nbd_update_can_read(NBDClient *client)
     }
 }
 
+/* Negotiation runs in the main loop, but the export's clients may be served
+ * from an I/O thread (qemu-nbd --iothread) that adds and removes them too */
+static AioContext *nbd_export_acquire(NBDExport *exp)
+{
+    AioContext *ctx = exp ? exp->ctx : NULL;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    return ctx;
+}
+
+static void nbd_export_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 static coroutine_fn void nbd_co_client_start(void *opaque)
 {
     NBDClientNewData *data = opaque;
     NBDClient *client = data->client;
     NBDExport *exp = client->exp;
+    AioContext *ctx;
 
+    ctx = nbd_export_acquire(exp);
     if (exp) {
         nbd_export_get(exp);
     }
+    nbd_export_release(ctx);
     if (nbd_negotiate(data)) {
+        ctx = nbd_export_acquire(exp);
         client_close(client);
+        nbd_export_release(ctx);
         goto out;
     }
     qemu_co_mutex_init(&client->send_lock);
-    nbd_set_handlers(client);
+    /* TLS encrypts into its own buffers, so only plain sockets qualify.
+     * Enabling the socket here lets each large reply opt in cheaply.  */
+    if (client->ioc == QIO_CHANNEL(client->sioc) &&
+        qio_channel_socket_set_zero_copy(client->sioc, true, NULL) == 0) {
+        qio_channel_socket_set_zero_copy(client->sioc, false, &error_abort);
+        client->zero_copy = true;
+    }
 
+    ctx = nbd_export_acquire(exp);
+    nbd_set_handlers(client);
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
     }
+    nbd_export_release(ctx);
 out:
     g_free(data);
 }
@@ -1442,6 +2117,8 @@ void nbd_client_new(NBDExport *exp,
     object_ref(OBJECT(client->ioc));
     client->can_read = true;
     client->close = close_fn;
+    QSIMPLEQ_INIT(&client->free_buffers);
+    QSIMPLEQ_INIT(&client->zero_copy_buffers);
 
     data->client = client;
     data->co = qemu_coroutine_create(nbd_co_client_start, data);
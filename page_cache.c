@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -35,24 +35,37 @@ struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    /* used since the clock hand last went over it */
+    bool it_ref;
 };
 
+/*
+ * The cache is split in sets of @ways items; the address of a page selects
+ * a set, and the page can be stored in any item of the set.  When the set
+ * is full, the item to replace is chosen by a clock sweep, starting from
+ * the set's hand.
+ */
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int ways;
+    int64_t num_sets;
+    unsigned int *hands;
+    uint64_t num_evictions;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+PageCache *cache_init(int64_t num_pages, unsigned int page_size,
+                      unsigned int ways)
 {
     int64_t i;
 
     PageCache *cache;
 
-    if (num_pages <= 0) {
-        DPRINTF("invalid number of pages\n");
+    if (num_pages <= 0 || ways == 0) {
+        DPRINTF("invalid number of pages or ways\n");
         return NULL;
     }
 
@@ -67,18 +80,26 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         num_pages = pow2floor(num_pages);
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
+    ways = MIN(pow2floor(ways), num_pages);
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = ways;
+    cache->num_sets = num_pages / ways;
+    cache->num_evictions = 0;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " in sets of %u\n",
+            cache->max_num_items, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->hands = g_try_malloc0(cache->num_sets * sizeof(*cache->hands));
+    if (!cache->page_cache || !cache->hands) {
         DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->hands);
         g_free(cache);
         return NULL;
     }
@@ -87,6 +108,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_ref = false;
     }
 
     return cache;
@@ -105,31 +127,38 @@ void cache_fini(PageCache *cache)
 
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    g_free(cache->hands);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return &cache->page_cache[pos];
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->ways];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -139,14 +168,50 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_ref = true;
         return true;
     }
     return false;
 }
 
+/*
+ * Returns a free item of the set of @addr if there is one, otherwise the
+ * item chosen by the clock: pages that were used since the hand last went
+ * over them get a second chance, and fresh pages are not replaced at all.
+ * Returns NULL if all the pages of the set are fresh.
+ */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    size_t set = cache_get_set(cache, addr);
+    CacheItem *items = &cache->page_cache[set * cache->ways];
+    CacheItem *it;
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (!items[i].it_data) {
+            return &items[i];
+        }
+    }
+
+    for (i = 0; i < 2 * cache->ways; i++) {
+        it = &items[cache->hands[set]];
+        cache->hands[set] = (cache->hands[set] + 1) & (cache->ways - 1);
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            continue;
+        }
+        if (it->it_ref) {
+            it->it_ref = false;
+            continue;
+        }
+        return it;
+    }
+    return NULL;
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
@@ -155,12 +220,14 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (!it) {
+            /* the cache pages are fresh, don't replace them */
+            return -1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -169,16 +236,42 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
             return -1;
         }
         cache->num_items++;
+    } else if (it->it_addr != addr) {
+        cache->num_evictions++;
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
     it->it_addr = addr;
+    it->it_ref = true;
 
     return 0;
 }
 
+uint64_t cache_get_evictions(const PageCache *cache)
+{
+    return cache->num_evictions;
+}
+
+/* Returns a free item of the set of @addr, or else its least recent one */
+static CacheItem *cache_get_oldest(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set, *oldest = NULL;
+    unsigned int i;
+
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->ways];
+    for (i = 0; i < cache->ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+        if (!oldest || set[i].it_age < oldest->it_age) {
+            oldest = &set[i];
+        }
+    }
+    return oldest;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
@@ -198,7 +291,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
+    new_cache = cache_init(new_num_pages, cache->page_size, cache->ways);
     if (!(new_cache)) {
         DPRINTF("Error creating new cache\n");
         return -1;
@@ -209,7 +302,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_oldest(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -221,14 +314,19 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
                 new_it->it_addr = old_it->it_addr;
+                new_it->it_ref = old_it->it_ref;
             }
         }
     }
 
     g_free(cache->page_cache);
+    g_free(cache->hands);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->ways = new_cache->ways;
+    cache->num_sets = new_cache->num_sets;
+    cache->hands = new_cache->hands;
 
     g_free(new_cache);
 
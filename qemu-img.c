@@ -135,6 +135,8 @@ static void QEMU_NORETURN help(void)
            "  'snapshot_id_or_name' is deprecated, use 'snapshot_param'\n"
            "    instead\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-C' offloads the copy to the storage where possible, e.g. with\n"
+           "       copy_file_range() or reflinks (convert only)\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -1459,6 +1461,7 @@ typedef struct ImgConvertState {
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool copy_range;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
@@ -1649,6 +1652,25 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
+/* Offload the copy of the data at @sector_num; the copy stays within one
+ * source image, *nb_sectors is reduced accordingly. */
+static int convert_copy_range(ImgConvertState *s, int64_t sector_num,
+                              int *nb_sectors)
+{
+    int64_t src_sector;
+    int n;
+
+    assert(!s->compressed);
+    convert_select_part(s, sector_num);
+    src_sector = sector_num - s->src_cur_offset;
+    n = MIN(*nb_sectors, s->src_sectors[s->src_cur] - src_sector);
+    *nb_sectors = n;
+
+    return blk_copy_range(s->src[s->src_cur], src_sector << BDRV_SECTOR_BITS,
+                          s->target, sector_num << BDRV_SECTOR_BITS,
+                          n << BDRV_SECTOR_BITS, 0);
+}
+
 static int convert_do_copy(ImgConvertState *s)
 {
     uint8_t *buf = NULL;
@@ -1719,6 +1741,20 @@ static int convert_do_copy(ImgConvertState *s)
                                 0);
         }
 
+        if (s->status == BLK_DATA && s->copy_range) {
+            ret = convert_copy_range(s, sector_num, &n);
+            if (ret == 0) {
+                sector_num += n;
+                continue;
+            } else if (ret != -ENOTSUP) {
+                error_report("error while copying sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                goto fail;
+            }
+            /* Not supported by source and target, copy through buf */
+            s->copy_range = false;
+        }
+
         if (s->status == BLK_DATA) {
             ret = convert_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -1759,6 +1795,7 @@ fail:
 static int img_convert(int argc, char **argv)
 {
     int c, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    bool copy_range = false;
     int64_t ret = 0;
     int progress = 0, flags, src_flags;
     bool writethrough, src_writethrough;
@@ -1796,7 +1833,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:cCe6o:s:l:S:pt:T:qn",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1818,6 +1855,9 @@ static int img_convert(int argc, char **argv)
         case 'c':
             compress = 1;
             break;
+        case 'C':
+            copy_range = true;
+            break;
         case 'e':
             error_report("option -e is deprecated, please use \'-o "
                   "encryption\' instead!");
@@ -1933,6 +1973,13 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (copy_range && compress) {
+        error_report("Copy offloading and compression cannot be used at "
+                     "the same time");
+        ret = -1;
+        goto out;
+    }
+
     src_flags = 0;
     ret = bdrv_parse_cache_mode(src_cache, &src_flags, &src_writethrough);
     if (ret < 0) {
@@ -2144,6 +2191,7 @@ static int img_convert(int argc, char **argv)
         .target             = out_blk,
         .compressed         = compress,
         .target_has_backing = (bool) out_baseimg,
+        .copy_range         = copy_range,
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
@@ -24,6 +24,8 @@
 #include "block/block_int.h"
 #include "block/nbd.h"
 #include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 #include "qemu/error-report.h"
 #include "qemu/config-file.h"
 #include "qemu/bswap.h"
@@ -49,6 +51,7 @@
 #define QEMU_NBD_OPT_TLSCREDS      261
 #define QEMU_NBD_OPT_IMAGE_OPTS    262
 #define QEMU_NBD_OPT_FORK          263
+#define QEMU_NBD_OPT_IOTHREAD      264
 
 #define MBR_SIZE 512
 
@@ -64,6 +67,9 @@ static int nb_fds;
 static QIOChannelSocket *server_ioc;
 static int server_watch = -1;
 static QCryptoTLSCreds *tlscreds;
+static AioContext *iothread_ctx;
+static QemuThread iothread_thread;
+static bool iothread_stopping;
 
 static void usage(const char *name)
 {
@@ -79,7 +85,9 @@ static void usage(const char *name)
 "  -b, --bind=IFACE          interface to bind to (default `0.0.0.0')\n"
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
-"  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"  -e, --shared=NUM          device can be shared by NUM clients (default '1');\n"
+"                            more than one also allows a client to open\n"
+"                            up to NUM connections to the export\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name\n"
@@ -96,6 +104,7 @@ static void usage(const char *name)
 "                            specify tracing options\n"
 "  --fork                    fork off the server process and exit the parent\n"
 "                            once the server is running\n"
+"  --iothread                process requests in a dedicated I/O thread\n"
 #ifdef __linux__
 "Kernel NBD client support:\n"
 "  -c, --connect=DEV         connect FILE to the local NBD device DEV\n"
@@ -272,7 +281,7 @@ static void *nbd_client_thread(void *arg)
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
                                 NULL, NULL, NULL,
-                                &size, &local_error);
+                                &size, NULL, &local_error);
     if (ret < 0) {
         if (local_error) {
             error_report_err(local_error);
@@ -328,22 +337,74 @@ static int nbd_can_accept(void)
 
 static void nbd_export_closed(NBDExport *exp)
 {
-    assert(state == TERMINATING);
-    state = TERMINATED;
+    assert(atomic_read(&state) == TERMINATING);
+    /* With --iothread this runs in the I/O thread; wake up the main loop */
+    atomic_set(&state, TERMINATED);
+    qemu_notify_event();
 }
 
 static void nbd_update_server_watch(void);
 
-static void nbd_client_closed(NBDClient *client)
+static void nbd_client_closed_bh(void *opaque)
 {
     nb_fds--;
     if (nb_fds == 0 && !persistent && state == RUNNING) {
         state = TERMINATE;
     }
     nbd_update_server_watch();
+}
+
+static void nbd_client_closed(NBDClient *client)
+{
+    /* The server watch and the connection count belong to the main loop,
+     * but clients of an export in an I/O thread are closed from there. */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), nbd_client_closed_bh,
+                            NULL);
     nbd_client_put(client);
 }
 
+static void *nbd_iothread_run(void *opaque)
+{
+    rcu_register_thread();
+
+    while (!atomic_read(&iothread_stopping)) {
+        aio_poll(iothread_ctx, true);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void nbd_iothread_start(BlockBackend *blk)
+{
+    Error *local_err = NULL;
+
+    iothread_ctx = aio_context_new(&local_err);
+    if (!iothread_ctx) {
+        error_report_err(local_err);
+        exit(EXIT_FAILURE);
+    }
+    qemu_thread_create(&iothread_thread, "nbd-iothread", nbd_iothread_run,
+                       NULL, QEMU_THREAD_JOINABLE);
+
+    aio_context_acquire(iothread_ctx);
+    blk_set_aio_context(blk, iothread_ctx);
+    aio_context_release(iothread_ctx);
+}
+
+static void nbd_iothread_stop(BlockBackend *blk)
+{
+    aio_context_acquire(iothread_ctx);
+    blk_set_aio_context(blk, qemu_get_aio_context());
+    aio_context_release(iothread_ctx);
+
+    atomic_set(&iothread_stopping, true);
+    aio_notify(iothread_ctx);
+    qemu_thread_join(&iothread_thread);
+    aio_context_unref(iothread_ctx);
+    iothread_ctx = NULL;
+}
+
 static gboolean nbd_accept(QIOChannel *ioc, GIOCondition cond, gpointer opaque)
 {
     QIOChannelSocket *cioc;
@@ -509,6 +570,7 @@ int main(int argc, char **argv)
         { "image-opts", no_argument, NULL, QEMU_NBD_OPT_IMAGE_OPTS },
         { "trace", required_argument, NULL, 'T' },
         { "fork", no_argument, NULL, QEMU_NBD_OPT_FORK },
+        { "iothread", no_argument, NULL, QEMU_NBD_OPT_IOTHREAD },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -529,6 +591,7 @@ int main(int argc, char **argv)
     const char *export_description = NULL;
     const char *tlscredsid = NULL;
     bool imageOpts = false;
+    bool use_iothread = false;
     bool writethrough = true;
     char *trace_file = NULL;
     bool fork_process = false;
@@ -727,6 +790,9 @@ int main(int argc, char **argv)
             g_free(trace_file);
             trace_file = trace_opt_parse(optarg);
             break;
+        case QEMU_NBD_OPT_IOTHREAD:
+            use_iothread = true;
+            break;
         case QEMU_NBD_OPT_FORK:
             fork_process = true;
             break;
@@ -935,6 +1001,16 @@ int main(int argc, char **argv)
         }
     }
 
+    /* All clients share one BlockBackend, so a flush on any connection
+     * covers the writes completed on every other connection as well. */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
+    if (use_iothread) {
+        nbd_iothread_start(blk);
+    }
+
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          writethrough, NULL, &local_err);
     if (!exp) {
@@ -989,13 +1065,20 @@ int main(int argc, char **argv)
     do {
         main_loop_wait(false);
         if (state == TERMINATE) {
+            AioContext *ctx = blk_get_aio_context(blk);
+
             state = TERMINATING;
+            aio_context_acquire(ctx);
             nbd_export_close(exp);
             nbd_export_put(exp);
+            aio_context_release(ctx);
             exp = NULL;
         }
-    } while (state != TERMINATED);
+    } while (atomic_read(&state) != TERMINATED);
 
+    if (iothread_ctx) {
+        nbd_iothread_stop(blk);
+    }
     blk_unref(blk);
     if (sockpath) {
         unlink(sockpath);
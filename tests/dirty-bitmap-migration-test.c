@@ -0,0 +1,325 @@
+/*
+ * QTest testcase for dirty bitmap migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+#define GRANULARITY 65536
+
+static char *tmpfs;
+static bool got_postcopy;
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
+#include <sys/ioctl.h>
+#include <linux/userfaultfd.h>
+
+static bool ufd_version_check(void)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+    int ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+
+    if (ufd == -1) {
+        g_test_message("Skipping postcopy: userfaultfd not available");
+        return false;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        g_test_message("Skipping postcopy: UFFDIO_API failed");
+        close(ufd);
+        return false;
+    }
+    close(ufd);
+
+    ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                 (__u64)1 << _UFFDIO_UNREGISTER;
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        g_test_message("Skipping postcopy: Missing userfault feature");
+        return false;
+    }
+
+    return true;
+}
+
+#else
+static bool ufd_version_check(void)
+{
+    g_test_message("Skipping postcopy: Userfault not available (buildtime)");
+    return false;
+}
+
+#endif
+
+/*
+ * Events can get in the way of responses we are actually waiting for.
+ * Remember whether the source went through postcopy, though.
+ */
+static QDict *return_or_event(QDict *response)
+{
+    if (!qdict_haskey(response, "event")) {
+        return response;
+    }
+
+    if (!strcmp(qdict_get_str(response, "event"), "MIGRATION")) {
+        QDict *data = qdict_get_qdict(response, "data");
+
+        if (!strcmp(qdict_get_str(data, "status"), "postcopy-active")) {
+            got_postcopy = true;
+        }
+    }
+
+    QDECREF(response);
+    return return_or_event(qtest_qmp_receive(global_qtest));
+}
+
+static void hmp_qemu_io(const char *drive, const char *cmd)
+{
+    QDict *rsp;
+    gchar *line;
+
+    line = g_strdup_printf("{ 'execute': 'human-monitor-command',"
+                           "'arguments': { 'command-line':"
+                           " 'qemu-io %s \"%s\"' } }", drive, cmd);
+    rsp = return_or_event(qmp(line));
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    g_free(line);
+}
+
+static void set_capability(const char *capability)
+{
+    QDict *rsp;
+    gchar *cmd;
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate-set-capabilities',"
+                          "'arguments': { "
+                              "'capabilities': [ {"
+                                  "'capability': '%s',"
+                                  "'state': true } ] } }", capability);
+    rsp = qmp(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    g_free(cmd);
+}
+
+static void wait_for_migration_complete(void)
+{
+    QDict *rsp, *rsp_return;
+    bool completed;
+
+    do {
+        const char *status;
+
+        rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+        rsp_return = qdict_get_qdict(rsp, "return");
+        status = qdict_get_str(rsp_return, "status");
+        completed = strcmp(status, "completed") == 0;
+        g_assert_cmpstr(status, !=,  "failed");
+        QDECREF(rsp);
+        usleep(1000 * 10);
+    } while (!completed);
+}
+
+/* Returns the only dirty bitmap of the only block device */
+static QDict *query_bitmap(void)
+{
+    QDict *rsp, *bitmap;
+    QList *list;
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-block' }"));
+    list = qdict_get_qlist(rsp, "return");
+    g_assert(list);
+    list = qdict_get_qlist(qobject_to_qdict(qlist_peek(list)),
+                           "dirty-bitmaps");
+    g_assert(list);
+    g_assert_cmpint(qlist_size(list), ==, 1);
+
+    bitmap = qobject_to_qdict(qlist_peek(list));
+    QINCREF(bitmap);
+    QDECREF(rsp);
+    return bitmap;
+}
+
+/* Waits until all bitmap data has arrived on the destination */
+static QDict *query_bitmap_active(void)
+{
+    QDict *bitmap;
+
+    for (;;) {
+        bitmap = query_bitmap();
+        if (strcmp(qdict_get_str(bitmap, "status"), "frozen")) {
+            return bitmap;
+        }
+        QDECREF(bitmap);
+        usleep(1000 * 10);
+    }
+}
+
+static void test_migrate(bool postcopy)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd;
+    QDict *rsp, *bitmap;
+
+    from = qtest_start("-drive if=none,id=drive0,driver=null-co");
+
+    cmd = g_strdup_printf("-drive if=none,id=drive0,driver=null-co"
+                          " -incoming %s", uri);
+    to = qtest_init(cmd);
+    g_free(cmd);
+
+    global_qtest = from;
+    rsp = qmp("{ 'execute': 'block-dirty-bitmap-add',"
+              "'arguments': { 'node': 'drive0', 'name': 'bitmap0',"
+                             "'granularity': %d } }", GRANULARITY);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    hmp_qemu_io("drive0", "write 0 64k");
+    hmp_qemu_io("drive0", "write 1M 128k");
+
+    set_capability("dirty-bitmaps");
+
+    if (postcopy) {
+        set_capability("postcopy-ram");
+        set_capability("events");
+
+        /* Slow enough that the first RAM pass cannot finish before
+         * postcopy is started; the limit is lifted at the switchover.
+         */
+        rsp = qmp("{ 'execute': 'migrate_set_speed',"
+                  "'arguments': { 'value': 100000 } }");
+        g_assert(qdict_haskey(rsp, "return"));
+        QDECREF(rsp);
+
+        global_qtest = to;
+        set_capability("postcopy-ram");
+        global_qtest = from;
+    }
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    if (postcopy) {
+        got_postcopy = false;
+        rsp = return_or_event(qmp("{ 'execute': 'migrate-start-postcopy' }"));
+        g_assert(qdict_haskey(rsp, "return"));
+        QDECREF(rsp);
+
+        /* The destination runs while the bitmap data is still arriving.
+         * Dirty an area that was clean on the source and one that was
+         * dirty already; both must end up in the migrated bitmap.
+         */
+        global_qtest = to;
+        qmp_eventwait("RESUME");
+        hmp_qemu_io("drive0", "write 2M 64k");
+        hmp_qemu_io("drive0", "write 0 64k");
+        global_qtest = from;
+    }
+
+    wait_for_migration_complete();
+    g_assert(got_postcopy == postcopy);
+    qtest_quit(from);
+
+    global_qtest = to;
+    if (postcopy) {
+        /* 192k from the source plus 64k from the destination, in sectors */
+        bitmap = query_bitmap_active();
+        g_assert_cmpstr(qdict_get_str(bitmap, "name"), ==, "bitmap0");
+        g_assert_cmpint(qdict_get_int(bitmap, "granularity"), ==, GRANULARITY);
+        g_assert_cmpstr(qdict_get_str(bitmap, "status"), ==, "active");
+    } else {
+        qmp_eventwait("RESUME");
+
+        /* 192k dirty, in sectors */
+        bitmap = query_bitmap();
+        g_assert_cmpstr(qdict_get_str(bitmap, "name"), ==, "bitmap0");
+        g_assert_cmpint(qdict_get_int(bitmap, "granularity"), ==, GRANULARITY);
+        g_assert_cmpint(qdict_get_int(bitmap, "count"), ==, 384);
+        g_assert_cmpstr(qdict_get_str(bitmap, "status"), ==, "active");
+        QDECREF(bitmap);
+
+        /* The migrated bitmap keeps tracking writes on the destination */
+        hmp_qemu_io("drive0", "write 2M 64k");
+        bitmap = query_bitmap();
+    }
+    g_assert_cmpint(qdict_get_int(bitmap, "count"), ==, 512);
+    QDECREF(bitmap);
+
+    /* ...and can be used by QMP again */
+    rsp = qmp("{ 'execute': 'block-dirty-bitmap-clear',"
+              "'arguments': { 'node': 'drive0', 'name': 'bitmap0' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    cmd = g_strdup_printf("%s/migsocket", tmpfs);
+    unlink(cmd);
+    g_free(cmd);
+}
+
+static void test_migrate_precopy(void)
+{
+    test_migrate(false);
+}
+
+static void test_migrate_postcopy(void)
+{
+    test_migrate(true);
+}
+
+int main(int argc, char **argv)
+{
+    char template[] = "/tmp/dirty-bitmap-migration-test-XXXXXX";
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmpfs = mkdtemp(template);
+    if (!tmpfs) {
+        g_test_message("mkdtemp on path (%s): %s\n", template, strerror(errno));
+    }
+    g_assert(tmpfs);
+
+    qtest_add_func("/dirty-bitmap-migration/precopy", test_migrate_precopy);
+    if (ufd_version_check()) {
+        qtest_add_func("/dirty-bitmap-migration/postcopy",
+                       test_migrate_postcopy);
+    }
+
+    ret = g_test_run();
+
+    g_assert_cmpint(ret, ==, 0);
+
+    ret = rmdir(tmpfs);
+    if (ret != 0) {
+        g_test_message("unable to rmdir: path (%s): %s\n",
+                       tmpfs, strerror(errno));
+    }
+
+    return ret;
+}
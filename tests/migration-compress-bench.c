@@ -0,0 +1,224 @@
+/*
+ * Compare the compression methods of migration on a RAM image
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "migration/compress.h"
+
+static const char *image_path;
+static size_t image_size = 64 << 20;
+static size_t page_size = 4096;
+static int level = 1;
+
+static uint8_t *image;
+static size_t n_pages;
+
+static const char commands_string[] =
+    " -f = RAM image to compress, e.g. written by the pmemsave command\n"
+    " -s = size of the synthetic image in MiB, if -f is not given\n"
+    " -p = page size in bytes\n"
+    " -l = compression level (0-9)";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ * This is faster than rand_r(), and gives us a wider range (RAND_MAX is only
+ * guaranteed to be >= INT_MAX).
+ */
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+/*
+ * Without a real image, mix the kind of pages found in guest RAM: free
+ * (zero) pages, incompressible ones (page cache of compressed files,
+ * crypto) and pages of small structures with many similar fields.
+ */
+static void fill_synthetic_image(void)
+{
+    uint64_t r = 1;
+    size_t i, j;
+
+    for (i = 0; i < n_pages; i++) {
+        uint8_t *p = image + i * page_size;
+        uint64_t *q = (uint64_t *)p;
+
+        r = xorshift64star(r);
+        switch (r % 10) {
+        case 0 ... 2:
+            memset(p, 0, page_size);
+            break;
+        case 3 ... 4:
+            for (j = 0; j < page_size / sizeof(*q); j++) {
+                r = xorshift64star(r);
+                q[j] = r;
+            }
+            break;
+        default:
+            for (j = 0; j < page_size / sizeof(*q); j++) {
+                r = xorshift64star(r);
+                q[j] = (j % 8 == 0) ? 0xffff880000000000ULL + (r & 0xfff0)
+                                    : r % 64;
+            }
+            break;
+        }
+    }
+}
+
+static void load_image(void)
+{
+    GError *err = NULL;
+    gchar *contents;
+    gsize len;
+
+    if (!image_path) {
+        n_pages = image_size / page_size;
+        image = g_malloc(n_pages * page_size);
+        fill_synthetic_image();
+        return;
+    }
+
+    if (!g_file_get_contents(image_path, &contents, &len, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        exit(1);
+    }
+    n_pages = len / page_size;
+    image = (uint8_t *)contents;
+}
+
+static void run_method(MigrationCompressMethod method)
+{
+    size_t bound = migration_compress_bound(method, page_size);
+    MigrationCompressor *c;
+    MigrationDecompressor *d;
+    uint8_t *out, *page;
+    size_t *lens, i, pos, in_bytes, out_bytes;
+    int64_t t0, t_comp, t_decomp;
+    ssize_t len;
+
+    /*
+     * One compressor and one decompressor over the whole image, like a
+     * single compression thread; zero pages are skipped as in migration.
+     */
+    out = g_malloc(n_pages * bound);
+    lens = g_new0(size_t, n_pages);
+    page = g_malloc(page_size);
+
+    c = migration_compressor_new(method, level, page_size);
+    t0 = g_get_monotonic_time();
+    for (i = 0, pos = 0, in_bytes = 0; i < n_pages; i++) {
+        if (buffer_is_zero(image + i * page_size, page_size)) {
+            continue;
+        }
+        len = migration_compress_page(c, image + i * page_size, page_size,
+                                      out + pos, bound);
+        if (len < 0) {
+            fprintf(stderr, "%s: compression failed\n",
+                    MigrationCompressMethod_lookup[method]);
+            exit(1);
+        }
+        lens[i] = len;
+        pos += len;
+        in_bytes += page_size;
+    }
+    t_comp = g_get_monotonic_time() - t0;
+    out_bytes = pos;
+    migration_compressor_free(c);
+
+    d = migration_decompressor_new(method, page_size);
+    t0 = g_get_monotonic_time();
+    for (i = 0, pos = 0; i < n_pages; i++) {
+        if (!lens[i]) {
+            continue;
+        }
+        if (migration_decompress_page(d, out + pos, lens[i], page,
+                                      page_size) < 0 ||
+            memcmp(page, image + i * page_size, page_size)) {
+            fprintf(stderr, "%s: page %zu does not match\n",
+                    MigrationCompressMethod_lookup[method], i);
+            exit(1);
+        }
+        pos += lens[i];
+    }
+    t_decomp = g_get_monotonic_time() - t0;
+    migration_decompressor_free(d);
+
+    printf("%-6s %8.2f %12.1f %14.1f\n",
+           MigrationCompressMethod_lookup[method],
+           out_bytes ? (double)in_bytes / out_bytes : 0.0,
+           t_comp ? (double)in_bytes / t_comp : 0.0,
+           t_decomp ? (double)in_bytes / t_decomp : 0.0);
+
+    g_free(page);
+    g_free(lens);
+    g_free(out);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hf:s:p:l:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'f':
+            image_path = optarg;
+            break;
+        case 's':
+            image_size = (size_t)atoi(optarg) << 20;
+            break;
+        case 'p':
+            page_size = atoi(optarg);
+            break;
+        case 'l':
+            level = atoi(optarg);
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+    if (!page_size || page_size % sizeof(uint64_t) ||
+        level < 0 || level > 9) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int method;
+
+    parse_args(argc, argv);
+    load_image();
+
+    printf("Image: %s, %zu pages of %zu bytes, level %d\n",
+           image_path ? image_path : "synthetic", n_pages, page_size, level);
+    printf("method    ratio  comp (MB/s)  decomp (MB/s)\n");
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD__MAX; method++) {
+        if (migration_compress_method_supported(method)) {
+            run_method(method);
+        }
+    }
+
+    g_free(image);
+    return 0;
+}
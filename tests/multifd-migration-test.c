@@ -0,0 +1,428 @@
+/*
+ * QTest testcase for RAM migration: multifd, mapped-ram and ignore-shared
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qint.h"
+
+/* Guest RAM filled with a pattern, so that it is not sent as zero pages */
+#define FILL_START  (1 << 20)
+#define FILL_SIZE   (64 << 20)
+#define FILL_PATTERN 0x5a
+
+static char *tmpfs;
+
+/*
+ * Events can get in the way of responses we are actually waiting for.
+ */
+static QDict *return_or_event(QDict *response)
+{
+    if (!qdict_haskey(response, "event")) {
+        return response;
+    }
+
+    QDECREF(response);
+    return return_or_event(qtest_qmp_receive(global_qtest));
+}
+
+static void set_capability(const char *name)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+              "'arguments': { "
+                  "'capabilities': [ {"
+                      "'capability': %s,"
+                      "'state': true } ] } }", name);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+static void set_multifd(int channels)
+{
+    QDict *rsp;
+
+    set_capability("multifd");
+
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'multifd-channels': %d } }", channels);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+/* Returns the throughput reported for the completed migration in Mbps */
+static double wait_for_migration_complete(void)
+{
+    QDict *rsp, *rsp_return;
+    double mbps = 0;
+    bool completed;
+
+    do {
+        const char *status;
+
+        rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+        rsp_return = qdict_get_qdict(rsp, "return");
+        status = qdict_get_str(rsp_return, "status");
+        completed = strcmp(status, "completed") == 0;
+        g_assert_cmpstr(status, !=,  "failed");
+        if (completed) {
+            mbps = qdict_get_double(qdict_get_qdict(rsp_return, "ram"),
+                                    "mbps");
+        }
+        QDECREF(rsp);
+        usleep(1000 * 10);
+    } while (!completed);
+
+    return mbps;
+}
+
+/*
+ * All normal pages go over the channels, and every one of them must have
+ * carried a share of the work.
+ */
+static void check_multifd_pages(int channels)
+{
+    QDict *rsp, *ram;
+    QList *list;
+    const QListEntry *entry;
+    int64_t total = 0;
+    int n = 0;
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+    ram = qdict_get_qdict(qdict_get_qdict(rsp, "return"), "ram");
+    if (!channels) {
+        g_assert(!qdict_haskey(ram, "multifd-pages"));
+        QDECREF(rsp);
+        return;
+    }
+
+    list = qdict_get_qlist(ram, "multifd-pages");
+    g_assert(list);
+    QLIST_FOREACH_ENTRY(list, entry) {
+        int64_t pages = qint_get_int(qobject_to_qint(qlist_entry_obj(entry)));
+
+        g_test_message("channel %d: %" PRId64 " pages", n, pages);
+        g_assert_cmpint(pages, >, 0);
+        total += pages;
+        n++;
+    }
+    g_assert_cmpint(n, ==, channels);
+    g_assert_cmpint(total, ==, qdict_get_int(ram, "normal"));
+    g_assert_cmpint(total, >=, FILL_SIZE / 4096);
+    QDECREF(rsp);
+}
+
+/*
+ * The sections saved in stop-copy, or loaded on the destination, are
+ * listed by query-vmstate-timing; RAM and the devices of the pc machine
+ * must be among them.
+ */
+static void check_vmstate_timing(const char *list)
+{
+    const char *expected[] = { "ram", "timer", "mc146818rtc" };
+    bool found[ARRAY_SIZE(expected)] = { false };
+    QDict *rsp, *ret;
+    QList *sections;
+    const QListEntry *entry;
+    int i, n = 0;
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-vmstate-timing' }"));
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert(qdict_haskey(ret, list));
+
+    sections = qdict_get_qlist(ret, list);
+    QLIST_FOREACH_ENTRY(sections, entry) {
+        QDict *timing = qobject_to_qdict(qlist_entry_obj(entry));
+        const char *idstr = qdict_get_str(timing, "idstr");
+
+        g_assert_cmpint(qdict_get_int(timing, "time"), >=, 0);
+        g_assert_cmpint(qdict_get_int(timing, "bytes"), >=, 0);
+        for (i = 0; i < ARRAY_SIZE(expected); i++) {
+            if (!strcmp(idstr, expected[i])) {
+                found[i] = true;
+                if (!strcmp(idstr, "ram")) {
+                    g_assert_cmpint(qdict_get_int(timing, "bytes"), >, 0);
+                }
+            }
+        }
+        n++;
+    }
+    g_test_message("%s: %d sections", list, n);
+    for (i = 0; i < ARRAY_SIZE(expected); i++) {
+        if (!found[i]) {
+            g_test_message("no %s timing for %s", list, expected[i]);
+        }
+        g_assert(found[i]);
+    }
+    QDECREF(rsp);
+}
+
+static void check_pattern(uint64_t addr)
+{
+    uint8_t buf[4096], expected[4096];
+
+    memset(expected, FILL_PATTERN, sizeof(expected));
+    memread(addr, buf, sizeof(buf));
+    g_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+}
+
+static void test_migrate(int channels)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    int64_t start, end;
+    double mbps;
+    gchar *cmd;
+    QDict *rsp;
+
+    from = qtest_start("-m 128M");
+
+    cmd = g_strdup_printf("-m 128M -incoming %s", uri);
+    to = qtest_init(cmd);
+    g_free(cmd);
+
+    if (channels) {
+        global_qtest = to;
+        set_multifd(channels);
+        global_qtest = from;
+        set_multifd(channels);
+    }
+
+    qmemset(FILL_START, FILL_PATTERN, FILL_SIZE);
+
+    /* Unlimited bandwidth */
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'max-bandwidth': 0 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    start = g_get_monotonic_time();
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    mbps = wait_for_migration_complete();
+    end = g_get_monotonic_time();
+    g_test_message("%d channel(s): %.0f Mbps, %" PRId64 " ms wall clock",
+                   channels ? channels : 1, mbps, (end - start) / 1000);
+    check_multifd_pages(channels);
+    check_vmstate_timing("save");
+    qtest_quit(from);
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+    check_vmstate_timing("load");
+
+    check_pattern(FILL_START);
+    check_pattern(FILL_START + FILL_SIZE / 2);
+    check_pattern(FILL_START + FILL_SIZE - 4096);
+
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    cmd = g_strdup_printf("%s/migsocket", tmpfs);
+    unlink(cmd);
+    g_free(cmd);
+}
+
+/* Save to a mapped-ram file, then load it into a new guest */
+static void test_migrate_file(int channels)
+{
+    char *file = g_strdup_printf("%s/migfile", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd;
+    QDict *rsp;
+
+    from = qtest_start("-m 128M");
+    set_capability("mapped-ram");
+    if (channels) {
+        set_multifd(channels);
+    }
+
+    qmemset(FILL_START, FILL_PATTERN, FILL_SIZE);
+
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'max-bandwidth': 0 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': 'file:%s' } }",
+                          file);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_migration_complete();
+    qtest_quit(from);
+
+    /* Capabilities must be set before the file is read */
+    to = qtest_init("-m 128M -incoming defer");
+    global_qtest = to;
+    set_capability("mapped-ram");
+    if (channels) {
+        set_multifd(channels);
+    }
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate-incoming',"
+                          "'arguments': { 'uri': 'file:%s' } }",
+                          file);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    qmp_eventwait("RESUME");
+
+    check_pattern(FILL_START);
+    check_pattern(FILL_START + FILL_SIZE / 2);
+    check_pattern(FILL_START + FILL_SIZE - 4096);
+
+    qtest_quit(to);
+    global_qtest = global;
+
+    unlink(file);
+    g_free(file);
+}
+
+/*
+ * Guest RAM on a shared file is mapped by both sides, so with ignore-shared
+ * only the small non-shared blocks go through the stream.
+ */
+static void test_migrate_ignore_shared(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    char *mem_path = g_strdup_printf("%s/shmem", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    int64_t transferred;
+    gchar *cmd;
+    QDict *rsp;
+
+    cmd = g_strdup_printf("-m 128M -vga none"
+                          " -object memory-backend-file,id=mem,size=128M,"
+                          "mem-path=%s,share=on -numa node,memdev=mem",
+                          mem_path);
+    from = qtest_start(cmd);
+    g_free(cmd);
+
+    cmd = g_strdup_printf("-m 128M -vga none"
+                          " -object memory-backend-file,id=mem,size=128M,"
+                          "mem-path=%s,share=on -numa node,memdev=mem"
+                          " -incoming %s", mem_path, uri);
+    to = qtest_init(cmd);
+    g_free(cmd);
+
+    global_qtest = to;
+    set_capability("ignore-shared");
+    global_qtest = from;
+    set_capability("ignore-shared");
+
+    qmemset(FILL_START, FILL_PATTERN, FILL_SIZE);
+
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'max-bandwidth': 0 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_migration_complete();
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+    transferred = qdict_get_int(qdict_get_qdict(qdict_get_qdict(rsp, "return"),
+                                                "ram"), "transferred");
+    QDECREF(rsp);
+    g_test_message("%" PRId64 " bytes of RAM transferred", transferred);
+    g_assert_cmpint(transferred, <, FILL_SIZE / 16);
+    qtest_quit(from);
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+
+    check_pattern(FILL_START);
+    check_pattern(FILL_START + FILL_SIZE / 2);
+    check_pattern(FILL_START + FILL_SIZE - 4096);
+
+    qtest_quit(to);
+    global_qtest = global;
+
+    unlink(mem_path);
+    g_free(mem_path);
+    cmd = g_strdup_printf("%s/migsocket", tmpfs);
+    unlink(cmd);
+    g_free(cmd);
+    g_free(uri);
+}
+
+static void test_migrate_mapped_ram(void)
+{
+    test_migrate_file(0);
+}
+
+static void test_migrate_mapped_ram_multifd(void)
+{
+    test_migrate_file(4);
+}
+
+static void test_migrate_single(void)
+{
+    test_migrate(0);
+}
+
+static void test_migrate_multifd(void)
+{
+    test_migrate(4);
+}
+
+int main(int argc, char **argv)
+{
+    char template[] = "/tmp/multifd-migration-test-XXXXXX";
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmpfs = mkdtemp(template);
+    if (!tmpfs) {
+        g_test_message("mkdtemp on path (%s): %s\n", template, strerror(errno));
+    }
+    g_assert(tmpfs);
+
+    qtest_add_func("/multifd-migration/single", test_migrate_single);
+    qtest_add_func("/multifd-migration/multifd", test_migrate_multifd);
+    qtest_add_func("/multifd-migration/mapped-ram", test_migrate_mapped_ram);
+    qtest_add_func("/multifd-migration/mapped-ram-multifd",
+                   test_migrate_mapped_ram_multifd);
+    qtest_add_func("/multifd-migration/ignore-shared",
+                   test_migrate_ignore_shared);
+
+    ret = g_test_run();
+
+    g_assert_cmpint(ret, ==, 0);
+
+    ret = rmdir(tmpfs);
+    if (ret != 0) {
+        g_test_message("unable to rmdir: path (%s): %s\n",
+                       tmpfs, strerror(errno));
+    }
+
+    return ret;
+}
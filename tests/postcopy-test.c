@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 
 #include "libqtest.h"
+#include "qapi/qmp/qint.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
@@ -353,53 +354,111 @@ static void cleanup(const char *filename)
     g_free(path);
 }
 
-static void test_migrate(void)
+/*
+ * Writes the boot file of the guest that modifies memory in a loop, and
+ * returns the command lines for the source and for the destination, which
+ * gets @dest_args in addition.
+ */
+static void guest_cmdlines(char **cmd_src, char **cmd_dst,
+                           const char *dest_args)
 {
-    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
-    QTestState *global = global_qtest, *from, *to;
-    unsigned char dest_byte_a, dest_byte_b, dest_byte_c, dest_byte_d;
-    gchar *cmd, *cmd_src, *cmd_dst;
-    QDict *rsp;
-
     char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
     const char *arch = qtest_get_arch();
 
-    got_stop = false;
-
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
         init_bootfile_x86(bootpath);
-        cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
-                                  " -name pcsource,debug-threads=on"
-                                  " -serial file:%s/src_serial"
-                                  " -drive file=%s,format=raw",
-                                  tmpfs, bootpath);
-        cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
-                                  " -name pcdest,debug-threads=on"
-                                  " -serial file:%s/dest_serial"
-                                  " -drive file=%s,format=raw"
-                                  " -incoming %s",
-                                  tmpfs, bootpath, uri);
+        *cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                                   " -name pcsource,debug-threads=on"
+                                   " -serial file:%s/src_serial"
+                                   " -drive file=%s,format=raw",
+                                   tmpfs, bootpath);
+        *cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                                   " -name pcdest,debug-threads=on"
+                                   " -serial file:%s/dest_serial"
+                                   " -drive file=%s,format=raw"
+                                   " %s",
+                                   tmpfs, bootpath, dest_args);
     } else if (strcmp(arch, "ppc64") == 0) {
         const char *accel;
 
         /* On ppc64, the test only works with kvm-hv, but not with kvm-pr */
         accel = access("/sys/module/kvm_hv", F_OK) ? "tcg" : "kvm:tcg";
         init_bootfile_ppc(bootpath);
-        cmd_src = g_strdup_printf("-machine accel=%s -m 256M"
-                                  " -name pcsource,debug-threads=on"
-                                  " -serial file:%s/src_serial"
-                                  " -drive file=%s,if=pflash,format=raw",
-                                  accel, tmpfs, bootpath);
-        cmd_dst = g_strdup_printf("-machine accel=%s -m 256M"
-                                  " -name pcdest,debug-threads=on"
-                                  " -serial file:%s/dest_serial"
-                                  " -incoming %s",
-                                  accel, tmpfs, uri);
+        *cmd_src = g_strdup_printf("-machine accel=%s -m 256M"
+                                   " -name pcsource,debug-threads=on"
+                                   " -serial file:%s/src_serial"
+                                   " -drive file=%s,if=pflash,format=raw",
+                                   accel, tmpfs, bootpath);
+        *cmd_dst = g_strdup_printf("-machine accel=%s -m 256M"
+                                   " -name pcdest,debug-threads=on"
+                                   " -serial file:%s/dest_serial"
+                                   " %s",
+                                   accel, tmpfs, dest_args);
     } else {
         g_assert_not_reached();
     }
 
     g_free(bootpath);
+}
+
+static void set_capability(const char *name)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': %s,"
+                          "'state': true } ] } }", name);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+/*
+ * The destination touched pages that had not arrived yet, so it must
+ * report how long it waited for them.
+ */
+static void check_fault_latency(void)
+{
+    QDict *rsp, *latency;
+    QList *histogram;
+    const QListEntry *entry;
+    int64_t faults, total = 0;
+    int buckets = 0;
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+    latency = qdict_get_qdict(qdict_get_qdict(rsp, "return"),
+                              "postcopy-fault-latency");
+    g_assert(latency);
+
+    faults = qdict_get_int(latency, "faults");
+    g_test_message("%" PRId64 " faults, longest wait %" PRId64 " us",
+                   faults, qdict_get_int(latency, "max"));
+    g_assert_cmpint(faults, >, 0);
+
+    histogram = qdict_get_qlist(latency, "histogram");
+    QLIST_FOREACH_ENTRY(histogram, entry) {
+        total += qint_get_int(qobject_to_qint(qlist_entry_obj(entry)));
+        buckets++;
+    }
+    g_assert_cmpint(buckets, ==, 24);
+    g_assert_cmpint(total, ==, faults);
+    QDECREF(rsp);
+}
+
+static void test_migrate(bool preempt)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    unsigned char dest_byte_a, dest_byte_b, dest_byte_c, dest_byte_d;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    QDict *rsp;
+
+    got_stop = false;
+
+    cmd = g_strdup_printf("-incoming %s", uri);
+    guest_cmdlines(&cmd_src, &cmd_dst, cmd);
+    g_free(cmd);
 
     from = qtest_start(cmd_src);
     g_free(cmd_src);
@@ -408,22 +467,16 @@ static void test_migrate(void)
     g_free(cmd_dst);
 
     global_qtest = from;
-    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
-                  "'arguments': { "
-                      "'capabilities': [ {"
-                          "'capability': 'postcopy-ram',"
-                          "'state': true } ] } }");
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
+    set_capability("postcopy-ram");
+    if (preempt) {
+        set_capability("postcopy-preempt");
+    }
 
     global_qtest = to;
-    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
-                  "'arguments': { "
-                      "'capabilities': [ {"
-                          "'capability': 'postcopy-ram',"
-                          "'state': true } ] } }");
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
+    set_capability("postcopy-ram");
+    if (preempt) {
+        set_capability("postcopy-preempt");
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -473,6 +526,7 @@ static void test_migrate(void)
     qtest_quit(from);
 
     global_qtest = to;
+    check_fault_latency();
 
     qtest_memread(to, start_address, &dest_byte_a, 1);
 
@@ -502,9 +556,135 @@ static void test_migrate(void)
     cleanup("dest_serial");
 }
 
+static void test_migrate_postcopy(void)
+{
+    test_migrate(false);
+}
+
+static void test_migrate_preempt(void)
+{
+    test_migrate(true);
+}
+
+static bool capability_enabled(const char *name)
+{
+    QDict *rsp;
+    QList *caps;
+    const QListEntry *entry;
+    bool enabled = false;
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-migrate-capabilities' }"));
+    caps = qdict_get_qlist(rsp, "return");
+    QLIST_FOREACH_ENTRY(caps, entry) {
+        QDict *cap = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(cap, "capability"), name)) {
+            enabled = qdict_get_bool(cap, "state");
+        }
+    }
+    QDECREF(rsp);
+    return enabled;
+}
+
+/*
+ * The guest keeps modifying its memory while a background snapshot is
+ * saved; the snapshot must still be what the memory was at one point in
+ * time.
+ */
+static void test_background_snapshot(void)
+{
+    char *snapshot = g_strdup_printf("%s/snapshot", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    unsigned char src_byte_a, src_byte_b;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    const char *status;
+    QDict *rsp;
+
+    got_stop = false;
+
+    /* -S: check the RAM of the snapshot before the guest changes it */
+    cmd = g_strdup_printf("-S -incoming 'exec:cat %s'", snapshot);
+    guest_cmdlines(&cmd_src, &cmd_dst, cmd);
+    g_free(cmd);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'background-snapshot',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    if (!capability_enabled("background-snapshot")) {
+        g_test_message("Skipping test: "
+                       "userfaultfd write protection not available");
+        goto out;
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': 'exec:cat > %s' } }",
+                          snapshot);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_migration_complete();
+
+    /* The source is still running */
+    qtest_memread(from, start_address, &src_byte_a, 1);
+    do {
+        qtest_memread(from, start_address, &src_byte_b, 1);
+        usleep(10 * 1000);
+    } while (src_byte_a == src_byte_b);
+
+    qtest_quit(from);
+
+    to = qtest_init(cmd_dst);
+    global_qtest = to;
+
+    do {
+        rsp = return_or_event(qmp("{ 'execute': 'query-status' }"));
+        status = qdict_get_str(qdict_get_qdict(rsp, "return"), "status");
+        if (strcmp(status, "inmigrate")) {
+            g_assert_cmpstr(status, ==, "paused");
+            QDECREF(rsp);
+            break;
+        }
+        QDECREF(rsp);
+        usleep(10 * 1000);
+    } while (true);
+
+    check_guests_ram();
+
+    /* And it goes on from there */
+    rsp = qmp("{ 'execute': 'cont' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    wait_for_serial("dest_serial");
+
+out:
+    qtest_quit(global_qtest);
+    global_qtest = global;
+    g_free(cmd_dst);
+    g_free(snapshot);
+
+    cleanup("bootsect");
+    cleanup("snapshot");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/postcopy-test-XXXXXX";
+    const char *arch = qtest_get_arch();
     int ret;
 
     g_test_init(&argc, &argv, NULL);
@@ -521,7 +701,12 @@ int main(int argc, char **argv)
 
     module_call_init(MODULE_INIT_QOM);
 
-    qtest_add_func("/postcopy", test_migrate);
+    qtest_add_func("/postcopy", test_migrate_postcopy);
+    qtest_add_func("/postcopy/preempt", test_migrate_preempt);
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        /* The iterative hash table of pseries is not in the snapshot */
+        qtest_add_func("/background-snapshot", test_background_snapshot);
+    }
 
     ret = g_test_run();
 
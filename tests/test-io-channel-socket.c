@@ -553,6 +553,86 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    QIOChannelSocket *ssrc;
+    size_t len = 256 * 1024;
+    char *sendbuf = g_malloc(len);
+    char *recvbuf = g_malloc0(len);
+    size_t sent, got;
+    int i;
+
+    listen_addr->type = SOCKET_ADDRESS_KIND_INET;
+    listen_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *listen_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_INET;
+    connect_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *connect_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+    ssrc = QIO_CHANNEL_SOCKET(src);
+
+    if (qio_channel_socket_set_zero_copy(ssrc, true, NULL) < 0) {
+        g_test_message("MSG_ZEROCOPY not supported, skipping");
+        goto cleanup;
+    }
+
+    for (i = 0; i < len; i++) {
+        sendbuf[i] = i * 7;
+    }
+
+    /* Alternate between sending and receiving, the socket buffers are small */
+    qio_channel_set_blocking(src, false, NULL);
+    sent = got = 0;
+    while (got < len) {
+        ssize_t ret;
+
+        if (sent < len) {
+            ret = qio_channel_write(src, sendbuf + sent, len - sent,
+                                    &error_abort);
+            if (ret > 0) {
+                sent += ret;
+            }
+        }
+        if (got < sent) {
+            ret = qio_channel_read(dst, recvbuf + got, sent - got,
+                                   &error_abort);
+            g_assert_cmpint(ret, >, 0);
+            got += ret;
+        }
+    }
+    g_assert(memcmp(sendbuf, recvbuf, len) == 0);
+    qio_channel_socket_set_zero_copy(ssrc, false, &error_abort);
+    g_assert_cmpint(ssrc->zero_copy_queued, >, 0);
+
+    /* The socket polls with POLLERR while completions are queued */
+    while (qio_channel_socket_poll_zero_copy(ssrc) < ssrc->zero_copy_queued) {
+        struct pollfd pfd = { .fd = ssrc->fd, .events = 0 };
+
+        g_assert_cmpint(poll(&pfd, 1, 10000), ==, 1);
+        g_assert(pfd.revents & POLLERR);
+    }
+    g_assert_cmpint(ssrc->zero_copy_sent, ==, ssrc->zero_copy_queued);
+
+ cleanup:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    g_free(sendbuf);
+    g_free(recvbuf);
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -578,6 +658,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -169,9 +170,138 @@ static void test_encode_decode(void)
 {
     int i;
 
-    for (i = 0; i < 10000; i++) {
-        encode_decode_range();
+    /* In perf mode the accelerators are left to the benchmark */
+    do {
+        for (i = 0; i < 10000; i++) {
+            encode_decode_range();
+        }
+    } while (!g_test_perf() && test_xbzrle_next_accel());
+}
+
+/* An in-memory cache bumping a few counters */
+static void mutate_sparse(uint8_t *page)
+{
+    int i, n = g_test_rand_int_range(1, 5);
+
+    for (i = 0; i < n; i++) {
+        page[g_test_rand_int_range(0, PAGE_SIZE / 8) * 8]++;
+    }
+}
+
+/* A hot field at the start of each cache line */
+static void mutate_lines(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i += 64) {
+        *(uint64_t *)(page + i) += 1;
+    }
+}
+
+/* Bytes changed at random, 1 in 64 */
+static void mutate_random(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        if (g_test_rand_int_range(0, 64) == 0) {
+            page[i] ^= 0xff;
+        }
+    }
+}
+
+static void mutate_none(uint8_t *page)
+{
+}
+
+static void bench_encode(const char *name, void (*mutate)(uint8_t *page))
+{
+    const int n_pages = 256, rounds = 200;
+    uint8_t *old_buf = g_malloc(n_pages * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(n_pages * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int64_t start, elapsed;
+    int i, j;
+
+    for (i = 0; i < n_pages * PAGE_SIZE; i += 4) {
+        *(uint32_t *)(old_buf + i) = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, n_pages * PAGE_SIZE);
+    for (i = 0; i < n_pages; i++) {
+        mutate(new_buf + i * PAGE_SIZE);
+    }
+
+    start = g_get_monotonic_time();
+    for (j = 0; j < rounds; j++) {
+        for (i = 0; i < n_pages; i++) {
+            xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                 new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                 compressed, PAGE_SIZE);
+        }
+    }
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_test_message("%-10s %8.1f MB/s", name,
+                   (double)n_pages * rounds * PAGE_SIZE / elapsed);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
+static void test_encode_perf(void)
+{
+    int accel = 0;
+
+    /* From the most preferred accelerator down to the generic code */
+    do {
+        g_test_message("accelerator %d:", accel++);
+        bench_encode("unchanged", mutate_none);
+        bench_encode("sparse", mutate_sparse);
+        bench_encode("lines", mutate_lines);
+        bench_encode("random", mutate_random);
+    } while (test_xbzrle_next_accel());
+}
+
+static void test_page_cache(void)
+{
+    /* 4 sets of 4 ways: pages 0, 4, 8, ... share set 0 */
+    PageCache *cache = cache_init(16, PAGE_SIZE, 4);
+    uint8_t page[PAGE_SIZE];
+    uint64_t i;
+
+    g_assert(cache);
+    for (i = 0; i < 4; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert_cmpint(cache_insert(cache, i * 4 * PAGE_SIZE, page, 0), ==, 0);
     }
+
+    /* The set is full of pages younger than their lifetime */
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, 1), ==, -1);
+    g_assert(!cache_is_cached(cache, 16 * PAGE_SIZE, 1));
+    g_assert(!get_cached_data(cache, 16 * PAGE_SIZE));
+    g_assert_cmpint(cache_insert(cache, PAGE_SIZE, page, 1), ==, 0);
+
+    /* Page 0 is used again, the next page in clock order goes instead */
+    g_assert(cache_is_cached(cache, 0, 4));
+    memset(page, 0xff, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, 4), ==, 0);
+    g_assert_cmpint(cache_get_evictions(cache), ==, 1);
+    g_assert(cache_is_cached(cache, 0, 4));
+    g_assert(!cache_is_cached(cache, 4 * PAGE_SIZE, 4));
+    g_assert(cache_is_cached(cache, 8 * PAGE_SIZE, 4));
+    g_assert(cache_is_cached(cache, 12 * PAGE_SIZE, 4));
+    g_assert(cache_is_cached(cache, 16 * PAGE_SIZE, 4));
+    g_assert(memcmp(get_cached_data(cache, 16 * PAGE_SIZE), page,
+                    PAGE_SIZE) == 0);
+    g_assert(cache_is_cached(cache, PAGE_SIZE, 4));
+
+    /* Shrinking keeps the pages of the sets that remain */
+    g_assert_cmpint(cache_resize(cache, 8), ==, 8);
+    g_assert(cache_is_cached(cache, 16 * PAGE_SIZE, 4));
+    g_assert(cache_is_cached(cache, PAGE_SIZE, 4));
+
+    cache_fini(cache);
 }
 
 int main(int argc, char **argv)
@@ -186,6 +316,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/page_cache", test_page_cache);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_perf", test_encode_perf);
+    }
 
     return g_test_run();
 }
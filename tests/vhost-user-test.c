@@ -24,6 +24,8 @@
 
 #include "libqos/malloc-pc.h"
 #include "hw/virtio/virtio-net.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_pci.h"
 
 #include <linux/vhost.h>
 #include <linux/virtio_ids.h>
@@ -50,6 +52,8 @@
 
 #define HUGETLBFS_MAGIC       0x958458f6
 
+#define TEST_BLK_CAPACITY     0x12345 /* in 512 byte sectors */
+
 /*********** FROM hw/virtio/vhost-user.c *************************************/
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
@@ -57,6 +61,7 @@
 #define VHOST_USER_F_PROTOCOL_FEATURES 30
 #define VHOST_USER_PROTOCOL_F_MQ 0
 #define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
 
 #define VHOST_LOG_PAGE 0x1000
 
@@ -80,6 +85,8 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_PROTOCOL_FEATURES = 16,
     VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_SET_CONFIG = 25,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -101,6 +108,17 @@ typedef struct VhostUserLog {
     uint64_t mmap_offset;
 } VhostUserLog;
 
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+#define VHOST_USER_CONFIG_HDR_SIZE (offsetof(VhostUserConfig, region))
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -116,6 +134,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
         VhostUserLog log;
+        VhostUserConfig config;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -152,6 +171,10 @@ typedef struct TestServer {
     bool test_fail;
     int test_flags;
     int queues;
+    bool config;
+    int get_config_count;
+    int set_config_count;
+    VhostUserConfig set_config;
 } TestServer;
 
 static const char *tmpfs;
@@ -300,6 +323,9 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         if (s->queues > 1) {
             msg.payload.u64 |= 0x1ULL << VIRTIO_NET_F_MQ;
         }
+        if (s->config) {
+            msg.payload.u64 |= 0x1ULL << VIRTIO_BLK_F_CONFIG_WCE;
+        }
         if (s->test_flags >= TEST_FLAGS_BAD) {
             msg.payload.u64 = 0;
             s->test_flags = TEST_FLAGS_END;
@@ -325,6 +351,9 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         if (s->queues > 1) {
             msg.payload.u64 |= 1 << VHOST_USER_PROTOCOL_F_MQ;
         }
+        if (s->config) {
+            msg.payload.u64 |= 1 << VHOST_USER_PROTOCOL_F_CONFIG;
+        }
         p = (uint8_t *) &msg;
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
@@ -390,6 +419,39 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
 
+    case VHOST_USER_GET_CONFIG: {
+        struct virtio_blk_config blkcfg = {
+            .capacity = cpu_to_le64(TEST_BLK_CAPACITY),
+            .blk_size = cpu_to_le32(512),
+            .num_queues = cpu_to_le16(1),
+        };
+
+        /* QEMU asks for the whole config space of the device */
+        g_assert_cmpint(msg.payload.config.offset, ==, 0);
+        g_assert_cmpint(msg.payload.config.size, ==, sizeof(blkcfg));
+        g_assert_cmpint(msg.size, ==,
+                        VHOST_USER_CONFIG_HDR_SIZE + sizeof(blkcfg));
+        s->get_config_count++;
+
+        /* the reply carries the same request number and layout */
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        memcpy(msg.payload.config.region, &blkcfg, sizeof(blkcfg));
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+    }
+
+    case VHOST_USER_SET_CONFIG:
+        g_assert_cmpint(msg.payload.config.size, <=,
+                        VHOST_USER_MAX_CONFIG_SIZE);
+        g_assert_cmpint(msg.size, ==,
+                        VHOST_USER_CONFIG_HDR_SIZE + msg.payload.config.size);
+        memcpy(&s->set_config, &msg.payload.config, sizeof(s->set_config));
+        s->set_config_count++;
+
+        g_cond_signal(&s->data_cond);
+        break;
+
     default:
         break;
     }
@@ -914,6 +976,93 @@ static void test_multiqueue(void)
     test_server_free(s);
 }
 
+#ifdef CONFIG_VHOST_USER_BLK
+static void wait_for_set_config(TestServer *s)
+{
+    gint64 end_time;
+
+    g_mutex_lock(&s->data_mutex);
+    end_time = g_get_monotonic_time() + 5 * G_TIME_SPAN_SECOND;
+    while (!s->set_config_count) {
+        if (!g_cond_wait_until(&s->data_cond, &s->data_mutex, end_time)) {
+            /* timeout has passed */
+            g_assert(s->set_config_count);
+            break;
+        }
+    }
+
+    g_mutex_unlock(&s->data_mutex);
+}
+
+static void test_config(void)
+{
+    TestServer *s = test_server_new("config");
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    uint32_t features;
+    uint64_t wce_off;
+    char *cmd;
+
+    s->config = true;
+    test_server_listen(s);
+
+    cmd = g_strdup_printf(QEMU_CMD_MEM QEMU_CMD_CHR
+                          " -device vhost-user-blk-pci,chardev=%s",
+                          512, 512, root, s->chr_name,
+                          s->socket_path, "", s->chr_name);
+    qtest_start(cmd);
+    g_free(cmd);
+
+    /* The config space is fetched once, while the device is realized */
+    g_mutex_lock(&s->data_mutex);
+    g_assert_cmpint(s->get_config_count, ==, 1);
+    g_assert_cmpint(s->set_config_count, ==, 0);
+    g_mutex_unlock(&s->data_mutex);
+
+    bus = qpci_init_pc(NULL);
+    dev = qvirtio_pci_device_find(bus, VIRTIO_ID_BLOCK);
+    g_assert(dev != NULL);
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&dev->vdev);
+    qvirtio_set_acknowledge(&dev->vdev);
+    qvirtio_set_driver(&dev->vdev);
+
+    features = qvirtio_get_features(&dev->vdev);
+    g_assert(features & (1u << VIRTIO_BLK_F_CONFIG_WCE));
+    qvirtio_set_features(&dev->vdev, 1u << VIRTIO_BLK_F_CONFIG_WCE);
+
+    /* The guest sees what the backend returned for GET_CONFIG */
+    g_assert_cmphex(qvirtio_config_readq(&dev->vdev, 0), ==,
+                    TEST_BLK_CAPACITY);
+    wce_off = offsetof(struct virtio_blk_config, wce);
+    g_assert_cmpint(qvirtio_config_readb(&dev->vdev, wce_off), ==, 0);
+
+    /* Toggling the cache mode is forwarded as a one byte SET_CONFIG */
+    qpci_io_writeb(dev->pdev, dev->bar,
+                   VIRTIO_PCI_CONFIG_OFF(dev->pdev->msix_enabled) + wce_off,
+                   1);
+    wait_for_set_config(s);
+
+    g_mutex_lock(&s->data_mutex);
+    g_assert_cmpint(s->set_config_count, ==, 1);
+    g_assert_cmpint(s->set_config.offset, ==, wce_off);
+    g_assert_cmpint(s->set_config.size, ==, 1);
+    g_assert_cmpint(s->set_config.region[0], ==, 1);
+    g_mutex_unlock(&s->data_mutex);
+
+    g_assert_cmpint(qvirtio_config_readb(&dev->vdev, wce_off), ==, 1);
+
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+
+    test_server_free(s);
+}
+#endif
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
@@ -960,6 +1109,9 @@ int main(int argc, char **argv)
     qtest_add_data_func("/vhost-user/read-guest-mem", server, read_guest_mem);
     qtest_add_func("/vhost-user/migrate", test_migrate);
     qtest_add_func("/vhost-user/multiqueue", test_multiqueue);
+#ifdef CONFIG_VHOST_USER_BLK
+    qtest_add_func("/vhost-user/config", test_config);
+#endif
 #ifdef CONFIG_HAS_GLIB_SUBPROCESS_TESTS
     qtest_add_func("/vhost-user/reconnect/subprocess",
                    test_reconnect_subprocess);
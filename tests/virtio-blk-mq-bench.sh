@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# virtio-blk multiqueue scaling benchmark
+#
+# Boots a guest once per queue count, with one iothread per virtqueue,
+# and runs fio inside the guest against the virtio-blk disk.
+#
+# The initrd must contain fio and an init that runs
+#
+#     fio --filename=/dev/vda --numjobs=$QUEUES $FIO_ARGS
+#
+# with QUEUES and FIO_ARGS taken from the kernel command line
+# ("bench.queues=" and "bench.fio="), prints the fio output to the
+# serial console and powers the guest off.
+#
+# Usage: virtio-blk-mq-bench.sh KERNEL INITRD DISK [QUEUES...]
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+if [ "$#" -lt 3 ]; then
+    echo "usage: $0 KERNEL INITRD DISK [QUEUES...]"
+    exit 1
+fi
+
+KERNEL="$1"
+INITRD="$2"
+DISK="$3"
+shift 3
+
+QUEUE_LIST="1 2 4 8"
+if [ "$#" -ne 0 ]; then
+    QUEUE_LIST="$@"
+fi
+
+QEMU_PROG="${QEMU_PROG:-$(pwd)/x86_64-softmmu/qemu-system-x86_64}"
+FIO_ARGS="${FIO_ARGS:---name=randread --rw=randread --bs=4k --iodepth=32 --ioengine=libaio --direct=1 --runtime=30 --time_based --group_reporting}"
+
+if [ ! -x "$QEMU_PROG" ]; then
+    echo "$0 requires qemu-system-x86_64 (set QEMU_PROG)"
+    exit 1
+fi
+
+printf "%-8s %s\n" "queues" "result"
+for QUEUES in $QUEUE_LIST ; do
+    OBJECTS=""
+    IOTHREADS=""
+    i=0
+    while [ $i -lt $QUEUES ]; do
+        OBJECTS="$OBJECTS -object iothread,id=iothread$i"
+        IOTHREADS="${IOTHREADS:+$IOTHREADS:}iothread$i"
+        i=$((i + 1))
+    done
+
+    OUTPUT=$("$QEMU_PROG" -enable-kvm -m 2G -smp "$QUEUES" \
+        -nographic -no-reboot -serial stdio -monitor none \
+        -kernel "$KERNEL" -initrd "$INITRD" \
+        -append "console=ttyS0 quiet panic=-1 bench.queues=$QUEUES bench.fio=\"$FIO_ARGS\"" \
+        $OBJECTS \
+        -drive if=none,id=drive0,file="$DISK",format=raw,cache=none,aio=native \
+        -device virtio-blk-pci,drive=drive0,num-queues=$QUEUES,iothreads=$IOTHREADS \
+        2>&1)
+
+    RESULT=$(echo "$OUTPUT" | grep -o "IOPS=[^,]*\|iops=[^,]*" | head -1)
+    printf "%-8s %s\n" "$QUEUES" "${RESULT:-no result}"
+done